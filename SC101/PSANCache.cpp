@@ -0,0 +1,264 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PSANCache.h"
+
+
+PSANBlockCache::PSANBlockCache()
+{
+  _lineSize = 0;
+  _capacity = 0;
+  _kin = 0;
+  _kout = 0;
+  _resident = 0;
+  _evictions = 0;
+
+  _lines = NULL;
+  _lineCount = 0;
+  TAILQ_INIT(&_free);
+  for (int i = 0; i < PSAN_CACHE_QUEUES; i++)
+  {
+    TAILQ_INIT(&_queues[i]);
+    _queueLength[i] = 0;
+  }
+
+  _buckets = NULL;
+  _bucketMask = 0;
+}
+
+
+PSANBlockCache::~PSANBlockCache()
+{
+  if (_lines)
+  {
+    for (uint32_t i = 0; i < _lineCount; i++)
+    {
+      if (_lines[i].data)
+        psan_free(_lines[i].data, _lineSize);
+    }
+
+    PSANDelete(_lines, struct psan_cache_line, _lineCount);
+  }
+
+  if (_buckets)
+    PSANDelete(_buckets, struct psanCacheBucket, _bucketMask + 1);
+}
+
+
+/* the 2Q paper's suggested sizes: A1in a quarter of the lines, A1out remembering half as many again. the tables are
+ * sized by the budget, so their allocation is allowed to fail rather than panic.
+ */
+bool PSANBlockCache::init(uint64_t budget, uint32_t lineSize)
+{
+  _lineSize = lineSize;
+  _capacity = (uint32_t)PSAN_MIN(PSAN_MAX(budget / lineSize, 4), UINT32_MAX / 4);
+  _kin = PSAN_MAX(_capacity / 4, 1);
+  _kout = PSAN_MAX(_capacity / 2, 1);
+
+  _lines = PSANTryNewZero(struct psan_cache_line, _capacity + _kout);
+  if (!_lines)
+    return false;
+
+  _lineCount = _capacity + _kout;
+
+  for (uint32_t i = 0; i < _lineCount; i++)
+    TAILQ_INSERT_TAIL(&_free, &_lines[i], entries);
+
+  uint32_t buckets = 1;
+  while (buckets < _lineCount)
+    buckets <<= 1;
+
+  _buckets = PSANTryNewZero(struct psanCacheBucket, buckets);
+  if (!_buckets)
+    return false;
+
+  _bucketMask = buckets - 1;
+
+  for (uint32_t i = 0; i < buckets; i++)
+    LIST_INIT(&_buckets[i]);
+
+  return true;
+}
+
+
+struct psan_cache_line *PSANBlockCache::lookup(uint32_t line)
+{
+  struct psan_cache_line *l = find(line);
+
+  return (l && l->queue != PSAN_CACHE_A1OUT ? l : NULL);
+}
+
+
+/* A1in is a FIFO, so only hits on Am reorder anything */
+void PSANBlockCache::touch(struct psan_cache_line *l)
+{
+  if (l->queue != PSAN_CACHE_AM)
+    return;
+
+  TAILQ_REMOVE(&_queues[PSAN_CACHE_AM], l, entries);
+  TAILQ_INSERT_HEAD(&_queues[PSAN_CACHE_AM], l, entries);
+}
+
+
+/* a line remembered on A1out has been asked for twice, and goes straight to Am */
+struct psan_cache_line *PSANBlockCache::insert(uint32_t line)
+{
+  uint8_t *data = reclaim();
+  if (!data)
+    return NULL;
+
+  /* looked up after reclaiming, which may have just forgotten it */
+  struct psan_cache_line *l = find(line);
+
+  if (l)
+  {
+    dequeue(l);
+    enqueue(l, PSAN_CACHE_AM);
+  }
+  else
+  {
+    /* can't be empty: at most _capacity - 1 lines are resident and _kout remembered */
+    l = TAILQ_FIRST(&_free);
+    TAILQ_REMOVE(&_free, l, entries);
+
+    l->line = line;
+    LIST_INSERT_HEAD(&_buckets[line & _bucketMask], l, hash);
+    enqueue(l, PSAN_CACHE_A1IN);
+  }
+
+  l->data = data;
+  l->filling = NULL;
+
+  return l;
+}
+
+
+void PSANBlockCache::remove(struct psan_cache_line *l)
+{
+  psan_free(l->data, _lineSize);
+  l->data = NULL;
+  _resident--;
+
+  dequeue(l);
+  release(l);
+}
+
+
+struct psan_cache_line *PSANBlockCache::find(uint32_t line)
+{
+  struct psan_cache_line *l;
+
+  LIST_FOREACH(l, &_buckets[line & _bucketMask], hash)
+  {
+    if (l->line == line)
+      return l;
+  }
+
+  return NULL;
+}
+
+
+/* a line's worth of data, newly allocated while under budget and taken from an evicted line after that. A1in is
+ * trimmed back to _kin first, its lines being remembered on A1out; then the least recently used of Am.
+ */
+uint8_t *PSANBlockCache::reclaim()
+{
+  if (_resident < _capacity)
+  {
+    uint8_t *data = (uint8_t *)psan_alloc(_lineSize);
+    if (data)
+    {
+      _resident++;
+      return data;
+    }
+  }
+
+  struct psan_cache_line *victim = NULL;
+
+  if (_queueLength[PSAN_CACHE_A1IN] > _kin)
+    victim = oldest(PSAN_CACHE_A1IN);
+  if (!victim)
+    victim = oldest(PSAN_CACHE_AM);
+  if (!victim)
+    victim = oldest(PSAN_CACHE_A1IN);
+  if (!victim)
+    return NULL;
+
+  uint8_t *data = victim->data;
+  victim->data = NULL;
+  _evictions++;
+
+  uint8_t queue = victim->queue;
+  dequeue(victim);
+
+  if (queue == PSAN_CACHE_A1IN)
+  {
+    enqueue(victim, PSAN_CACHE_A1OUT);
+
+    if (_queueLength[PSAN_CACHE_A1OUT] > _kout)
+    {
+      struct psan_cache_line *forgotten = TAILQ_LAST(&_queues[PSAN_CACHE_A1OUT], psanCacheQueue);
+      dequeue(forgotten);
+      release(forgotten);
+    }
+  }
+  else
+  {
+    release(victim);
+  }
+
+  return data;
+}
+
+
+/* the oldest line on a queue that isn't filling */
+struct psan_cache_line *PSANBlockCache::oldest(uint8_t queue)
+{
+  struct psan_cache_line *l;
+
+  TAILQ_FOREACH_REVERSE(l, &_queues[queue], psanCacheQueue, entries)
+  {
+    if (!l->filling)
+      return l;
+  }
+
+  return NULL;
+}
+
+
+void PSANBlockCache::enqueue(struct psan_cache_line *l, uint8_t queue)
+{
+  l->queue = queue;
+  TAILQ_INSERT_HEAD(&_queues[queue], l, entries);
+  _queueLength[queue]++;
+}
+
+
+void PSANBlockCache::dequeue(struct psan_cache_line *l)
+{
+  TAILQ_REMOVE(&_queues[l->queue], l, entries);
+  _queueLength[l->queue]--;
+}
+
+
+void PSANBlockCache::release(struct psan_cache_line *l)
+{
+  LIST_REMOVE(l, hash);
+  l->filling = NULL;
+  TAILQ_INSERT_TAIL(&_free, l, entries);
+}
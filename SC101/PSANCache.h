@@ -0,0 +1,97 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_CACHE_H__
+#define __PSAN_CACHE_H__
+
+#include "PSANPlatform.h"
+
+/* 2Q queues, see PSANBlockCache */
+#define PSAN_CACHE_A1IN (0)
+#define PSAN_CACHE_AM (1)
+#define PSAN_CACHE_A1OUT (2)
+#define PSAN_CACHE_QUEUES (3)
+
+
+struct psan_cache_line {
+  uint32_t line;  /* block / line blocks */
+  uint8_t queue;
+  uint8_t *data;  /* line size bytes, NULL on A1out */
+  void *filling;  /* the owner's state while data is being fetched, NULL once it's valid */
+
+  TAILQ_ENTRY(psan_cache_line) entries; /* in its queue, most recent first, or on the free list */
+  LIST_ENTRY(psan_cache_line) hash;
+};
+
+TAILQ_HEAD(psanCacheQueue, psan_cache_line);
+LIST_HEAD(psanCacheBucket, psan_cache_line);
+
+
+/* fixed budget of fixed size lines, replaced 2Q style (Johnson & Shasha): lines seen once go through a short FIFO
+ * (A1in) and are remembered for a while after they leave it (A1out, no data). only lines asked for again while
+ * remembered make it into the LRU main queue (Am), so one pass over a lot of blocks can't flush what's hot.
+ *
+ * only bookkeeping happens here, the owner fetches data into lines and keeps them up to date. lines still being
+ * filled are never evicted.
+ */
+class PSANBlockCache
+  {
+  public:
+    PSANBlockCache();
+    ~PSANBlockCache();
+    /* lineSize is a power of 2 multiple of SECTOR_SIZE */
+    bool init(uint64_t budget, uint32_t lineSize);
+
+    uint32_t getLineSize() { return _lineSize; }
+    uint32_t getLineBlocks() { return _lineSize / SECTOR_SIZE; }
+    uint64_t getEvictions() { return _evictions; }
+
+    /* the resident line, valid or still filling, NULL if there isn't one */
+    struct psan_cache_line *lookup(uint32_t line);
+    /* a read was served from it */
+    void touch(struct psan_cache_line *l);
+    /* make a line resident for the caller to fill (and set filling on), NULL if everything is filling */
+    struct psan_cache_line *insert(uint32_t line);
+    /* forget a resident line, valid or not */
+    void remove(struct psan_cache_line *l);
+  protected:
+    struct psan_cache_line *find(uint32_t line);
+    uint8_t *reclaim();
+    struct psan_cache_line *oldest(uint8_t queue);
+    void enqueue(struct psan_cache_line *l, uint8_t queue);
+    void dequeue(struct psan_cache_line *l);
+    void release(struct psan_cache_line *l);
+
+    uint32_t _lineSize;
+    uint32_t _capacity;  /* lines of data */
+    uint32_t _kin;       /* A1in lines kept before evicting from it rather than Am */
+    uint32_t _kout;      /* A1out lines remembered */
+    uint32_t _resident;  /* lines of data allocated */
+    uint64_t _evictions;
+
+    struct psan_cache_line *_lines; /* _capacity + _kout, enough for every resident and remembered line */
+    uint32_t _lineCount;
+    struct psanCacheQueue _free;
+    struct psanCacheQueue _queues[PSAN_CACHE_QUEUES];
+    uint32_t _queueLength[PSAN_CACHE_QUEUES];
+
+    struct psanCacheBucket *_buckets;
+    uint32_t _bucketMask;
+  };
+
+#endif /* __PSAN_CACHE_H__ */
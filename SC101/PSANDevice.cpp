@@ -0,0 +1,3257 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PSANDevice.h"
+
+extern "C" {
+#include "psan_wireformat.h"
+};
+
+
+// the congestion window is kept in 1/256ths of an IO so additive increase can add 1/window per response
+#define IO_WINDOW_SHIFT (8)
+#define IO_WINDOW(n) ((uint32_t)(n) << IO_WINDOW_SHIFT)
+
+
+/* a caller's request, pinned for its whole life */
+struct pinned_request {
+  PSANBuffer *buffer;
+  uint32_t block;
+  uint32_t nblks;
+  struct psan_completion completion;
+};
+
+
+/* a request split into chunks, and one chunk of it */
+struct deblock_master_state {
+  PSANBuffer *buffer;
+  uint32_t block;
+  uint32_t nblks;
+  struct psan_completion completion;
+
+  uint32_t pending;
+
+  int status;
+  uint64_t actualByteCount;
+};
+
+
+struct deblock_state {
+  struct deblock_master_state *master;
+};
+
+
+/* the payload of one PUT or GET standing in for several IOs: their buffers back to back, in block order, then for a
+ * read rounded up to a power of 2 whatever it fetched past them, which is dropped. the IOs themselves wait here to be
+ * completed once it's done. a range within one IO's buffer is that buffer's own memory, if it has any to offer, so a
+ * rounded-up read of one IO is still received in place, its surplus going to the transport's scratch.
+ */
+class PSANCoalescedBuffer : public PSANBuffer
+  {
+  public:
+    PSANCoalescedBuffer(bool isWrite) : _isWrite(isWrite), _len(0), _covered(0) { STAILQ_INIT(&_ios); }
+
+    /* built in the device's _carrierPool rather than on the heap, and handed back there by coalesceCompletion() */
+    static void *operator new(size_t size, PSANPool &pool) throw() { return pool.get(); }
+
+    virtual bool isWrite() { return _isWrite; }
+    virtual uint64_t getLength() { return _len; }
+
+    void append(struct outstanding_io *io)
+    {
+      STAILQ_INSERT_TAIL(&_ios, io, entries);
+      _covered += (uint64_t)io->nblks * SECTOR_SIZE;
+      _len = _covered;
+    }
+
+    /* the transfer is len, of which everything past the IOs is surplus */
+    void setLength(uint64_t len) { _len = len; }
+    uint64_t getSurplus() { return _len - _covered; }
+
+    struct outstanding_io *takeFirst()
+    {
+      struct outstanding_io *io = STAILQ_FIRST(&_ios);
+
+      if (io)
+        STAILQ_REMOVE_HEAD(&_ios, entries);
+
+      return io;
+    }
+
+    virtual uint64_t readBytes(uint64_t offset, void *bytes, uint64_t len)
+    {
+      return copy(offset, bytes, len, false);
+    }
+
+    virtual uint64_t writeBytes(uint64_t offset, const void *bytes, uint64_t len)
+    {
+      if (offset >= _len)
+        return 0;
+      len = PSAN_MIN(len, _len - offset);
+
+      /* the surplus is taken and dropped */
+      uint64_t want = (offset < _covered ? PSAN_MIN(len, _covered - offset) : 0);
+
+      return (copy(offset, (void *)bytes, want, true) == want ? len : 0);
+    }
+
+    virtual void *getBytesNoCopy(uint64_t offset, uint64_t len)
+    {
+      struct outstanding_io *io;
+      uint64_t start = 0;
+
+      STAILQ_FOREACH(io, &_ios, entries)
+      {
+        uint64_t ioLen = (uint64_t)io->nblks * SECTOR_SIZE;
+
+        if (offset < start + ioLen)
+          return (len <= start + ioLen - offset ? io->buffer->getBytesNoCopy(io->offset + offset - start, len) : NULL);
+
+        start += ioLen;
+      }
+
+      return NULL;
+    }
+  protected:
+    uint64_t copy(uint64_t offset, void *bytes, uint64_t len, bool toIOs)
+    {
+      struct outstanding_io *io;
+      uint64_t done = 0;
+      uint64_t start = 0;
+
+      STAILQ_FOREACH(io, &_ios, entries)
+      {
+        uint64_t ioLen = (uint64_t)io->nblks * SECTOR_SIZE;
+
+        if (done < len && offset + done < start + ioLen)
+        {
+          uint64_t skip = offset + done - start;
+          uint64_t n = PSAN_MIN(ioLen - skip, len - done);
+          uint64_t copied;
+
+          if (toIOs)
+            copied = io->buffer->writeBytes(io->offset + skip, (uint8_t *)bytes + done, n);
+          else
+            copied = io->buffer->readBytes(io->offset + skip, (uint8_t *)bytes + done, n);
+
+          if (copied != n)
+            return done;
+          done += n;
+        }
+
+        start += ioLen;
+      }
+
+      return done;
+    }
+
+    bool _isWrite;
+    struct outstandingIOQueue _ios;
+    uint64_t _len;
+    uint64_t _covered; /* by the IOs */
+  };
+
+
+/* part of a read waiting for a prefetch or cache fill still in flight */
+struct read_waiter {
+  struct deblock_master_state *master;
+  uint64_t offset; /* into master->buffer */
+  uint32_t block;
+  uint32_t nblks;
+  int status;
+
+  STAILQ_ENTRY(read_waiter) entries;
+};
+
+STAILQ_HEAD(readWaiterList, read_waiter);
+
+
+/* the data from one prefetch, READAHEAD_SEGMENT (or less) read ahead of a stream */
+struct readahead_segment {
+  uint32_t block;
+  uint32_t nblks;
+  uint32_t consumed; /* blocks handed to readers, the segment is freed once all of them have been */
+  PSANFlatBuffer *buffer;
+  bool done;
+  bool stale;        /* overwritten or evicted while in flight, freed when it lands */
+  int status;
+
+  struct readWaiterList waiters;
+  TAILQ_ENTRY(readahead_segment) entries;
+};
+
+
+/* one GET of a run of cache lines, which point at it (psan_cache_line::filling) until it lands */
+struct cache_fill {
+  uint32_t block;
+  uint32_t nblks;
+  PSANFlatBuffer *buffer;
+
+  struct readWaiterList waiters;
+};
+
+
+#define WRITEBACK_CHUNK_BLOCKS (WRITEBACK_CHUNK / SECTOR_SIZE)
+#define WRITEBACK_MAP_WORDS ((WRITEBACK_CHUNK_BLOCKS + 63) / 64)
+
+/* WRITEBACK_CHUNK of written data, aligned, with a bit per block in each map. data holds the latest write of every
+ * block in written for as long as the chunk is held, which is until it's clean and no read is waiting on it.
+ */
+struct writeback_chunk {
+  uint32_t chunk;      /* block / WRITEBACK_CHUNK_BLOCKS */
+  uint64_t generation; /* _chunkGeneration when allocated */
+  uint8_t *data;
+
+  uint64_t written[WRITEBACK_MAP_WORDS];   /* ever written since allocated */
+  uint64_t dirty[WRITEBACK_MAP_WORDS];     /* only in memory */
+  uint64_t flushing[WRITEBACK_MAP_WORDS];  /* being written, may be dirty again too */
+  uint64_t syncDirty[WRITEBACK_MAP_WORDS]; /* dirty when the active sync started and not written since */
+  uint64_t syncWait[WRITEBACK_MAP_WORDS];  /* what the active sync is waiting on */
+
+  uint64_t dirtied; /* when it joined _dirtyChunks */
+  uint64_t retryAt; /* not flushed again before this after a failure */
+  uint32_t readers; /* reads gone to the unit that will be patched from it */
+  bool isDirty;     /* on _dirtyChunks */
+  bool issuing;     /* in writeBackFlush(), so not to be released */
+
+  TAILQ_ENTRY(writeback_chunk) dirtyEntries;
+  LIST_ENTRY(writeback_chunk) hash;
+};
+
+
+/* one run of dirty blocks being written */
+struct writeback_flush {
+  struct writeback_chunk *chunk;
+  uint32_t first;
+  uint32_t nblks;
+  PSANFlatBuffer *buffer; /* over chunk->data */
+};
+
+
+/* a read only partly covered by written data, gone to the unit. the chunks it overlaps are held until it's back */
+struct writeback_read {
+  PSANBuffer *buffer;
+  uint32_t block;
+  uint32_t nblks;
+  uint64_t generation; /* chunks allocated before this were held for it */
+  struct psan_completion completion;
+};
+
+
+struct writeback_sync {
+  struct psan_completion completion;
+
+  STAILQ_ENTRY(writeback_sync) entries;
+};
+
+
+static inline bool bitmapTest(const uint64_t *map, uint32_t bit)
+{
+  return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bitmapSet(uint64_t *map, uint32_t first, uint32_t count)
+{
+  for (uint32_t bit = first; bit < first + count; bit++)
+    map[bit / 64] |= (1ULL << (bit % 64));
+}
+
+static inline void bitmapClear(uint64_t *map, uint32_t first, uint32_t count)
+{
+  for (uint32_t bit = first; bit < first + count; bit++)
+    map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+static inline uint32_t bitmapCount(const uint64_t *map)
+{
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < WRITEBACK_MAP_WORDS; i++)
+    count += __builtin_popcountll(map[i]);
+
+  return count;
+}
+
+static inline bool bitmapEmpty(const uint64_t *map)
+{
+  for (uint32_t i = 0; i < WRITEBACK_MAP_WORDS; i++)
+  {
+    if (map[i])
+      return false;
+  }
+
+  return true;
+}
+
+
+PSANDevice::PSANDevice(PSANEngine *engine, const char *id, const struct psan_device_handlers *handlers)
+{
+  _engine = engine;
+
+  memset(_id, 0, sizeof(_id));
+  strncpy(_id, id, sizeof(_id) - 1);
+
+  if (handlers)
+    _handlers = *handlers;
+  else
+    memset(&_handlers, 0, sizeof(_handlers));
+
+  _ioMaxReadSize = DEFAULT_IO_READ_SIZE;
+  _ioMaxWriteSize = DEFAULT_IO_WRITE_SIZE;
+
+  psan_sockaddr_init(&_resolveAddress, INADDR_BROADCAST, htons(PSAN_PORT));
+  psan_sockaddr_init(&_partitionAddress, INADDR_ANY, 0);
+  psan_sockaddr_init(&_rootAddress, INADDR_ANY, 0);
+  _resolved = false;
+  _attached = false;
+  _size = 0;
+
+  _resolveInterval = 1000000000ULL * 60;
+  _lastReply = 0;
+  _lastResolve = 0;
+
+  STAILQ_INIT(&_outstandingHead);
+  _outstandingCount = 0;
+  _inFlight[false] = 0;
+  _inFlight[true] = 0;
+
+  struct psan_sched_params sched;
+  sched.policy = PSANIOScheduler::policyNamed(SCHED_POLICY);
+  sched.deadlineMS[false] = SCHED_READ_DEADLINE_MS;
+  sched.deadlineMS[true] = SCHED_WRITE_DEADLINE_MS;
+  sched.depth[false] = SCHED_READ_DEPTH;
+  sched.depth[true] = SCHED_WRITE_DEPTH;
+  sched.writeStarve = SCHED_WRITE_STARVE;
+  _scheduler.setParams(&sched);
+
+  memset(&_getTemplate, 0, sizeof(_getTemplate));
+  _getTemplate.ctrl.cmd = PSAN_GET;
+  memset(_putTemplate, 0, sizeof(_putTemplate));
+  ((psan_put_t *)_putTemplate)->ctrl.cmd = PSAN_PUT;
+
+  memset(&_stats, 0, sizeof(_stats));
+
+  _ioWindow = IO_WINDOW(IO_WINDOW_INITIAL);
+  _ioWindowThreshold = IO_WINDOW(IO_WINDOW_MAX);
+  _ioWindowReduced = 0;
+
+  memset(_rtt, 0, sizeof(_rtt));
+  _baseRTTEpoch = psan_uptime_ns();
+  _rtoMinMS = RTO_MIN_MS;
+  _rtoMaxMS = RTO_MAX_MS;
+
+  _stats.ioWindow = _stats.ioWindowMax = IO_WINDOW_INITIAL;
+
+  _sizeProbing = false;
+  _sizeProbed = false;
+  memset(_sizes, 0, sizeof(_sizes));
+  _sizes[false].limit = _ioMaxReadSize;
+  _sizes[true].limit = _ioMaxWriteSize;
+  for (int d = 0; d < 2; d++)
+    _sizes[d].backoffMS[false] = _sizes[d].backoffMS[true] = IO_SIZE_BACKOFF_MS;
+  _sizeEvaluated = 0;
+
+  _hedgeBudget = HEDGE_BUDGET_PERCENT;
+  _hedgePercentile = HEDGE_PERCENTILE;
+  _hedgeCredit = 0;
+  memset(_latency, 0, sizeof(_latency));
+
+  _poolWaiting = false;
+
+  memset(_streams, 0, sizeof(_streams));
+  _readAheadStreams = READAHEAD_STREAMS;
+  TAILQ_INIT(&_segments);
+  _readAheadHeld = 0;
+
+  _cache = NULL;
+
+  _writeBack = false;
+  for (int i = 0; i < WRITEBACK_BUCKETS; i++)
+    LIST_INIT(&_chunks[i]);
+  TAILQ_INIT(&_dirtyChunks);
+  _writeBackHeld = 0;
+  _flushesInFlight = 0;
+  _flushing = false;
+  memset(&_flushTimer, 0, sizeof(_flushTimer));
+  _flushTimerArmed = false;
+  _chunkGeneration = 0;
+  STAILQ_INIT(&_syncs);
+  _syncActive = false;
+  _syncPending = 0;
+
+  _stopping = false;
+}
+
+
+/* stop() or the engine's own stop has run by now, so no prefetch is still in flight */
+PSANDevice::~PSANDevice()
+{
+  struct readahead_segment *segment;
+
+  while ((segment = TAILQ_FIRST(&_segments)))
+    readAheadFree(segment);
+
+  if (_cache)
+    delete _cache;
+
+  /* dirty data left by now had nowhere to go, see writeBackKick() */
+  for (int i = 0; i < WRITEBACK_BUCKETS; i++)
+  {
+    struct writeback_chunk *c;
+
+    while ((c = LIST_FIRST(&_chunks[i])))
+    {
+      LIST_REMOVE(c, hash);
+      psan_free(c->data, WRITEBACK_CHUNK);
+      _chunkPool.put(c);
+    }
+  }
+}
+
+
+/* the engine outlives the device (it's shared with the rest of its shard), so before the device goes everything it has
+ * in flight is failed, from the caller's IOs to its own read-ahead, cache fills and write-back flushes, and the flush
+ * timer is cancelled. IOs waiting for room in the window are sent as those fail, and fail in turn. further IOs fail
+ * straight away, as does a sync still waiting for dirty data that now has nowhere to go.
+ */
+void PSANDevice::stop()
+{
+  _stopping = true;
+
+  if (_flushTimerArmed)
+  {
+    _flushTimerArmed = false;
+    _engine->cancelTimer(&_flushTimer);
+  }
+
+  _engine->stopTarget(this);
+
+  writeBackKick();
+}
+
+
+/* preallocate enough bookkeeping for a full IO window, so steady-state IO doesn't go near the system allocator */
+bool PSANDevice::init()
+{
+  if (!_resolvePool.init(sizeof(outstanding), 1, 1, 4) ||
+      !_requestPool.init(sizeof(pinned_request), IO_WINDOW_MAX, POOL_SLAB, POOL_LIMIT) ||
+      !_ioPool.init(sizeof(outstanding_io), IO_WINDOW_MAX, POOL_SLAB, POOL_LIMIT) ||
+      !_masterPool.init(sizeof(deblock_master_state), IO_WINDOW_MAX, POOL_SLAB, POOL_LIMIT) ||
+      !_deblockPool.init(sizeof(deblock_state), IO_WINDOW_MAX, POOL_SLAB, POOL_LIMIT) ||
+      !_carrierPool.init(sizeof(PSANCoalescedBuffer), IO_WINDOW_MAX, POOL_SLAB, POOL_LIMIT) ||
+      !_segmentPool.init(sizeof(readahead_segment), READAHEAD_BUDGET / READAHEAD_SEGMENT, POOL_SLAB, POOL_LIMIT) ||
+      !_waiterPool.init(sizeof(read_waiter), IO_WINDOW_MAX, POOL_SLAB, POOL_LIMIT) ||
+      !_fillPool.init(sizeof(cache_fill), IO_WINDOW_MAX, POOL_SLAB, POOL_LIMIT) ||
+      !_chunkPool.init(sizeof(writeback_chunk), 0, POOL_SLAB, POOL_LIMIT) ||
+      !_flushPool.init(sizeof(writeback_flush), 0, POOL_SLAB, WRITEBACK_FLUSHES) ||
+      !_mergePool.init(sizeof(writeback_read), 0, POOL_SLAB, POOL_LIMIT) ||
+      !_syncPool.init(sizeof(writeback_sync), 0, POOL_SLAB, POOL_LIMIT))
+  {
+    KINFO("%s: failed to preallocate pools", _id);
+    return false;
+  }
+
+  return true;
+}
+
+
+const struct psan_device_stats *PSANDevice::getStatistics()
+{
+  _stats.requestPoolHighWater = _requestPool.getHighWater();
+  _stats.ioPoolHighWater = _ioPool.getHighWater();
+  _stats.deblockPoolHighWater = _deblockPool.getHighWater();
+  _stats.carrierPoolHighWater = _carrierPool.getHighWater();
+  _stats.cacheEvictions = (_cache ? _cache->getEvictions() : 0);
+  _stats.ioReadSize = _ioMaxReadSize;
+  _stats.ioWriteSize = _ioMaxWriteSize;
+  _stats.ioReadLimit = _sizes[false].limit;
+  _stats.ioWriteLimit = _sizes[true].limit;
+
+  const struct psan_sched_stats *sched = _scheduler.getStatistics();
+  _stats.queuedReads = sched->queued[false];
+  _stats.queuedWrites = sched->queued[true];
+  _stats.queueWaitReads = sched->waitTotal[false];
+  _stats.queueWaitWrites = sched->waitTotal[true];
+  _stats.queueWaitMaxRead = sched->waitMax[false];
+  _stats.queueWaitMaxWrite = sched->waitMax[true];
+  _stats.queueExpired = sched->expired;
+  _stats.queueWritesStarved = sched->starved;
+
+  return &_stats;
+}
+
+
+/* sizes are expected to be validated (powers of 2, SECTOR_SIZE..MAX_IO_*_SIZE) by the caller */
+void PSANDevice::setIOMaxSize(uint32_t ioMaxReadSize, uint32_t ioMaxWriteSize)
+{
+  _ioMaxReadSize = ioMaxReadSize;
+  _ioMaxWriteSize = ioMaxWriteSize;
+  _sizes[false].limit = ioMaxReadSize;
+  _sizes[true].limit = ioMaxWriteSize;
+}
+
+
+void PSANDevice::setIOSizeProbing(bool probing)
+{
+  _sizeProbing = probing;
+}
+
+
+/* defaults to broadcast, which is what real devices want */
+void PSANDevice::setResolveAddress(const struct sockaddr_in *addr)
+{
+  _resolveAddress = *addr;
+}
+
+
+/* clamps for the retransmit timeout estimate, expected to be validated (min <= max) by the caller */
+void PSANDevice::setRetransmitTimeouts(uint32_t minMS, uint32_t maxMS)
+{
+  _rtoMinMS = minMS;
+  _rtoMaxMS = maxMS;
+}
+
+
+void PSANDevice::setReadAheadStreams(uint32_t streams)
+{
+  _readAheadStreams = PSAN_MIN(streams, READAHEAD_STREAMS);
+}
+
+
+bool PSANDevice::setCache(uint64_t budget, uint32_t lineSize)
+{
+  if (_cache)
+  {
+    delete _cache;
+    _cache = NULL;
+  }
+
+  if (!budget)
+    return true;
+
+  if (lineSize < CACHE_LINE_MIN || lineSize > CACHE_LINE_MAX || (lineSize & (lineSize - 1)))
+    return false;
+
+  _cache = new PSANBlockCache();
+  if (!_cache || !_cache->init(budget, lineSize))
+  {
+    KINFO("%s: failed to allocate cache", _id);
+    if (_cache)
+      delete _cache;
+    _cache = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+
+void PSANDevice::setWriteBack(bool writeBack)
+{
+  _writeBack = writeBack;
+}
+
+
+void PSANDevice::setScheduler(const struct psan_sched_params *params)
+{
+  _scheduler.setParams(params);
+}
+
+
+void PSANDevice::setHedging(uint32_t budgetPercent, uint32_t percentile)
+{
+  _hedgeBudget = PSAN_MIN(budgetPercent, 100);
+  _hedgePercentile = PSAN_MAX(PSAN_MIN(percentile, 99), 1);
+  _hedgeCredit = PSAN_MIN(_hedgeCredit, _hedgeBudget ? HEDGE_BURST * 100 : 0);
+}
+
+
+/* the buffer is prepared once here and completed once in requestCompletion(). every chunk, packet and retry in between
+ * nests inside that, rather than wiring and unwiring the same pages each time.
+ */
+void PSANDevice::asyncReadWrite(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion)
+{
+  if (_stopping)
+  {
+    psan_complete(completion, ENXIO, 0);
+    return;
+  }
+
+  if (!_resolved)
+  {
+    KINFO("%s not resolved yet", _id);
+    psan_complete(completion, ENXIO, 0);
+    return;
+  }
+
+  /* callers are expected to check canAccept() first, this is just in case */
+  if (!hasPoolSpace(buffer->isWrite(), nblks))
+  {
+    KINFO("%s: pools exhausted", _id);
+    _stats.poolExhausted++;
+    psan_complete(completion, EBUSY, 0);
+    return;
+  }
+
+  if (!buffer->prepare())
+  {
+    KINFO("buffer prepare failed");
+    psan_complete(completion, ENOMEM, 0);
+    return;
+  }
+
+  pinned_request *request = PSANPoolGet(_requestPool, pinned_request);
+  if (!request)
+  {
+    _stats.poolExhausted++;
+    buffer->complete();
+    psan_complete(completion, ENOMEM, 0);
+    return;
+  }
+
+  request->buffer = buffer;
+  request->block = block;
+  request->nblks = nblks;
+  request->completion = completion;
+
+  struct psan_completion new_completion;
+  new_completion.target = this;
+  new_completion.action = CompletionActionCast<PSANDevice, &PSANDevice::requestCompletion>;
+  new_completion.parameter = request;
+
+  if (buffer->isWrite())
+  {
+    readAheadInvalidate(block, nblks);
+
+    if (_cache)
+      cacheWrite(buffer, block, nblks);
+
+    if (_writeBack)
+      writeBackWrite(buffer, block, nblks, new_completion);
+    else
+      prepareAndDoAsyncReadWrite(&_partitionAddress, buffer, 0, block, nblks, new_completion);
+  }
+  else if (!_writeBack || !writeBackRead(buffer, block, nblks, new_completion))
+  {
+    dispatchRead(buffer, block, nblks, new_completion);
+  }
+}
+
+
+/* a read that write-back has nothing to say about, served from read-ahead or the cache where possible */
+void PSANDevice::dispatchRead(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion)
+{
+  /* the stream is advanced before serving, which may complete the read (and start the caller's next) right away */
+  struct readahead_stream *stream = (_readAheadStreams ? readAheadTrack(block, nblks) : NULL);
+
+  /* reads continuing a stream are streaming rather than metadata, and left to read-ahead instead of the cache */
+  if (!stream && _cache && cacheRead(buffer, block, nblks, completion))
+    return;
+
+  if (_readAheadStreams)
+  {
+    bool hit = readAheadServe(buffer, block, nblks, completion);
+
+    if (hit)
+    {
+      _stats.readAheadHits++;
+    }
+    else
+    {
+      _stats.readAheadMisses++;
+      prepareAndDoAsyncReadWrite(&_partitionAddress, buffer, 0, block, nblks, completion);
+    }
+
+    if (stream)
+      readAheadIssue(stream, hit);
+
+    return;
+  }
+
+  prepareAndDoAsyncReadWrite(&_partitionAddress, buffer, 0, block, nblks, completion);
+}
+
+
+void PSANDevice::requestCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  pinned_request *request = (pinned_request *)parameter;
+  struct psan_completion completion = request->completion;
+  PSANBuffer *buffer = request->buffer;
+
+  /* the cache took the write's data when it was submitted, so can't be trusted with those blocks now */
+  if (_cache && status != 0 && buffer->isWrite())
+    cacheInvalidate(request->block, request->nblks);
+
+  _requestPool.put(request);
+
+  if (!buffer->complete())
+    KINFO("buffer complete failed");
+
+  /* the buffer may still be referenced by packets in flight (PSANBuffer::retainPages), but has finished nesting */
+  _stats.prepares += buffer->getPrepares();
+  _stats.preparesSaved += buffer->getPreparesSaved();
+
+  psan_complete(completion, status, actualByteCount);
+
+  if (_poolWaiting)
+  {
+    _poolWaiting = false;
+
+    if (_handlers.availableHandler)
+      _handlers.availableHandler(_handlers.target);
+  }
+}
+
+
+/* every object a request will need is available, or nothing at all is in flight (so even an oversized request gets a
+ * go rather than waiting forever, and fails cleanly if the pools can't grow far enough)
+ */
+bool PSANDevice::hasPoolSpace(bool isWrite, uint32_t nblks)
+{
+  uint32_t chunks = countChunks(isWrite, nblks);
+  uint32_t split = (chunks > 1 ? 1 : 0);
+
+  if (!_requestPool.getInUse())
+    return true;
+
+  return (_requestPool.getAvailable() >= 1 &&
+          _carrierPool.getAvailable() >= 1 &&
+          _ioPool.getAvailable() >= chunks &&
+          _masterPool.getAvailable() >= split &&
+          _deblockPool.getAvailable() >= chunks * split);
+}
+
+
+bool PSANDevice::canAccept(bool isWrite, uint32_t nblks)
+{
+  if (hasPoolSpace(isWrite, nblks) && (!isWrite || !_writeBack || writeBackHasSpace(nblks)))
+    return true;
+
+  _stats.poolWaits++;
+  _poolWaiting = true;
+
+  return false;
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark functions
+/**********************************************************************************************************************************/
+
+
+//
+#define POWER_OF_2(n) ({ \
+  int __power = 1; \
+  while ((1U << __power) < (n)) \
+    __power++; \
+  __power; \
+})
+
+
+// least significant bit set in value
+#define LSB(n) ((n) & ~((n) - 1))
+
+
+static uint64_t getUInt48(const unsigned char *buf)
+{
+  // TODO(iwade) endianess?
+  uint64_t ret = 0;
+  for (int i = 0; i < 6; i++)
+    ret = (ret << 8) | buf[i];
+  return ret;
+}
+
+
+void PSANDevice::resolve()
+{
+  KDEBUG("resolving");
+  _lastResolve = psan_uptime_ns();
+
+  psan_resolve_t req;
+  memset(&req, 0, sizeof(req));
+  req.ctrl.cmd = PSAN_RESOLVE;
+  req.ctrl.seq = _engine->getSequenceNumber(NULL);
+  strncpy(req.id, _id, sizeof(req.id));
+
+  outstanding *out = PSANPoolGet(_resolvePool, outstanding);
+  if (!out)
+  {
+    KDEBUG("resolve already in progress");
+    return;
+  }
+
+  out->seq = ntohs(req.ctrl.seq);
+  out->len = sizeof(psan_resolve_response_t);
+  out->cmd = PSAN_RESOLVE_RESPONSE;
+  out->anyPeer = true;
+  out->packetHandler = PacketHandlerCast<PSANDevice, &PSANDevice::handleResolvePacket>;
+  out->timeoutHandler = TimeoutHandlerCast<PSANDevice, &PSANDevice::handleResolveTimeout>;
+  out->target = this;
+  out->timeout_ms = RESOLVE_TIMEOUT_MS;
+
+  _engine->sendPacket(&_resolveAddress, &req, sizeof(req), NULL, 0, 0, out);
+}
+
+
+void PSANDevice::retryResolve()
+{
+  uint64_t now = psan_uptime_ns();
+
+  if (now - _lastResolve > _resolveInterval &&
+      now - _lastReply > _resolveInterval)
+  {
+    resolve();
+  }
+}
+
+
+void PSANDevice::handleResolvePacket(const struct sockaddr_in *addr, PSANPacket *packet, outstanding *out, void *ctx)
+{
+  _lastReply = psan_uptime_ns();
+
+  psan_resolve_response_t *res = (psan_resolve_response_t *)packet->pullup(out->len);
+
+  _resolvePool.put(out);
+
+  if (!res)
+  {
+    KINFO("pullup failed");
+    return;
+  }
+
+  KDEBUG("resolve succeeded!");
+
+  psan_sockaddr_init(&_partitionAddress, res->ip4.s_addr, htons(PSAN_PORT));
+  _rootAddress = *addr;
+  _resolved = true;
+
+  if (_handlers.resolveHandler)
+    _handlers.resolveHandler(_handlers.target, &_partitionAddress, &_rootAddress);
+
+  if (!_size)
+    disk();
+}
+
+
+void PSANDevice::handleResolveTimeout(outstanding *out, void *ctx)
+{
+  KINFO("resolve timed out, no such ID '%s'?", _id);
+
+  _resolvePool.put(out);
+
+  // TODO(iwade) detach if never successfully resolved.
+}
+
+
+/* read the first sector on the root address for model, firmware and partition info */
+void PSANDevice::disk()
+{
+  uint32_t block = 0;
+  uint32_t nblks = 1;
+
+  PSANFlatBuffer *buffer = new PSANFlatBuffer(nblks * SECTOR_SIZE, false);
+  if (!buffer)
+    psan_panic("alloc failed"); // TODO(iwade) handle
+
+  struct psan_completion completion;
+  completion.target = this;
+  completion.action = CompletionActionCast<PSANDevice, &PSANDevice::diskCompletion>;
+  completion.parameter = buffer;
+
+  prepareAndDoAsyncReadWrite(&_rootAddress, buffer, 0, block, nblks, completion);
+}
+
+
+void PSANDevice::diskCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  PSANFlatBuffer *buffer = (PSANFlatBuffer *)parameter;
+
+  if (status != 0 || actualByteCount != sizeof(psan_get_response_disk_t))
+  {
+    KINFO("disk query on %s failed", _id);
+    delete buffer;
+    return;
+  }
+
+  psan_get_response_disk_t *disk = (psan_get_response_disk_t *)buffer->getBytesNoCopy();
+  disk->version[sizeof(disk->version) - 1] = '\0';
+
+  if (_handlers.diskHandler)
+    _handlers.diskHandler(_handlers.target, disk);
+
+  uint8_t partitions = disk->partitions;
+  delete buffer;
+
+  partition(partitions);
+}
+
+
+void PSANDevice::partition(uint8_t partitions)
+{
+  uint32_t block = 1;
+  uint32_t nblks = partitions;
+
+  if (!nblks)
+  {
+    KINFO("no partitions on %s", _id);
+    return;
+  }
+
+  PSANFlatBuffer *buffer = new PSANFlatBuffer(nblks * SECTOR_SIZE, false);
+  if (!buffer)
+    psan_panic("alloc failed"); // TODO(iwade) handle
+
+  struct psan_completion completion;
+  completion.target = this;
+  completion.action = CompletionActionCast<PSANDevice, &PSANDevice::partitionCompletion>;
+  completion.parameter = buffer;
+
+  prepareAndDoAsyncReadWrite(&_rootAddress, buffer, 0, block, nblks, completion);
+}
+
+
+/* read the <partition#> sector on the root address for label and size */
+void PSANDevice::partitionCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  PSANFlatBuffer *buffer = (PSANFlatBuffer *)parameter;
+
+  if (status != 0 || actualByteCount % sizeof(psan_get_response_partition_t))
+  {
+    KINFO("partition lookup on %s failed", _id);
+    delete buffer;
+    return;
+  }
+
+  psan_get_response_partition_t *part = (psan_get_response_partition_t *)buffer->getBytesNoCopy();
+
+  for (uint32_t i = 0; i < actualByteCount / sizeof(psan_get_response_partition_t); i++, part++)
+  {
+    KDEBUG("cmp %s", part->id);
+
+    if (strncmp(part->id, _id, strlen(_id) + 1) != 0)
+      continue;
+
+    KDEBUG("Matched!");
+
+    part->label[sizeof(part->label) - 1] = '\0';
+    _size = getUInt48(part->sector_size) << 9;
+
+    if (1) // TODO(iwade) determine minimum fields needed
+      _attached = true;
+
+    if (_handlers.partitionHandler)
+      _handlers.partitionHandler(_handlers.target, part, _size);
+
+    if (_attached && _sizeProbing && !_sizeProbed)
+    {
+      _sizeProbed = true;
+      sizeProbe(MAX_IO_READ_SIZE);
+    }
+
+    break;
+  }
+
+  delete buffer;
+}
+
+
+void PSANDevice::handleAsyncIOPacket(const struct sockaddr_in *addr, PSANPacket *packet, outstanding *out, void *ctx)
+{
+  _lastReply = psan_uptime_ns();
+
+  outstanding_io *io = (outstanding_io *)ctx;
+  bool isWrite = io->buffer->isWrite();
+  uint32_t ioLen = (io->nblks * SECTOR_SIZE);
+
+  struct psan_completion completion = io->completion;
+  int status = EIO;
+  uint64_t wrote = ioLen;
+
+  if (isWrite)
+  {
+    //KDEBUG("%p write %d %d", io, io->block, io->nblks);
+
+    status = 0;
+  }
+  else
+  {
+    //KDEBUG("%p read %d %d", io, io->block, io->nblks);
+
+    if (packet->isPlaced(io->buffer, io->offset, sizeof(psan_get_response_t), ioLen))
+      status = 0;
+    else if (packet->copyToBuffer(io->buffer, io->offset, sizeof(psan_get_response_t), ioLen))
+    {
+      _stats.readBytesCopied += ioLen;
+      status = 0;
+    }
+    else
+      KINFO("copyToBuffer failed");
+
+    if (status == 0)
+      _stats.readBytes += ioLen;
+  }
+
+  if (status != 0)
+    KINFO("%p FAILED", io);
+
+  /* a hedge, or the GET it duplicated, answered before any retry */
+  if (io->hedged && !io->attempt)
+  {
+    if (out->matchedSeq == out->seq)
+      _stats.hedgesWon++;
+  }
+  /* answered on an earlier seq# than the latest retry's, see outstanding.acceptLate */
+  else if (out->matchedSeq != out->seq)
+  {
+    uint64_t wait = _lastReply - io->sent;
+
+    _stats.lateResponses++;
+    _stats.lateWait += wait;
+    _stats.lateWaitMax = PSAN_MAX(_stats.lateWaitMax, wait);
+  }
+
+  if (_hedgeBudget && !isWrite && !io->attempt && !io->probe)
+    hedgeSample(io, _lastReply - (io->hedged && out->matchedSeq != out->seq ? io->firstSent : io->sent));
+
+  ioWindowClean(io, sampleRTT(io), (_scheduler.getCount() || _outstandingCount >= getIOWindow()));
+  sizeSample(io, false);
+
+  completeIO(io);
+  _ioPool.put(io);
+
+  psan_complete(completion, status, wrote);
+}
+
+
+void PSANDevice::handleAsyncIOTimeout(outstanding *out, void *ctx)
+{
+  outstanding_io *io = (outstanding_io *)ctx;
+  struct psan_completion completion = io->completion;
+
+  if (io->hedgeArmed && !isStopping())
+  {
+    hedgeFire(io);
+    return;
+  }
+
+  if (!isStopping() && !io->probe)
+  {
+    _stats.timeouts++;
+    ioWindowReduce(io, _ioWindow / 2, _ioWindow / 2);
+    sizeSample(io, true);
+
+    if (sizeResplit(io))
+      return;
+  }
+
+  io->attempt++;
+  io->timeout_ms = (isStopping() ? 0 : getTimeoutMS(io));
+
+  if (io->timeout_ms)
+  {
+    if (io->attempt > 3)
+      KINFO("retry IO (%p, %d, %d)", io, io->attempt, io->timeout_ms);
+    else
+      KDEBUG("retry IO (%p, %d, %d)", io, io->attempt, io->timeout_ms);
+    // IOBlockStorageDriver::incrementRetries(isWrite)
+
+    doSubmitIO(io);
+    return;
+  }
+
+  KINFO("abort IO %p", io);
+  // IOBlockStorageDriver::incrementErrors(isWrite)
+
+  completeIO(io);
+  _ioPool.put(io);
+
+  psan_complete(completion, ETIMEDOUT, 0);
+}
+
+
+/* the engine has already pushed the retry out by SPINUP_INTERVAL_MS, stop piling more IOs onto a drive that isn't ready */
+void PSANDevice::handleAsyncIOError(outstanding *out, void *ctx)
+{
+  outstanding_io *io = (outstanding_io *)ctx;
+
+  _stats.errors++;
+  io->hedgeArmed = false; /* it's waiting out the spin-up now */
+  if (!io->probe)
+    ioWindowReduce(io, IO_WINDOW(IO_WINDOW_MIN), _ioWindow / 2);
+}
+
+
+void PSANDevice::prepareAndDoAsyncReadWrite(const struct sockaddr_in *addr, PSANBuffer *buffer, uint64_t offset, uint32_t block, uint32_t nblks, struct psan_completion completion)
+{
+  bool isWrite = buffer->isWrite();
+  uint64_t ioMaxSize = (isWrite ? _ioMaxWriteSize : _ioMaxReadSize);
+  uint64_t ioSize = (nblks * SECTOR_SIZE);
+
+#if WRITEPROTECT
+  if (isWrite)
+    psan_panic("write while write protected");
+#endif
+
+  /* a read that fits in one GET once rounded up is sent as one, see makeCarrier() */
+  uint32_t rounded = 0;
+
+  if ((ioSize > ioMaxSize || ioSize & (ioSize - 1)) &&
+      (isWrite || ioSize > ioMaxSize || !(rounded = roundUpRead(block, nblks))))
+  {
+    KDEBUG("%s size=%llu, deblocking", (isWrite ? "write" : "read"), (unsigned long long)ioSize);
+    deblock(addr, buffer, offset, block, nblks, completion);
+    return;
+  }
+
+  outstanding_io *io = PSANPoolGet(_ioPool, outstanding_io);
+  if (!io)
+  {
+    KINFO("IO pool exhausted");
+    _stats.poolExhausted++;
+    psan_complete(completion, ENOMEM, 0);
+    return;
+  }
+
+  io->addr = *addr;
+  io->buffer = buffer;
+  io->offset = offset;
+  io->block = block;
+  io->nblks = nblks;
+  io->completion = completion;
+  io->attempt = 0;
+  io->timeout_ms = getTimeoutMS(io);
+
+  if (rounded)
+  {
+    outstanding_io *carrier = makeCarrier(io, 0, rounded);
+    if (!carrier)
+    {
+      _ioPool.put(io);
+      deblock(addr, buffer, offset, block, nblks, completion);
+      return;
+    }
+
+    io = carrier;
+  }
+
+  submitIO(io);
+}
+
+
+/* SRTT + 4*RTTVAR for the IO's direction and size (RFC 6298), doubled for every retry and clamped to the configured
+ * floor and ceiling. PSAN_ERROR still pushes the next retry out to SPINUP_INTERVAL_MS regardless, see PSANEngine.
+ */
+uint32_t PSANDevice::getTimeoutMS(outstanding_io *io)
+{
+  struct psan_rtt *rtt = getRTT(io);
+  uint64_t rto;
+
+  if (io->attempt >= (io->probe ? IO_SIZE_PROBE_ATTEMPTS : IO_MAX_ATTEMPTS))
+  {
+#ifdef RETRY_INDEFINITELY_DELAY_MS
+    if (io->buffer->isWrite())
+      return RETRY_INDEFINITELY_DELAY_MS;
+#endif
+
+    return 0;
+  }
+
+  if (rtt->srtt)
+    rto = (rtt->srtt + PSAN_MAX(4 * rtt->rttvar, NSEC_PER_MSEC) + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+  else
+    rto = RTO_INITIAL_MS;
+
+  rto <<= PSAN_MIN(io->attempt, 16);
+
+  return PSAN_MAX(PSAN_MIN(rto, _rtoMaxMS), _rtoMinMS);
+}
+
+
+void PSANDevice::submitIO(outstanding_io *io)
+{
+  bool isWrite = io->buffer->isWrite();
+
+  io->sched.owner = io;
+  io->sched.block = io->block;
+  io->sched.nblks = io->nblks;
+  io->sched.isWrite = isWrite;
+
+  if (_outstandingCount >= getIOWindow() || _scheduler.atDepth(isWrite, _inFlight[isWrite]))
+  {
+    queueIO(io);
+    return;
+  }
+
+  STAILQ_INSERT_TAIL(&_outstandingHead, io, entries);
+  _outstandingCount++;
+  _inFlight[isWrite]++;
+
+  doSubmitIO(io);
+}
+
+
+void PSANDevice::doSubmitIO(outstanding_io *io)
+{
+  bool isWrite = io->buffer->isWrite();
+  uint32_t ioLen = (io->nblks * SECTOR_SIZE);
+
+  retryResolve();
+
+  io->outstanding.packetHandler = PacketHandlerCast<PSANDevice, &PSANDevice::handleAsyncIOPacket>;
+  io->outstanding.timeoutHandler = TimeoutHandlerCast<PSANDevice, &PSANDevice::handleAsyncIOTimeout>;
+  io->outstanding.errorHandler = TimeoutHandlerCast<PSANDevice, &PSANDevice::handleAsyncIOError>;
+  io->outstanding.target = this;
+  io->outstanding.ctx = io;
+  io->outstanding.timeout_ms = io->timeout_ms;
+  io->outstanding.acceptLate = true;
+  io->sent = psan_uptime_ns();
+
+  /* a GET's first send may time out early, to be hedged */
+  io->hedgeArmed = false;
+
+  if (_hedgeBudget && !isWrite && !io->attempt && !io->hedged && !io->probe)
+  {
+    uint32_t hedgeMS = hedgeDelayMS(io);
+
+    _hedgeCredit = PSAN_MIN(_hedgeCredit + _hedgeBudget, HEDGE_BURST * 100);
+
+    if (hedgeMS && hedgeMS < io->outstanding.timeout_ms)
+    {
+      io->outstanding.timeout_ms = hedgeMS;
+      io->hedgeArmed = true;
+    }
+  }
+
+  if (isWrite)
+  {
+    KDEBUG("%p write %d %d (%d)", io, io->block, io->nblks, _outstandingCount);
+
+    psan_put_t req;
+    memcpy(&req, _putTemplate, sizeof(req));
+    req.ctrl.seq = _engine->getSequenceNumber(&io->addr);
+    req.ctrl.len_power = POWER_OF_2(ioLen);
+    req.sector = htonl(io->block);
+
+    io->outstanding.seq = ntohs(req.ctrl.seq);
+    io->outstanding.len = sizeof(psan_put_response_t);
+    io->outstanding.cmd = PSAN_PUT_RESPONSE;
+    io->outstanding.payload = NULL;
+
+    if (!_engine->sendPacket(&io->addr, &req, sizeof(req), io->buffer, io->offset, ioLen, &io->outstanding))
+      KINFO("sendPacket failed"); // retried on timeout
+  }
+  else
+  {
+    KDEBUG("%p read %d %d (%d)", io, io->block, io->nblks, _outstandingCount);
+
+    psan_get_t req = _getTemplate;
+    req.ctrl.seq = _engine->getSequenceNumber(&io->addr);
+    req.ctrl.len_power = POWER_OF_2(ioLen);
+    req.sector = htonl(io->block);
+
+    io->outstanding.seq = ntohs(req.ctrl.seq);
+    io->outstanding.len = sizeof(psan_get_response_t) + ioLen;
+    io->outstanding.cmd = PSAN_GET_RESPONSE;
+    io->outstanding.payload = io->buffer;
+    io->outstanding.payloadOffset = io->offset;
+    io->outstanding.payloadLen = ioLen;
+    io->outstanding.payloadSurplus = (uint16_t)(io->carrier ? ((PSANCoalescedBuffer *)io->buffer)->getSurplus() : 0);
+
+    if (!_engine->sendPacket(&io->addr, &req, sizeof(req), NULL, 0, 0, &io->outstanding))
+      KINFO("sendPacket failed"); // retried on timeout
+  }
+}
+
+
+void PSANDevice::completeIO(outstanding_io *io)
+{
+  /* an answer to a transmission that timed out could still come, after giving up on it */
+  _engine->releaseRequest(&io->outstanding);
+
+  STAILQ_REMOVE(&_outstandingHead, io, outstanding_io, entries);
+  _outstandingCount--;
+  _inFlight[io->sched.isWrite]--;
+
+  dequeueAndSubmitIO();
+}
+
+
+void PSANDevice::queueIO(outstanding_io *io)
+{
+  _scheduler.enqueue(&io->sched, psan_uptime_ns());
+}
+
+
+static inline outstanding_io *ioFromEntry(struct psan_sched_entry *e)
+{
+  return (e ? (outstanding_io *)e->owner : NULL);
+}
+
+
+/* the window may have grown by more than the one IO that just completed */
+void PSANDevice::dequeueAndSubmitIO()
+{
+  outstanding_io *io;
+
+  while (_outstandingCount < getIOWindow() && (io = ioFromEntry(_scheduler.dequeue(_inFlight, psan_uptime_ns()))))
+  {
+    if (_scheduler.getCount() && !io->carrier)
+      io = coalescePending(io);
+
+    submitIO(io);
+  }
+}
+
+
+/* the pending IO in the same direction starting at block, the longest waiting if there's more than one */
+outstanding_io *PSANDevice::findPending(const struct sockaddr_in *addr, uint32_t block, bool isWrite)
+{
+  struct psan_sched_entry *e;
+
+  for (e = _scheduler.find(isWrite, block); e; e = _scheduler.findNext(e))
+  {
+    outstanding_io *io = ioFromEntry(e);
+
+    if (!io->carrier && io->addr.sin_addr.s_addr == addr->sin_addr.s_addr && io->addr.sin_port == addr->sin_port)
+      return io;
+  }
+
+  return NULL;
+}
+
+
+/* the blocks a GET for [block, block + nblks) is better rounded up to than split, 0 if it's a power of 2 already or
+ * the rounded GET would be too big or run off the end of the device
+ */
+uint32_t PSANDevice::roundUpRead(uint32_t block, uint32_t nblks)
+{
+  uint64_t deviceBlocks = _size / SECTOR_SIZE;
+  uint32_t rounded = 1;
+
+  while (rounded < nblks)
+    rounded <<= 1;
+
+  if (rounded == nblks || (uint64_t)rounded * SECTOR_SIZE > _ioMaxReadSize || (uint64_t)block + rounded > deviceBlocks)
+    return 0;
+
+  return rounded;
+}
+
+
+/* IOs queued behind a full window that carry on where this one ends go out with it as one request, the longest run
+ * that fits in the maximum transfer size: for writes, exactly a power of 2 in total; reads may be rounded up to one,
+ * the surplus being dropped. the original IOs are completed together when it is, see coalesceCompletion().
+ */
+outstanding_io *PSANDevice::coalescePending(outstanding_io *io)
+{
+  bool isWrite = io->buffer->isWrite();
+  uint32_t maxBlocks = (isWrite ? _ioMaxWriteSize : _ioMaxReadSize) / SECTOR_SIZE;
+  uint32_t total = io->nblks;
+  uint32_t count = 0;
+  uint32_t bestTransfer = 0;
+  uint32_t bestCount = 0;
+  outstanding_io *next;
+
+  while ((next = findPending(&io->addr, io->block + total, isWrite)) && total + next->nblks <= maxBlocks)
+  {
+    uint32_t rounded;
+
+    total += next->nblks;
+    count++;
+
+    if (!(total & (total - 1)))
+    {
+      bestTransfer = total;
+      bestCount = count;
+    }
+    else if (!isWrite && (rounded = roundUpRead(io->block, total)))
+    {
+      bestTransfer = rounded;
+      bestCount = count;
+    }
+  }
+
+  if (!bestCount)
+    return io;
+
+  outstanding_io *carrier = makeCarrier(io, bestCount, bestTransfer);
+
+  return (carrier ? carrier : io);
+}
+
+
+/* one IO of transfer blocks standing in for io and the count pending IOs following it, NULL (having taken nothing off
+ * the queue) if it can't be allocated
+ */
+outstanding_io *PSANDevice::makeCarrier(outstanding_io *io, uint32_t count, uint32_t transfer)
+{
+  bool isWrite = io->buffer->isWrite();
+
+  outstanding_io *carrier = PSANPoolGet(_ioPool, outstanding_io);
+  if (!carrier)
+    return NULL;
+
+  PSANCoalescedBuffer *buffer = new (_carrierPool) PSANCoalescedBuffer(isWrite);
+  if (!buffer)
+  {
+    _ioPool.put(carrier);
+    return NULL;
+  }
+
+  uint64_t now = psan_uptime_ns();
+  uint32_t covered = io->nblks;
+  buffer->append(io);
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    outstanding_io *next = findPending(&io->addr, io->block + covered, isWrite);
+
+    _scheduler.remove(&next->sched, now);
+
+    covered += next->nblks;
+    buffer->append(next);
+  }
+
+  buffer->setLength((uint64_t)transfer * SECTOR_SIZE);
+
+  if (count && isWrite)
+  {
+    _stats.coalescedPuts++;
+    _stats.coalescedWrites += count + 1;
+  }
+  else if (count)
+  {
+    _stats.coalescedGets++;
+    _stats.coalescedReads += count + 1;
+  }
+
+  if (transfer > covered)
+  {
+    _stats.overReads++;
+    _stats.overReadBytes += (uint64_t)(transfer - covered) * SECTOR_SIZE;
+  }
+
+  carrier->addr = io->addr;
+  carrier->buffer = buffer;
+  carrier->offset = 0;
+  carrier->block = io->block;
+  carrier->nblks = transfer;
+  carrier->completion.target = this;
+  carrier->completion.action = CompletionActionCast<PSANDevice, &PSANDevice::coalesceCompletion>;
+  carrier->completion.parameter = buffer;
+  carrier->carrier = true;
+  carrier->attempt = 0;
+  carrier->timeout_ms = getTimeoutMS(carrier);
+
+  return carrier;
+}
+
+
+/* the carrier IO itself has already gone back to the pool */
+void PSANDevice::coalesceCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  PSANCoalescedBuffer *buffer = (PSANCoalescedBuffer *)parameter;
+  outstanding_io *io;
+
+  while ((io = buffer->takeFirst()))
+  {
+    struct psan_completion completion = io->completion;
+    uint64_t done = (status ? 0 : (uint64_t)io->nblks * SECTOR_SIZE);
+
+    _ioPool.put(io);
+
+    psan_complete(completion, status, done);
+  }
+
+  buffer->~PSANCoalescedBuffer();
+  _carrierPool.put(buffer);
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Congestion control
+/**********************************************************************************************************************************/
+
+
+/* AIMD over the number of IOs in flight, as TCP does with its congestion window: slow start (+1 per response) up to the
+ * threshold, then +1 per window of responses, halved on a timeout and dropped to the minimum on PSAN_ERROR. a response
+ * much slower than the best recently seen for its direction and size means a queue is building somewhere, so the window
+ * is shrunk by an eighth before that turns into loss.
+ */
+uint32_t PSANDevice::getIOWindow()
+{
+  return (_ioWindow >> IO_WINDOW_SHIFT);
+}
+
+
+static inline int sizeClass(uint32_t size)
+{
+  return PSAN_MIN(POWER_OF_2(size) - 9, PSAN_SIZE_CLASSES - 1);
+}
+
+
+struct psan_rtt *PSANDevice::getRTT(outstanding_io *io)
+{
+  return &_rtt[io->buffer->isWrite()][sizeClass(io->nblks * SECTOR_SIZE)];
+}
+
+
+/* returns the RTT of a response to a first attempt, or 0 for a retransmit or hedge which could belong to either (Karn) */
+uint64_t PSANDevice::sampleRTT(outstanding_io *io)
+{
+  if (io->attempt != 0 || io->hedged)
+    return 0;
+
+  uint64_t now = psan_uptime_ns();
+  uint64_t sample = now - io->sent;
+  struct psan_rtt *rtt = getRTT(io);
+
+  if (!rtt->srtt)
+  {
+    rtt->srtt = sample;
+    rtt->rttvar = sample / 2;
+  }
+  else
+  {
+    uint64_t delta = (sample > rtt->srtt ? sample - rtt->srtt : rtt->srtt - sample);
+
+    rtt->rttvar = rtt->rttvar - rtt->rttvar / 4 + delta / 4;
+    rtt->srtt = rtt->srtt - rtt->srtt / 8 + sample / 8;
+  }
+
+  /* keep two generations of minimum so a route or firmware change is forgotten eventually */
+  if (now - _baseRTTEpoch > IO_WINDOW_BASE_RTT_MS * NSEC_PER_MSEC)
+  {
+    for (int d = 0; d < 2; d++)
+    {
+      for (int c = 0; c < PSAN_SIZE_CLASSES; c++)
+      {
+        if (_rtt[d][c].baseNext)
+          _rtt[d][c].base = _rtt[d][c].baseNext;
+        _rtt[d][c].baseNext = 0;
+      }
+    }
+
+    _baseRTTEpoch = now;
+  }
+
+  if (!rtt->base || sample < rtt->base)
+    rtt->base = sample;
+  if (!rtt->baseNext || sample < rtt->baseNext)
+    rtt->baseNext = sample;
+
+  return sample;
+}
+
+
+void PSANDevice::ioWindowClean(outstanding_io *io, uint64_t rtt, bool windowLimited)
+{
+  uint64_t base = getRTT(io)->base;
+
+  if (rtt && rtt > 2 * base + IO_WINDOW_DELAY_US * 1000ULL)
+  {
+    KDEBUG("rtt %lluus vs base %lluus, shrinking window", (unsigned long long)rtt / 1000, (unsigned long long)base / 1000);
+    ioWindowReduce(io, _ioWindow - _ioWindow / 8, _ioWindow - _ioWindow / 8);
+    return;
+  }
+
+  /* a window that isn't being filled hasn't been tested, so don't let it grow */
+  if (!windowLimited)
+    return;
+
+  if (_ioWindow < _ioWindowThreshold)
+    _ioWindow += IO_WINDOW(1);
+  else
+    _ioWindow += IO_WINDOW(1) * IO_WINDOW(1) / _ioWindow;
+
+  _ioWindow = PSAN_MIN(_ioWindow, IO_WINDOW(IO_WINDOW_MAX));
+
+  _stats.ioWindow = getIOWindow();
+  _stats.ioWindowMax = PSAN_MAX(_stats.ioWindowMax, _stats.ioWindow);
+}
+
+
+/* one reduction per window: IOs sent before the last reduction were part of the same congestion event */
+void PSANDevice::ioWindowReduce(outstanding_io *io, uint32_t window, uint32_t threshold)
+{
+  if (io->sent < _ioWindowReduced)
+    return;
+
+  _ioWindow = PSAN_MAX(window, IO_WINDOW(IO_WINDOW_MIN));
+  _ioWindowThreshold = PSAN_MAX(threshold, IO_WINDOW(IO_WINDOW_MIN));
+  _ioWindowReduced = psan_uptime_ns();
+
+  _stats.ioWindow = getIOWindow();
+  _stats.ioWindowReductions++;
+
+  KDEBUG("window now %u, threshold %u", getIOWindow(), _ioWindowThreshold >> IO_WINDOW_SHIFT);
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Transfer size functions
+/**********************************************************************************************************************************/
+
+
+/* one GET of size from the start of the partition, the largest that gets an answer is the unit's limit. sizes up to
+ * the one already in use are taken to work
+ */
+void PSANDevice::sizeProbe(uint32_t size)
+{
+  while (size > _ioMaxReadSize && size > _size)
+    size /= 2;
+
+  if (size <= _ioMaxReadSize)
+  {
+    sizeProbeFinish(0);
+    return;
+  }
+
+  PSANFlatBuffer *buffer = PSANFlatBuffer::tryAlloc(size, false);
+  if (!buffer)
+  {
+    sizeProbeFinish(0);
+    return;
+  }
+
+  outstanding_io *io = PSANPoolGet(_ioPool, outstanding_io);
+  if (!io)
+  {
+    delete buffer;
+    sizeProbeFinish(0);
+    return;
+  }
+
+  KDEBUG("%s: probing %u byte GETs", _id, size);
+
+  io->addr = _partitionAddress;
+  io->buffer = buffer;
+  io->offset = 0;
+  io->block = 0;
+  io->nblks = size / SECTOR_SIZE;
+  io->completion.target = this;
+  io->completion.action = CompletionActionCast<PSANDevice, &PSANDevice::sizeProbeCompletion>;
+  io->completion.parameter = buffer;
+  io->probe = true;
+  io->attempt = 0;
+  io->timeout_ms = getTimeoutMS(io);
+
+  submitIO(io);
+}
+
+
+void PSANDevice::sizeProbeCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  PSANFlatBuffer *buffer = (PSANFlatBuffer *)parameter;
+  uint32_t size = (uint32_t)buffer->getLength();
+
+  delete buffer;
+
+  if (!status)
+    sizeProbeFinish(size);
+  else if (!isStopping())
+    sizeProbe(size / 2);
+}
+
+
+/* writes are assumed to go as far as reads, PUTting data back to find out isn't worth the risk. a PUT size the unit
+ * doesn't take is found when trying it, see sizeSample()
+ */
+void PSANDevice::sizeProbeFinish(uint32_t answered)
+{
+  _sizes[false].limit = PSAN_MAX(_sizes[false].limit, answered);
+  _sizes[true].limit = PSAN_MAX(_sizes[true].limit, PSAN_MIN(_sizes[false].limit, MAX_IO_WRITE_SIZE));
+
+  KINFO("%s: GETs up to %u bytes answered", _id, _sizes[false].limit);
+}
+
+
+/* counts responses and timeouts by size, and every IO_SIZE_EVAL_MS has another look at the sizes being sent */
+void PSANDevice::sizeSample(outstanding_io *io, bool lost)
+{
+  if (!_sizeProbing || io->probe)
+    return;
+
+  bool isWrite = io->buffer->isWrite();
+  struct psan_size_state *state = &_sizes[isWrite];
+  uint32_t size = io->nblks * SECTOR_SIZE;
+  int c = sizeClass(size);
+  uint64_t now = psan_uptime_ns();
+
+  if (lost)
+    state->lost[c]++;
+  else
+    state->delivered[c]++;
+
+  if (state->delivered[c] + state->lost[c] > IO_SIZE_HISTORY)
+  {
+    state->delivered[c] /= 2;
+    state->lost[c] /= 2;
+  }
+
+  /* nothing at all coming back for a size being tried means the unit doesn't take it, no need to wait for a verdict */
+  if (state->previous && size == (isWrite ? _ioMaxWriteSize : _ioMaxReadSize) &&
+      !state->delivered[c] && state->lost[c] >= IO_SIZE_PROBE_ATTEMPTS)
+  {
+    KINFO("%s: no answer to %u byte %s", _id, size, (isWrite ? "PUTs" : "GETs"));
+    state->limit = state->previous;
+    sizeRevert(isWrite, now);
+    return;
+  }
+
+  if (now - _sizeEvaluated >= IO_SIZE_EVAL_MS * NSEC_PER_MSEC)
+  {
+    _sizeEvaluated = now;
+    sizeEvaluate(false, now);
+    sizeEvaluate(true, now);
+  }
+}
+
+
+/* a hill climb on goodput: with too many of the largest IOs lost, try the next size down, with next to none lost try
+ * the next size up, and keep whichever moves more data once it's been sent IO_SIZE_SAMPLES times. smaller IOs lose fewer
+ * fragments, but a loss that costs a retransmit timeout either way doesn't always make up for the extra round trips.
+ */
+void PSANDevice::sizeEvaluate(bool isWrite, uint64_t now)
+{
+  struct psan_size_state *state = &_sizes[isWrite];
+  uint32_t size = (isWrite ? _ioMaxWriteSize : _ioMaxReadSize);
+  int c = sizeClass(size);
+  uint64_t total = state->delivered[c] + state->lost[c];
+
+  if (total < IO_SIZE_SAMPLES)
+    return;
+
+  if (state->previous)
+  {
+    bool bigger = (size > state->previous);
+
+    if (sizeGoodput(isWrite, size) < sizeGoodput(isWrite, state->previous))
+    {
+      sizeRevert(isWrite, now);
+      return;
+    }
+
+    KINFO("%s: keeping %u byte %s", _id, size, (isWrite ? "PUTs" : "GETs"));
+    state->previous = 0;
+    state->backoffMS[bigger] = IO_SIZE_BACKOFF_MS;
+
+    if (bigger)
+      _stats.ioSizeRaises++;
+    else
+      _stats.ioSizeFallbacks++;
+
+    return;
+  }
+
+  uint64_t loss = state->lost[c] * 1000 / total;
+
+  if (loss > IO_SIZE_FALLBACK_LOSS && size > IO_SIZE_MIN && now >= state->tryAfter[false])
+  {
+    KINFO("%s: %llu/1000 %u byte %s lost", _id, (unsigned long long)loss, size, (isWrite ? "PUTs" : "GETs"));
+    sizeTry(isWrite, size / 2);
+  }
+  else if (loss <= IO_SIZE_RAISE_LOSS && size < state->limit && now >= state->tryAfter[true])
+  {
+    sizeTry(isWrite, size * 2);
+  }
+}
+
+
+/* bytes per ms per IO in flight: each loss costs a retransmit timeout on top of the round trips. 0 if unknown */
+uint64_t PSANDevice::sizeGoodput(bool isWrite, uint32_t size)
+{
+  struct psan_size_state *state = &_sizes[isWrite];
+  int c = sizeClass(size);
+  struct psan_rtt *rtt = &_rtt[isWrite][c];
+
+  if (!rtt->srtt || !state->delivered[c])
+    return 0;
+
+  uint64_t rto = rtt->srtt + PSAN_MAX(4 * rtt->rttvar, NSEC_PER_MSEC);
+  rto = PSAN_MAX(PSAN_MIN(rto, _rtoMaxMS * NSEC_PER_MSEC), _rtoMinMS * NSEC_PER_MSEC);
+
+  uint64_t busy = rtt->srtt * state->delivered[c] + rto * state->lost[c];
+
+  return (uint64_t)size * state->delivered[c] * NSEC_PER_MSEC / busy;
+}
+
+
+/* the new size's counts start over, they were taken at a different time if at all */
+void PSANDevice::sizeSet(bool isWrite, uint32_t size)
+{
+  struct psan_size_state *state = &_sizes[isWrite];
+  int c = sizeClass(size);
+
+  KDEBUG("%s: %s size now %u", _id, (isWrite ? "write" : "read"), size);
+
+  state->delivered[c] = 0;
+  state->lost[c] = 0;
+
+  if (isWrite)
+    _ioMaxWriteSize = size;
+  else
+    _ioMaxReadSize = size;
+
+  if (_handlers.ioSizeHandler)
+    _handlers.ioSizeHandler(_handlers.target, _ioMaxReadSize, _ioMaxWriteSize);
+}
+
+
+void PSANDevice::sizeTry(bool isWrite, uint32_t size)
+{
+  _sizes[isWrite].previous = (isWrite ? _ioMaxWriteSize : _ioMaxReadSize);
+  _stats.ioSizeTrials++;
+
+  sizeSet(isWrite, size);
+}
+
+
+/* back to the size before the one being tried, and leave sizes that way alone for a while. its counts are kept */
+void PSANDevice::sizeRevert(bool isWrite, uint64_t now)
+{
+  struct psan_size_state *state = &_sizes[isWrite];
+  uint32_t size = (isWrite ? _ioMaxWriteSize : _ioMaxReadSize);
+  bool bigger = (size > state->previous);
+
+  state->tryAfter[bigger] = now + state->backoffMS[bigger] * NSEC_PER_MSEC;
+  state->backoffMS[bigger] = PSAN_MIN(state->backoffMS[bigger] * 2, IO_SIZE_BACKOFF_MAX_MS);
+
+  if (isWrite)
+    _ioMaxWriteSize = state->previous;
+  else
+    _ioMaxReadSize = state->previous;
+  state->previous = 0;
+
+  if (_handlers.ioSizeHandler)
+    _handlers.ioSizeHandler(_handlers.target, _ioMaxReadSize, _ioMaxWriteSize);
+}
+
+
+/* an IO lost at a size since given up on is split up again rather than retried as it is. true if it was */
+bool PSANDevice::sizeResplit(outstanding_io *io)
+{
+  bool isWrite = io->buffer->isWrite();
+  uint32_t ioMaxSize = (isWrite ? _ioMaxWriteSize : _ioMaxReadSize);
+
+  if (io->nblks * SECTOR_SIZE <= ioMaxSize || !hasPoolSpace(isWrite, io->nblks))
+    return false;
+
+  struct sockaddr_in addr = io->addr;
+  PSANBuffer *buffer = io->buffer;
+  uint64_t offset = io->offset;
+  uint32_t block = io->block;
+  uint32_t nblks = io->nblks;
+  struct psan_completion completion = io->completion;
+
+  KDEBUG("%p resplit %d %d", io, block, nblks);
+  _stats.ioResplits++;
+
+  completeIO(io);
+  _ioPool.put(io);
+
+  deblock(&addr, buffer, offset, block, nblks, completion);
+
+  return true;
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Hedged reads
+/**********************************************************************************************************************************/
+
+
+/* 4 buckets per power of 2 ns from 16us, everything quicker in the first and slower than ~6s in the last */
+static int latencyBucket(uint64_t ns)
+{
+  if (ns < (1 << 14))
+    return 0;
+
+  int power = 14;
+  while (ns >> (power + 1))
+    power++;
+
+  return PSAN_MIN((power - 14) * 4 + (int)((ns >> (power - 2)) & 3) + 1, HEDGE_BUCKETS - 1);
+}
+
+
+/* the longest latency that goes in bucket */
+static uint64_t latencyBucketLimit(int bucket)
+{
+  if (bucket == 0)
+    return (1 << 14);
+
+  int power = (bucket - 1) / 4 + 14;
+
+  return (uint64_t)(4 + (bucket - 1) % 4 + 1) << (power - 2);
+}
+
+
+/* 0 if a GET this size isn't to be hedged (yet) */
+uint32_t PSANDevice::hedgeDelayMS(outstanding_io *io)
+{
+  return _latency[sizeClass(io->nblks * SECTOR_SIZE)].hedgeMS;
+}
+
+
+/* the GET has been out longer than most are: send it again under a new seq#, the first still stands (acceptLate), and
+ * the pair share what's left of its retransmit timeout. over budget it just waits that out.
+ */
+void PSANDevice::hedgeFire(outstanding_io *io)
+{
+  uint32_t waited = io->outstanding.timeout_ms;
+
+  io->hedgeArmed = false;
+  io->timeout_ms = PSAN_MAX(io->timeout_ms - (int)waited, 1);
+
+  if (_hedgeCredit < 100)
+  {
+    _stats.hedgesDenied++;
+
+    io->outstanding.timeout_ms = io->timeout_ms;
+    _engine->startTimer(&io->outstanding);
+    return;
+  }
+
+  KDEBUG("%p hedge %d %d after %u ms", io, io->block, io->nblks, waited);
+
+  _hedgeCredit -= 100;
+  _stats.hedgesFired++;
+
+  io->hedged = true;
+  io->firstSent = io->sent;
+
+  doSubmitIO(io);
+}
+
+
+/* latency is from the send the answer was to, so a hedge's own doesn't count the wait before it */
+void PSANDevice::hedgeSample(outstanding_io *io, uint64_t latency)
+{
+  struct psan_latency *l = &_latency[sizeClass(io->nblks * SECTOR_SIZE)];
+
+  l->buckets[latencyBucket(latency)]++;
+
+  if (++l->count > HEDGE_HISTORY)
+  {
+    l->count = 0;
+    for (int b = 0; b < HEDGE_BUCKETS; b++)
+    {
+      l->buckets[b] /= 2;
+      l->count += l->buckets[b];
+    }
+  }
+
+  if (l->count < HEDGE_MIN_SAMPLES)
+  {
+    l->hedgeMS = 0;
+    return;
+  }
+
+  uint32_t target = (uint32_t)((uint64_t)l->count * _hedgePercentile / 100);
+  uint32_t seen = 0;
+  int b = 0;
+
+  while (b < HEDGE_BUCKETS - 1 && (seen += l->buckets[b]) < target)
+    b++;
+
+  l->hedgeMS = (uint32_t)((latencyBucketLimit(b) + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Request Splitting functions
+/**********************************************************************************************************************************/
+
+
+void PSANDevice::deblockCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  deblock_state *state = (deblock_state *)parameter;
+  deblock_master_state *master = state->master;
+
+  _deblockPool.put(state);
+
+  deblockRelease(master, status, actualByteCount);
+}
+
+
+void PSANDevice::deblockRelease(deblock_master_state *master, int status, uint64_t actualByteCount)
+{
+  master->pending--;
+  master->actualByteCount += actualByteCount;
+  if (status != 0)
+    master->status = status;
+
+  if (!master->pending)
+  {
+    if (master->status != 0)
+      KINFO("deblock FAILED");
+
+    struct psan_completion completion = master->completion;
+    status = master->status;
+    actualByteCount = master->actualByteCount;
+
+    _masterPool.put(master);
+
+    psan_complete(completion, status, actualByteCount);
+  }
+}
+
+
+/* send part of a read that was to be served from memory (a prefetch, the cache) to the unit after all.
+ * master->pending already counts it.
+ */
+void PSANDevice::deblockRead(deblock_master_state *master, uint64_t offset, uint32_t block, uint32_t nblks)
+{
+  deblock_state *state = PSANPoolGet(_deblockPool, deblock_state);
+  if (!state)
+  {
+    _stats.poolExhausted++;
+    deblockRelease(master, ENOMEM, 0);
+    return;
+  }
+
+  state->master = master;
+
+  struct psan_completion completion;
+  completion.target = this;
+  completion.action = CompletionActionCast<PSANDevice, &PSANDevice::deblockCompletion>;
+  completion.parameter = state;
+
+  prepareAndDoAsyncReadWrite(&_partitionAddress, master->buffer, offset, block, nblks, completion);
+}
+
+
+/* how many IOs prepareAndDoAsyncReadWrite() will turn a request into, see deblock(). for reads that round their tail
+ * up instead this is an upper bound: the tail and its carrier are 2 IOs, splitting it would have been at least 2.
+ */
+uint32_t PSANDevice::countChunks(bool isWrite, uint32_t nblks)
+{
+  uint64_t ioMaxSize = (isWrite ? _ioMaxWriteSize : _ioMaxReadSize);
+  uint64_t ioSize = (nblks * SECTOR_SIZE);
+  uint32_t chunks = 0;
+
+  if (ioSize <= ioMaxSize && !(ioSize & (ioSize - 1)))
+    return 1;
+
+  for (uint64_t used = 0, use = PSAN_MIN(LSB(ioSize), ioMaxSize);
+       used < ioSize;
+       used += use, use = PSAN_MIN(LSB(ioSize - used), ioMaxSize))
+    chunks++;
+
+  return chunks;
+}
+
+
+/* the next chunk of what remains: as big as its alignment allows, or with roundTail as big as possible, leaving a tail
+ * to be rounded up into one GET
+ */
+static inline uint64_t deblockChunk(uint64_t remaining, uint64_t ioMaxSize, bool roundTail)
+{
+  return PSAN_MIN((roundTail ? remaining : LSB(remaining)), ioMaxSize);
+}
+
+
+/* chunks share the caller's buffer at increasing offsets rather than sub-range descriptors */
+void PSANDevice::deblock(const struct sockaddr_in *addr, PSANBuffer *buffer, uint64_t offset, uint32_t block, uint32_t nblks, struct psan_completion completion)
+{
+  bool isWrite = buffer->isWrite();
+  uint64_t ioMaxSize = (isWrite ? _ioMaxWriteSize : _ioMaxReadSize);
+  uint64_t ioSize = (nblks * SECTOR_SIZE);
+
+  deblock_master_state *master = PSANPoolGet(_masterPool, deblock_master_state);
+  if (!master)
+  {
+    KINFO("deblock pool exhausted");
+    _stats.poolExhausted++;
+    psan_complete(completion, ENOMEM, 0);
+    return;
+  }
+
+  master->buffer = buffer;
+  master->block = block;
+  master->nblks = nblks;
+  master->completion = completion;
+  master->status = 0;
+
+  /* hold a reference until every chunk has been issued, so a chunk completing synchronously can't free master */
+  master->pending++;
+
+  uint64_t tail = ioSize % ioMaxSize;
+  bool roundTail = (!isWrite && ioSize > ioMaxSize && tail &&
+                    roundUpRead(block + (uint32_t)((ioSize - tail) / SECTOR_SIZE), (uint32_t)(tail / SECTOR_SIZE)));
+
+  for (uint64_t used = 0, use = deblockChunk(ioSize, ioMaxSize, roundTail);
+       used < ioSize;
+       used += use, use = deblockChunk(ioSize - used, ioMaxSize, roundTail))
+  {
+    deblock_state *state = PSANPoolGet(_deblockPool, deblock_state);
+    if (!state)
+    {
+      /* the chunks already issued still complete, and the request fails once they have */
+      KINFO("deblock pool exhausted");
+      _stats.poolExhausted++;
+      master->status = ENOMEM;
+      break;
+    }
+
+    state->master = master;
+
+    struct psan_completion new_completion;
+    new_completion.target = this;
+    new_completion.action = CompletionActionCast<PSANDevice, &PSANDevice::deblockCompletion>;
+    new_completion.parameter = state;
+
+    master->pending++;
+
+    KDEBUG("deblock %s used=%llu, use=%llu", (isWrite ? "write" : "read"), (unsigned long long)used, (unsigned long long)use);
+
+    prepareAndDoAsyncReadWrite(addr, master->buffer, offset + used, master->block + used / SECTOR_SIZE, use / SECTOR_SIZE, new_completion);
+  }
+
+  deblockRelease(master, 0, 0);
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Read-ahead functions
+/**********************************************************************************************************************************/
+
+
+/* the stream this read continues, advanced past it. NULL if it starts a new one instead, which replaces the least
+ * recently used stream with no window, so random reads never get anything prefetched for them.
+ */
+struct readahead_stream *PSANDevice::readAheadTrack(uint32_t block, uint32_t nblks)
+{
+  struct readahead_stream *victim = NULL;
+  uint64_t now = psan_uptime_ns();
+
+  for (uint32_t i = 0; i < _readAheadStreams; i++)
+  {
+    struct readahead_stream *stream = &_streams[i];
+
+    if (stream->used && stream->next == block)
+    {
+      stream->next = block + nblks;
+      stream->issued = PSAN_MAX(stream->issued, stream->next);
+      stream->lastUsed = now;
+      return stream;
+    }
+
+    if (!victim || (victim->used && (!stream->used || stream->lastUsed < victim->lastUsed)))
+      victim = stream;
+  }
+
+  if (victim)
+  {
+    victim->used = true;
+    victim->next = block + nblks;
+    victim->issued = victim->next;
+    victim->window = 0;
+    victim->lastUsed = now;
+  }
+
+  return NULL;
+}
+
+
+/* serve a read from prefetched segments if they cover all of it, copying whatever has landed and leaving the rest to
+ * wait for its segment. false, having done nothing, if they don't.
+ */
+bool PSANDevice::readAheadServe(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion)
+{
+  uint32_t end = block + nblks;
+  struct readahead_segment *segment;
+
+  for (uint32_t b = block; b < end; b = segment->block + segment->nblks)
+  {
+    if (!(segment = readAheadFind(b)))
+      return false;
+  }
+
+  deblock_master_state *master = PSANPoolGet(_masterPool, deblock_master_state);
+  if (!master)
+    return false;
+
+  master->buffer = buffer;
+  master->block = block;
+  master->nblks = nblks;
+  master->completion = completion;
+  master->status = 0;
+
+  /* hold a reference until every part is accounted for, as in deblock() */
+  master->pending++;
+
+  for (uint32_t b = block, n; b < end; b += n)
+  {
+    segment = readAheadFind(b);
+    n = PSAN_MIN(segment->block + segment->nblks, end) - b;
+
+    uint64_t offset = (uint64_t)(b - block) * SECTOR_SIZE;
+    uint64_t len = (uint64_t)n * SECTOR_SIZE;
+
+    if (segment->done)
+    {
+      void *bytes = segment->buffer->getBytesNoCopy((uint64_t)(b - segment->block) * SECTOR_SIZE, len);
+
+      if (buffer->writeBytes(offset, bytes, len) == len)
+        master->actualByteCount += len;
+      else
+      {
+        KINFO("short IO");
+        master->status = EIO;
+      }
+
+      readAheadConsume(segment, n);
+      continue;
+    }
+
+    master->pending++;
+
+    read_waiter *waiter = PSANPoolGet(_waiterPool, read_waiter);
+    if (!waiter)
+    {
+      deblockRead(master, offset, b, n);
+      continue;
+    }
+
+    waiter->master = master;
+    waiter->offset = offset;
+    waiter->block = b;
+    waiter->nblks = n;
+    STAILQ_INSERT_TAIL(&segment->waiters, waiter, entries);
+  }
+
+  deblockRelease(master, 0, 0);
+
+  return true;
+}
+
+
+/* grow the window while reads keep landing in it, and keep it filled one aligned segment at a time */
+void PSANDevice::readAheadIssue(struct readahead_stream *stream, bool hit)
+{
+  uint32_t deviceBlocks = (uint32_t)PSAN_MIN(_size / SECTOR_SIZE, UINT32_MAX);
+  uint32_t segmentBlocks = READAHEAD_SEGMENT / SECTOR_SIZE;
+
+  if (!stream->window)
+    stream->window = READAHEAD_MIN / SECTOR_SIZE;
+  else if (hit)
+    stream->window = PSAN_MIN(stream->window * 2, READAHEAD_MAX / SECTOR_SIZE);
+
+  while (stream->issued < stream->next + stream->window && stream->issued < deviceBlocks)
+  {
+    uint32_t block = stream->issued;
+    uint32_t nblks = PSAN_MIN(segmentBlocks - block % segmentBlocks, deviceBlocks - block);
+    struct readahead_segment *segment = readAheadFind(block);
+
+    /* another stream, or this one before it was replaced, already has it */
+    if (segment)
+    {
+      stream->issued = segment->block + segment->nblks;
+      continue;
+    }
+
+    if (!readAheadReserve(nblks) || !(segment = PSANPoolGet(_segmentPool, readahead_segment)))
+      break;
+
+    segment->buffer = PSANFlatBuffer::tryAlloc((uint64_t)nblks * SECTOR_SIZE, false);
+    if (!segment->buffer)
+    {
+      KINFO("%s: failed to allocate read-ahead", _id);
+      _segmentPool.put(segment);
+      break;
+    }
+
+    segment->block = block;
+    segment->nblks = nblks;
+    STAILQ_INIT(&segment->waiters);
+    TAILQ_INSERT_TAIL(&_segments, segment, entries);
+
+    _readAheadHeld += (uint64_t)nblks * SECTOR_SIZE;
+    _stats.readAheadBytes += (uint64_t)nblks * SECTOR_SIZE;
+    stream->issued += nblks;
+
+    struct psan_completion completion;
+    completion.target = this;
+    completion.action = CompletionActionCast<PSANDevice, &PSANDevice::readAheadCompletion>;
+    completion.parameter = segment;
+
+    prepareAndDoAsyncReadWrite(&_partitionAddress, segment->buffer, 0, block, nblks, completion);
+  }
+}
+
+
+/* a write drops whatever was prefetched of the blocks it covers. reads already waiting on a segment in flight were
+ * issued before the write, so still get what it returns.
+ */
+void PSANDevice::readAheadInvalidate(uint32_t block, uint32_t nblks)
+{
+  struct readahead_segment *segment, *next;
+
+  for (segment = TAILQ_FIRST(&_segments); segment; segment = next)
+  {
+    next = TAILQ_NEXT(segment, entries);
+
+    if (segment->block >= block + nblks || block >= segment->block + segment->nblks)
+      continue;
+
+    if (segment->done)
+      readAheadFree(segment);
+    else
+      segment->stale = true;
+  }
+}
+
+
+struct readahead_segment *PSANDevice::readAheadFind(uint32_t block)
+{
+  struct readahead_segment *segment;
+
+  TAILQ_FOREACH(segment, &_segments, entries)
+  {
+    if (!segment->stale && block >= segment->block && block < segment->block + segment->nblks)
+      return segment;
+  }
+
+  return NULL;
+}
+
+
+/* make room for nblks under READAHEAD_BUDGET, evicting the oldest segments that have landed */
+bool PSANDevice::readAheadReserve(uint32_t nblks)
+{
+  uint64_t len = (uint64_t)nblks * SECTOR_SIZE;
+  struct readahead_segment *segment, *next;
+
+  for (segment = TAILQ_FIRST(&_segments); segment && _readAheadHeld + len > READAHEAD_BUDGET; segment = next)
+  {
+    next = TAILQ_NEXT(segment, entries);
+
+    if (segment->done)
+      readAheadFree(segment);
+  }
+
+  return (_readAheadHeld + len <= READAHEAD_BUDGET);
+}
+
+
+void PSANDevice::readAheadConsume(struct readahead_segment *segment, uint32_t nblks)
+{
+  segment->consumed += nblks;
+
+  if (segment->done && segment->consumed >= segment->nblks)
+    readAheadFree(segment);
+}
+
+
+void PSANDevice::readAheadFree(struct readahead_segment *segment)
+{
+  if (segment->done && segment->status == 0 && segment->consumed < segment->nblks)
+    _stats.readAheadWasted += (uint64_t)(segment->nblks - segment->consumed) * SECTOR_SIZE;
+
+  TAILQ_REMOVE(&_segments, segment, entries);
+  _readAheadHeld -= (uint64_t)segment->nblks * SECTOR_SIZE;
+
+  delete segment->buffer;
+  _segmentPool.put(segment);
+}
+
+
+/* everything is copied out to the waiters before any of them completes, since completing may start reads that consume
+ * (and free) the segment. waiters on a failed segment go to the unit themselves.
+ */
+void PSANDevice::readAheadCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  struct readahead_segment *segment = (struct readahead_segment *)parameter;
+  struct readWaiterList waiters;
+  read_waiter *waiter;
+
+  STAILQ_INIT(&waiters);
+  STAILQ_CONCAT(&waiters, &segment->waiters);
+
+  segment->done = true;
+  segment->status = status;
+
+  if (status == 0)
+  {
+    STAILQ_FOREACH(waiter, &waiters, entries)
+    {
+      uint64_t len = (uint64_t)waiter->nblks * SECTOR_SIZE;
+      void *bytes = segment->buffer->getBytesNoCopy((uint64_t)(waiter->block - segment->block) * SECTOR_SIZE, len);
+
+      if (waiter->master->buffer->writeBytes(waiter->offset, bytes, len) != len)
+      {
+        KINFO("short IO");
+        waiter->status = EIO;
+      }
+
+      segment->consumed += waiter->nblks;
+    }
+  }
+
+  if (status != 0 || segment->stale || segment->consumed >= segment->nblks)
+    readAheadFree(segment);
+
+  while ((waiter = STAILQ_FIRST(&waiters)))
+  {
+    STAILQ_REMOVE_HEAD(&waiters, entries);
+
+    deblock_master_state *master = waiter->master;
+    uint64_t offset = waiter->offset;
+    uint32_t block = waiter->block;
+    uint32_t nblks = waiter->nblks;
+    int waiterStatus = waiter->status;
+
+    _waiterPool.put(waiter);
+
+    if (status != 0)
+      deblockRead(master, offset, block, nblks);
+    else
+      deblockRelease(master, waiterStatus, (waiterStatus ? 0 : (uint64_t)nblks * SECTOR_SIZE));
+  }
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Cache functions
+/**********************************************************************************************************************************/
+
+
+/* serve a read line by line: from memory where the line is resident, waiting where it's already being fetched, and
+ * fetching each run of missing lines with one GET. false, having done nothing, if the read is too big to cache.
+ */
+bool PSANDevice::cacheRead(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion)
+{
+  uint32_t lineBlocks = _cache->getLineBlocks();
+  uint32_t deviceBlocks = (uint32_t)PSAN_MIN(_size / SECTOR_SIZE, UINT32_MAX);
+  uint32_t end = block + nblks;
+
+  if ((uint64_t)nblks * SECTOR_SIZE > CACHE_MAX_IO || end > deviceBlocks)
+    return false;
+
+  deblock_master_state *master = PSANPoolGet(_masterPool, deblock_master_state);
+  if (!master)
+    return false;
+
+  master->buffer = buffer;
+  master->block = block;
+  master->nblks = nblks;
+  master->completion = completion;
+  master->status = 0;
+
+  /* hold a reference until every part is accounted for, as in deblock() */
+  master->pending++;
+
+  struct cache_fill *fill = NULL; /* the run of missing lines being gathered */
+
+  for (uint32_t b = block, n; b < end; b += n)
+  {
+    uint32_t line = b / lineBlocks;
+    uint32_t lineStart = line * lineBlocks;
+    uint64_t offset = (uint64_t)(b - block) * SECTOR_SIZE;
+    n = PSAN_MIN(lineStart + lineBlocks, end) - b;
+
+    struct psan_cache_line *l = _cache->lookup(line);
+
+    if (l && !l->filling)
+    {
+      _stats.cacheHits++;
+      _cache->touch(l);
+
+      uint64_t len = (uint64_t)n * SECTOR_SIZE;
+      if (buffer->writeBytes(offset, l->data + (uint64_t)(b - lineStart) * SECTOR_SIZE, len) == len)
+        master->actualByteCount += len;
+      else
+      {
+        KINFO("short IO");
+        master->status = EIO;
+      }
+    }
+    else if (l)
+    {
+      _stats.cacheMisses++;
+      _stats.cacheCoalesced++;
+      cacheWait((struct cache_fill *)l->filling, master, offset, b, n);
+    }
+    else
+    {
+      _stats.cacheMisses++;
+
+      if (!(l = _cache->insert(line)))
+      {
+        master->pending++;
+        deblockRead(master, offset, b, n);
+      }
+      else if (fill || (fill = PSANPoolGet(_fillPool, cache_fill)))
+      {
+        if (!fill->nblks)
+        {
+          fill->block = lineStart;
+          STAILQ_INIT(&fill->waiters);
+        }
+
+        fill->nblks = PSAN_MIN(lineStart + lineBlocks, deviceBlocks) - fill->block;
+        l->filling = fill;
+        cacheWait(fill, master, offset, b, n);
+        continue;
+      }
+      else
+      {
+        _stats.poolExhausted++;
+        _cache->remove(l);
+        master->pending++;
+        deblockRead(master, offset, b, n);
+      }
+    }
+
+    /* the run of misses, if any, ended here */
+    if (fill)
+    {
+      cacheFill(fill);
+      fill = NULL;
+    }
+  }
+
+  if (fill)
+    cacheFill(fill);
+
+  deblockRelease(master, 0, 0);
+
+  return true;
+}
+
+
+/* write-through: resident lines take the new data as the write is submitted, lines still being fetched may get the
+ * old data and are dropped. requestCompletion() drops the rest again if the write fails.
+ */
+void PSANDevice::cacheWrite(PSANBuffer *buffer, uint32_t block, uint32_t nblks)
+{
+  uint32_t lineBlocks = _cache->getLineBlocks();
+  uint32_t end = block + nblks;
+
+  for (uint32_t b = block, n; b < end; b += n)
+  {
+    uint32_t line = b / lineBlocks;
+    uint32_t lineStart = line * lineBlocks;
+    uint64_t len;
+    n = PSAN_MIN(lineStart + lineBlocks, end) - b;
+    len = (uint64_t)n * SECTOR_SIZE;
+
+    struct psan_cache_line *l = _cache->lookup(line);
+    if (!l)
+      continue;
+
+    if (l->filling ||
+        buffer->readBytes((uint64_t)(b - block) * SECTOR_SIZE, l->data + (uint64_t)(b - lineStart) * SECTOR_SIZE, len) != len)
+      _cache->remove(l);
+  }
+}
+
+
+void PSANDevice::cacheInvalidate(uint32_t block, uint32_t nblks)
+{
+  uint32_t lineBlocks = _cache->getLineBlocks();
+
+  for (uint32_t line = block / lineBlocks; line <= (block + nblks - 1) / lineBlocks; line++)
+  {
+    struct psan_cache_line *l = _cache->lookup(line);
+    if (l)
+      _cache->remove(l);
+  }
+}
+
+
+/* part of a read waits for a fill to land. master->pending counts it */
+void PSANDevice::cacheWait(struct cache_fill *fill, deblock_master_state *master, uint64_t offset, uint32_t block, uint32_t nblks)
+{
+  master->pending++;
+
+  read_waiter *waiter = PSANPoolGet(_waiterPool, read_waiter);
+  if (!waiter)
+  {
+    deblockRead(master, offset, block, nblks);
+    return;
+  }
+
+  waiter->master = master;
+  waiter->offset = offset;
+  waiter->block = block;
+  waiter->nblks = nblks;
+  STAILQ_INSERT_TAIL(&fill->waiters, waiter, entries);
+}
+
+
+void PSANDevice::cacheFill(struct cache_fill *fill)
+{
+  struct psan_completion completion;
+  completion.target = this;
+  completion.action = CompletionActionCast<PSANDevice, &PSANDevice::cacheFillCompletion>;
+  completion.parameter = fill;
+
+  /* without the memory the fill fails, and its waiters read from the unit uncached */
+  fill->buffer = PSANFlatBuffer::tryAlloc((uint64_t)fill->nblks * SECTOR_SIZE, false);
+  if (!fill->buffer)
+  {
+    psan_complete(completion, ENOMEM, 0);
+    return;
+  }
+
+  prepareAndDoAsyncReadWrite(&_partitionAddress, fill->buffer, 0, fill->block, fill->nblks, completion);
+}
+
+
+/* lines that are still waiting on this fill (not dropped by a write meanwhile) take its data, then the waiters are
+ * copied out and completed, as in readAheadCompletion(). waiters on a failed fill go to the unit themselves.
+ */
+void PSANDevice::cacheFillCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  struct cache_fill *fill = (struct cache_fill *)parameter;
+  uint32_t lineBlocks = _cache->getLineBlocks();
+  struct readWaiterList waiters;
+  read_waiter *waiter;
+
+  STAILQ_INIT(&waiters);
+  STAILQ_CONCAT(&waiters, &fill->waiters);
+
+  for (uint32_t b = fill->block; b < fill->block + fill->nblks; b += lineBlocks)
+  {
+    struct psan_cache_line *l = _cache->lookup(b / lineBlocks);
+    if (!l || l->filling != fill)
+      continue;
+
+    uint64_t len = (uint64_t)PSAN_MIN(lineBlocks, fill->block + fill->nblks - b) * SECTOR_SIZE;
+
+    if (status == 0 && fill->buffer->readBytes((uint64_t)(b - fill->block) * SECTOR_SIZE, l->data, len) == len)
+      l->filling = NULL;
+    else
+      _cache->remove(l);
+  }
+
+  if (status == 0)
+  {
+    STAILQ_FOREACH(waiter, &waiters, entries)
+    {
+      uint64_t len = (uint64_t)waiter->nblks * SECTOR_SIZE;
+      void *bytes = fill->buffer->getBytesNoCopy((uint64_t)(waiter->block - fill->block) * SECTOR_SIZE, len);
+
+      if (waiter->master->buffer->writeBytes(waiter->offset, bytes, len) != len)
+      {
+        KINFO("short IO");
+        waiter->status = EIO;
+      }
+    }
+  }
+
+  if (fill->buffer)
+    delete fill->buffer;
+  _fillPool.put(fill);
+
+  while ((waiter = STAILQ_FIRST(&waiters)))
+  {
+    STAILQ_REMOVE_HEAD(&waiters, entries);
+
+    deblock_master_state *master = waiter->master;
+    uint64_t offset = waiter->offset;
+    uint32_t block = waiter->block;
+    uint32_t nblks = waiter->nblks;
+    int waiterStatus = waiter->status;
+
+    _waiterPool.put(waiter);
+
+    if (status != 0)
+      deblockRead(master, offset, block, nblks);
+    else
+      deblockRelease(master, waiterStatus, (waiterStatus ? 0 : (uint64_t)nblks * SECTOR_SIZE));
+  }
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Write-back functions
+/**********************************************************************************************************************************/
+
+
+void PSANDevice::synchronize(struct psan_completion completion)
+{
+  _stats.syncs++;
+
+  if (!_writeBack)
+  {
+    psan_complete(completion, 0, 0);
+    return;
+  }
+
+  writeback_sync *sync = PSANPoolGet(_syncPool, writeback_sync);
+  if (!sync)
+  {
+    _stats.poolExhausted++;
+    psan_complete(completion, ENOMEM, 0);
+    return;
+  }
+
+  sync->completion = completion;
+  STAILQ_INSERT_TAIL(&_syncs, sync, entries);
+
+  if (!_syncActive)
+    syncStart();
+}
+
+
+uint64_t PSANDevice::getUnwrittenBytes()
+{
+  uint64_t blocks = 0;
+
+  for (int i = 0; i < WRITEBACK_BUCKETS; i++)
+  {
+    struct writeback_chunk *c;
+
+    LIST_FOREACH(c, &_chunks[i], hash)
+    {
+      uint64_t unwritten[WRITEBACK_MAP_WORDS];
+
+      for (int w = 0; w < WRITEBACK_MAP_WORDS; w++)
+        unwritten[w] = c->dirty[w] | c->flushing[w];
+
+      blocks += bitmapCount(unwritten);
+    }
+  }
+
+  return blocks * SECTOR_SIZE;
+}
+
+
+/* the data is copied into chunks and the write completed right away, failing only if memory runs out. chunks are
+ * allocated past WRITEBACK_DIRTY_MAX if need be: canAccept() is what holds writes back, this is just in case.
+ */
+void PSANDevice::writeBackWrite(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion)
+{
+  uint64_t now = psan_uptime_ns();
+  uint32_t end = block + nblks;
+  int status = 0;
+
+  for (uint32_t b = block, n; b < end; b += n)
+  {
+    uint32_t first = b % WRITEBACK_CHUNK_BLOCKS;
+    uint64_t len;
+    n = PSAN_MIN(WRITEBACK_CHUNK_BLOCKS - first, end - b);
+    len = (uint64_t)n * SECTOR_SIZE;
+
+    struct writeback_chunk *c = writeBackFind(b / WRITEBACK_CHUNK_BLOCKS);
+    if (!c && !(c = writeBackAllocate(b / WRITEBACK_CHUNK_BLOCKS)))
+    {
+      KINFO("%s: failed to allocate write-back", _id);
+      status = ENOMEM;
+      break;
+    }
+
+    if (buffer->readBytes((uint64_t)(b - block) * SECTOR_SIZE, c->data + (uint64_t)first * SECTOR_SIZE, len) != len)
+    {
+      KINFO("short IO");
+      status = EIO;
+      writeBackRelease(c);
+      break;
+    }
+
+    bitmapSet(c->written, first, n);
+    writeBackDirty(c, first, n, now);
+    _stats.writeBackBytes += len;
+  }
+
+  writeBackKick();
+
+  psan_complete(completion, status, (status ? 0 : (uint64_t)nblks * SECTOR_SIZE));
+}
+
+
+/* false, having done nothing, if the read doesn't touch anything written. one covered entirely is copied from memory,
+ * anything else goes to the unit and has the written blocks copied over what comes back. the chunks it overlaps are
+ * held until then, so what's copied is never older than the unit's data even if they're flushed meanwhile.
+ */
+bool PSANDevice::writeBackRead(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion)
+{
+  uint32_t end = block + nblks;
+  bool overlap = false;
+  bool covered = true;
+
+  for (uint32_t b = block, n; b < end; b += n)
+  {
+    uint32_t first = b % WRITEBACK_CHUNK_BLOCKS;
+    n = PSAN_MIN(WRITEBACK_CHUNK_BLOCKS - first, end - b);
+
+    struct writeback_chunk *c = writeBackFind(b / WRITEBACK_CHUNK_BLOCKS);
+    if (!c)
+    {
+      covered = false;
+      continue;
+    }
+
+    for (uint32_t i = first; i < first + n; i++)
+    {
+      if (bitmapTest(c->written, i))
+        overlap = true;
+      else
+        covered = false;
+    }
+  }
+
+  if (!overlap)
+    return false;
+
+  if (covered)
+  {
+    int status = 0;
+
+    for (uint32_t b = block, n; b < end; b += n)
+    {
+      uint32_t first = b % WRITEBACK_CHUNK_BLOCKS;
+      uint64_t len;
+      n = PSAN_MIN(WRITEBACK_CHUNK_BLOCKS - first, end - b);
+      len = (uint64_t)n * SECTOR_SIZE;
+
+      struct writeback_chunk *c = writeBackFind(b / WRITEBACK_CHUNK_BLOCKS);
+
+      if (buffer->writeBytes((uint64_t)(b - block) * SECTOR_SIZE, c->data + (uint64_t)first * SECTOR_SIZE, len) != len)
+      {
+        KINFO("short IO");
+        status = EIO;
+      }
+    }
+
+    _stats.writeBackReadHits++;
+    psan_complete(completion, status, (status ? 0 : (uint64_t)nblks * SECTOR_SIZE));
+    return true;
+  }
+
+  writeback_read *merge = PSANPoolGet(_mergePool, writeback_read);
+  if (!merge)
+  {
+    _stats.poolExhausted++;
+    psan_complete(completion, ENOMEM, 0);
+    return true;
+  }
+
+  merge->buffer = buffer;
+  merge->block = block;
+  merge->nblks = nblks;
+  merge->generation = _chunkGeneration;
+  merge->completion = completion;
+
+  for (uint32_t b = block - block % WRITEBACK_CHUNK_BLOCKS; b < end; b += WRITEBACK_CHUNK_BLOCKS)
+  {
+    struct writeback_chunk *c = writeBackFind(b / WRITEBACK_CHUNK_BLOCKS);
+    if (c)
+      c->readers++;
+  }
+
+  _stats.writeBackReadMerges++;
+
+  struct psan_completion new_completion;
+  new_completion.target = this;
+  new_completion.action = CompletionActionCast<PSANDevice, &PSANDevice::writeBackReadCompletion>;
+  new_completion.parameter = merge;
+
+  dispatchRead(buffer, block, nblks, new_completion);
+
+  return true;
+}
+
+
+/* chunks allocated since the read went out weren't held for it, and writes to them came after it anyway */
+void PSANDevice::writeBackReadCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  writeback_read *merge = (writeback_read *)parameter;
+  uint32_t end = merge->block + merge->nblks;
+
+  for (uint32_t b = merge->block, n; b < end; b += n)
+  {
+    uint32_t first = b % WRITEBACK_CHUNK_BLOCKS;
+    n = PSAN_MIN(WRITEBACK_CHUNK_BLOCKS - first, end - b);
+
+    struct writeback_chunk *c = writeBackFind(b / WRITEBACK_CHUNK_BLOCKS);
+    if (!c || c->generation >= merge->generation)
+      continue;
+
+    for (uint32_t i = first, run; status == 0 && i < first + n; i = run)
+    {
+      for (run = i; run < first + n && bitmapTest(c->written, run); run++)
+        ;
+
+      if (run == i)
+      {
+        run++;
+        continue;
+      }
+
+      uint64_t offset = (uint64_t)(c->chunk * WRITEBACK_CHUNK_BLOCKS + i - merge->block) * SECTOR_SIZE;
+      uint64_t len = (uint64_t)(run - i) * SECTOR_SIZE;
+
+      if (merge->buffer->writeBytes(offset, c->data + (uint64_t)i * SECTOR_SIZE, len) != len)
+      {
+        KINFO("short IO");
+        status = EIO;
+      }
+    }
+
+    c->readers--;
+    writeBackRelease(c);
+  }
+
+  struct psan_completion completion = merge->completion;
+  _mergePool.put(merge);
+
+  psan_complete(completion, status, (status ? 0 : actualByteCount));
+}
+
+
+/* room for a write this size in chunks it may not share with anything already held */
+bool PSANDevice::writeBackHasSpace(uint32_t nblks)
+{
+  uint64_t need = ((uint64_t)nblks / WRITEBACK_CHUNK_BLOCKS + 2) * WRITEBACK_CHUNK;
+
+  return (!_writeBackHeld || _writeBackHeld + need <= WRITEBACK_DIRTY_MAX);
+}
+
+
+struct writeback_chunk *PSANDevice::writeBackFind(uint32_t chunk)
+{
+  struct writeback_chunk *c;
+
+  LIST_FOREACH(c, &_chunks[chunk % WRITEBACK_BUCKETS], hash)
+  {
+    if (c->chunk == chunk)
+      return c;
+  }
+
+  return NULL;
+}
+
+
+struct writeback_chunk *PSANDevice::writeBackAllocate(uint32_t chunk)
+{
+  writeback_chunk *c = PSANPoolGet(_chunkPool, writeback_chunk);
+  if (!c)
+  {
+    _stats.poolExhausted++;
+    return NULL;
+  }
+
+  c->data = (uint8_t *)psan_alloc(WRITEBACK_CHUNK);
+  if (!c->data)
+  {
+    _chunkPool.put(c);
+    return NULL;
+  }
+
+  c->chunk = chunk;
+  c->generation = _chunkGeneration++;
+  LIST_INSERT_HEAD(&_chunks[chunk % WRITEBACK_BUCKETS], c, hash);
+  _writeBackHeld += WRITEBACK_CHUNK;
+
+  return c;
+}
+
+
+void PSANDevice::writeBackDirty(struct writeback_chunk *c, uint32_t first, uint32_t nblks, uint64_t now)
+{
+  bitmapSet(c->dirty, first, nblks);
+
+  if (!c->isDirty)
+  {
+    c->isDirty = true;
+    c->dirtied = now;
+    TAILQ_INSERT_TAIL(&_dirtyChunks, c, dirtyEntries);
+  }
+}
+
+
+/* frees c once nothing needs it: nothing dirty, being written or waiting on it */
+void PSANDevice::writeBackRelease(struct writeback_chunk *c)
+{
+  if (c->issuing || c->readers || !bitmapEmpty(c->dirty) || !bitmapEmpty(c->flushing))
+    return;
+
+  if (c->isDirty)
+    TAILQ_REMOVE(&_dirtyChunks, c, dirtyEntries);
+
+  LIST_REMOVE(c, hash);
+  psan_free(c->data, WRITEBACK_CHUNK);
+  _writeBackHeld -= WRITEBACK_CHUNK;
+  _chunkPool.put(c);
+
+  /* a write waiting for room is woken once there's a fair amount of it, rather than for each chunk */
+  if (_poolWaiting && (!_writeBackHeld || _writeBackHeld + WRITEBACK_DIRTY_HIGH <= WRITEBACK_DIRTY_MAX))
+  {
+    _poolWaiting = false;
+
+    if (_handlers.availableHandler)
+      _handlers.availableHandler(_handlers.target);
+  }
+}
+
+
+/* flush the oldest dirty chunks: all of them while over WRITEBACK_DIRTY_HIGH, while a sync or a write is waiting, and
+ * otherwise just those older than WRITEBACK_MAX_AGE_MS. the timer comes back for the rest, and is cancelled once
+ * nothing is left dirty so an idle device has nothing in the engine's timer queue. once the device stops
+ * nothing more can be written, so a sync still waiting fails.
+ */
+void PSANDevice::writeBackKick()
+{
+  if (_flushing)
+    return;
+
+  if (isStopping())
+  {
+    if (_syncActive)
+      syncFinish(ENXIO);
+    return;
+  }
+
+  bool pressure = (_writeBackHeld > WRITEBACK_DIRTY_HIGH || _syncActive || _poolWaiting);
+  uint64_t now = psan_uptime_ns();
+  struct writeback_chunk *c, *next;
+
+  _flushing = true;
+
+  for (c = TAILQ_FIRST(&_dirtyChunks); c && _flushesInFlight < WRITEBACK_FLUSHES; c = next)
+  {
+    next = TAILQ_NEXT(c, dirtyEntries);
+
+    if (now < c->retryAt)
+      continue;
+
+    if (!pressure && now < c->dirtied + WRITEBACK_MAX_AGE_MS * NSEC_PER_MSEC)
+      break;
+
+    writeBackFlush(c);
+  }
+
+  _flushing = false;
+
+  if (!TAILQ_EMPTY(&_dirtyChunks) && !_flushTimerArmed)
+  {
+    _flushTimer.timeoutHandler = TimeoutHandlerCast<PSANDevice, &PSANDevice::writeBackTimeout>;
+    _flushTimer.target = this;
+    _flushTimer.ctx = NULL;
+    _flushTimer.timeout_ms = WRITEBACK_TIMER_MS;
+
+    _flushTimerArmed = true;
+    _engine->startTimer(&_flushTimer);
+  }
+  else if (TAILQ_EMPTY(&_dirtyChunks) && _flushTimerArmed)
+  {
+    _flushTimerArmed = false;
+    _engine->cancelTimer(&_flushTimer);
+  }
+}
+
+
+/* each run of dirty blocks not already being written goes out as one request (deblocked as usual if need be), straight
+ * from the chunk's memory. blocks written again meanwhile are dirty again, and flushed again after this.
+ */
+void PSANDevice::writeBackFlush(struct writeback_chunk *c)
+{
+  uint64_t now = psan_uptime_ns();
+
+  c->issuing = true;
+
+  for (uint32_t i = 0, first; i < WRITEBACK_CHUNK_BLOCKS && _flushesInFlight < WRITEBACK_FLUSHES && now >= c->retryAt; )
+  {
+    if (!bitmapTest(c->dirty, i) || bitmapTest(c->flushing, i))
+    {
+      i++;
+      continue;
+    }
+
+    for (first = i; i < WRITEBACK_CHUNK_BLOCKS && bitmapTest(c->dirty, i) && !bitmapTest(c->flushing, i); i++)
+      ;
+
+    writeback_flush *flush = PSANPoolGet(_flushPool, writeback_flush);
+    if (!flush)
+      break;
+
+    uint32_t nblks = i - first;
+
+    flush->chunk = c;
+    flush->first = first;
+    flush->nblks = nblks;
+    flush->buffer = new PSANFlatBuffer(c->data + (uint64_t)first * SECTOR_SIZE, (uint64_t)nblks * SECTOR_SIZE, true);
+    if (!flush->buffer)
+    {
+      _flushPool.put(flush);
+      break;
+    }
+
+    bitmapClear(c->dirty, first, nblks);
+    bitmapClear(c->syncDirty, first, nblks);
+    bitmapSet(c->flushing, first, nblks);
+
+    _flushesInFlight++;
+    _stats.writeBackFlushes++;
+    _stats.writeBackFlushBytes += (uint64_t)nblks * SECTOR_SIZE;
+
+    struct psan_completion completion;
+    completion.target = this;
+    completion.action = CompletionActionCast<PSANDevice, &PSANDevice::writeBackFlushCompletion>;
+    completion.parameter = flush;
+
+    prepareAndDoAsyncReadWrite(&_partitionAddress, flush->buffer, 0, c->chunk * WRITEBACK_CHUNK_BLOCKS + first, nblks, completion);
+  }
+
+  if (c->isDirty && bitmapEmpty(c->dirty))
+  {
+    TAILQ_REMOVE(&_dirtyChunks, c, dirtyEntries);
+    c->isDirty = false;
+  }
+
+  c->issuing = false;
+  writeBackRelease(c);
+}
+
+
+/* once a run is on the unit, anything read-ahead or the cache fetched of it while it was only in memory may be older,
+ * and is replaced with it. a failed run is dirty again and retried after WRITEBACK_RETRY_MS, failing the sync (if any)
+ * that was waiting on it.
+ */
+void PSANDevice::writeBackFlushCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  writeback_flush *flush = (writeback_flush *)parameter;
+  struct writeback_chunk *c = flush->chunk;
+  uint32_t first = flush->first;
+  uint32_t nblks = flush->nblks;
+  uint32_t block = c->chunk * WRITEBACK_CHUNK_BLOCKS + first;
+  bool syncDone = false;
+
+  _flushesInFlight--;
+  bitmapClear(c->flushing, first, nblks);
+
+  if (status == 0)
+  {
+    readAheadInvalidate(block, nblks);
+
+    if (_cache)
+      cacheWrite(flush->buffer, block, nblks);
+
+    bool waited = false;
+
+    for (uint32_t i = first; _syncActive && i < first + nblks; i++)
+    {
+      if (bitmapTest(c->syncWait, i) && !bitmapTest(c->syncDirty, i))
+      {
+        bitmapClear(c->syncWait, i, 1);
+        waited = true;
+      }
+    }
+
+    if (waited && bitmapEmpty(c->syncWait) && --_syncPending == 0)
+      syncDone = true;
+  }
+  else
+  {
+    uint64_t now = psan_uptime_ns();
+
+    KINFO("%s: write-back of %u blocks at %u failed (%d), retrying", _id, nblks, block, status);
+    _stats.writeBackErrors++;
+
+    writeBackDirty(c, first, nblks, now);
+    c->retryAt = now + WRITEBACK_RETRY_MS * NSEC_PER_MSEC;
+
+    for (uint32_t i = first; _syncActive && i < first + nblks; i++)
+    {
+      if (bitmapTest(c->syncWait, i))
+        syncDone = true;
+    }
+  }
+
+  delete flush->buffer;
+  _flushPool.put(flush);
+
+  writeBackRelease(c);
+
+  if (syncDone)
+    syncFinish(status);
+
+  writeBackKick();
+}
+
+
+void PSANDevice::writeBackTimeout(struct outstanding *out, void *ctx)
+{
+  _flushTimerArmed = false;
+  writeBackKick();
+}
+
+
+/* the active sync waits for everything dirty or being written right now, but not for what's written after it */
+void PSANDevice::syncStart()
+{
+  _syncActive = true;
+  _syncPending = 0;
+
+  for (int i = 0; i < WRITEBACK_BUCKETS; i++)
+  {
+    struct writeback_chunk *c;
+
+    LIST_FOREACH(c, &_chunks[i], hash)
+    {
+      for (int w = 0; w < WRITEBACK_MAP_WORDS; w++)
+      {
+        c->syncDirty[w] = c->dirty[w];
+        c->syncWait[w] = c->dirty[w] | c->flushing[w];
+      }
+
+      if (!bitmapEmpty(c->syncWait))
+        _syncPending++;
+    }
+  }
+
+  if (!_syncPending)
+    syncFinish(0);
+  else
+    writeBackKick();
+}
+
+
+void PSANDevice::syncFinish(int status)
+{
+  writeback_sync *sync = STAILQ_FIRST(&_syncs);
+  struct psan_completion completion = sync->completion;
+
+  STAILQ_REMOVE_HEAD(&_syncs, entries);
+  _syncPool.put(sync);
+
+  _syncActive = false;
+  _syncPending = 0;
+
+  for (int i = 0; i < WRITEBACK_BUCKETS; i++)
+  {
+    struct writeback_chunk *c;
+
+    LIST_FOREACH(c, &_chunks[i], hash)
+    {
+      memset(c->syncDirty, 0, sizeof(c->syncDirty));
+      memset(c->syncWait, 0, sizeof(c->syncWait));
+    }
+  }
+
+  psan_complete(completion, status, 0);
+
+  /* the completion may have queued and started another already */
+  if (!_syncActive && !STAILQ_EMPTY(&_syncs))
+    syncStart();
+}
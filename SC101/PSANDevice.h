@@ -0,0 +1,450 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_DEVICE_H__
+#define __PSAN_DEVICE_H__
+
+#include "PSANEngine.h"
+#include "PSANCache.h"
+#include "PSANScheduler.h"
+
+extern "C" {
+#include "psan_wireformat.h"
+};
+
+struct psan_get_response_disk_t;
+struct psan_get_response_partition_t;
+
+/* same shape as IOStorageCompletion, status is 0 or an errno */
+typedef void (*PSANCompletionAction)(void *target, void *parameter, int status, uint64_t actualByteCount);
+
+struct psan_completion {
+  void *target;
+  PSANCompletionAction action;
+  void *parameter;
+};
+
+template <class T, void (T::*method)(void *, int, uint64_t)>
+void CompletionActionCast(void *target, void *parameter, int status, uint64_t actualByteCount)
+{
+  (((T *)target)->*method)(parameter, status, actualByteCount);
+}
+
+static inline void psan_complete(struct psan_completion completion, int status, uint64_t actualByteCount)
+{
+  if (completion.action)
+    completion.action(completion.target, completion.parameter, status, actualByteCount);
+}
+
+
+/* 512 bytes (len_power 9) up to 64k */
+#define PSAN_SIZE_CLASSES (8)
+
+
+/* round trip estimate for one direction and size class */
+struct psan_rtt {
+  uint64_t srtt;     /* ns, 0 until the first sample */
+  uint64_t rttvar;
+  uint64_t base;     /* best seen recently, for the IO window's delay signal */
+  uint64_t baseNext;
+};
+
+
+/* transfer size choice for one direction, see sizeEvaluate() */
+struct psan_size_state {
+  uint32_t limit;     /* largest the unit is known to take */
+  uint32_t previous;  /* size before trying another, 0 when not trying one */
+  uint64_t delivered[PSAN_SIZE_CLASSES]; /* responses and timeouts per size class, halved past IO_SIZE_HISTORY */
+  uint64_t lost[PSAN_SIZE_CLASSES];
+  uint64_t tryAfter[2];  /* [bigger] no smaller or bigger size is tried before this... */
+  uint32_t backoffMS[2]; /* ...which is pushed out this much further each time one doesn't pay */
+};
+
+
+/* counters exported by the nub, see getStatistics() */
+struct psan_device_stats {
+  uint64_t ioWindow;           /* IOs allowed in flight right now */
+  uint64_t ioWindowMax;        /* largest it has been */
+  uint64_t ioWindowReductions; /* times it was shrunk by loss, delay or PSAN_ERROR */
+  uint64_t timeouts;
+  uint64_t lateResponses;      /* IOs completed by the answer to a transmission that had already timed out */
+  uint64_t lateWait;           /* ns from the retry being sent to that answer, which it didn't have to wait for */
+  uint64_t lateWaitMax;
+  uint64_t errors;             /* PSAN_ERROR responses */
+  uint64_t readBytes;          /* payload bytes delivered to read buffers */
+  uint64_t readBytesCopied;    /* of those, bytes copied in from a packet rather than received in place */
+  uint64_t prepares;           /* times a request's buffer was actually prepared (wired) */
+  uint64_t preparesSaved;      /* per-chunk, per-packet and per-retry prepares that reused the request's */
+  uint64_t requestPoolHighWater; /* most requests, IOs, deblock chunks and carriers ever allocated from the pools at once */
+  uint64_t ioPoolHighWater;
+  uint64_t deblockPoolHighWater;
+  uint64_t carrierPoolHighWater;
+  uint64_t poolWaits;          /* times canAccept() made a caller wait for pool space */
+  uint64_t poolExhausted;      /* requests or chunks failed for lack of it */
+  uint64_t readAheadHits;      /* reads served (or waiting to be) from prefetched data */
+  uint64_t readAheadMisses;    /* reads that had to go to the unit */
+  uint64_t readAheadBytes;     /* bytes prefetched */
+  uint64_t readAheadWasted;    /* ...and thrown away unread, overwritten or evicted */
+  uint64_t cacheHits;          /* cache lines read from memory */
+  uint64_t cacheMisses;        /* ...and not, including those already being fetched for someone else */
+  uint64_t cacheCoalesced;     /* of the misses, those already being fetched */
+  uint64_t cacheEvictions;
+  uint64_t writeBackBytes;     /* bytes of writes acknowledged from memory */
+  uint64_t writeBackFlushes;   /* dirty runs written to the unit */
+  uint64_t writeBackFlushBytes;
+  uint64_t writeBackErrors;    /* runs that failed to be written, and were kept for a retry */
+  uint64_t writeBackReadHits;  /* reads served entirely from data still to be written */
+  uint64_t writeBackReadMerges; /* reads partly covering it, patched with it once the unit's data landed */
+  uint64_t syncs;
+  uint64_t coalescedWrites;    /* queued writes sent as part of a bigger PUT... */
+  uint64_t coalescedPuts;      /* ...and those PUTs */
+  uint64_t coalescedReads;     /* the same for reads... */
+  uint64_t coalescedGets;
+  uint64_t overReads;          /* GETs rounded up to a power of 2 rather than split */
+  uint64_t overReadBytes;      /* the surplus they fetched and dropped */
+  uint64_t queuedReads;        /* reads that waited for room in the window... */
+  uint64_t queuedWrites;
+  uint64_t queueWaitReads;     /* ...and the ns they waited, in total */
+  uint64_t queueWaitWrites;
+  uint64_t queueWaitMaxRead;
+  uint64_t queueWaitMaxWrite;
+  uint64_t queueExpired;       /* IOs the scheduler sent out of order because they'd waited out their deadline */
+  uint64_t queueWritesStarved; /* writes it sent ahead of reads so they couldn't wait forever */
+  uint64_t ioReadSize;         /* largest GET and PUT being sent right now... */
+  uint64_t ioWriteSize;
+  uint64_t ioReadLimit;        /* ...and the largest the unit is known to take */
+  uint64_t ioWriteLimit;
+  uint64_t ioSizeRaises;       /* times a direction tried a bigger size and kept it... */
+  uint64_t ioSizeFallbacks;    /* ...or a smaller one */
+  uint64_t ioSizeTrials;       /* sizes tried, kept or not */
+  uint64_t ioResplits;         /* IOs bigger than the size after a fallback, split up again to be retried */
+  uint64_t hedgesFired;        /* GETs sent a second time for having been out longer than most, see hedgeFire()... */
+  uint64_t hedgesWon;          /* ...and answered on that second seq# first */
+  uint64_t hedgesDenied;       /* ...or not sent, for being over HEDGE_BUDGET_PERCENT */
+};
+
+
+/* how long one size of GET takes to be answered, see hedgeSample() */
+struct psan_latency {
+  uint32_t count;
+  uint32_t buckets[HEDGE_BUCKETS]; /* 4 per power of 2 ns from 16us, see latencyBucket() */
+  uint32_t hedgeMS;                /* the hedging percentile of them rounded up, 0 until HEDGE_MIN_SAMPLES */
+};
+
+
+struct outstanding_io {
+  struct sockaddr_in addr;
+
+  PSANBuffer *buffer;
+  uint64_t offset; /* into buffer, non-zero for deblocked requests */
+  uint32_t block;
+  uint32_t nblks;
+  struct psan_completion completion;
+
+  int attempt;
+  int timeout_ms;
+  uint64_t sent;
+  struct outstanding outstanding;
+  bool carrier; /* buffer is a PSANCoalescedBuffer, standing in for other IOs */
+  bool probe;   /* looking for the largest transfer the unit takes, given up on after IO_SIZE_PROBE_ATTEMPTS */
+  bool hedgeArmed; /* outstanding.timeout_ms is when to hedge it rather than its retransmit timeout */
+  bool hedged;     /* sent again under a new seq# while the first was still out, at firstSent */
+  uint64_t firstSent;
+  struct psan_sched_entry sched; /* while queued, and its direction while in flight */
+
+  STAILQ_ENTRY(outstanding_io) entries;
+};
+
+
+STAILQ_HEAD(outstandingIOQueue, outstanding_io);
+
+
+/* notifications as the device is resolved and queried, all optional */
+typedef void (*ResolveHandler)(void *owner, const struct sockaddr_in *partition, const struct sockaddr_in *root);
+typedef void (*DiskHandler)(void *owner, const struct psan_get_response_disk_t *disk);
+typedef void (*PartitionHandler)(void *owner, const struct psan_get_response_partition_t *partition, uint64_t size);
+typedef void (*AvailableHandler)(void *owner);
+typedef void (*IOSizeHandler)(void *owner, uint32_t ioReadSize, uint32_t ioWriteSize);
+
+struct psan_device_handlers {
+  void *target;
+  ResolveHandler resolveHandler;
+  DiskHandler diskHandler;
+  PartitionHandler partitionHandler;
+  AvailableHandler availableHandler; /* optional, a request canAccept() turned away may fit now */
+  IOSizeHandler ioSizeHandler;       /* optional, the transfer sizes changed, see setIOSizeProbing() */
+};
+
+struct deblock_master_state;
+struct readahead_segment;
+struct cache_fill;
+struct writeback_chunk;
+struct writeback_sync;
+
+TAILQ_HEAD(writebackChunkList, writeback_chunk);
+LIST_HEAD(writebackChunkBucket, writeback_chunk);
+STAILQ_HEAD(writebackSyncQueue, writeback_sync);
+
+#define WRITEBACK_BUCKETS (WRITEBACK_DIRTY_MAX / WRITEBACK_CHUNK)
+
+TAILQ_HEAD(readaheadSegmentList, readahead_segment);
+
+
+/* a sequential read stream, see readAheadTrack() */
+struct readahead_stream {
+  uint32_t next;     /* block the stream's next read is expected at */
+  uint32_t issued;   /* prefetch has been issued up to here */
+  uint32_t window;   /* blocks to keep prefetched past next, 0 until the stream has read sequentially */
+  uint64_t lastUsed;
+  bool used;
+};
+
+
+/* the per-partition half of the protocol: resolving the ID, reading the disk and partition tables,
+ * queueing, splitting and retrying reads and writes.
+ */
+class PSANDevice
+  {
+  public:
+    PSANDevice(PSANEngine *engine, const char *id, const struct psan_device_handlers *handlers);
+    virtual ~PSANDevice();
+    bool init();
+
+    void setIOMaxSize(uint32_t ioMaxReadSize, uint32_t ioMaxWriteSize);
+    /* start from the sizes above but find the best between IO_SIZE_MIN and MAX_IO_*_SIZE, see sizeEvaluate() */
+    void setIOSizeProbing(bool probing);
+    void setResolveAddress(const struct sockaddr_in *addr);
+    void setRetransmitTimeouts(uint32_t minMS, uint32_t maxMS);
+    /* follow up to READAHEAD_STREAMS sequential readers, 0 for no read-ahead */
+    void setReadAheadStreams(uint32_t streams);
+    /* cache up to budget bytes of lineSize lines (a power of 2, CACHE_LINE_MIN..CACHE_LINE_MAX), 0 for no cache.
+     * only before the first IO.
+     */
+    bool setCache(uint64_t budget, uint32_t lineSize);
+    /* acknowledge writes once they're in memory and write them out in the background. only before the first IO */
+    void setWriteBack(bool writeBack);
+    /* how IOs waiting for room in the window are ordered, see PSANIOScheduler */
+    void setScheduler(const struct psan_sched_params *params);
+    /* send a GET again once it's been out longer than percentile of them, for up to budgetPercent of GETs. 0 for none */
+    void setHedging(uint32_t budgetPercent, uint32_t percentile);
+
+    /* fail everything outstanding, including the device's own IO, before deleting it. see PSANEngine::stopTarget() */
+    void stop();
+    /* write-back data not on the unit yet, dirty or being written */
+    uint64_t getUnwrittenBytes();
+
+    void resolve();
+    void asyncReadWrite(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion);
+    /* completes once every write acknowledged before it is on the unit, with an error if one of them couldn't be */
+    void synchronize(struct psan_completion completion);
+    /* false if the pools can't take a request this size right now, in which case availableHandler is called later */
+    bool canAccept(bool isWrite, uint32_t nblks);
+
+    const char *getID() { return _id; }
+    bool isResolved() { return _resolved; }
+    bool isAttached() { return _attached; }
+    uint64_t getSize() { return _size; }
+    const struct sockaddr_in *getPartitionAddress() { return &_partitionAddress; }
+    const struct sockaddr_in *getRootAddress() { return &_rootAddress; }
+    uint32_t getIOWindow();
+    const struct psan_device_stats *getStatistics();
+    const struct psan_size_state *getSizeState(bool isWrite) { return &_sizes[isWrite]; }
+  protected:
+    /* stop() on this device or the engine's own */
+    bool isStopping() { return (_stopping || _engine->isStopping()); }
+
+    /* initial setup functions */
+    void retryResolve();
+    void handleResolvePacket(const struct sockaddr_in *addr, PSANPacket *packet, struct outstanding *out, void *ctx);
+    void handleResolveTimeout(struct outstanding *out, void *ctx);
+    void disk();
+    void diskCompletion(void *parameter, int status, uint64_t actualByteCount);
+    void partition(uint8_t partitions);
+    void partitionCompletion(void *parameter, int status, uint64_t actualByteCount);
+
+    /* main IO functions */
+    void handleAsyncIOPacket(const struct sockaddr_in *addr, PSANPacket *packet, struct outstanding *out, void *ctx);
+    void handleAsyncIOTimeout(struct outstanding *out, void *ctx);
+    void handleAsyncIOError(struct outstanding *out, void *ctx);
+    void requestCompletion(void *parameter, int status, uint64_t actualByteCount);
+    void dispatchRead(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion);
+    void prepareAndDoAsyncReadWrite(const struct sockaddr_in *addr, PSANBuffer *buffer, uint64_t offset, uint32_t block, uint32_t nblks, struct psan_completion completion);
+    void submitIO(struct outstanding_io *io);
+    void doSubmitIO(struct outstanding_io *io);
+    void completeIO(struct outstanding_io *io);
+    void queueIO(struct outstanding_io *io);
+    void dequeueAndSubmitIO();
+    struct outstanding_io *findPending(const struct sockaddr_in *addr, uint32_t block, bool isWrite);
+    uint32_t roundUpRead(uint32_t block, uint32_t nblks);
+    struct outstanding_io *coalescePending(struct outstanding_io *io);
+    struct outstanding_io *makeCarrier(struct outstanding_io *io, uint32_t count, uint32_t transfer);
+    void coalesceCompletion(void *parameter, int status, uint64_t actualByteCount);
+    uint32_t getTimeoutMS(struct outstanding_io *io);
+    void deblock(const struct sockaddr_in *addr, PSANBuffer *buffer, uint64_t offset, uint32_t block, uint32_t nblks, struct psan_completion completion);
+    void deblockCompletion(void *parameter, int status, uint64_t actualByteCount);
+    void deblockRelease(struct deblock_master_state *master, int status, uint64_t actualByteCount);
+    void deblockRead(struct deblock_master_state *master, uint64_t offset, uint32_t block, uint32_t nblks);
+    uint32_t countChunks(bool isWrite, uint32_t nblks);
+    bool hasPoolSpace(bool isWrite, uint32_t nblks);
+
+    /* read-ahead */
+    struct readahead_stream *readAheadTrack(uint32_t block, uint32_t nblks);
+    bool readAheadServe(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion);
+    void readAheadIssue(struct readahead_stream *stream, bool hit);
+    void readAheadInvalidate(uint32_t block, uint32_t nblks);
+    struct readahead_segment *readAheadFind(uint32_t block);
+    bool readAheadReserve(uint32_t nblks);
+    void readAheadConsume(struct readahead_segment *segment, uint32_t nblks);
+    void readAheadFree(struct readahead_segment *segment);
+    void readAheadCompletion(void *parameter, int status, uint64_t actualByteCount);
+
+    /* cache */
+    bool cacheRead(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion);
+    void cacheWrite(PSANBuffer *buffer, uint32_t block, uint32_t nblks);
+    void cacheInvalidate(uint32_t block, uint32_t nblks);
+    void cacheWait(struct cache_fill *fill, struct deblock_master_state *master, uint64_t offset, uint32_t block, uint32_t nblks);
+    void cacheFill(struct cache_fill *fill);
+    void cacheFillCompletion(void *parameter, int status, uint64_t actualByteCount);
+
+    /* write-back */
+    void writeBackWrite(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion);
+    bool writeBackRead(PSANBuffer *buffer, uint32_t block, uint32_t nblks, struct psan_completion completion);
+    bool writeBackHasSpace(uint32_t nblks);
+    struct writeback_chunk *writeBackFind(uint32_t chunk);
+    struct writeback_chunk *writeBackAllocate(uint32_t chunk);
+    void writeBackDirty(struct writeback_chunk *c, uint32_t first, uint32_t nblks, uint64_t now);
+    void writeBackRelease(struct writeback_chunk *c);
+    void writeBackReadCompletion(void *parameter, int status, uint64_t actualByteCount);
+    void writeBackKick();
+    void writeBackFlush(struct writeback_chunk *c);
+    void writeBackFlushCompletion(void *parameter, int status, uint64_t actualByteCount);
+    void writeBackTimeout(struct outstanding *out, void *ctx);
+    void syncStart();
+    void syncFinish(int status);
+
+    /* congestion control */
+    struct psan_rtt *getRTT(struct outstanding_io *io);
+    uint64_t sampleRTT(struct outstanding_io *io);
+    void ioWindowClean(struct outstanding_io *io, uint64_t rtt, bool windowLimited);
+    void ioWindowReduce(struct outstanding_io *io, uint32_t window, uint32_t threshold);
+
+    /* transfer sizes */
+    void sizeProbe(uint32_t size);
+    void sizeProbeCompletion(void *parameter, int status, uint64_t actualByteCount);
+    void sizeProbeFinish(uint32_t answered);
+    void sizeSample(struct outstanding_io *io, bool lost);
+    void sizeEvaluate(bool isWrite, uint64_t now);
+    uint64_t sizeGoodput(bool isWrite, uint32_t size);
+    void sizeSet(bool isWrite, uint32_t size);
+    void sizeTry(bool isWrite, uint32_t size);
+    void sizeRevert(bool isWrite, uint64_t now);
+    bool sizeResplit(struct outstanding_io *io);
+
+    /* hedged reads */
+    uint32_t hedgeDelayMS(struct outstanding_io *io);
+    void hedgeFire(struct outstanding_io *io);
+    void hedgeSample(struct outstanding_io *io, uint64_t latency);
+
+    PSANEngine *_engine;
+    char _id[64];
+    struct psan_device_handlers _handlers;
+
+    uint32_t _ioMaxReadSize;
+    uint32_t _ioMaxWriteSize;
+
+    struct sockaddr_in _resolveAddress;
+    struct sockaddr_in _partitionAddress;
+    struct sockaddr_in _rootAddress;
+    bool _resolved;
+    bool _attached;
+    uint64_t _size;
+
+    uint64_t _resolveInterval;
+    uint64_t _lastReply;
+    uint64_t _lastResolve;
+
+    PSANIOScheduler _scheduler; /* IOs waiting for room in the window */
+    struct outstandingIOQueue _outstandingHead;
+    uint32_t _outstandingCount;
+    uint32_t _inFlight[2];      /* [isWrite] of those outstanding */
+
+    uint32_t _ioWindow; /* fixed point, see IO_WINDOW() */
+    uint32_t _ioWindowThreshold;
+    uint64_t _ioWindowReduced;
+
+    struct psan_rtt _rtt[2][PSAN_SIZE_CLASSES]; /* [isWrite][size class] */
+    uint64_t _baseRTTEpoch;
+    uint32_t _rtoMinMS;
+    uint32_t _rtoMaxMS;
+
+    bool _sizeProbing;
+    bool _sizeProbed;                 /* the attach time probe has been started */
+    struct psan_size_state _sizes[2]; /* [isWrite] */
+    uint64_t _sizeEvaluated;
+
+    uint32_t _hedgeBudget;     /* percent of GETs, 0 for no hedging */
+    uint32_t _hedgePercentile;
+    uint32_t _hedgeCredit;     /* hundredths of a hedge, earned by each GET sent */
+    struct psan_latency _latency[PSAN_SIZE_CLASSES];
+
+    /* fixed-size bookkeeping, see PSANPool */
+    PSANPool _resolvePool;  /* outstanding */
+    PSANPool _requestPool;  /* pinned_request */
+    PSANPool _ioPool;       /* outstanding_io */
+    PSANPool _masterPool;   /* deblock_master_state */
+    PSANPool _deblockPool;  /* deblock_state */
+    PSANPool _carrierPool;  /* PSANCoalescedBuffer */
+    PSANPool _segmentPool;  /* readahead_segment */
+    PSANPool _waiterPool;   /* read_waiter */
+    PSANPool _fillPool;     /* cache_fill */
+    PSANPool _chunkPool;    /* writeback_chunk */
+    PSANPool _flushPool;    /* writeback_flush */
+    PSANPool _mergePool;    /* writeback_read */
+    PSANPool _syncPool;     /* writeback_sync */
+    bool _poolWaiting;
+
+    struct readahead_stream _streams[READAHEAD_STREAMS];
+    uint32_t _readAheadStreams;
+    struct readaheadSegmentList _segments; /* oldest first */
+    uint64_t _readAheadHeld;               /* bytes of prefetched data, against READAHEAD_BUDGET */
+
+    PSANBlockCache *_cache; /* NULL unless setCache() */
+
+    bool _writeBack;
+    struct writebackChunkBucket _chunks[WRITEBACK_BUCKETS]; /* every chunk held, dirty or not */
+    struct writebackChunkList _dirtyChunks;                 /* those with dirty blocks, oldest first */
+    uint64_t _writeBackHeld;                                /* bytes of chunks, against WRITEBACK_DIRTY_MAX */
+    uint32_t _flushesInFlight;
+    bool _flushing;                                         /* in writeBackKick() */
+    struct outstanding _flushTimer;
+    bool _flushTimerArmed;
+    uint64_t _chunkGeneration;                              /* numbers chunks as they're allocated */
+    struct writebackSyncQueue _syncs;                       /* the first is active once _syncActive */
+    bool _syncActive;
+    uint32_t _syncPending;                                  /* chunks the active sync is still waiting on */
+
+    bool _stopping;
+
+    /* request headers with everything but seq, len_power and sector filled in */
+    psan_get_t _getTemplate;
+    uint8_t _putTemplate[sizeof(psan_put_t)]; /* psan_put_t ends in a flexible array, so can't be a member itself */
+
+    struct psan_device_stats _stats;
+  };
+
+#endif /* __PSAN_DEVICE_H__ */
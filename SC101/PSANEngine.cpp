@@ -0,0 +1,855 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PSANEngine.h"
+
+extern "C" {
+#include "psan_wireformat.h"
+};
+
+
+PSANEngine::PSANEngine(PSANTransport *transport)
+{
+  _transport = transport;
+  _anySeq = 0;
+  _shardIndex = 0;
+  _shardCount = 1;
+  _seqLimit = INT16_MAX;
+  _stopping = false;
+
+  _requests = NULL;
+  _requestCapacity = 0;
+  _requestCount = 0;
+  _requestTombstones = 0;
+  LIST_INIT(&_live);
+
+  _peers = NULL;
+  _peerCapacity = 0;
+  _peerCount = 0;
+
+  memset(&_stats, 0, sizeof(_stats));
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+  {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+      LIST_INIT(&_wheel[level].slots[slot]);
+    memset(_wheel[level].occupied, 0, sizeof(_wheel[level].occupied));
+  }
+
+  _wheelTick = 0;
+  _timeoutCount = 0;
+  _timerArmed = 0;
+  _timerSlack = TIMER_SLACK_MS * NSEC_PER_MSEC;
+  _deferTimerUpdates = 0;
+}
+
+
+PSANEngine::~PSANEngine()
+{
+  if (_requests)
+    PSANDelete(_requests, struct request_slot, _requestCapacity);
+  if (_peers)
+    PSANDelete(_peers, struct peer_slot, _peerCapacity);
+}
+
+
+bool PSANEngine::init()
+{
+  if ((_requests = PSANTryNewZero(struct request_slot, REQUEST_TABLE_INITIAL)))
+    _requestCapacity = REQUEST_TABLE_INITIAL;
+
+  if ((_peers = PSANTryNewZero(struct peer_slot, PEER_TABLE_INITIAL)))
+    _peerCapacity = PEER_TABLE_INITIAL;
+
+  if (!_requests || !_peers)
+  {
+    KINFO("Failed to alloc request tables");
+    return false;
+  }
+
+  /* there is no particular reason for this to be random */
+  _anySeq = psan_uptime_ns() % _seqLimit;
+  KINFO("Sequence#: %d", _anySeq * _shardCount + _shardIndex);
+
+  return true;
+}
+
+
+/* every outstanding request gets its timeout handler called one last time; isStopping() tells it not to retry */
+void PSANEngine::stop()
+{
+  struct outstanding *out;
+
+  _stopping = true;
+
+  while ((out = LIST_FIRST(&_live)))
+  {
+    KINFO("killing outstanding seq#%d", out->seq);
+
+    unregisterPacketHandler(out, false);
+    out->timeoutHandler(out->target, out, out->ctx);
+  }
+}
+
+
+/* its timeout handlers have to give up rather than retry, see PSANDevice::stop(). one at a time, since any of them may
+ * start or finish others
+ */
+void PSANEngine::stopTarget(void *target)
+{
+  struct outstanding *out;
+
+  for (;;)
+  {
+    LIST_FOREACH(out, &_live, live)
+    {
+      if (out->target == target)
+        break;
+    }
+
+    if (!out)
+      break;
+
+    KINFO("killing outstanding seq#%d", out->seq);
+
+    unregisterPacketHandler(out, false);
+    out->timeoutHandler(out->target, out, out->ctx);
+  }
+}
+
+
+/* a timer already set to fire no more than this late is left alone rather than re-armed */
+void PSANEngine::setTimerSlack(uint32_t slackMS)
+{
+  _timerSlack = slackMS * NSEC_PER_MSEC;
+}
+
+
+void PSANEngine::setShard(uint16_t index, uint16_t count)
+{
+  _shardIndex = index;
+  _shardCount = count;
+  _seqLimit = INT16_MAX / count;
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Core Functions
+/**********************************************************************************************************************************/
+
+
+/* NULL for the space shared by requests that can be answered from anywhere (see outstanding.anyPeer) */
+uint16_t PSANEngine::getSequenceNumber(const struct sockaddr_in *peer)
+{
+  struct peer_slot *slot = (peer ? lookupPeer(peer->sin_addr.s_addr, peer->sin_port, true) : NULL);
+  uint16_t *seq = (slot ? &slot->seq : &_anySeq);
+
+  return htons(nextSequenceNumber(seq));
+}
+
+
+uint16_t PSANEngine::nextSequenceNumber(uint16_t *counter)
+{
+  if (*counter >= _seqLimit)
+    *counter = 0;
+
+  return (*counter)++ * _shardCount + _shardIndex;
+}
+
+
+bool PSANEngine::sendPacket(const struct sockaddr_in *dest, const void *header, size_t headerLen,
+                            PSANBuffer *payload, uint64_t payloadOffset, size_t payloadLen, struct outstanding *out)
+{
+  if (out)
+  {
+    if (out->anyPeer)
+      psan_sockaddr_init(&out->peer, INADDR_ANY, 0);
+    else
+      out->peer = *dest;
+
+    registerPacketHandler(out);
+  }
+
+  return _transport->sendPacket(dest, header, headerLen, payload, payloadOffset, payloadLen, (out && out->anyPeer));
+}
+
+
+/* the timeout is armed even if the table is full, so the request is retried rather than lost */
+void PSANEngine::registerPacketHandler(struct outstanding *out)
+{
+  if (!insertRequest(out))
+    KINFO("no room for seq#%d", out->seq);
+
+  LIST_INSERT_HEAD(&_live, out, live);
+
+  if (out->timeout_ms)
+    addTimeout(out);
+}
+
+
+/* answered: whatever seq# it was matched on, every one it was sent with has had its answer */
+void PSANEngine::unregisterPacketHandler(struct outstanding *out, bool answered)
+{
+  releaseSlot(out, out->tableSlot, out->tableGeneration, answered);
+
+  while (out->lateCount)
+  {
+    out->lateCount--;
+    releaseSlot(out, out->late[out->lateCount].slot, out->late[out->lateCount].generation, answered);
+  }
+
+  LIST_REMOVE(out, live);
+
+  if (out->timeout_ms)
+    removeTimeout(out);
+}
+
+
+/* timed out but left in the table under its seq# (see acceptLate), until it is answered or released */
+void PSANEngine::retireRequest(struct outstanding *out)
+{
+  if (out->tableSlot < _requestCapacity)
+  {
+    if (out->lateCount == OUTSTANDING_LATE_MAX)
+    {
+      releaseSlot(out, out->late[0].slot, out->late[0].generation, false);
+      memmove(&out->late[0], &out->late[1], sizeof(out->late[0]) * --out->lateCount);
+    }
+
+    out->late[out->lateCount].slot = out->tableSlot;
+    out->late[out->lateCount].generation = out->tableGeneration;
+    out->lateCount++;
+    out->tableSlot = UINT32_MAX;
+  }
+
+  LIST_REMOVE(out, live);
+
+  if (out->timeout_ms)
+    removeTimeout(out);
+}
+
+
+void PSANEngine::releaseRequest(struct outstanding *out)
+{
+  while (out->lateCount)
+  {
+    out->lateCount--;
+    releaseSlot(out, out->late[out->lateCount].slot, out->late[out->lateCount].generation, false);
+  }
+}
+
+
+/* live, but not (re-)registered in the request table, so no new seq# can be answered. late slots out already holds
+ * from earlier sends (an acceptLate IO that hedgeFire() left waiting) stay live, so an answer to one of those still
+ * completes it: that's intended, not a leak to be cleaned up here.
+ */
+void PSANEngine::startTimer(struct outstanding *out)
+{
+  out->tableSlot = UINT32_MAX;
+  LIST_INSERT_HEAD(&_live, out, live);
+  addTimeout(out);
+}
+
+
+void PSANEngine::cancelTimer(struct outstanding *out)
+{
+  unregisterPacketHandler(out, false);
+}
+
+
+/* packets handled between beginBatch() and endBatch() set the transport timer once, at the end */
+void PSANEngine::beginBatch()
+{
+  _deferTimerUpdates++;
+}
+
+
+void PSANEngine::endBatch(uint32_t packets, bool budgetExhausted)
+{
+  if (packets)
+  {
+    _stats.rxBatches++;
+    _stats.rxPackets += packets;
+    _stats.rxBatchMax = PSAN_MAX(_stats.rxBatchMax, packets);
+  }
+
+  if (budgetExhausted)
+    _stats.rxBudgetExhausted++;
+
+  if (!--_deferTimerUpdates)
+    updateTimeout();
+}
+
+
+void PSANEngine::handlePacket(const struct sockaddr_in *addr, PSANPacket *packet)
+{
+  size_t len = packet->getLength();
+  struct psan_ctrl_t *ctrl = (struct psan_ctrl_t *)packet->pullup(sizeof(struct psan_ctrl_t));
+
+  if (!ctrl)
+  {
+    KINFO("short packet, ignoring.");
+    return;
+  }
+
+  /* other hosts looking for their devices */
+  if (ctrl->cmd == PSAN_FIND || ctrl->cmd == PSAN_RESOLVE)
+    return;
+
+  uint16_t seq = ntohs(ctrl->seq);
+  struct outstanding *out = matchRequest(addr, seq);
+
+  if (!out)
+  {
+    if (lookupAnswered(addr->sin_addr.s_addr, addr->sin_port, seq))
+      _stats.duplicates++;
+    else if (lookupPeer(addr->sin_addr.s_addr, addr->sin_port, false))
+      _stats.stale++;
+    else
+      _stats.foreign++;
+
+    KDEBUG("No matching request for seq#%d,cmd=0x%02x,len=%zu", seq, ctrl->cmd, len);
+    return;
+  }
+
+  if (ctrl->cmd == PSAN_ERROR)
+  {
+    if (out->timeout_ms)
+    {
+      KINFO("Drive not ready, backing off for %d seconds", SPINUP_INTERVAL_MS/1000);
+
+      removeTimeout(out);
+      out->timeout_ms = SPINUP_INTERVAL_MS;
+      addTimeout(out);
+
+      if (out->errorHandler)
+        out->errorHandler(out->target, out, out->ctx);
+    }
+
+    return;
+  }
+
+  if (len != out->len || ctrl->cmd != out->cmd)
+  {
+    _stats.mismatched++;
+
+    KDEBUG("Mismatched response for seq#%d,cmd=0x%02x,len=%zu expected:cmd=0x%02x,len=%d",
+           seq, ctrl->cmd, len, out->cmd, out->len);
+    return;
+  }
+
+  if (seq != out->seq)
+  {
+    _stats.late++;
+
+    KDEBUG("Late response for seq#%d, retried as seq#%d", seq, out->seq);
+  }
+
+  unregisterPacketHandler(out, true);
+
+  out->matchedSeq = seq;
+  out->packetHandler(out->target, addr, packet, out, out->ctx);
+}
+
+
+/* for transports that can peek at a datagram before receiving it. header is its first headerLen bytes and len its
+ * full length: if it is the expected response to a request that named a payload buffer, say where the payload
+ * belongs so it can be received there directly, bar the last surplus bytes which the buffer would only drop and are
+ * better received into scratch. only answers yes when handlePacket() would accept the packet.
+ */
+bool PSANEngine::getPayloadPlacement(const struct sockaddr_in *addr, const void *header, size_t headerLen, size_t len,
+                                     PSANBuffer **payload, uint64_t *payloadOffset, size_t *packetOffset, size_t *surplus)
+{
+  const struct psan_ctrl_t *ctrl = (const struct psan_ctrl_t *)header;
+
+  if (headerLen < sizeof(struct psan_ctrl_t))
+    return false;
+
+  struct outstanding *out = matchRequest(addr, ntohs(ctrl->seq));
+
+  if (!out || !out->payload || !out->payloadLen ||
+      ctrl->cmd != out->cmd || len != out->len || len < out->payloadLen || out->payloadSurplus >= out->payloadLen)
+    return false;
+
+  *payload = out->payload;
+  *payloadOffset = out->payloadOffset;
+  *packetOffset = len - out->payloadLen;
+  *surplus = out->payloadSurplus;
+
+  return true;
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Request table
+/**********************************************************************************************************************************/
+
+
+/* responses normally come from where the request went, RESOLVE's from whichever unit owns the ID */
+struct outstanding *PSANEngine::matchRequest(const struct sockaddr_in *addr, uint16_t seq)
+{
+  struct outstanding *out = lookupRequest(addr->sin_addr.s_addr, addr->sin_port, seq);
+
+  if (!out)
+    out = lookupRequest(INADDR_ANY, 0, seq);
+
+  return out;
+}
+
+
+static uint32_t requestHash(in_addr_t addr, in_port_t port, uint16_t seq)
+{
+  uint32_t h = addr * 0x9E3779B1U;
+
+  h ^= (((uint32_t)port << 16) | seq) * 0x85EBCA6BU;
+
+  return h ^ (h >> 15);
+}
+
+
+struct outstanding *PSANEngine::lookupRequest(in_addr_t addr, in_port_t port, uint16_t seq)
+{
+  uint32_t mask = _requestCapacity - 1;
+
+  for (uint32_t i = requestHash(addr, port, seq) & mask, n = 0; n < _requestCapacity; i = (i + 1) & mask, n++)
+  {
+    struct request_slot *slot = &_requests[i];
+
+    if (!slot->used)
+      break;
+
+    if (slot->out && slot->addr == addr && slot->port == port && slot->seq == seq)
+      return slot->out;
+  }
+
+  return NULL;
+}
+
+
+bool PSANEngine::lookupAnswered(in_addr_t addr, in_port_t port, uint16_t seq)
+{
+  uint32_t mask = _requestCapacity - 1;
+
+  for (uint32_t i = requestHash(addr, port, seq) & mask, n = 0; n < _requestCapacity; i = (i + 1) & mask, n++)
+  {
+    struct request_slot *slot = &_requests[i];
+
+    if (!slot->used)
+      break;
+
+    if (!slot->out && slot->answered && slot->addr == addr && slot->port == port && slot->seq == seq)
+      return true;
+  }
+
+  return false;
+}
+
+
+/* fails only if the table is full and can't be grown */
+bool PSANEngine::insertRequest(struct outstanding *out)
+{
+  out->tableSlot = UINT32_MAX;
+
+  /* keep probes short: grow when half full, or just sweep out the tombstones */
+  if ((_requestCount + _requestTombstones + 1) * 4 > _requestCapacity * 3)
+  {
+    if (!resizeRequestTable((_requestCount + 1) * 2 > _requestCapacity ? _requestCapacity * 2 : _requestCapacity) &&
+        _requestCount + 1 >= _requestCapacity)
+      return false;
+  }
+
+  struct request_slot *slot = insertSlot(out->peer.sin_addr.s_addr, out->peer.sin_port, out->seq, out);
+
+  if (!slot)
+    return false;
+
+  out->tableSlot = slot - _requests;
+  out->tableGeneration = slot->generation;
+
+  return true;
+}
+
+
+/* the caller records where it went, a request can hold slots under earlier seq#s too (see retireRequest) */
+struct request_slot *PSANEngine::insertSlot(in_addr_t addr, in_port_t port, uint16_t seq, struct outstanding *out)
+{
+  uint32_t mask = _requestCapacity - 1;
+  struct request_slot *empty = NULL;
+
+  for (uint32_t i = requestHash(addr, port, seq) & mask, n = 0; n < _requestCapacity; i = (i + 1) & mask, n++)
+  {
+    struct request_slot *slot = &_requests[i];
+
+    if (!slot->used || !slot->out)
+    {
+      if (!empty)
+        empty = slot;
+
+      /* keep looking past tombstones in case the key is already there */
+      if (!slot->used)
+        break;
+      continue;
+    }
+
+    if (slot->addr == addr && slot->port == port && slot->seq == seq)
+    {
+      /* the sequence space wrapped with a request still outstanding, the old one can only time out now */
+      KINFO("seq#%d already used!", seq);
+      if (slot->out->tableSlot == i)
+        slot->out->tableSlot = UINT32_MAX;
+      slot->out = NULL;
+      slot->answered = false;
+      _requestCount--;
+      _requestTombstones++;
+
+      if (!empty)
+        empty = slot;
+      break;
+    }
+  }
+
+  if (!empty)
+    return NULL;
+
+  if (empty->used)
+    _requestTombstones--;
+
+  empty->addr = addr;
+  empty->port = port;
+  empty->seq = seq;
+  empty->generation++;
+  empty->used = true;
+  empty->answered = false;
+  empty->out = out;
+
+  _requestCount++;
+
+  return empty;
+}
+
+
+/* only if it's still out's: a slot that was taken over when the sequence space wrapped has a new generation */
+void PSANEngine::releaseSlot(struct outstanding *out, uint32_t index, uint32_t generation, bool answered)
+{
+  struct request_slot *slot = (index < _requestCapacity ? &_requests[index] : NULL);
+
+  if (slot && slot->out == out && slot->generation == generation)
+  {
+    slot->out = NULL;
+    slot->answered = answered;
+    _requestCount--;
+    _requestTombstones++;
+  }
+}
+
+
+/* a request's late slots move along with its current one; tombstones, and with them what was answered, are dropped */
+bool PSANEngine::resizeRequestTable(uint32_t capacity)
+{
+  struct request_slot *requests = PSANTryNewZero(struct request_slot, capacity);
+
+  if (!requests)
+  {
+    KINFO("Failed to grow request table to %u", capacity);
+    return false;
+  }
+
+  struct request_slot *old = _requests;
+  uint32_t oldCapacity = _requestCapacity;
+
+  _requests = requests;
+  _requestCapacity = capacity;
+  _requestCount = 0;
+  _requestTombstones = 0;
+  _stats.tableResizes++;
+
+  for (uint32_t i = 0; i < oldCapacity; i++)
+  {
+    struct outstanding *out = old[i].out;
+    struct request_slot *slot;
+
+    if (!out || !(slot = insertSlot(old[i].addr, old[i].port, old[i].seq, out)))
+      continue;
+
+    if (out->tableSlot == i && out->tableGeneration == old[i].generation)
+    {
+      out->tableSlot = slot - _requests;
+      out->tableGeneration = slot->generation;
+      continue;
+    }
+
+    for (uint8_t l = 0; l < out->lateCount; l++)
+    {
+      if (out->late[l].slot == i && out->late[l].generation == old[i].generation)
+      {
+        out->late[l].slot = slot - _requests;
+        out->late[l].generation = slot->generation;
+        break;
+      }
+    }
+  }
+
+  PSANDelete(old, struct request_slot, oldCapacity);
+
+  return true;
+}
+
+
+/* peers are never forgotten, there is one per partition and root address we've talked to */
+struct peer_slot *PSANEngine::lookupPeer(in_addr_t addr, in_port_t port, bool create)
+{
+  uint32_t mask = _peerCapacity - 1;
+  uint32_t i;
+
+  for (i = requestHash(addr, port, 0) & mask; _peers[i].used; i = (i + 1) & mask)
+  {
+    if (_peers[i].addr == addr && _peers[i].port == port)
+      return &_peers[i];
+  }
+
+  if (!create)
+    return NULL;
+
+  if ((_peerCount + 1) * 2 > _peerCapacity)
+  {
+    struct peer_slot *peers = PSANTryNewZero(struct peer_slot, _peerCapacity * 2);
+    if (!peers)
+      return NULL;
+
+    struct peer_slot *old = _peers;
+    uint32_t oldCapacity = _peerCapacity;
+
+    _peers = peers;
+    _peerCapacity *= 2;
+    mask = _peerCapacity - 1;
+
+    for (uint32_t j = 0; j < oldCapacity; j++)
+    {
+      if (!old[j].used)
+        continue;
+
+      for (i = requestHash(old[j].addr, old[j].port, 0) & mask; _peers[i].used; i = (i + 1) & mask)
+        ;
+      _peers[i] = old[j];
+    }
+
+    PSANDelete(old, struct peer_slot, oldCapacity);
+
+    for (i = requestHash(addr, port, 0) & mask; _peers[i].used; i = (i + 1) & mask)
+      ;
+  }
+
+  _peers[i].addr = addr;
+  _peers[i].port = port;
+  _peers[i].used = true;
+  /* there is no particular reason for this to be random either */
+  _peers[i].seq = (psan_uptime_ns() + i) % _seqLimit;
+  _peerCount++;
+
+  return &_peers[i];
+}
+
+
+void PSANEngine::timeoutOccurred()
+{
+  processTimeout();
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Timer wheel
+/**********************************************************************************************************************************/
+
+
+#define WHEEL_SHIFT(level) (TIMER_WHEEL_BITS * (level))
+#define WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+
+static uint64_t nsToTick(uint64_t ns)
+{
+  return (ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+}
+
+
+/* first occupied slot at or after from, or -1 */
+static int findOccupied(const uint64_t *occupied, int from)
+{
+  for (int word = from / 64; word < TIMER_WHEEL_SLOTS / 64; word++)
+  {
+    uint64_t bits = occupied[word];
+
+    if (word == from / 64)
+      bits &= ~0ULL << (from % 64);
+
+    if (bits)
+      return word * 64 + __builtin_ctzll(bits);
+  }
+
+  return -1;
+}
+
+
+void PSANEngine::addTimeout(struct outstanding *out)
+{
+  out->timeout = psan_uptime_ns() + out->timeout_ms * NSEC_PER_MSEC;
+
+  /* an empty wheel can skip straight to now rather than walking the idle ticks later */
+  if (!_timeoutCount)
+    _wheelTick = psan_uptime_ns() / NSEC_PER_MSEC;
+
+  wheelInsert(out);
+  _timeoutCount++;
+
+  updateTimeout();
+}
+
+
+/* no re-arm here, a timer that fires for nothing just sets the next one */
+void PSANEngine::removeTimeout(struct outstanding *out)
+{
+  struct timer_wheel_level *level = &_wheel[out->wheelLevel];
+
+  LIST_REMOVE(out, entries);
+  _timeoutCount--;
+
+  if (LIST_EMPTY(&level->slots[out->wheelSlot]))
+    level->occupied[out->wheelSlot / 64] &= ~(1ULL << (out->wheelSlot % 64));
+}
+
+
+void PSANEngine::wheelInsert(struct outstanding *out)
+{
+  uint64_t tick = PSAN_MAX(nsToTick(out->timeout), _wheelTick);
+  uint64_t delta = tick - _wheelTick;
+  int level = 0;
+
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << WHEEL_SHIFT(level + 1)))
+    level++;
+
+  /* beyond the top level, park in the furthest slot and re-file when it cascades */
+  if (delta >= (1ULL << WHEEL_SHIFT(TIMER_WHEEL_LEVELS)))
+    tick = _wheelTick + (1ULL << WHEEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1;
+
+  int slot = (tick >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+
+  out->wheelLevel = level;
+  out->wheelSlot = slot;
+  LIST_INSERT_HEAD(&_wheel[level].slots[slot], out, entries);
+  _wheel[level].occupied[slot / 64] |= (1ULL << (slot % 64));
+}
+
+
+/* called as _wheelTick reaches the start of a new slot at this level, to spread it over the levels below */
+void PSANEngine::wheelCascade(int level)
+{
+  int slot = (_wheelTick >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+  struct outstanding *out;
+
+  while ((out = LIST_FIRST(&_wheel[level].slots[slot])))
+  {
+    LIST_REMOVE(out, entries);
+    wheelInsert(out);
+  }
+
+  _wheel[level].occupied[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+
+/* earliest tick anything needs doing, either an expiry on level 0 or a cascade from above */
+uint64_t PSANEngine::wheelNextTick()
+{
+  uint64_t next = UINT64_MAX;
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+  {
+    uint64_t current = _wheelTick >> WHEEL_SHIFT(level);
+    uint64_t base = current & ~(uint64_t)WHEEL_MASK;
+    bool cascaded = (level && (_wheelTick & ((1ULL << WHEEL_SHIFT(level)) - 1))); /* past the start of the current slot */
+    int from = (current & WHEEL_MASK) + (cascaded ? 1 : 0);
+    int slot = (from < TIMER_WHEEL_SLOTS ? findOccupied(_wheel[level].occupied, from) : -1);
+
+    /* slots before the current one have wrapped around */
+    if (slot < 0)
+    {
+      slot = findOccupied(_wheel[level].occupied, 0);
+      base += TIMER_WHEEL_SLOTS;
+    }
+
+    if (slot >= 0)
+      next = PSAN_MIN(next, (base + slot) << WHEEL_SHIFT(level));
+  }
+
+  return next;
+}
+
+
+void PSANEngine::updateTimeout()
+{
+  if (!_timeoutCount || _deferTimerUpdates)
+    return;
+
+  uint64_t deadline = wheelNextTick() * NSEC_PER_MSEC;
+
+  /* an earlier or only slightly later timer will do, coalescing re-arms as requests come and go */
+  if (_timerArmed && _timerArmed <= deadline + _timerSlack)
+    return;
+
+  _timerArmed = deadline;
+  _transport->setTimer(deadline);
+}
+
+
+/* expire everything due in one pass, then set the timer once for whatever is next */
+void PSANEngine::processTimeout()
+{
+  uint64_t now = psan_uptime_ns() / NSEC_PER_MSEC;
+
+  _timerArmed = 0;
+  _deferTimerUpdates++;
+
+  while (_timeoutCount && _wheelTick <= now)
+  {
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+    {
+      if (!(_wheelTick & ((1ULL << WHEEL_SHIFT(level)) - 1)))
+        wheelCascade(level);
+    }
+
+    int slot = _wheelTick & WHEEL_MASK;
+    struct outstanding *out;
+
+    while ((out = LIST_FIRST(&_wheel[0].slots[slot])))
+    {
+      if (out->acceptLate && !_stopping)
+        retireRequest(out);
+      else
+        unregisterPacketHandler(out, false);
+      out->timeoutHandler(out->target, out, out->ctx);
+    }
+
+    /* skip ahead to the next occupied slot, but never past the next cascade */
+    int next = (slot + 1 < TIMER_WHEEL_SLOTS ? findOccupied(_wheel[0].occupied, slot + 1) : -1);
+    uint64_t nextTick = (next >= 0 ? (_wheelTick & ~(uint64_t)WHEEL_MASK) + next : (_wheelTick | WHEEL_MASK) + 1);
+
+    _wheelTick = PSAN_MIN(nextTick, now + 1);
+  }
+
+  _deferTimerUpdates--;
+
+  updateTimeout();
+}
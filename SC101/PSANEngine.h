@@ -0,0 +1,244 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_ENGINE_H__
+#define __PSAN_ENGINE_H__
+
+#include "PSANPlatform.h"
+
+typedef void (*PacketHandler)(void *owner, const struct sockaddr_in *addr, PSANPacket *packet, struct outstanding *, void *ctx);
+typedef void (*TimeoutHandler)(void *owner, struct outstanding *, void *ctx);
+
+/* earlier transmissions an acceptLate request stays matchable on, the oldest is forgotten first */
+#define OUTSTANDING_LATE_MAX (4)
+
+struct outstanding {
+  uint8_t cmd;
+  uint16_t seq;
+  uint16_t len;
+  bool anyPeer; /* accept the response from any address, for RESOLVE which the owning unit answers */
+
+  PacketHandler packetHandler;
+  TimeoutHandler timeoutHandler;
+  TimeoutHandler errorHandler; /* optional, told about PSAN_ERROR once the spin-up backoff is armed */
+  void *target;
+  void *ctx;
+
+  /* optional, where the payload of the response belongs: the last payloadLen bytes of its len go to payload at
+   * payloadOffset. transports that can scatter a datagram (getPayloadPlacement) then skip the bounce buffer. the
+   * final payloadSurplus of those are only dropped by payload (a rounded-up read's), so can land anywhere.
+   */
+  PSANBuffer *payload;
+  uint64_t payloadOffset;
+  uint16_t payloadLen;
+  uint16_t payloadSurplus;
+
+  uint32_t timeout_ms;
+  uint64_t timeout; /* auto-filled by addTimeout routine */
+
+  /* position in the timer wheel, also auto-filled */
+  uint8_t wheelLevel;
+  uint16_t wheelSlot;
+  LIST_ENTRY(outstanding) entries;
+
+  /* position in the request table, auto-filled by registerPacketHandler */
+  struct sockaddr_in peer;
+  uint32_t tableSlot;
+  uint32_t tableGeneration;
+  LIST_ENTRY(outstanding) live;
+
+  /* with acceptLate set, a request that times out stays in the request table under its old seq#: the owner's retry
+   * gets a new one, and whichever answer comes back first is handled as the answer to the retry. matchedSeq says
+   * which it was. an owner that gives up rather than retrying calls releaseRequest().
+   */
+  bool acceptLate;
+  uint16_t matchedSeq;
+  uint8_t lateCount;
+  struct {
+    uint32_t slot;
+    uint32_t generation;
+  } late[OUTSTANDING_LATE_MAX];
+};
+
+LIST_HEAD(timeoutList, outstanding);
+LIST_HEAD(liveList, outstanding);
+
+
+/* open-addressed (linear probing) table of live requests keyed by (peer, seq). entries stay put until the table is
+ * resized, so each request remembers its slot; the generation is bumped every time a slot is reused so a request
+ * that has already been released can't release whoever took its place.
+ */
+struct request_slot {
+  in_addr_t addr;
+  in_port_t port;
+  uint16_t seq;
+  uint32_t generation;
+  bool used; /* with out == NULL, a tombstone */
+  bool answered; /* a tombstone left by a request that was answered, so a second answer can be told from a stale one */
+  struct outstanding *out;
+};
+
+/* every address we've sent to has its own sequence space */
+struct peer_slot {
+  in_addr_t addr;
+  in_port_t port;
+  uint16_t seq;
+  bool used;
+};
+
+#define REQUEST_TABLE_INITIAL (1024)
+#define PEER_TABLE_INITIAL (64)
+
+
+struct psan_engine_stats {
+  uint64_t stale;      /* responses from a known peer with no live request, eg. after giving up on it */
+  uint64_t late;       /* answers to an earlier transmission of a request that was retried, see acceptLate */
+  uint64_t duplicates; /* further answers to a request that was already answered */
+  uint64_t foreign;    /* responses from an address we never sent to */
+  uint64_t mismatched; /* matched a live request but had the wrong command or length */
+  uint64_t tableResizes;
+
+  uint64_t rxBatches;  /* wakeups that received anything */
+  uint64_t rxPackets;
+  uint64_t rxBatchMax;
+  uint64_t rxBudgetExhausted; /* wakeups that stopped with packets still queued */
+};
+
+
+/* hierarchical timer wheel of 1ms ticks: level 0 covers the next 256ms, level 1 the next 65s and level 2 the next 4.6h.
+ * entries further out are parked in the last slot and re-filed as it cascades down.
+ */
+#define TIMER_WHEEL_BITS (8)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS (3)
+
+struct timer_wheel_level {
+  struct timeoutList slots[TIMER_WHEEL_SLOTS];
+  uint64_t occupied[TIMER_WHEEL_SLOTS / 64];
+};
+
+
+/* portable stand-ins for OSMemberFunctionCast(PacketHandler/TimeoutHandler, this, &Class::method) */
+template <class T, void (T::*method)(const struct sockaddr_in *, PSANPacket *, struct outstanding *, void *)>
+void PacketHandlerCast(void *owner, const struct sockaddr_in *addr, PSANPacket *packet, struct outstanding *out, void *ctx)
+{
+  (((T *)owner)->*method)(addr, packet, out, ctx);
+}
+
+template <class T, void (T::*method)(struct outstanding *, void *)>
+void TimeoutHandlerCast(void *owner, struct outstanding *out, void *ctx)
+{
+  (((T *)owner)->*method)(out, ctx);
+}
+
+
+/* the shared half of the protocol: sequence numbers, matching responses to requests and retransmit timeouts.
+ * one engine per socket shard (workloop), shared by the devices on it. shards split the sequence space between them
+ * so a response can be handed to the engine that sent the request by its seq# alone.
+ */
+class PSANEngine
+  {
+  public:
+    PSANEngine(PSANTransport *transport);
+    virtual ~PSANEngine();
+
+    bool init();
+    void stop();
+    /* as stop(), for just the requests and timers of one target, which wants no more callbacks once this returns */
+    void stopTarget(void *target);
+    void setTimerSlack(uint32_t slackMS);
+    /* before init(): only hand out seq#s that are index modulo count */
+    void setShard(uint16_t index, uint16_t count);
+    static uint16_t getShardForSequence(uint16_t seq, uint16_t count) { return seq % count; }
+
+    // called from transport
+    void beginBatch();
+    void handlePacket(const struct sockaddr_in *addr, PSANPacket *packet);
+    bool getPayloadPlacement(const struct sockaddr_in *addr, const void *header, size_t headerLen, size_t len,
+                             PSANBuffer **payload, uint64_t *payloadOffset, size_t *packetOffset, size_t *surplus);
+    void endBatch(uint32_t packets, bool budgetExhausted);
+    void timeoutOccurred();
+
+    // called from device
+    uint16_t getSequenceNumber(const struct sockaddr_in *peer);
+    bool isStopping() { return _stopping; }
+    bool sendPacket(const struct sockaddr_in *dest, const void *header, size_t headerLen,
+                    PSANBuffer *payload, uint64_t payloadOffset, size_t payloadLen, struct outstanding *out);
+
+    /* a plain timer on the same wheel: out->timeoutHandler is called once out->timeout_ms (non-zero) have passed,
+     * or when the engine stops. nothing else in out need be filled in.
+     */
+    void startTimer(struct outstanding *out);
+    void cancelTimer(struct outstanding *out);
+    /* an acceptLate request that timed out and won't be retried, no answer to it is wanted any more */
+    void releaseRequest(struct outstanding *out);
+
+    const struct psan_engine_stats *getStatistics() { return &_stats; }
+  protected:
+    void registerPacketHandler(struct outstanding *out);
+    void unregisterPacketHandler(struct outstanding *out, bool answered);
+    void retireRequest(struct outstanding *out);
+
+    struct outstanding *matchRequest(const struct sockaddr_in *addr, uint16_t seq);
+    struct outstanding *lookupRequest(in_addr_t addr, in_port_t port, uint16_t seq);
+    bool lookupAnswered(in_addr_t addr, in_port_t port, uint16_t seq);
+    bool insertRequest(struct outstanding *out);
+    struct request_slot *insertSlot(in_addr_t addr, in_port_t port, uint16_t seq, struct outstanding *out);
+    void releaseSlot(struct outstanding *out, uint32_t index, uint32_t generation, bool answered);
+    bool resizeRequestTable(uint32_t capacity);
+    struct peer_slot *lookupPeer(in_addr_t addr, in_port_t port, bool create);
+
+    void addTimeout(struct outstanding *out);
+    void removeTimeout(struct outstanding *out);
+    void updateTimeout();
+    void processTimeout();
+
+    void wheelInsert(struct outstanding *out);
+    void wheelCascade(int level);
+    uint64_t wheelNextTick();
+
+    uint16_t nextSequenceNumber(uint16_t *counter);
+
+    PSANTransport *_transport;
+    uint16_t _anySeq;       /* counters, scaled by nextSequenceNumber() */
+    uint16_t _shardIndex;
+    uint16_t _shardCount;
+    uint16_t _seqLimit;     /* counters wrap here */
+    bool _stopping;
+
+    struct request_slot *_requests;
+    uint32_t _requestCapacity;
+    uint32_t _requestCount;
+    uint32_t _requestTombstones;
+    struct liveList _live;
+
+    struct peer_slot *_peers;
+    uint32_t _peerCapacity;
+    uint32_t _peerCount;
+
+    struct psan_engine_stats _stats;
+
+    struct timer_wheel_level _wheel[TIMER_WHEEL_LEVELS];
+    uint64_t _wheelTick;    /* everything before this has been expired */
+    uint32_t _timeoutCount;
+    uint64_t _timerArmed;   /* deadline the transport timer is set for, 0 if none */
+    uint64_t _timerSlack;
+    uint32_t _deferTimerUpdates; /* while expiring timeouts or handling a batch of packets */
+  };
+
+#endif /* __PSAN_ENGINE_H__ */
@@ -0,0 +1,461 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* the small set of services the portable PSAN engine needs from its host: memory, time, buffers, packets
+ * and a transport. the kext implements these over IOKit/mbufs (SC101Driver.cpp, SC101Device.cpp) and
+ * the userspace library over plain memory and UDP sockets (linux/PSANLinux.cpp).
+ */
+
+#ifndef __PSAN_PLATFORM_H__
+#define __PSAN_PLATFORM_H__
+
+#include "config.h"
+
+#ifdef KERNEL
+#include <IOKit/IOLib.h>
+
+extern "C" {
+#include <stdint.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include <kern/clock.h>
+}
+#else /* KERNEL */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#endif /* KERNEL */
+
+
+#ifdef KERNEL
+#define psan_alloc(len) IOMalloc(len)
+#define psan_free(ptr, len) IOFree(ptr, len)
+#define psan_panic(msg) panic(msg)
+
+static inline uint64_t psan_uptime_ns(void)
+{
+  uint64_t now, ns;
+  clock_get_uptime(&now);
+  absolutetime_to_nanoseconds(now, &ns);
+  return ns;
+}
+#else /* KERNEL */
+#define psan_alloc(len) malloc(len)
+#define psan_free(ptr, len) free(ptr)
+#define psan_panic(msg) do { KINFO("%s", msg); abort(); } while (0)
+
+static inline uint64_t psan_uptime_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif /* KERNEL */
+
+
+static inline void *psan_alloc_zero(size_t len)
+{
+  void *buf = psan_alloc(len);
+  if (!buf)
+    psan_panic("alloc failed");
+  memset(buf, 0, len);
+  return buf;
+}
+#define PSANNewZero(type, number) (type*)psan_alloc_zero(sizeof(type) * (number))
+
+/* for allocations that can fail gracefully: NULL rather than a panic */
+static inline void *psan_try_alloc_zero(size_t len)
+{
+  void *buf = psan_alloc(len);
+  if (buf)
+    memset(buf, 0, len);
+  return buf;
+}
+#define PSANTryNewZero(type, number) (type*)psan_try_alloc_zero(sizeof(type) * (number))
+#define PSANDelete(ptr, type, number) psan_free(ptr, sizeof(type) * (number))
+
+#define PSAN_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define PSAN_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define NSEC_PER_MSEC (1000000ULL)
+
+
+/* fixed-size objects carved out of slabs, so steady-state IO makes no general purpose allocations. slabs are only
+ * returned to the system when the pool is destroyed. get() hands out zeroed objects like PSANNewZero(), but
+ * returns NULL instead of panicking once limit objects are in use or a new slab can't be had.
+ */
+struct psan_pool_slab {
+  struct psan_pool_slab *next;
+  size_t len;
+};
+
+class PSANPool
+  {
+  public:
+    PSANPool() : _free(NULL), _slabs(NULL), _size(0), _perSlab(0), _capacity(0), _limit(0), _inUse(0), _highWater(0), _failures(0) {}
+
+    ~PSANPool()
+    {
+      while (_slabs)
+      {
+        struct psan_pool_slab *slab = _slabs;
+        _slabs = slab->next;
+        psan_free(slab, slab->len);
+      }
+    }
+
+    bool init(size_t size, uint32_t initial, uint32_t perSlab, uint32_t limit)
+    {
+      _size = (PSAN_MAX(size, sizeof(void *)) + 7) & ~(size_t)7;
+      _perSlab = perSlab;
+      _limit = limit;
+
+      while (_capacity < initial)
+      {
+        if (!grow())
+          return false;
+      }
+
+      return true;
+    }
+
+    void *get()
+    {
+      if (!_free && !grow())
+      {
+        _failures++;
+        return NULL;
+      }
+
+      void **object = (void **)_free;
+      _free = *object;
+
+      if (++_inUse > _highWater)
+        _highWater = _inUse;
+
+      memset(object, 0, _size);
+      return object;
+    }
+
+    void put(void *object)
+    {
+      *(void **)object = _free;
+      _free = object;
+      _inUse--;
+    }
+
+    uint32_t getAvailable() { return _limit - _inUse; }
+    uint32_t getInUse() { return _inUse; }
+    uint32_t getHighWater() { return _highWater; }
+    uint64_t getFailures() { return _failures; }
+  protected:
+    bool grow()
+    {
+      uint32_t count = PSAN_MIN(_perSlab, _limit - _capacity);
+      size_t header = (sizeof(struct psan_pool_slab) + 7) & ~(size_t)7;
+      size_t len = header + count * _size;
+
+      if (!count)
+        return false;
+
+      struct psan_pool_slab *slab = (struct psan_pool_slab *)psan_alloc(len);
+      if (!slab)
+        return false;
+
+      slab->next = _slabs;
+      slab->len = len;
+      _slabs = slab;
+
+      for (uint32_t i = 0; i < count; i++)
+      {
+        void **object = (void **)((uint8_t *)slab + header + i * _size);
+        *object = _free;
+        _free = object;
+      }
+
+      _capacity += count;
+      return true;
+    }
+
+    void *_free; /* singly linked through the first word of each free object */
+    struct psan_pool_slab *_slabs;
+    size_t _size;
+    uint32_t _perSlab;
+    uint32_t _capacity;
+    uint32_t _limit;
+    uint32_t _inUse;
+    uint32_t _highWater;
+    uint64_t _failures;
+  };
+
+#define PSANPoolGet(pool, type) ((type *)(pool).get())
+
+
+/* addresses passed around in network byte order, as in the sockaddr itself */
+static inline void psan_sockaddr_init(struct sockaddr_in *addr, in_addr_t ip, in_port_t port)
+{
+  memset(addr, 0, sizeof(*addr));
+#ifdef __APPLE__
+  addr->sin_len = sizeof(*addr);
+#endif
+  addr->sin_family = AF_INET;
+  addr->sin_port = port;
+  addr->sin_addr.s_addr = ip;
+}
+
+
+static inline bool psan_sockaddr_equal(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+  return (a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port);
+}
+
+
+/* payload memory for an I/O. prepare()/complete() bracket any access to the bytes, for hosts
+ * where that means wiring pages (IOMemoryDescriptor). they nest, and only the outermost pair reaches
+ * the host (doPrepare/doComplete), so a request pinned once up front isn't rewired around every packet.
+ */
+class PSANBuffer
+  {
+  public:
+    PSANBuffer() : _prepareCount(0), _prepares(0), _preparesSaved(0) {}
+    virtual ~PSANBuffer() {}
+
+    virtual bool isWrite() = 0;
+    virtual uint64_t getLength() = 0;
+
+    bool prepare()
+    {
+      if (_prepareCount)
+      {
+        _prepareCount++;
+        _preparesSaved++;
+        return true;
+      }
+
+      if (!doPrepare())
+        return false;
+
+      _prepareCount++;
+      _prepares++;
+      return true;
+    }
+
+    bool complete()
+    {
+      if (!_prepareCount)
+        return false;
+
+      if (--_prepareCount)
+        return true;
+
+      return doComplete();
+    }
+
+    /* host level prepares done, and nested ones that didn't need to be */
+    uint64_t getPrepares() { return _prepares; }
+    uint64_t getPreparesSaved() { return _preparesSaved; }
+
+    /* buffer -> bytes */
+    virtual uint64_t readBytes(uint64_t offset, void *bytes, uint64_t len) = 0;
+    /* bytes -> buffer */
+    virtual uint64_t writeBytes(uint64_t offset, const void *bytes, uint64_t len) = 0;
+
+    /* contiguous memory backing [offset, offset + len), so a transport can receive straight into it.
+     * NULL if the buffer can't offer that, in which case readBytes()/writeBytes() are the only way in.
+     */
+    virtual void *getBytesNoCopy(uint64_t offset, uint64_t len) { return NULL; }
+
+    /* for transports that hand getBytesNoCopy() memory to the network stack by reference rather than copying it:
+     * each reference keeps the pages pinned, and the request from being handed back to its owner, until released.
+     * false if the buffer can't be referenced that way, in which case copy. releasePages() may be called from any thread.
+     */
+    virtual bool retainPages() { return false; }
+    virtual void releasePages() {}
+  protected:
+    virtual bool doPrepare() { return true; }
+    virtual bool doComplete() { return true; }
+
+    uint32_t _prepareCount;
+    uint64_t _prepares;
+    uint64_t _preparesSaved;
+  };
+
+
+/* contiguous buffer allocated by the engine itself (disk/partition queries), or used directly by userspace */
+class PSANFlatBuffer : public PSANBuffer
+  {
+  public:
+    PSANFlatBuffer(void *bytes, uint64_t len, bool isWrite) : _bytes((uint8_t *)bytes), _len(len), _isWrite(isWrite), _owned(false) {}
+
+    PSANFlatBuffer(uint64_t len, bool isWrite) : _len(len), _isWrite(isWrite), _owned(true)
+    {
+      _bytes = (uint8_t *)psan_alloc_zero(len);
+    }
+
+    /* an owned buffer for IO the device starts itself, which can do without: NULL rather than a panic */
+    static PSANFlatBuffer *tryAlloc(uint64_t len, bool isWrite)
+    {
+      void *bytes = psan_try_alloc_zero(len);
+      if (!bytes)
+        return NULL;
+
+      PSANFlatBuffer *buffer = new PSANFlatBuffer(bytes, len, isWrite);
+      if (!buffer)
+      {
+        psan_free(bytes, len);
+        return NULL;
+      }
+
+      buffer->_owned = true;
+      return buffer;
+    }
+
+    virtual ~PSANFlatBuffer()
+    {
+      if (_owned)
+        psan_free(_bytes, _len);
+    }
+
+    virtual bool isWrite() { return _isWrite; }
+    virtual uint64_t getLength() { return _len; }
+
+    virtual uint64_t readBytes(uint64_t offset, void *bytes, uint64_t len)
+    {
+      if (offset >= _len)
+        return 0;
+      len = PSAN_MIN(len, _len - offset);
+      memcpy(bytes, _bytes + offset, len);
+      return len;
+    }
+
+    virtual uint64_t writeBytes(uint64_t offset, const void *bytes, uint64_t len)
+    {
+      if (offset >= _len)
+        return 0;
+      len = PSAN_MIN(len, _len - offset);
+      memcpy(_bytes + offset, bytes, len);
+      return len;
+    }
+
+    virtual void *getBytesNoCopy(uint64_t offset, uint64_t len)
+    {
+      return (offset <= _len && len <= _len - offset ? _bytes + offset : NULL);
+    }
+
+    void *getBytesNoCopy() { return _bytes; }
+  protected:
+    uint8_t *_bytes;
+    uint64_t _len;
+    bool _isWrite;
+    bool _owned;
+  };
+
+
+/* a received datagram. only valid for the duration of the PSANEngine::handlePacket() call. */
+class PSANPacket
+  {
+  public:
+    virtual ~PSANPacket() {}
+
+    virtual size_t getLength() = 0;
+    /* make the first len bytes contiguous and return them, NULL if the packet is too short */
+    virtual void *pullup(size_t len) = 0;
+    /* copy len bytes starting at packetOffset into buffer at bufferOffset */
+    virtual bool copyToBuffer(PSANBuffer *buffer, uint64_t bufferOffset, size_t packetOffset, size_t len) = 0;
+    /* true if the transport already received those bytes into buffer at bufferOffset (see
+     * PSANEngine::getPayloadPlacement), making copyToBuffer() a no-op
+     */
+    virtual bool isPlaced(PSANBuffer *buffer, uint64_t bufferOffset, size_t packetOffset, size_t len) { return false; }
+  };
+
+
+class PSANFlatPacket : public PSANPacket
+  {
+  public:
+    PSANFlatPacket(void *bytes, size_t len) : _bytes((uint8_t *)bytes), _len(len) {}
+
+    virtual size_t getLength() { return _len; }
+
+    virtual void *pullup(size_t len)
+    {
+      return (len <= _len ? _bytes : NULL);
+    }
+
+    virtual bool copyToBuffer(PSANBuffer *buffer, uint64_t bufferOffset, size_t packetOffset, size_t len)
+    {
+      if (packetOffset + len > _len)
+        return false;
+
+      if (!buffer->prepare())
+        return false;
+
+      uint64_t wrote = buffer->writeBytes(bufferOffset, _bytes + packetOffset, len);
+
+      if (!buffer->complete())
+        return false;
+
+      return (wrote == len);
+    }
+  protected:
+    uint8_t *_bytes;
+    size_t _len;
+  };
+
+
+struct psan_transport_stats {
+  uint64_t sendFailures;
+  uint64_t packetRingMisses;    /* packets that had to be allocated on the spot, the preallocated ones having run out */
+  uint64_t packetRingExhausted; /* ...and couldn't be, without blocking */
+  uint64_t handoffs;      /* responses received for another workloop and queued for it */
+  uint64_t handoffDrops;  /* ...that didn't fit in its queue */
+  uint64_t flowSockets;   /* connected sockets open, see FLOW_SOCKETS */
+  uint64_t flowFailures;  /* ...that couldn't be opened, their unit staying on the shared socket */
+};
+
+
+/* how the engine reaches the network and the clock. all engine entry points (handlePacket,
+ * timeoutOccurred, device submission) must be serialized by the host, e.g. on a workloop.
+ */
+class PSANTransport
+  {
+  public:
+    PSANTransport() { memset(&_transportStats, 0, sizeof(_transportStats)); }
+    virtual ~PSANTransport() {}
+
+    /* send header followed by payloadLen bytes of payload starting at payloadOffset (payload may be NULL).
+     * anyPeer means the response may come from an address other than dest, so it can't use a connected socket.
+     */
+    virtual bool sendPacket(const struct sockaddr_in *dest, const void *header, size_t headerLen,
+                            PSANBuffer *payload, uint64_t payloadOffset, size_t payloadLen, bool anyPeer) = 0;
+
+    /* call PSANEngine::timeoutOccurred() at (or shortly after) deadline, in psan_uptime_ns() units */
+    virtual void setTimer(uint64_t deadline) = 0;
+    virtual void cancelTimer() = 0;
+
+    const struct psan_transport_stats *getTransportStatistics() { return &_transportStats; }
+  protected:
+    struct psan_transport_stats _transportStats;
+  };
+
+#endif /* __PSAN_PLATFORM_H__ */
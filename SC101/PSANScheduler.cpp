@@ -0,0 +1,263 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PSANScheduler.h"
+
+
+static const char *gPSANSchedPolicies[PSAN_SCHED_POLICIES] = { "fifo", "deadline", "elevator" };
+
+
+PSANIOScheduler::PSANIOScheduler()
+{
+  memset(&_params, 0, sizeof(_params));
+  memset(&_stats, 0, sizeof(_stats));
+
+  for (int i = 0; i < 2; i++)
+  {
+    TAILQ_INIT(&_fifo[i]);
+    TAILQ_INIT(&_sorted[i]);
+    _count[i] = 0;
+    _position[i] = 0;
+  }
+
+  _ticket = 0;
+  _sweep = 0;
+  _writesPassed = 0;
+}
+
+
+const char *PSANIOScheduler::policyName(uint32_t policy)
+{
+  return (policy < PSAN_SCHED_POLICIES ? gPSANSchedPolicies[policy] : "unknown");
+}
+
+
+int PSANIOScheduler::policyNamed(const char *name)
+{
+  for (int i = 0; i < PSAN_SCHED_POLICIES; i++)
+  {
+    if (!strcmp(name, gPSANSchedPolicies[i]))
+      return i;
+  }
+
+  return -1;
+}
+
+
+void PSANIOScheduler::setParams(const struct psan_sched_params *params)
+{
+  _params = *params;
+
+  if (_params.policy >= PSAN_SCHED_POLICIES)
+    _params.policy = PSAN_SCHED_FIFO;
+
+  _writesPassed = 0;
+}
+
+
+void PSANIOScheduler::enqueue(struct psan_sched_entry *e, uint64_t now)
+{
+  struct psan_sched_entry *prev;
+
+  e->queued = now;
+  e->ticket = _ticket++;
+
+  TAILQ_INSERT_TAIL(&_fifo[e->isWrite], e, fifo);
+
+  /* most IOs carry on from one queued just before them, so look from the end */
+  prev = TAILQ_LAST(&_sorted[e->isWrite], psanSchedQueue);
+  while (prev && prev->block > e->block)
+    prev = TAILQ_PREV(prev, psanSchedQueue, sorted);
+
+  if (prev)
+    TAILQ_INSERT_AFTER(&_sorted[e->isWrite], prev, e, sorted);
+  else
+    TAILQ_INSERT_HEAD(&_sorted[e->isWrite], e, sorted);
+
+  _count[e->isWrite]++;
+}
+
+
+struct psan_sched_entry *PSANIOScheduler::dequeue(const uint32_t inFlight[2], uint64_t now)
+{
+  struct psan_sched_entry *e;
+  bool eligible[2];
+
+  for (int i = 0; i < 2; i++)
+    eligible[i] = (_count[i] && !atDepth(i, inFlight[i]));
+
+  if (!eligible[false] && !eligible[true])
+    return NULL;
+
+  switch (_params.policy)
+  {
+    case PSAN_SCHED_DEADLINE:
+      e = deadline(eligible, now);
+      break;
+    case PSAN_SCHED_ELEVATOR:
+      e = elevator(eligible, now);
+      break;
+    default:
+      e = oldest(eligible);
+      break;
+  }
+
+  remove(e, now);
+
+  return e;
+}
+
+
+struct psan_sched_entry *PSANIOScheduler::find(bool isWrite, uint32_t block)
+{
+  struct psan_sched_entry *e;
+
+  TAILQ_FOREACH(e, &_sorted[isWrite], sorted)
+  {
+    if (e->block >= block)
+      return (e->block == block ? e : NULL);
+  }
+
+  return NULL;
+}
+
+
+struct psan_sched_entry *PSANIOScheduler::findNext(struct psan_sched_entry *e)
+{
+  struct psan_sched_entry *next = TAILQ_NEXT(e, sorted);
+
+  return (next && next->block == e->block ? next : NULL);
+}
+
+
+void PSANIOScheduler::remove(struct psan_sched_entry *e, uint64_t now)
+{
+  uint64_t wait = now - e->queued;
+
+  TAILQ_REMOVE(&_fifo[e->isWrite], e, fifo);
+  TAILQ_REMOVE(&_sorted[e->isWrite], e, sorted);
+  _count[e->isWrite]--;
+
+  _stats.queued[e->isWrite]++;
+  _stats.waitTotal[e->isWrite] += wait;
+  _stats.waitMax[e->isWrite] = PSAN_MAX(_stats.waitMax[e->isWrite], wait);
+}
+
+
+bool PSANIOScheduler::expired(struct psan_sched_entry *e, uint64_t now)
+{
+  uint32_t deadlineMS = _params.deadlineMS[e->isWrite];
+
+  return (deadlineMS && now - e->queued >= deadlineMS * NSEC_PER_MSEC);
+}
+
+
+/* the longest waiting entry in the eligible directions */
+struct psan_sched_entry *PSANIOScheduler::oldest(const bool eligible[2])
+{
+  struct psan_sched_entry *read = (eligible[false] ? TAILQ_FIRST(&_fifo[false]) : NULL);
+  struct psan_sched_entry *write = (eligible[true] ? TAILQ_FIRST(&_fifo[true]) : NULL);
+
+  if (!read || (write && write->ticket < read->ticket))
+    return write;
+
+  return read;
+}
+
+
+/* the first entry in the direction at or past position, NULL if the sweep has to start over */
+struct psan_sched_entry *PSANIOScheduler::ahead(bool isWrite, uint32_t position)
+{
+  struct psan_sched_entry *e;
+
+  TAILQ_FOREACH(e, &_sorted[isWrite], sorted)
+  {
+    if (e->block >= position)
+      return e;
+  }
+
+  return NULL;
+}
+
+
+/* pick a direction, reads unless writes have been passed over for too long or only theirs have expired, then the
+ * direction's oldest entry if it has expired, or the next one along its sweep
+ */
+struct psan_sched_entry *PSANIOScheduler::deadline(const bool eligible[2], uint64_t now)
+{
+  struct psan_sched_entry *e;
+  bool isWrite = !eligible[false];
+
+  if (eligible[false] && eligible[true])
+  {
+    if (_params.writeStarve && _writesPassed >= _params.writeStarve)
+    {
+      isWrite = true;
+      _stats.starved++;
+    }
+    else if (expired(TAILQ_FIRST(&_fifo[true]), now) && !expired(TAILQ_FIRST(&_fifo[false]), now))
+    {
+      isWrite = true;
+    }
+  }
+
+  e = TAILQ_FIRST(&_fifo[isWrite]);
+
+  if (expired(e, now))
+    _stats.expired++;
+  else if (!(e = ahead(isWrite, _position[isWrite])))
+    e = TAILQ_FIRST(&_sorted[isWrite]);
+
+  if (isWrite)
+    _writesPassed = 0;
+  else if (eligible[true])
+    _writesPassed++;
+
+  _position[isWrite] = e->block + e->nblks;
+
+  return e;
+}
+
+
+/* the oldest entry if it has expired, otherwise the next one along the sweep in either direction */
+struct psan_sched_entry *PSANIOScheduler::elevator(const bool eligible[2], uint64_t now)
+{
+  struct psan_sched_entry *e = oldest(eligible);
+
+  if (expired(e, now))
+  {
+    _stats.expired++;
+  }
+  else
+  {
+    struct psan_sched_entry *read = (eligible[false] ? ahead(false, _sweep) : NULL);
+    struct psan_sched_entry *write = (eligible[true] ? ahead(true, _sweep) : NULL);
+
+    if (!read && !write)
+    {
+      read = (eligible[false] ? TAILQ_FIRST(&_sorted[false]) : NULL);
+      write = (eligible[true] ? TAILQ_FIRST(&_sorted[true]) : NULL);
+    }
+
+    e = (!read || (write && write->block < read->block) ? write : read);
+  }
+
+  _sweep = e->block + e->nblks;
+
+  return e;
+}
@@ -0,0 +1,120 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_SCHEDULER_H__
+#define __PSAN_SCHEDULER_H__
+
+#include "PSANPlatform.h"
+
+/* policies, see PSANIOScheduler */
+#define PSAN_SCHED_FIFO (0)
+#define PSAN_SCHED_DEADLINE (1)
+#define PSAN_SCHED_ELEVATOR (2)
+#define PSAN_SCHED_POLICIES (3)
+
+
+/* embedded in whatever the owner queues */
+struct psan_sched_entry {
+  void *owner;      /* what's being queued, for the owner to get back to */
+  uint32_t block;
+  uint32_t nblks;
+  bool isWrite;
+  uint64_t queued;  /* psan_uptime_ns() when it was queued */
+  uint64_t ticket;  /* arrival order */
+
+  TAILQ_ENTRY(psan_sched_entry) fifo;   /* in its direction's queue, oldest first */
+  TAILQ_ENTRY(psan_sched_entry) sorted; /* ...and by block, oldest first among equals */
+};
+
+TAILQ_HEAD(psanSchedQueue, psan_sched_entry);
+
+
+/* indexed [isWrite] */
+struct psan_sched_params {
+  uint32_t policy;
+  uint32_t deadlineMS[2]; /* queued this long, an IO goes next. 0 for no deadline */
+  uint32_t depth[2];      /* most IOs in flight in the direction, 0 for as many as the window allows */
+  uint32_t writeStarve;   /* deadline: reads sent ahead of waiting writes before one of them has to go. 0 for no limit */
+};
+
+struct psan_sched_stats {
+  uint64_t queued[2];     /* IOs that had to wait */
+  uint64_t waitTotal[2];  /* ns they waited, in total */
+  uint64_t waitMax[2];
+  uint64_t expired;       /* IOs sent out of order because their deadline had passed */
+  uint64_t starved;       /* writes sent ahead of reads after writeStarve */
+};
+
+
+/* orders the IOs waiting for room in a device's window:
+ *
+ *   FIFO      in arrival order.
+ *   DEADLINE  reads before writes, each direction swept in block order, unless the oldest IO of a direction has waited
+ *             out its deadline or writeStarve reads have gone ahead of waiting writes.
+ *   ELEVATOR  one ascending sweep over the blocks, reads and writes alike, unless the oldest IO has waited out its
+ *             deadline.
+ *
+ * each direction can be limited to fewer IOs in flight than the window, so reads always find room next to a stream of
+ * writes (or the other way round). the owner keeps count of what's in flight.
+ */
+class PSANIOScheduler
+  {
+  public:
+    PSANIOScheduler();
+
+    /* the policy's name ("fifo", "deadline", "elevator") and back, -1 for an unknown name */
+    static const char *policyName(uint32_t policy);
+    static int policyNamed(const char *name);
+
+    /* may be changed with IOs queued, they're taken in the new order from then on */
+    void setParams(const struct psan_sched_params *params);
+    const struct psan_sched_params *getParams() { return &_params; }
+    const struct psan_sched_stats *getStatistics() { return &_stats; }
+    uint32_t getCount() { return _count[0] + _count[1]; }
+    /* an IO in this direction has to be queued rather than sent, given inFlight of them already are */
+    bool atDepth(bool isWrite, uint32_t inFlight) { return (_params.depth[isWrite] && inFlight >= _params.depth[isWrite]); }
+
+    void enqueue(struct psan_sched_entry *e, uint64_t now);
+    /* the entry to send next, given inFlight[isWrite] already in flight, and take it off the queue. NULL if none can go */
+    struct psan_sched_entry *dequeue(const uint32_t inFlight[2], uint64_t now);
+    /* the queued entries in the direction starting at block, oldest first */
+    struct psan_sched_entry *find(bool isWrite, uint32_t block);
+    struct psan_sched_entry *findNext(struct psan_sched_entry *e);
+    /* take an entry off the queue out of turn, e.g. to go out with the one dequeued */
+    void remove(struct psan_sched_entry *e, uint64_t now);
+  protected:
+    bool expired(struct psan_sched_entry *e, uint64_t now);
+    struct psan_sched_entry *oldest(const bool eligible[2]);
+    struct psan_sched_entry *ahead(bool isWrite, uint32_t position);
+    struct psan_sched_entry *deadline(const bool eligible[2], uint64_t now);
+    struct psan_sched_entry *elevator(const bool eligible[2], uint64_t now);
+
+    struct psan_sched_params _params;
+    struct psan_sched_stats _stats;
+
+    struct psanSchedQueue _fifo[2];
+    struct psanSchedQueue _sorted[2];
+    uint32_t _count[2];
+    uint64_t _ticket;
+
+    uint32_t _position[2];  /* where each direction's sweep has got to (deadline) */
+    uint32_t _sweep;        /* ...and the one shared sweep (elevator) */
+    uint32_t _writesPassed; /* reads sent since the last write while writes were waiting */
+  };
+
+#endif /* __PSAN_SCHEDULER_H__ */
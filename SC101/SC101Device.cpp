@@ -16,25 +16,134 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-#import <IOKit/IOBufferMemoryDescriptor.h>
 #import <IOKit/IOKitKeys.h>
+#import <IOKit/storage/IOMedia.h>
 
 #import "SC101Device.h"
 
 extern "C" {
 #import <netinet/in.h>
+#import <libkern/OSAtomic.h>
 #import "psan_wireformat.h"
 };
 
 static const OSSymbol *gSC101DeviceIDKey;
 static const OSSymbol *gSC101DeviceIOMaxReadSizeKey;
 static const OSSymbol *gSC101DeviceIOMaxWriteSizeKey;
+static const OSSymbol *gSC101DeviceIOSizeProbingKey;
+static const OSSymbol *gSC101DeviceIOReadSizeKey;
+static const OSSymbol *gSC101DeviceIOWriteSizeKey;
+static const OSSymbol *gSC101DeviceRetransmitMinKey;
+static const OSSymbol *gSC101DeviceRetransmitMaxKey;
+static const OSSymbol *gSC101DeviceCacheSizeKey;
+static const OSSymbol *gSC101DeviceCacheLineSizeKey;
+static const OSSymbol *gSC101DeviceWriteBackKey;
+static const OSSymbol *gSC101DeviceSchedulerKey;
+static const OSSymbol *gSC101DeviceReadDeadlineKey;
+static const OSSymbol *gSC101DeviceWriteDeadlineKey;
+static const OSSymbol *gSC101DeviceReadDepthKey;
+static const OSSymbol *gSC101DeviceWriteDepthKey;
+static const OSSymbol *gSC101DeviceHedgeBudgetKey;
+static const OSSymbol *gSC101DeviceHedgePercentileKey;
 static const OSSymbol *gSC101DevicePartitionAddressKey;
 static const OSSymbol *gSC101DeviceRootAddressKey;
 static const OSSymbol *gSC101DevicePartNumberKey;
 static const OSSymbol *gSC101DeviceVersionKey;
 static const OSSymbol *gSC101DeviceLabelKey;
 static const OSSymbol *gSC101DeviceSizeKey;
+static const OSSymbol *gSC101DeviceStatisticsKey;
+static const OSSymbol *gSC101DeviceShardKey;
+
+// PSANDevice counters published in the Statistics dictionary
+static const struct {
+  const char *key;
+  size_t offset;
+} gSC101DeviceStatistics[] = {
+  { kSC101DeviceIOWindowKey, offsetof(struct psan_device_stats, ioWindow) },
+  { kSC101DeviceIOWindowMaxKey, offsetof(struct psan_device_stats, ioWindowMax) },
+  { kSC101DeviceIOWindowReductionsKey, offsetof(struct psan_device_stats, ioWindowReductions) },
+  { kSC101DeviceTimeoutsKey, offsetof(struct psan_device_stats, timeouts) },
+  { kSC101DeviceLateResponsesKey, offsetof(struct psan_device_stats, lateResponses) },
+  { kSC101DeviceLateWaitKey, offsetof(struct psan_device_stats, lateWait) },
+  { kSC101DeviceLateWaitMaxKey, offsetof(struct psan_device_stats, lateWaitMax) },
+  { kSC101DeviceErrorsKey, offsetof(struct psan_device_stats, errors) },
+  { kSC101DeviceReadBytesKey, offsetof(struct psan_device_stats, readBytes) },
+  { kSC101DeviceReadBytesCopiedKey, offsetof(struct psan_device_stats, readBytesCopied) },
+  { kSC101DevicePreparesKey, offsetof(struct psan_device_stats, prepares) },
+  { kSC101DevicePreparesSavedKey, offsetof(struct psan_device_stats, preparesSaved) },
+  { kSC101DeviceRequestPoolHighWaterKey, offsetof(struct psan_device_stats, requestPoolHighWater) },
+  { kSC101DeviceIOPoolHighWaterKey, offsetof(struct psan_device_stats, ioPoolHighWater) },
+  { kSC101DeviceDeblockPoolHighWaterKey, offsetof(struct psan_device_stats, deblockPoolHighWater) },
+  { kSC101DeviceCarrierPoolHighWaterKey, offsetof(struct psan_device_stats, carrierPoolHighWater) },
+  { kSC101DevicePoolWaitsKey, offsetof(struct psan_device_stats, poolWaits) },
+  { kSC101DevicePoolExhaustedKey, offsetof(struct psan_device_stats, poolExhausted) },
+  { kSC101DeviceReadAheadHitsKey, offsetof(struct psan_device_stats, readAheadHits) },
+  { kSC101DeviceReadAheadMissesKey, offsetof(struct psan_device_stats, readAheadMisses) },
+  { kSC101DeviceReadAheadBytesKey, offsetof(struct psan_device_stats, readAheadBytes) },
+  { kSC101DeviceReadAheadWastedKey, offsetof(struct psan_device_stats, readAheadWasted) },
+  { kSC101DeviceCacheHitsKey, offsetof(struct psan_device_stats, cacheHits) },
+  { kSC101DeviceCacheMissesKey, offsetof(struct psan_device_stats, cacheMisses) },
+  { kSC101DeviceCacheCoalescedKey, offsetof(struct psan_device_stats, cacheCoalesced) },
+  { kSC101DeviceCacheEvictionsKey, offsetof(struct psan_device_stats, cacheEvictions) },
+  { kSC101DeviceWriteBackBytesKey, offsetof(struct psan_device_stats, writeBackBytes) },
+  { kSC101DeviceWriteBackFlushesKey, offsetof(struct psan_device_stats, writeBackFlushes) },
+  { kSC101DeviceWriteBackFlushBytesKey, offsetof(struct psan_device_stats, writeBackFlushBytes) },
+  { kSC101DeviceWriteBackErrorsKey, offsetof(struct psan_device_stats, writeBackErrors) },
+  { kSC101DeviceWriteBackReadHitsKey, offsetof(struct psan_device_stats, writeBackReadHits) },
+  { kSC101DeviceWriteBackReadMergesKey, offsetof(struct psan_device_stats, writeBackReadMerges) },
+  { kSC101DeviceSyncsKey, offsetof(struct psan_device_stats, syncs) },
+  { kSC101DeviceCoalescedWritesKey, offsetof(struct psan_device_stats, coalescedWrites) },
+  { kSC101DeviceCoalescedPutsKey, offsetof(struct psan_device_stats, coalescedPuts) },
+  { kSC101DeviceCoalescedReadsKey, offsetof(struct psan_device_stats, coalescedReads) },
+  { kSC101DeviceCoalescedGetsKey, offsetof(struct psan_device_stats, coalescedGets) },
+  { kSC101DeviceOverReadsKey, offsetof(struct psan_device_stats, overReads) },
+  { kSC101DeviceOverReadBytesKey, offsetof(struct psan_device_stats, overReadBytes) },
+  { kSC101DeviceQueuedReadsKey, offsetof(struct psan_device_stats, queuedReads) },
+  { kSC101DeviceQueuedWritesKey, offsetof(struct psan_device_stats, queuedWrites) },
+  { kSC101DeviceQueueWaitReadsKey, offsetof(struct psan_device_stats, queueWaitReads) },
+  { kSC101DeviceQueueWaitWritesKey, offsetof(struct psan_device_stats, queueWaitWrites) },
+  { kSC101DeviceQueueWaitMaxReadKey, offsetof(struct psan_device_stats, queueWaitMaxRead) },
+  { kSC101DeviceQueueWaitMaxWriteKey, offsetof(struct psan_device_stats, queueWaitMaxWrite) },
+  { kSC101DeviceQueueExpiredKey, offsetof(struct psan_device_stats, queueExpired) },
+  { kSC101DeviceQueueWritesStarvedKey, offsetof(struct psan_device_stats, queueWritesStarved) },
+  { kSC101DeviceIOReadLimitKey, offsetof(struct psan_device_stats, ioReadLimit) },
+  { kSC101DeviceIOWriteLimitKey, offsetof(struct psan_device_stats, ioWriteLimit) },
+  { kSC101DeviceIOSizeTrialsKey, offsetof(struct psan_device_stats, ioSizeTrials) },
+  { kSC101DeviceIOSizeRaisesKey, offsetof(struct psan_device_stats, ioSizeRaises) },
+  { kSC101DeviceIOSizeFallbacksKey, offsetof(struct psan_device_stats, ioSizeFallbacks) },
+  { kSC101DeviceIOResplitsKey, offsetof(struct psan_device_stats, ioResplits) },
+  { kSC101DeviceHedgesFiredKey, offsetof(struct psan_device_stats, hedgesFired) },
+  { kSC101DeviceHedgesWonKey, offsetof(struct psan_device_stats, hedgesWon) },
+  { kSC101DeviceHedgesDeniedKey, offsetof(struct psan_device_stats, hedgesDenied) },
+};
+
+#define STATISTICS_COUNT (sizeof(gSC101DeviceStatistics) / sizeof(gSC101DeviceStatistics[0]))
+
+// a synchronize() waiting on the gate for PSANDevice to finish
+struct sync_state {
+  bool done;
+  int status;
+};
+
+
+static IOReturn psanStatusToIOReturn(int status)
+{
+  switch (status)
+  {
+    case 0:
+      return kIOReturnSuccess;
+    case ETIMEDOUT:
+      return kIOReturnNotResponding;
+    case ENXIO:
+      return kIOReturnNoDevice;
+    case ENOMEM:
+      return kIOReturnNoMemory;
+    case EBUSY:
+      return kIOReturnBusy;
+    default:
+      return kIOReturnError;
+  }
+}
 
 // Define my superclass
 #define super IOBlockStorageDevice
@@ -45,17 +154,6 @@ static const OSSymbol *gSC101DeviceSizeKey;
 OSDefineMetaClassAndStructors(net_habitue_device_SC101, IOBlockStorageDevice)
 
 
-static void *IOMallocZero(int len)
-{
-  void *buf = IOMalloc(len);
-  if (!buf)
-    panic("alloc failed");
-  bzero(buf, len);
-  return buf;
-}
-#define IONewZero(type, number) (type*)IOMallocZero(sizeof(type) * (number))
-
-
 /**********************************************************************************************************************************/
 #pragma mark IOService stubs
 /**********************************************************************************************************************************/
@@ -67,12 +165,29 @@ bool net_habitue_device_SC101::init(OSDictionary *properties)
   gSC101DeviceIDKey = OSSymbol::withCString(kSC101DeviceIDKey);
   gSC101DeviceIOMaxReadSizeKey = OSSymbol::withCString(kSC101DeviceIOMaxReadSizeKey);
   gSC101DeviceIOMaxWriteSizeKey = OSSymbol::withCString(kSC101DeviceIOMaxWriteSizeKey);
+  gSC101DeviceIOSizeProbingKey = OSSymbol::withCString(kSC101DeviceIOSizeProbingKey);
+  gSC101DeviceIOReadSizeKey = OSSymbol::withCString(kSC101DeviceIOReadSizeKey);
+  gSC101DeviceIOWriteSizeKey = OSSymbol::withCString(kSC101DeviceIOWriteSizeKey);
+  gSC101DeviceRetransmitMinKey = OSSymbol::withCString(kSC101DeviceRetransmitMinKey);
+  gSC101DeviceRetransmitMaxKey = OSSymbol::withCString(kSC101DeviceRetransmitMaxKey);
+  gSC101DeviceCacheSizeKey = OSSymbol::withCString(kSC101DeviceCacheSizeKey);
+  gSC101DeviceCacheLineSizeKey = OSSymbol::withCString(kSC101DeviceCacheLineSizeKey);
+  gSC101DeviceWriteBackKey = OSSymbol::withCString(kSC101DeviceWriteBackKey);
+  gSC101DeviceSchedulerKey = OSSymbol::withCString(kSC101DeviceSchedulerKey);
+  gSC101DeviceReadDeadlineKey = OSSymbol::withCString(kSC101DeviceReadDeadlineKey);
+  gSC101DeviceWriteDeadlineKey = OSSymbol::withCString(kSC101DeviceWriteDeadlineKey);
+  gSC101DeviceReadDepthKey = OSSymbol::withCString(kSC101DeviceReadDepthKey);
+  gSC101DeviceWriteDepthKey = OSSymbol::withCString(kSC101DeviceWriteDepthKey);
+  gSC101DeviceHedgeBudgetKey = OSSymbol::withCString(kSC101DeviceHedgeBudgetKey);
+  gSC101DeviceHedgePercentileKey = OSSymbol::withCString(kSC101DeviceHedgePercentileKey);
   gSC101DevicePartitionAddressKey = OSSymbol::withCString(kSC101DevicePartitionAddressKey);
   gSC101DeviceRootAddressKey = OSSymbol::withCString(kSC101DeviceRootAddressKey);
   gSC101DevicePartNumberKey = OSSymbol::withCString(kSC101DevicePartNumberKey);
   gSC101DeviceVersionKey = OSSymbol::withCString(kSC101DeviceVersionKey);
   gSC101DeviceLabelKey = OSSymbol::withCString(kSC101DeviceLabelKey);
   gSC101DeviceSizeKey = OSSymbol::withCString(kSC101DeviceSizeKey);
+  gSC101DeviceStatisticsKey = OSSymbol::withCString(kSC101DeviceStatisticsKey);
+  gSC101DeviceShardKey = OSSymbol::withCString(kSC101DeviceShardKey);
   
   OSString *id = OSDynamicCast(OSString, properties->getObject(gSC101DeviceIDKey));
   if (!id)
@@ -113,22 +228,214 @@ bool net_habitue_device_SC101::init(OSDictionary *properties)
     }
   }
   
-  nanoseconds_to_absolutetime(1000000000ULL * 60, &_resolveInterval);
+  if (!OSDynamicCast(OSBoolean, properties->getObject(gSC101DeviceIOSizeProbingKey)))
+    setProperty(gSC101DeviceIOSizeProbingKey, (IO_SIZE_PROBING ? kOSBooleanTrue : kOSBooleanFalse));
+  
+  OSNumber *retransmitMin = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceRetransmitMinKey));
+  OSNumber *retransmitMax = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceRetransmitMaxKey));
+  
+  if (!retransmitMin || !retransmitMax ||
+      retransmitMin->unsigned32BitValue() < 1 ||
+      retransmitMin->unsigned32BitValue() > retransmitMax->unsigned32BitValue())
+  {
+    retransmitMin = OSNumber::withNumber(RTO_MIN_MS, 32);
+    retransmitMax = OSNumber::withNumber(RTO_MAX_MS, 32);
+    
+    if (retransmitMin && retransmitMax)
+    {
+      setProperty(gSC101DeviceRetransmitMinKey, retransmitMin);
+      setProperty(gSC101DeviceRetransmitMaxKey, retransmitMax);
+    }
+    
+    if (retransmitMin)
+      retransmitMin->release();
+    if (retransmitMax)
+      retransmitMax->release();
+  }
+  
+  OSNumber *cacheSize = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceCacheSizeKey));
+  OSNumber *cacheLineSize = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceCacheLineSizeKey));
+  
+  if (cacheSize && cacheSize->unsigned64BitValue() > CACHE_SIZE_MAX)
+  {
+    cacheSize = OSNumber::withNumber(CACHE_SIZE_MAX, 64);
+    
+    if (cacheSize)
+    {
+      setProperty(gSC101DeviceCacheSizeKey, cacheSize);
+      cacheSize->release();
+      cacheSize = OSDynamicCast(OSNumber, getProperty(gSC101DeviceCacheSizeKey));
+    }
+  }
+  
+  if (!cacheSize || !cacheLineSize ||
+      cacheLineSize->unsigned32BitValue() < CACHE_LINE_MIN ||
+      cacheLineSize->unsigned32BitValue() > CACHE_LINE_MAX ||
+      cacheLineSize->unsigned32BitValue() & (cacheLineSize->unsigned32BitValue() - 1))
+  {
+    cacheSize = OSNumber::withNumber(cacheSize ? cacheSize->unsigned64BitValue() : CACHE_SIZE, 64);
+    cacheLineSize = OSNumber::withNumber(CACHE_LINE_SIZE, 32);
+    
+    if (cacheSize && cacheLineSize)
+    {
+      setProperty(gSC101DeviceCacheSizeKey, cacheSize);
+      setProperty(gSC101DeviceCacheLineSizeKey, cacheLineSize);
+    }
+    
+    if (cacheSize)
+      cacheSize->release();
+    if (cacheLineSize)
+      cacheLineSize->release();
+  }
+  
+  if (!OSDynamicCast(OSBoolean, properties->getObject(gSC101DeviceWriteBackKey)))
+    setProperty(gSC101DeviceWriteBackKey, (WRITEBACK_DEFAULT ? kOSBooleanTrue : kOSBooleanFalse));
+  
+  OSString *scheduler = OSDynamicCast(OSString, properties->getObject(gSC101DeviceSchedulerKey));
+  
+  if (!scheduler || PSANIOScheduler::policyNamed(scheduler->getCStringNoCopy()) < 0)
+  {
+    scheduler = OSString::withCString(SCHED_POLICY);
+    
+    if (scheduler)
+    {
+      setProperty(gSC101DeviceSchedulerKey, scheduler);
+      scheduler->release();
+    }
+  }
+  
+  OSNumber *readDeadline = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceReadDeadlineKey));
+  OSNumber *writeDeadline = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceWriteDeadlineKey));
+  
+  if (!readDeadline || !writeDeadline)
+  {
+    readDeadline = OSNumber::withNumber(readDeadline ? readDeadline->unsigned32BitValue() : SCHED_READ_DEADLINE_MS, 32);
+    writeDeadline = OSNumber::withNumber(writeDeadline ? writeDeadline->unsigned32BitValue() : SCHED_WRITE_DEADLINE_MS, 32);
+    
+    if (readDeadline && writeDeadline)
+    {
+      setProperty(gSC101DeviceReadDeadlineKey, readDeadline);
+      setProperty(gSC101DeviceWriteDeadlineKey, writeDeadline);
+    }
+    
+    if (readDeadline)
+      readDeadline->release();
+    if (writeDeadline)
+      writeDeadline->release();
+  }
+  
+  OSNumber *readDepth = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceReadDepthKey));
+  OSNumber *writeDepth = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceWriteDepthKey));
+  
+  if (!readDepth || !writeDepth)
+  {
+    readDepth = OSNumber::withNumber(readDepth ? readDepth->unsigned32BitValue() : SCHED_READ_DEPTH, 32);
+    writeDepth = OSNumber::withNumber(writeDepth ? writeDepth->unsigned32BitValue() : SCHED_WRITE_DEPTH, 32);
+    
+    if (readDepth && writeDepth)
+    {
+      setProperty(gSC101DeviceReadDepthKey, readDepth);
+      setProperty(gSC101DeviceWriteDepthKey, writeDepth);
+    }
+    
+    if (readDepth)
+      readDepth->release();
+    if (writeDepth)
+      writeDepth->release();
+  }
+  
+  OSNumber *hedgeBudget = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceHedgeBudgetKey));
+  OSNumber *hedgePercentile = OSDynamicCast(OSNumber, properties->getObject(gSC101DeviceHedgePercentileKey));
+  
+  if (!hedgeBudget || !hedgePercentile ||
+      hedgeBudget->unsigned32BitValue() > 100 ||
+      hedgePercentile->unsigned32BitValue() < 1 ||
+      hedgePercentile->unsigned32BitValue() > 99)
+  {
+    hedgeBudget = OSNumber::withNumber(hedgeBudget && hedgeBudget->unsigned32BitValue() <= 100 ?
+                                       hedgeBudget->unsigned32BitValue() : HEDGE_BUDGET_PERCENT, 32);
+    hedgePercentile = OSNumber::withNumber(HEDGE_PERCENTILE, 32);
+    
+    if (hedgeBudget && hedgePercentile)
+    {
+      setProperty(gSC101DeviceHedgeBudgetKey, hedgeBudget);
+      setProperty(gSC101DeviceHedgePercentileKey, hedgePercentile);
+    }
+    
+    if (hedgeBudget)
+      hedgeBudget->release();
+    if (hedgePercentile)
+      hedgePercentile->release();
+  }
   
   _mediaStateAttached = false;
   _mediaStateChanged = true;
+  _claimed = 0;
   
-  STAILQ_INIT(&_pendingHead);
-  _pendingCount = 0;
-  STAILQ_INIT(&_outstandingHead);
-  _outstandingCount = 0;
+  _device = NULL;
+  _shard = NULL;
+  _releaseSource = NULL;
+  TAILQ_INIT(&_releasing);
+  _statistics = NULL;
+  _statisticsTimer = NULL;
 
   return true;
 }
 
+void net_habitue_device_SC101::free(void)
+{
+  if (_statisticsTimer)
+  {
+    _statisticsTimer->cancelTimeout();
+    _statisticsTimer->disable();
+    getWorkLoop()->removeEventSource(_statisticsTimer);
+    _statisticsTimer->release();
+    _statisticsTimer = NULL;
+  }
+  
+  if (_device)
+  {
+    /* in case it never got as far as detach(), see there */
+    if (getWorkLoop())
+      getWorkLoop()->runAction(OSMemberFunctionCast(Action, this, &net_habitue_device_SC101::safeStop), this);
+    
+    delete _device;
+    _device = NULL;
+  }
+  
+  if (_releaseSource)
+  {
+    /* anything still here is referenced by mbufs the stack hasn't freed; leak it rather than let them dangle. each
+     * holds a reference on _releaseSource, so freeing them later just signals a source that's off the workloop
+     */
+    if (!TAILQ_EMPTY(&_releasing))
+      KINFO("%s: requests still referenced by packets in flight", getName());
+    
+    _releaseSource->disable();
+    getWorkLoop()->removeEventSource(_releaseSource);
+    _releaseSource->release();
+    _releaseSource = NULL;
+  }
+  
+  if (_shard)
+  {
+    _shard->removeClient();
+    _shard->release();
+    _shard = NULL;
+  }
+  
+  if (_statistics)
+  {
+    IODelete(_statistics, OSNumber *, STATISTICS_COUNT);
+    _statistics = NULL;
+  }
+  
+  super::free();
+}
+
 IOWorkLoop *net_habitue_device_SC101::getWorkLoop()
 {
-  return ((net_habitue_driver_SC101 *)getProvider())->getWorkLoop();
+  return (_shard ? _shard->getWorkLoop() : NULL);
 }
 
 bool net_habitue_device_SC101::attach(IOService *provider)
@@ -136,11 +443,91 @@ bool net_habitue_device_SC101::attach(IOService *provider)
   if (!super::attach(provider))
     return false;
 
-  resolve();
+  if (!_device)
+  {
+    struct psan_device_handlers handlers;
+    handlers.target = this;
+    handlers.resolveHandler = OSMemberFunctionCast(ResolveHandler, this, &net_habitue_device_SC101::handleResolve);
+    handlers.diskHandler = OSMemberFunctionCast(DiskHandler, this, &net_habitue_device_SC101::handleDisk);
+    handlers.partitionHandler = OSMemberFunctionCast(PartitionHandler, this, &net_habitue_device_SC101::handlePartition);
+    handlers.availableHandler = OSMemberFunctionCast(AvailableHandler, this, &net_habitue_device_SC101::handleAvailable);
+    handlers.ioSizeHandler = OSMemberFunctionCast(IOSizeHandler, this, &net_habitue_device_SC101::handleIOSize);
+    
+    /* each nub runs on one of the driver's shards, with its own workloop and engine */
+    _shard = ((net_habitue_driver_SC101 *)provider)->attachShard();
+    OSNumber *shardIndex = OSNumber::withNumber(_shard->getIndex(), 32);
+    if (shardIndex)
+    {
+      setProperty(gSC101DeviceShardKey, shardIndex);
+      shardIndex->release();
+    }
+    
+    _device = new PSANDevice(_shard->getEngine(), getID()->getCStringNoCopy(), &handlers);
+    if (!_device || !_device->init())
+      return false;
+    
+    UInt64 ioMaxReadSize = OSDynamicCast(OSNumber, getProperty(gSC101DeviceIOMaxReadSizeKey))->unsigned64BitValue();
+    UInt64 ioMaxWriteSize = OSDynamicCast(OSNumber, getProperty(gSC101DeviceIOMaxWriteSizeKey))->unsigned64BitValue();
+    _device->setIOMaxSize(ioMaxReadSize, ioMaxWriteSize);
+    _device->setIOSizeProbing(getProperty(gSC101DeviceIOSizeProbingKey) == kOSBooleanTrue);
+    handleIOSize(ioMaxReadSize, ioMaxWriteSize);
+    
+    UInt32 retransmitMin = OSDynamicCast(OSNumber, getProperty(gSC101DeviceRetransmitMinKey))->unsigned32BitValue();
+    UInt32 retransmitMax = OSDynamicCast(OSNumber, getProperty(gSC101DeviceRetransmitMaxKey))->unsigned32BitValue();
+    _device->setRetransmitTimeouts(retransmitMin, retransmitMax);
+    _device->setReadAheadStreams(READAHEAD_STREAMS);
+    
+    UInt64 cacheSize = OSDynamicCast(OSNumber, getProperty(gSC101DeviceCacheSizeKey))->unsigned64BitValue();
+    UInt32 cacheLineSize = OSDynamicCast(OSNumber, getProperty(gSC101DeviceCacheLineSizeKey))->unsigned32BitValue();
+    if (!_device->setCache(cacheSize, cacheLineSize))
+      KINFO("%s: running without a cache", getName());
+    
+    _device->setWriteBack(getProperty(gSC101DeviceWriteBackKey) == kOSBooleanTrue);
+    
+    struct psan_sched_params sched;
+    sched.policy = PSANIOScheduler::policyNamed(OSDynamicCast(OSString, getProperty(gSC101DeviceSchedulerKey))->getCStringNoCopy());
+    sched.deadlineMS[false] = OSDynamicCast(OSNumber, getProperty(gSC101DeviceReadDeadlineKey))->unsigned32BitValue();
+    sched.deadlineMS[true] = OSDynamicCast(OSNumber, getProperty(gSC101DeviceWriteDeadlineKey))->unsigned32BitValue();
+    sched.depth[false] = OSDynamicCast(OSNumber, getProperty(gSC101DeviceReadDepthKey))->unsigned32BitValue();
+    sched.depth[true] = OSDynamicCast(OSNumber, getProperty(gSC101DeviceWriteDepthKey))->unsigned32BitValue();
+    sched.writeStarve = SCHED_WRITE_STARVE;
+    _device->setScheduler(&sched);
+    
+    UInt32 hedgeBudget = OSDynamicCast(OSNumber, getProperty(gSC101DeviceHedgeBudgetKey))->unsigned32BitValue();
+    UInt32 hedgePercentile = OSDynamicCast(OSNumber, getProperty(gSC101DeviceHedgePercentileKey))->unsigned32BitValue();
+    _device->setHedging(hedgeBudget, hedgePercentile);
+    
+    /* writes are sent by reference to their pages, so completing a request may have to wait for the mbufs to be freed */
+    _releaseSource = IOInterruptEventSource::interruptEventSource(this,
+                                                                  OSMemberFunctionCast(IOInterruptEventAction, this, &net_habitue_device_SC101::handleRelease));
+    if (!_releaseSource || getWorkLoop()->addEventSource(_releaseSource) != kIOReturnSuccess)
+    {
+      KINFO("%s: Failed to set up release event source", getName());
+      return false;
+    }
+    
+    setupStatistics();
+  }
+  
+  _device->resolve();
 
   return true;
 }
 
+void net_habitue_device_SC101::detach(IOService *provider)
+{
+  /* last chance for anything write-back is still holding; there's no refusing a detach, so a failure is just logged.
+   * the unit may be gone for good, so this gives up after a while rather than hold up termination forever
+   */
+  synchronize(WRITEBACK_DETACH_MS);
+  
+  /* nothing may be left in the shard's engine pointing at the device once it's freed */
+  if (_device)
+    getWorkLoop()->runAction(OSMemberFunctionCast(Action, this, &net_habitue_device_SC101::safeStop), this);
+  
+  super::detach(provider);
+}
+
 
 IOReturn net_habitue_device_SC101::doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion)
 {
@@ -154,14 +541,165 @@ IOReturn net_habitue_device_SC101::doAsyncReadWrite(IOMemoryDescriptor *buffer,
 
 void net_habitue_device_SC101::safeDoAsyncReadWrite(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion *completion)
 {
-  OSData *addr = OSDynamicCast(OSData, getProperty(gSC101DevicePartitionAddressKey));
+#if WRITEPROTECT
+  if (buffer->getDirection() == kIODirectionOut)
+    panic();
+#endif
+
+  /* backpressure: hold the caller here (on the gate, so the workloop keeps running) until the pools have room */
+  bool isWrite = (buffer->getDirection() == kIODirectionOut);
+  
+  while (!_device->canAccept(isWrite, nblks))
+    _shard->getCommandGate()->commandSleep(_device, THREAD_UNINT);
+  
+  SC101Buffer *request = new SC101Buffer(buffer, *completion, _releaseSource);
+  if (!request)
+  {
+    IOStorage::complete(*completion, kIOReturnNoMemory, 0);
+    return;
+  }
+  
+  struct psan_completion new_completion;
+  new_completion.target = this;
+  new_completion.action = OSMemberFunctionCast(PSANCompletionAction, this, &net_habitue_device_SC101::ioCompletion);
+  new_completion.parameter = request;
+  
+  _device->asyncReadWrite(request, block, nblks, new_completion);
+}
+
+
+void net_habitue_device_SC101::ioCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  SC101Buffer *request = (SC101Buffer *)parameter;
+  IOReturn ret = psanStatusToIOReturn(status);
+  
+  /* the caller may reuse its buffer as soon as it hears back, so wait until no retransmission still points at it */
+  if (!request->finish(ret, actualByteCount))
+  {
+    TAILQ_INSERT_TAIL(&_releasing, request, entries);
+    return;
+  }
+  
+  completeRequest(request);
+}
+
+
+void net_habitue_device_SC101::completeRequest(SC101Buffer *request)
+{
+  IOStorageCompletion completion = request->getCompletion();
+  IOReturn ret = request->getStatus();
+  UInt64 actualByteCount = request->getActualByteCount();
+  
+  delete request;
+  
+  IOStorage::complete(completion, ret, actualByteCount);
+}
+
+
+void net_habitue_device_SC101::handleAvailable()
+{
+  _shard->getCommandGate()->commandWakeup(_device, false);
+}
+
+
+void net_habitue_device_SC101::handleRelease(IOInterruptEventSource *sender, int count)
+{
+  SC101Buffer *request, *next;
+  
+  for (request = TAILQ_FIRST(&_releasing); request; request = next)
+  {
+    next = TAILQ_NEXT(request, entries);
+    
+    if (request->isReleased())
+    {
+      TAILQ_REMOVE(&_releasing, request, entries);
+      completeRequest(request);
+    }
+  }
+}
+
+
+/* with write-back on, writes already acknowledged may only be in memory: wait for them to reach the unit. with a
+ * timeout, the device is stopped if they haven't by then, failing the rest
+ */
+IOReturn net_habitue_device_SC101::synchronize(UInt32 timeoutMS)
+{
+  if (!_device)
+    return kIOReturnSuccess;
   
-  prepareAndDoAsyncReadWrite(addr, buffer, block, nblks, *completion);
+  return getWorkLoop()->runAction(OSMemberFunctionCast(Action, this, &net_habitue_device_SC101::safeSynchronize),
+                                  this, (void *)(uintptr_t)timeoutMS);
+}
+
+
+IOReturn net_habitue_device_SC101::safeSynchronize(void *timeoutMS)
+{
+  struct sync_state state;
+  state.done = false;
+  state.status = 0;
+  
+  struct psan_completion completion;
+  completion.target = this;
+  completion.action = OSMemberFunctionCast(PSANCompletionAction, this, &net_habitue_device_SC101::syncCompletion);
+  completion.parameter = &state;
+  
+  _device->synchronize(completion);
+  
+  AbsoluteTime deadline;
+  bool bounded = (timeoutMS != NULL);
+  
+  if (bounded)
+    clock_interval_to_deadline((UInt32)(uintptr_t)timeoutMS, kMillisecondScale, &deadline);
+  
+  while (!state.done)
+  {
+    if (!bounded)
+      _shard->getCommandGate()->commandSleep(&state, THREAD_UNINT);
+    else if (_shard->getCommandGate()->commandSleep(&state, deadline, THREAD_UNINT) == THREAD_TIMED_OUT && !state.done)
+    {
+      /* stopping fails the flushes and with them the sync, so the wait that's left is short */
+      KINFO("%s: synchronize timed out, dropping %llu bytes not yet written", getName(),
+            (unsigned long long)_device->getUnwrittenBytes());
+      _device->stop();
+      bounded = false;
+    }
+  }
+  
+  updateStatistics();
+  
+  if (state.status)
+    KINFO("%s: synchronize failed (%d)", getName(), state.status);
+  
+  return psanStatusToIOReturn(state.status);
+}
+
+
+/* fails read-ahead, cache fills and write-back flushes still in flight along with anything of the caller's */
+IOReturn net_habitue_device_SC101::safeStop()
+{
+  _device->stop();
+  
+  return kIOReturnSuccess;
+}
+
+
+void net_habitue_device_SC101::syncCompletion(void *parameter, int status, uint64_t actualByteCount)
+{
+  struct sync_state *state = (struct sync_state *)parameter;
+  
+  state->status = status;
+  state->done = true;
+  
+  _shard->getCommandGate()->commandWakeup(state, false);
 }
 
 
 IOReturn net_habitue_device_SC101::doEjectMedia(void)
 {
+  IOReturn ret = synchronize();
+  if (ret != kIOReturnSuccess)
+    return ret;
+  
   _mediaStateAttached = false;
   _mediaStateChanged = true;
   
@@ -189,7 +727,7 @@ IOReturn net_habitue_device_SC101::doLockUnlockMedia(bool doLock)
 
 IOReturn net_habitue_device_SC101::doSynchronizeCache(void)
 {
-  return kIOReturnSuccess;
+  return synchronize();
 }
 
 
@@ -283,12 +821,12 @@ IOReturn net_habitue_device_SC101::reportMaxValidBlock(UInt64 *maxBlock)
 
 IOReturn net_habitue_device_SC101::reportMediaState(bool *mediaPresent, bool *changed)
 {
-  *mediaPresent = _mediaStateAttached;
+  *mediaPresent = (_mediaStateAttached && !_claimed);
   *changed = _mediaStateChanged;
 
   if (_mediaStateChanged)
   {
-    KINFO("media now %s", _mediaStateAttached ? "present" : "missing");
+    KINFO("media now %s", *mediaPresent ? "present" : "missing");
     _mediaStateChanged = false;
   }
 
@@ -331,140 +869,41 @@ IOReturn net_habitue_device_SC101::reportWriteProtection(bool *isWriteProtected)
 /**********************************************************************************************************************************/
 
 
-// 
-#define POWER_OF_2(n) ({ \
-  int __power = 1; \
-  while ((1 << __power) < n) \
-    __power++; \
-  __power; \
-})
-
-
-// least significant bit set in value
-#define LSB(n) ((n) & ~((n) - 1))
-
-
-static UInt64 getUInt48(unsigned char *buf)
-{
-  // TODO(iwade) endianess?
-  UInt64 ret = 0;
-  for (int i = 0; i < 6; i++)
-    ret = (ret << 8) | buf[i];
-  return ret;
-}
-
-
-static struct {
-  UInt32 timeout_ms;
-  UInt32 tries;
-} retry_plan[] = {
-  // {  100,  1 },
-  // WD10EACS can take ~380ms(?!) for initial response while in power saving mode.
-  {  500,  1 },
-  { 1000,  1 },
-  { 3000, 20 },
-  {    0,  0 }
-};
-
-
-static UInt32 getNextTimeoutMS(UInt32 attempt, bool isWrite)
+OSString *net_habitue_device_SC101::getID()
 {
-  for (int i = 0, a = 0; retry_plan[i].tries; i++)
-  {
-    a += retry_plan[i].tries;
-    
-    if (attempt >= a)
-      continue;
-    
-    return retry_plan[i].timeout_ms;
-  }
-  
-#ifdef RETRY_INDEFINITELY_DELAY_MS
-  if (isWrite)
-    return RETRY_INDEFINITELY_DELAY_MS;
-#endif
-  
-  return 0;
+  return OSDynamicCast(OSString, getProperty(gSC101DeviceIDKey));
 }
 
 
-static bool mbuf_buffer(IOMemoryDescriptor *buffer, int skip_buffer, mbuf_t m, int skip_mbuf, int copy)
+/* a volume takes its members' own media out of service while it uses them, so nothing mounted on a member writes
+ * around the volume (and a mirror's dirty maps). the block storage driver is told straight away rather than at its
+ * next poll, and the media comes back once the volume lets go. false if another volume already has the nub: two
+ * volumes sharing a member would write over each other.
+ */
+bool net_habitue_device_SC101::claim()
 {
-  int offset = 0;
-  bool isWrite = (buffer->getDirection() == kIODirectionOut);
-  
-  if (buffer->prepare() != kIOReturnSuccess)
+  if (!OSCompareAndSwap(0, 1, &_claimed))
   {
-    KINFO("buffer prepare failed");
+    KINFO("%s: already claimed by a volume", getName());
     return false;
   }
-  
-  if (isWrite && mbuf_pkthdr_len(m) < skip_mbuf + copy)
-    mbuf_pkthdr_setlen(m, skip_mbuf + copy);
-  
-  for (; m; m = mbuf_next(m))
-  {
-    if (isWrite && mbuf_len(m) < skip_mbuf + copy && mbuf_trailingspace(m))
-      mbuf_setlen(m, min(mbuf_maxlen(m), skip_mbuf + copy));
-    
-    UInt32 available = mbuf_len(m);
-    
-    //KDEBUG("available=%d, skip_mbuf=%d", available, skip_mbuf);
-    
-    if (skip_mbuf >= available)
-    {
-      skip_mbuf -= available;
-      continue;
-    }
-    
-    UInt8 *buf = (UInt8 *)mbuf_data(m) + skip_mbuf;
-    IOByteCount len = copy;                       // remaining requested
-    len = min(len, available - skip_mbuf);        // available in mbuf
-    len = min(len, buffer->getLength() - offset); // available in iomd    
-    IOByteCount wrote = 0;
-    
-    if (!len)
-    {
-      KDEBUG("no space, %d-%d, %d-%d", available, skip_mbuf, buffer->getLength(), offset);
-      break;
-    }
-    
-    //KDEBUG("COPY: skip_buffer=%d, offset=%d, len=%d (remaining=%d)", skip_buffer, offset, len, copy);
-    if (isWrite)
-      wrote = buffer->readBytes(skip_buffer + offset, buf, len);
-    else
-      wrote = buffer->writeBytes(skip_buffer + offset, buf, len);
 
-    if (wrote != len)
-    {
-      KINFO("short IO");
-      break;
-    }
-    
-    offset += len;
-    copy -= len;
-    skip_mbuf = 0;
-  }
-  
-  if (buffer->complete() != kIOReturnSuccess)
-  {
-    KINFO("buffer complete failed");
-    return false;
-  }
+  KINFO("%s: claimed by a volume", getName());
+  _mediaStateChanged = true;
+  messageClients(kIOMessageMediaStateHasChanged, (void *)kIOMediaStateOffline);
 
-  if (copy > 0)
-  {
-    KINFO("failed to copy requested data: %d remaining", copy);
-    return false;
-  }
-  
   return true;
 }
 
 
-OSString *net_habitue_device_SC101::getID()
+void net_habitue_device_SC101::unclaim()
 {
-  return OSDynamicCast(OSString, getProperty(gSC101DeviceIDKey));
+  if (OSCompareAndSwap(1, 0, &_claimed))
+  {
+    KINFO("%s: released by its volume", getName());
+    _mediaStateChanged = true;
+    messageClients(kIOMessageMediaStateHasChanged, (void *)kIOMediaStateOnline);
+  }
 }
 
 
@@ -483,146 +922,122 @@ void net_habitue_device_SC101::setIcon(OSString *resourceFile)
 }
 
 
-void net_habitue_device_SC101::resolve()
-{
-  KDEBUG("resolving");
-  clock_get_uptime(&_lastResolve);
-  
-  sockaddr_in addr;
-  bzero(&addr, sizeof(addr));
-  addr.sin_len = sizeof(addr);
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(PSAN_PORT);
-  addr.sin_addr.s_addr = INADDR_BROADCAST;
-
-  psan_resolve_t req;
-  bzero(&req, sizeof(req));
-  req.ctrl.cmd = PSAN_RESOLVE;
-  req.ctrl.seq = ((net_habitue_driver_SC101 *)getProvider())->getSequenceNumber();
-  strncpy(req.id, getID()->getCStringNoCopy(), sizeof(req.id));
-  
-  outstanding *out = IONewZero(outstanding, 1);
-  out->seq = ntohs(req.ctrl.seq);
-  out->len = sizeof(psan_resolve_response_t);
-  out->cmd = PSAN_RESOLVE_RESPONSE;
-  out->packetHandler = OSMemberFunctionCast(PacketHandler, this, &net_habitue_device_SC101::handleResolvePacket);
-  out->timeoutHandler = OSMemberFunctionCast(TimeoutHandler, this, &net_habitue_device_SC101::handleResolveTimeout);
-  out->target = this;
-  out->timeout_ms = RESOLVE_TIMEOUT_MS;
-  
-  mbuf_t m;
-
-  if (mbuf_allocpacket(MBUF_WAITOK, sizeof(psan_resolve_t), NULL, &m) != 0)
-    KINFO("mbuf_allocpacket failed!"); // TODO(iwade) handle
-
-  if (mbuf_copyback(m, 0, sizeof(req), &req, MBUF_WAITOK) != 0)
-    KINFO("mbuf_copyback failed!"); // TODO(iwade) handle
-  
-  ((net_habitue_driver_SC101 *)getProvider())->sendPacket(&addr, m, out);
-}
-
-
-void net_habitue_device_SC101::retryResolve()
+/* the dictionary is published once and its numbers updated in place, like IOBlockStorageDriver's Statistics. that's
+ * every STATISTICS_INTERVAL_MS, from a timer on the workloop, so no IO pays for rewriting all of them.
+ */
+void net_habitue_device_SC101::setupStatistics()
 {
-  UInt64 now;
-  clock_get_uptime(&now);
+  OSDictionary *dict = OSDictionary::withCapacity(STATISTICS_COUNT);
+  if (!dict)
+    return;
   
-  if (now - _lastResolve > _resolveInterval &&
-      now - _lastReply > _resolveInterval)
+  _statistics = IONew(OSNumber *, STATISTICS_COUNT);
+  if (!_statistics)
   {
-    resolve();
+    dict->release();
+    return;
   }
-}
-
-
-void net_habitue_device_SC101::handleResolvePacket(sockaddr_in *addr, mbuf_t m, size_t len, outstanding *out, void *ctx)
-{
-  clock_get_uptime(&_lastReply);
   
-  if (mbuf_len(m) < out->len &&
-      mbuf_pullup(&m, out->len) != 0)
+  for (size_t i = 0; i < STATISTICS_COUNT; i++)
   {
-    KINFO("pullup failed");
-    return;
+    _statistics[i] = OSNumber::withNumber(0ULL, 64);
+    if (_statistics[i])
+    {
+      dict->setObject(gSC101DeviceStatistics[i].key, _statistics[i]);
+      _statistics[i]->release(); // retained by dict
+    }
   }
   
-  KDEBUG("resolve succeeded!");
-  
-  psan_resolve_response_t *res = (psan_resolve_response_t *)mbuf_data(m);
+  setProperty(gSC101DeviceStatisticsKey, dict);
+  dict->release();
   
-  sockaddr_in part;
-  bzero(&part, sizeof(part));
-  part.sin_len = sizeof(part);
-  part.sin_family = AF_INET;
-  part.sin_port = htons(PSAN_PORT);
-  part.sin_addr = res->ip4;
+  updateStatistics();
   
-  OSData *partData = OSData::withBytes(&part, sizeof(part));
-  if (partData)
-  {
-    setProperty(gSC101DevicePartitionAddressKey, partData);
-    partData->release();
-  }
+  _statisticsTimer = IOTimerEventSource::timerEventSource(this,
+                                                          OSMemberFunctionCast(IOTimerEventSource::Action, this, &net_habitue_device_SC101::handleStatisticsTimer));
   
-  OSData *rootData = OSData::withBytes(addr, sizeof(*addr));
-  if (rootData)
+  if (!_statisticsTimer || getWorkLoop()->addEventSource(_statisticsTimer) != kIOReturnSuccess)
   {
-    setProperty(gSC101DeviceRootAddressKey, rootData);
-    rootData->release();
+    KINFO("%s: Failed to set up statistics timer", getName());
+    if (_statisticsTimer)
+    {
+      _statisticsTimer->release();
+      _statisticsTimer = NULL;
+    }
+    return;
   }
   
-  IODelete(out, outstanding, 1);
-  
-  mbuf_freem(m);
-
-  if (!getProperty(gSC101DeviceSizeKey))
-    disk();
+  _statisticsTimer->setTimeoutMS(STATISTICS_INTERVAL_MS);
 }
 
 
-void net_habitue_device_SC101::handleResolveTimeout(outstanding *out, void *ctx)
+void net_habitue_device_SC101::updateStatistics()
 {
-  KINFO("resolve timed out, no such ID '%s'?", getID()->getCStringNoCopy());
+  if (!_statistics)
+    return;
   
-  IODelete(out, outstanding, 1);
+  const struct psan_device_stats *stats = _device->getStatistics();
   
-  // TODO(iwade) detach if never successfully resolved.
+  for (size_t i = 0; i < STATISTICS_COUNT; i++)
+  {
+    if (_statistics[i])
+      _statistics[i]->setValue(*(const uint64_t *)((const char *)stats + gSC101DeviceStatistics[i].offset));
+  }
 }
 
 
-/* read the first sector on the root address for model, firmware and partition info */
-void net_habitue_device_SC101::disk()
+void net_habitue_device_SC101::handleStatisticsTimer(IOTimerEventSource *sender)
 {
-  UInt32 block = 0;
-  UInt32 nblks = 1;
+  updateStatistics();
   
-  IOBufferMemoryDescriptor *buffer = IOBufferMemoryDescriptor::withCapacity(nblks * SECTOR_SIZE, kIODirectionIn);
-  if (!buffer)
-    panic("alloc failed"); // TODO(iwade) handle
-  
-  IOStorageCompletion completion;
-  completion.target = this;
-  completion.action = OSMemberFunctionCast(IOStorageCompletionAction, this, &net_habitue_device_SC101::diskCompletion);
-  completion.parameter = buffer;
+  _statisticsTimer->setTimeoutMS(STATISTICS_INTERVAL_MS);
+}
 
-  OSData *addr = OSDynamicCast(OSData, getProperty(gSC101DeviceRootAddressKey));
 
-  prepareAndDoAsyncReadWrite(addr, buffer, block, nblks, completion);
-}
+/**********************************************************************************************************************************/
+#pragma mark Engine notifications
+/**********************************************************************************************************************************/
 
 
-void net_habitue_device_SC101::diskCompletion(void *parameter, IOReturn status, UInt64 actualByteCount)
+void net_habitue_device_SC101::handleResolve(const struct sockaddr_in *partition, const struct sockaddr_in *root)
 {
-  if (status != kIOReturnSuccess || actualByteCount != sizeof(psan_get_response_disk_t))
+  OSData *partData = OSData::withBytes(partition, sizeof(*partition));
+  if (partData)
   {
-    KINFO("disk query on %s failed", getID()->getCStringNoCopy());
-    return;
+    setProperty(gSC101DevicePartitionAddressKey, partData);
+    partData->release();
   }
   
-  IOBufferMemoryDescriptor *buffer = (IOBufferMemoryDescriptor *)parameter;
-  
-  psan_get_response_disk_t *disk = (psan_get_response_disk_t *)buffer->getBytesNoCopy();
+  OSData *rootData = OSData::withBytes(root, sizeof(*root));
+  if (rootData)
+  {
+    setProperty(gSC101DeviceRootAddressKey, rootData);
+    rootData->release();
+  }
+}
+
+
+/* the sizes PSANDevice settled on, which IOMaxReadSize and IOMaxWriteSize only start it at */
+void net_habitue_device_SC101::handleIOSize(uint32_t ioReadSize, uint32_t ioWriteSize)
+{
+  OSNumber *readSize = OSNumber::withNumber(ioReadSize, 32);
+  if (readSize)
+  {
+    setProperty(gSC101DeviceIOReadSizeKey, readSize);
+    readSize->release();
+  }
   
+  OSNumber *writeSize = OSNumber::withNumber(ioWriteSize, 32);
+  if (writeSize)
+  {
+    setProperty(gSC101DeviceIOWriteSizeKey, writeSize);
+    writeSize->release();
+  }
+}
+
+
+void net_habitue_device_SC101::handleDisk(const struct psan_get_response_disk_t *disk)
+{
   OSData *partNumber = OSData::withBytes(disk->part_number, sizeof(disk->part_number));
   if (partNumber)
   {
@@ -649,376 +1064,104 @@ void net_habitue_device_SC101::diskCompletion(void *parameter, IOReturn status,
     setProperty(gSC101DeviceVersionKey, version);
     version->release();
   }
-  
-  partition(disk->partitions);
 }
 
 
-void net_habitue_device_SC101::partition(UInt8 partitions)
+void net_habitue_device_SC101::handlePartition(const struct psan_get_response_partition_t *partition, uint64_t size)
 {
-  UInt32 block = 1;
-  UInt32 nblks = partitions;
-  
-  IOBufferMemoryDescriptor *buffer = IOBufferMemoryDescriptor::withCapacity(nblks * SECTOR_SIZE, kIODirectionIn);
-  if (!buffer)
-    panic("alloc failed"); // TODO(iwade) handle
-  
-  IOStorageCompletion completion;
-  completion.target = this;
-  completion.action = OSMemberFunctionCast(IOStorageCompletionAction, this, &net_habitue_device_SC101::partitionCompletion);
-  completion.parameter = buffer;
-  
-  OSData *addr = OSDynamicCast(OSData, getProperty(gSC101DeviceRootAddressKey));
-
-  prepareAndDoAsyncReadWrite(addr, buffer, block, nblks, completion);
-}
-
-/* read the <partition#> sector on the root address for label and size */
-void net_habitue_device_SC101::partitionCompletion(void *parameter, IOReturn status, UInt64 actualByteCount)
-{
-  if (status != kIOReturnSuccess || actualByteCount != sizeof(psan_get_response_partition_t))
+  OSString *label = OSString::withCString(partition->label);
+  if (label)
   {
-    KINFO("partition lookup on %s failed", getID()->getCStringNoCopy());
-    return;
+    setProperty(gSC101DeviceLabelKey, label);
+    label->release();
   }
   
-  IOBufferMemoryDescriptor *buffer = (IOBufferMemoryDescriptor *)parameter;
-  
-  psan_get_response_partition_t *part = (psan_get_response_partition_t *)buffer->getBytesNoCopy();
-  OSString *id = getID();
-
-  for (UInt32 i = 0; i < actualByteCount / sizeof(psan_get_response_partition_t); i++, part++)
+  OSNumber *sizeNumber = OSNumber::withNumber(size, 64);
+  if (sizeNumber)
   {
-    KDEBUG("cmp %s", part->id);
-    
-    if (strncmp(part->id, id->getCStringNoCopy(), id->getLength() + 1) != 0)
-      continue;
-    
-    KDEBUG("Matched!");
-    
-    OSString *label = OSString::withCString(part->label);
-    if (label)
-    {
-      setProperty(gSC101DeviceLabelKey, label);
-      label->release();
-    }
-    
-    OSNumber *size = OSNumber::withNumber(getUInt48(part->sector_size) << 9, 64);
-    if (size)
-    {
-      setProperty(gSC101DeviceSizeKey, size);
-      size->release();
-    }
- 
-    if (1) // TODO(iwade) determine minimum fields needed
-    {
-      _mediaStateAttached = true;
-      _mediaStateChanged = true;
-    }
-
-    break;
+    setProperty(gSC101DeviceSizeKey, sizeNumber);
+    sizeNumber->release();
   }
+  
+  _mediaStateAttached = _device->isAttached();
+  _mediaStateChanged = true;
 }
 
-void net_habitue_device_SC101::handleAsyncIOPacket(sockaddr_in *addr, mbuf_t m, size_t len, outstanding *out, void *ctx)
-{  
-  clock_get_uptime(&_lastReply);
-  
-  outstanding_io *io = (outstanding_io *)ctx;
-  bool isWrite = (io->buffer->getDirection() == kIODirectionOut);
-  UInt32 ioLen = (io->nblks * SECTOR_SIZE);
-  
-  IOStorageCompletion completion = io->completion;
-  IOReturn status = kIOReturnError;
-  IOByteCount wrote = ioLen;
-  
-  if (isWrite)
-  {
-    //KDEBUG("%p write %d %d", io, io->block, io->nblks);
 
-    status = kIOReturnSuccess;
-  }
-  else
-  {
-    //KDEBUG("%p read %d %d", io, io->block, io->nblks);
+/**********************************************************************************************************************************/
+#pragma mark SC101Buffer
+/**********************************************************************************************************************************/
 
-    if (mbuf_buffer(io->buffer, 0, m, sizeof(psan_get_response_t), ioLen))
-      status = kIOReturnSuccess;
-    else
-      KINFO("mbuf_buffer failed");
-  }
-  
-  if (status != kIOReturnSuccess)
-    KINFO("%p FAILED", io);
 
-  completeIO(io);
-  io->addr->release();
-  IODelete(io, outstanding_io, 1);
-  
-  mbuf_freem(m);
-  
-  IOStorage::complete(completion, status, wrote);
+SC101Buffer::SC101Buffer(IOMemoryDescriptor *buffer, IOStorageCompletion completion, IOInterruptEventSource *releaseSource)
+  : _buffer(buffer), _completion(completion), _map(NULL), _mapFailed(false),
+    _refs(1), _pagesPrepared(false), _releaseSource(releaseSource), _status(kIOReturnSuccess), _actualByteCount(0)
+{
+  /* kept for as long as packets might reference the pages, which can be after the nub has gone */
+  _releaseSource->retain();
 }
 
 
-void net_habitue_device_SC101::handleAsyncIOTimeout(outstanding *out, void *ctx)
+/* always on the workloop, once nothing references the pages */
+SC101Buffer::~SC101Buffer()
 {
-  outstanding_io *io = (outstanding_io *)ctx;
-  IOStorageCompletion completion = io->completion;
-  bool isWrite = (io->buffer->getDirection() == kIODirectionOut);
-  
-  io->attempt++;
-  io->timeout_ms = getNextTimeoutMS(io->attempt, isWrite);
-  
-  if (io->timeout_ms)
-  {
-    if (io->attempt > 3)
-      KINFO("retry IO (%p, %d, %d)", io, io->attempt, io->timeout_ms);
-    else
-      KDEBUG("retry IO (%p, %d, %d)", io, io->attempt, io->timeout_ms);
-    // IOBlockStorageDriver::incrementRetries(isWrite)
-    
-    doSubmitIO(io);
-    return;
-  }
+  if (_map)
+    _map->release();
   
-  KINFO("abort IO %p", io);
-  // IOBlockStorageDriver::incrementErrors(isWrite)
+  if (_pagesPrepared)
+    complete();
   
-  completeIO(io);
-  io->addr->release();
-  IODelete(io, outstanding_io, 1);
-
-  IOStorage::complete(completion, kIOReturnNotResponding, 0);
+  _releaseSource->release();
 }
 
 
-void net_habitue_device_SC101::prepareAndDoAsyncReadWrite(OSData *addr, IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion)
+bool SC101Buffer::finish(IOReturn status, UInt64 actualByteCount)
 {
-  bool isWrite = (buffer->getDirection() == kIODirectionOut);
-  const OSSymbol *ioMaxKey = (isWrite ? gSC101DeviceIOMaxWriteSizeKey : gSC101DeviceIOMaxReadSizeKey);
-  UInt64 ioMaxSize = OSDynamicCast(OSNumber, getProperty(ioMaxKey))->unsigned64BitValue();
-  UInt64 ioSize = (nblks * SECTOR_SIZE);
-  
-#if WRITEPROTECT
-  if (isWrite)
-    panic();
-#endif
-
-  if (ioSize > ioMaxSize || ioSize & (ioSize - 1))
-  {
-    KDEBUG("%s size=%llu, deblocking", (isWrite ? "write" : "read"), ioSize);
-    deblock(addr, buffer, block, nblks, completion);
-    return;
-  }
+  _status = status;
+  _actualByteCount = actualByteCount;
   
-  outstanding_io *io = IONewZero(outstanding_io, 1);
-  io->addr = addr;
-  io->buffer = buffer;
-  io->block = block;
-  io->nblks = nblks;
-  io->completion = completion;
-  io->attempt = 0;
-  io->timeout_ms = getNextTimeoutMS(io->attempt, isWrite);
-  
-  io->addr->retain();
-  
-  getWorkLoop()->runAction(OSMemberFunctionCast(Action, this, &net_habitue_device_SC101::submitIO), this, io);
+  return (OSDecrementAtomic(&_refs) == 1);
 }
 
-void net_habitue_device_SC101::submitIO(outstanding_io *io)
-{
-  if (_outstandingCount >= MAX_IO_OUTSTANDING)
-  {
-    queueIO(io);
-    return;
-  }
-  
-  STAILQ_INSERT_TAIL(&_outstandingHead, io, entries);
-  _outstandingCount++;
-  
-  doSubmitIO(io);
-}
 
-void net_habitue_device_SC101::doSubmitIO(outstanding_io *io)
+/* pages stay wired from the first reference until the request is deleted, so the stack and the NIC can DMA from them */
+bool SC101Buffer::retainPages()
 {
-  bool isWrite = (io->buffer->getDirection() == kIODirectionOut);
-  UInt32 ioLen = (io->nblks * SECTOR_SIZE);
-  mbuf_t m;
-
-  retryResolve();
-  
-  if (isWrite)
+  if (!_pagesPrepared)
   {
-    KDEBUG("%p write %d %d (%d)", io, io->block, io->nblks, _outstandingCount);
+    if (!prepare())
+      return false;
     
-    psan_put_t req;
-    bzero(&req, sizeof(req));
-    req.ctrl.cmd = PSAN_PUT;
-    req.ctrl.seq = ((net_habitue_driver_SC101 *)getProvider())->getSequenceNumber();
-    req.ctrl.len_power = POWER_OF_2(ioLen);
-    req.sector = htonl(io->block);
-    
-    if (mbuf_allocpacket(MBUF_WAITOK, sizeof(req) + ioLen, NULL, &m) != 0)
-      KINFO("mbuf_allocpacket failed!"); // TODO(iwade) handle
-
-    if (mbuf_copyback(m, 0, sizeof(req), &req, MBUF_WAITOK) != 0)
-      KINFO("mbuf_copyback failed!"); // TODO(iwade) handle
-    
-    if (!mbuf_buffer(io->buffer, 0, m, sizeof(req), ioLen))
-      KINFO("mbuf_buffer failed"); // TODO(iwade) handle
-
-    io->outstanding.seq = ntohs(req.ctrl.seq);
-    io->outstanding.len = sizeof(psan_put_response_t);
-    io->outstanding.cmd = PSAN_PUT_RESPONSE;
-  }
-  else
-  {
-    KDEBUG("%p read %d %d (%d)", io, io->block, io->nblks, _outstandingCount);
-    
-    psan_get_t req;
-    bzero(&req, sizeof(req));
-    req.ctrl.cmd = PSAN_GET;
-    req.ctrl.seq = ((net_habitue_driver_SC101 *)getProvider())->getSequenceNumber();
-    req.ctrl.len_power = POWER_OF_2(ioLen);
-    req.sector = htonl(io->block);
-    
-    if (mbuf_allocpacket(MBUF_WAITOK, sizeof(req), NULL, &m) != 0)
-      KINFO("mbuf_allocpacket failed!"); // TODO(iwade) handle
-
-    if (mbuf_copyback(m, 0, sizeof(req), &req, MBUF_WAITOK) != 0)
-      KINFO("mbuf_copyback failed!"); // TODO(iwade) handle
-    
-    io->outstanding.seq = ntohs(req.ctrl.seq);
-    io->outstanding.len = sizeof(psan_get_response_t) + ioLen;
-    io->outstanding.cmd = PSAN_GET_RESPONSE;
+    _pagesPrepared = true;
   }
   
-  io->outstanding.packetHandler = OSMemberFunctionCast(PacketHandler, this, &net_habitue_device_SC101::handleAsyncIOPacket);
-  io->outstanding.timeoutHandler = OSMemberFunctionCast(TimeoutHandler, this, &net_habitue_device_SC101::handleAsyncIOTimeout);
-  io->outstanding.target = this;
-  io->outstanding.ctx = io;
-  io->outstanding.timeout_ms = io->timeout_ms;
-
-  ((net_habitue_driver_SC101 *)getProvider())->sendPacket((sockaddr_in *)io->addr->getBytesNoCopy(), m, &io->outstanding);
-}
-
-
-void net_habitue_device_SC101::completeIO(outstanding_io *io)
-{
-  STAILQ_REMOVE(&_outstandingHead, io, outstanding_io, entries);
-  _outstandingCount--;
+  OSIncrementAtomic(&_refs);
   
-  dequeueAndSubmitIO();
+  return true;
 }
 
 
-void net_habitue_device_SC101::queueIO(outstanding_io *io)
+/* called from wherever the stack frees the mbuf. only the last reference after finish() wakes the nub */
+void SC101Buffer::releasePages()
 {
-  STAILQ_INSERT_TAIL(&_pendingHead, io, entries);
-  _pendingCount++;
+  if (OSDecrementAtomic(&_refs) == 1)
+    _releaseSource->interruptOccurred(NULL, NULL, 0);
 }
 
 
-void net_habitue_device_SC101::dequeueAndSubmitIO()
+/* map the whole descriptor into the kernel once, on first use, so packets can be copied to and from its pages
+ * directly rather than through readBytes()/writeBytes(), which look up the physical segments on every call.
+ */
+void *SC101Buffer::getBytesNoCopy(uint64_t offset, uint64_t len)
 {
-  outstanding_io *io = STAILQ_FIRST(&_pendingHead);
-  
-  if (io)
+  if (!_map && !_mapFailed)
   {
-    STAILQ_REMOVE(&_pendingHead, io, outstanding_io, entries);
-    _pendingCount--;
-    
-    submitIO(io);
+    _map = _buffer->map();
+    _mapFailed = !_map;
   }
-}
-
-/**********************************************************************************************************************************/
-#pragma mark Request Splitting functions
-/**********************************************************************************************************************************/
-
-
-struct deblock_master_state {
-  OSData *addr;
-  IOMemoryDescriptor *buffer;
-  UInt32 block;
-  UInt32 nblks;
-  IOStorageCompletion completion;
   
-  UInt32 pending;
+  if (!_map || offset > _map->getLength() || len > _map->getLength() - offset)
+    return NULL;
   
-  IOReturn status;
-  UInt64 actualByteCount;
-};
-
-
-struct deblock_state {
-  struct deblock_master_state *master;
-  IOMemoryDescriptor *buffer;
-};
-
-
-void deblockCompletion(void *target, void *parameter, IOReturn status, UInt64 actualByteCount)
-{
-  deblock_state *state = (deblock_state *)parameter;
-  deblock_master_state *master = state->master;
-  
-  state->buffer->release();
-  IODelete(state, deblock_state, 1);
-  
-  master->pending--;
-  master->actualByteCount += actualByteCount;
-  if (status != kIOReturnSuccess)
-    master->status = status;
-  
-  if (!master->pending)
-  {    
-    if (master->status != kIOReturnSuccess)
-      KINFO("deblock FAILED");
-    
-    IOStorage::complete(master->completion, master->status, master->actualByteCount);
-    
-    master->addr->release();
-    IODelete(master, deblock_master_state, 1);
-  }
-}
-
-void net_habitue_device_SC101::deblock(OSData *addr, IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion)
-{
-  bool isWrite = (buffer->getDirection() == kIODirectionOut);
-  const OSSymbol *ioMaxKey = (isWrite ? gSC101DeviceIOMaxWriteSizeKey : gSC101DeviceIOMaxReadSizeKey);
-  UInt64 ioMaxSize = OSDynamicCast(OSNumber, getProperty(ioMaxKey))->unsigned64BitValue();
-  UInt64 ioSize = (nblks * SECTOR_SIZE);
-  
-  deblock_master_state *master = IONewZero(deblock_master_state, 1);
-  master->addr = addr;
-  master->buffer = buffer;
-  master->block = block;
-  master->nblks = nblks;
-  master->completion = completion;
-  master->status = kIOReturnSuccess;
-    
-  master->addr->retain();
-  
-  for (UInt64 used = 0, use = min(LSB(ioSize), ioMaxSize);
-       used < ioSize;
-       used += use, use = min(LSB(ioSize - used), ioMaxSize))
-  {
-    deblock_state *state = IONewZero(deblock_state, 1);
-    state->master = master;
-    state->buffer = IOMemoryDescriptor::withSubRange(master->buffer, used, use, master->buffer->getDirection());
-    if (!state->buffer)
-      panic("alloc failed"); // TODO(iwade) handle
-
-    IOStorageCompletion new_completion;
-    new_completion.target = this;
-    new_completion.action = deblockCompletion;
-    new_completion.parameter = state;
-    
-    master->pending++;
-    
-    KDEBUG("deblock %s used=%llu, use=%llu", (isWrite ? "write" : "read"), used, use);
-    
-    prepareAndDoAsyncReadWrite(master->addr, state->buffer, master->block + used / SECTOR_SIZE, use / SECTOR_SIZE, new_completion);
-  }
+  return (UInt8 *)_map->getVirtualAddress() + offset;
 }
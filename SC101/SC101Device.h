@@ -6,23 +6,51 @@
 #import "SC101Driver.h"
 #import "SC101Keys.h"
 
-struct outstanding_io {
-  OSData *addr;
-  
-  IOMemoryDescriptor *buffer;
-  UInt32 block;
-  UInt32 nblks;
-  IOStorageCompletion completion;
-  
-  int attempt;
-  int timeout_ms;
-  struct outstanding outstanding;
-  
-  STAILQ_ENTRY(outstanding_io) entries;
-};
+#import "PSANDevice.h"
 
 
-STAILQ_HEAD(outstandingIOQueue, outstanding_io);
+/* an IOMemoryDescriptor (and the completion for the request it belongs to), as seen by the engine */
+class SC101Buffer : public PSANBuffer
+  {
+  public:
+    SC101Buffer(IOMemoryDescriptor *buffer, IOStorageCompletion completion, IOInterruptEventSource *releaseSource);
+    virtual ~SC101Buffer();
+
+    IOStorageCompletion getCompletion() { return _completion; }
+    IOReturn getStatus() { return _status; }
+    UInt64 getActualByteCount() { return _actualByteCount; }
+    /* the engine is done with the request. false if packets still reference its pages, in which case
+     * releaseSource fires once the last of them is freed and isReleased() becomes true.
+     */
+    bool finish(IOReturn status, UInt64 actualByteCount);
+    bool isReleased() { return (_refs == 0); }
+
+    virtual bool isWrite() { return (_buffer->getDirection() == kIODirectionOut); }
+    virtual uint64_t getLength() { return _buffer->getLength(); }
+    virtual uint64_t readBytes(uint64_t offset, void *bytes, uint64_t len) { return _buffer->readBytes(offset, bytes, len); }
+    virtual uint64_t writeBytes(uint64_t offset, const void *bytes, uint64_t len) { return _buffer->writeBytes(offset, bytes, len); }
+    virtual void *getBytesNoCopy(uint64_t offset, uint64_t len);
+    virtual bool retainPages();
+    virtual void releasePages();
+
+    TAILQ_ENTRY(SC101Buffer) entries; /* on the nub's releasing list while waiting for packets to let go */
+  protected:
+    virtual bool doPrepare() { return (_buffer->prepare() == kIOReturnSuccess); }
+    virtual bool doComplete() { return (_buffer->complete() == kIOReturnSuccess); }
+
+    IOMemoryDescriptor *_buffer;
+    IOStorageCompletion _completion;
+    IOMemoryMap *_map;
+    bool _mapFailed;
+
+    volatile SInt32 _refs; /* one for the request itself plus one per mbuf referencing the pages */
+    bool _pagesPrepared;   /* prepare() on first reference, complete() when the request is deleted */
+    IOInterruptEventSource *_releaseSource;
+    IOReturn _status;
+    UInt64 _actualByteCount;
+  };
+
+TAILQ_HEAD(SC101BufferList, SC101Buffer);
 
 
 class net_habitue_device_SC101 : public IOBlockStorageDevice
@@ -31,6 +59,7 @@ class net_habitue_device_SC101 : public IOBlockStorageDevice
   public:
     virtual bool init(OSDictionary *dictionary = 0);
     virtual bool attach(IOService *provider);
+    virtual void detach(IOService *provider);
     virtual IOReturn doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion);
     virtual IOReturn doEjectMedia(void);
     virtual IOReturn doFormatMedia(UInt64 byteCapacity);
@@ -54,40 +83,44 @@ class net_habitue_device_SC101 : public IOBlockStorageDevice
 
     OSString *getID();
     IOWorkLoop *getWorkLoop();
+    /* what reportMediaState() last said or will say next, without consuming the change */
+    bool isMediaPresent() { return _mediaStateAttached; }
+    /* while a volume uses the nub its own media is out of service, see claim() */
+    bool claim();
+    void unclaim();
   protected:
-    /* initial setup functions */
-    void resolve();
-    void retryResolve();
-    void handleResolvePacket(struct sockaddr_in *addr, mbuf_t m, size_t len, struct outstanding *out, void *ctx);
-    void handleResolveTimeout(struct outstanding *out, void *ctx);
-    void disk();
-    void diskCompletion(void *parameter, IOReturn status, UInt64 actualByteCount);
-    void partition(UInt8 partitions);
-    void partitionCompletion(void *parameter, IOReturn status, UInt64 actualByteCount);
+    virtual void free(void);
+
+    /* engine notifications */
+    void handleResolve(const struct sockaddr_in *partition, const struct sockaddr_in *root);
+    void handleDisk(const struct psan_get_response_disk_t *disk);
+    void handlePartition(const struct psan_get_response_partition_t *partition, uint64_t size);
+    void handleIOSize(uint32_t ioReadSize, uint32_t ioWriteSize);
 
     /* main IO functions */
-    void handleAsyncIOPacket(struct sockaddr_in *addr, mbuf_t m, size_t len, struct outstanding *out, void *ctx);
-    void handleAsyncIOTimeout(struct outstanding *out, void *ctx);    
     void safeDoAsyncReadWrite(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion *completion);
-    void prepareAndDoAsyncReadWrite(OSData *addr, IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion);
-    void submitIO(struct outstanding_io *io);
-    void doSubmitIO(struct outstanding_io *io);
-    void completeIO(struct outstanding_io *io);
-    void queueIO(struct outstanding_io *io);
-    void dequeueAndSubmitIO();
-    void deblock(OSData *addr, IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion);
+    void ioCompletion(void *parameter, int status, uint64_t actualByteCount);
+    void completeRequest(SC101Buffer *request);
+    void handleRelease(IOInterruptEventSource *sender, int count);
+    void handleAvailable();
+    IOReturn synchronize(UInt32 timeoutMS = 0);
+    IOReturn safeSynchronize(void *timeoutMS);
+    IOReturn safeStop();
+    void syncCompletion(void *parameter, int status, uint64_t actualByteCount);
     
     void setIcon(OSString *resourceFile);
+    void setupStatistics();
+    void updateStatistics();
+    void handleStatisticsTimer(IOTimerEventSource *sender);
     
     bool _mediaStateAttached;
     bool _mediaStateChanged;
+    volatile UInt32 _claimed; /* by a volume, 1 or 0 */
 
-    UInt64 _resolveInterval;
-    UInt64 _lastReply;
-    UInt64 _lastResolve;    
-    
-    struct outstandingIOQueue _pendingHead;
-    UInt32 _pendingCount;
-    struct outstandingIOQueue _outstandingHead;
-    UInt32 _outstandingCount;
+    PSANDevice *_device;
+    net_habitue_shard_SC101 *_shard;
+    IOInterruptEventSource *_releaseSource;
+    struct SC101BufferList _releasing; /* finished requests whose pages are still referenced by mbufs */
+    OSNumber **_statistics; /* in gSC101DeviceStatistics order, owned by the Statistics property */
+    IOTimerEventSource *_statisticsTimer;
   };
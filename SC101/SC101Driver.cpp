@@ -18,16 +18,49 @@
 
 #import "SC101Driver.h"
 #import "SC101Device.h"
+#import "SC101Volume.h"
 
 extern "C" {
 #import <sys/errno.h>
 #import <netinet/in.h>
+#import <mach/vm_param.h>
+#import <libkern/OSAtomic.h>
 #import "psan_wireformat.h"
 };
 
 
 static const OSSymbol *gSC101DriverSummonKey;
+static const OSSymbol *gSC101DriverSummonStripeKey;
+static const OSSymbol *gSC101DriverSummonMirrorKey;
 static const OSSymbol *gSC101DeviceIDKey;
+static const OSSymbol *gSC101DriverStatisticsKey;
+
+// PSANEngine and SC101Transport counters published in the Statistics dictionary
+static const struct {
+  const char *key;
+  bool transport; /* offset is into psan_transport_stats rather than psan_engine_stats */
+  size_t offset;
+} gSC101DriverStatistics[] = {
+  { kSC101DriverStaleResponsesKey, false, offsetof(struct psan_engine_stats, stale) },
+  { kSC101DriverLateResponsesKey, false, offsetof(struct psan_engine_stats, late) },
+  { kSC101DriverDuplicateResponsesKey, false, offsetof(struct psan_engine_stats, duplicates) },
+  { kSC101DriverForeignResponsesKey, false, offsetof(struct psan_engine_stats, foreign) },
+  { kSC101DriverMismatchedResponsesKey, false, offsetof(struct psan_engine_stats, mismatched) },
+  { kSC101DriverRequestTableResizesKey, false, offsetof(struct psan_engine_stats, tableResizes) },
+  { kSC101DriverReceiveBatchesKey, false, offsetof(struct psan_engine_stats, rxBatches) },
+  { kSC101DriverReceivePacketsKey, false, offsetof(struct psan_engine_stats, rxPackets) },
+  { kSC101DriverReceiveBatchMaxKey, false, offsetof(struct psan_engine_stats, rxBatchMax) },
+  { kSC101DriverReceiveBudgetExhaustedKey, false, offsetof(struct psan_engine_stats, rxBudgetExhausted) },
+  { kSC101DriverSendFailuresKey, true, offsetof(struct psan_transport_stats, sendFailures) },
+  { kSC101DriverPacketRingMissesKey, true, offsetof(struct psan_transport_stats, packetRingMisses) },
+  { kSC101DriverPacketRingExhaustedKey, true, offsetof(struct psan_transport_stats, packetRingExhausted) },
+  { kSC101DriverHandoffsKey, true, offsetof(struct psan_transport_stats, handoffs) },
+  { kSC101DriverHandoffDropsKey, true, offsetof(struct psan_transport_stats, handoffDrops) },
+  { kSC101DriverFlowSocketsKey, true, offsetof(struct psan_transport_stats, flowSockets) },
+  { kSC101DriverFlowFailuresKey, true, offsetof(struct psan_transport_stats, flowFailures) },
+};
+
+#define STATISTICS_COUNT (sizeof(gSC101DriverStatistics) / sizeof(gSC101DriverStatistics[0]))
 
 static void socketUpcallHandler(socket_t so, void* cookie, int waitf);
 
@@ -50,15 +83,18 @@ bool net_habitue_driver_SC101::start(IOService *provider)
   KINFO("Starting");
   
   gSC101DriverSummonKey = OSSymbol::withCString(kSC101DriverSummonKey);
+  gSC101DriverSummonStripeKey = OSSymbol::withCString(kSC101DriverSummonStripeKey);
+  gSC101DriverSummonMirrorKey = OSSymbol::withCString(kSC101DriverSummonMirrorKey);
   gSC101DeviceIDKey = OSSymbol::withCString(kSC101DeviceIDKey);
+  gSC101DriverStatisticsKey = OSSymbol::withCString(kSC101DriverStatisticsKey);
   
   if (!super::start(provider))
     return false;
 
-  /* set up Event Loop to single thread all work */
-  if (!setupEventLoop())
+  /* set up a workloop per shard, each with its own protocol engine tracking requests by 16-bit seq# */
+  if (!setupShards())
   {
-    KINFO("%s: Failed to set up event loop!", getName());
+    KINFO("%s: Failed to set up shards!", getName());
     return false;
   }
   
@@ -68,22 +104,8 @@ bool net_habitue_driver_SC101::start(IOService *provider)
     KINFO("%s: Failed to set up socket!", getName());
     return false;
   }
-
-  /* create and initialize array for tracking outstanding requests by 16-bit seq# */
-  if (!(outstanding = (struct outstanding **)IONew(struct outstanding *, INT16_MAX)))
-  {
-    KINFO("%s: Failed to alloc outstanding array", getName());
-    return false;
-  }
-  bzero(outstanding, INT16_MAX * sizeof(struct outstanding *));
   
-  TAILQ_INIT(&_timeoutHead);
-  
-  /* there is no particular reason for this to be random */
-  UInt64 now;
-  clock_get_uptime(&now);
-  _seq = now % INT16_MAX;
-  KINFO("Sequence#: %d", _seq);
+  setupStatistics();
   
   registerService();
   
@@ -95,22 +117,20 @@ void net_habitue_driver_SC101::stop(IOService *provider)
 {
   KINFO("Stopping");
 
-  cleanupEventLoop();
-  cleanupSocket();
-
-  for (int i = 0; i < INT16_MAX; i++)
+  for (uint16_t i = 0; _shards && i < _shardCount; i++)
   {
-    if (outstanding[i] == NULL)
-      continue;
-    
-    KINFO("killing outstanding[%d]", i);
-    
-    struct outstanding *out = outstanding[i];
-    unregisterPacketHandler(out);
-    out->timeoutHandler(out->target, out, out->ctx);
+    if (_shards[i])
+      _shards[i]->stop();
   }
   
-  IODelete(outstanding, struct outstanding *, INT16_MAX);
+  cleanupSocket();
+  cleanupShards();
+  
+  if (_statistics)
+  {
+    IODelete(_statistics, OSNumber *, STATISTICS_COUNT);
+    _statistics = NULL;
+  }
   
   super::stop(provider);
 }
@@ -130,19 +150,59 @@ IOReturn net_habitue_driver_SC101::setProperties(OSObject *properties)
   
   OSDictionary *summon = OSDynamicCast(OSDictionary, dict->getObject(gSC101DriverSummonKey));
   
-  if (!summon)
-    return kIOReturnBadArgument;
+  if (summon)
+  {
+    KINFO("summoning nub");
+    addClient(summon);
+    
+    return kIOReturnSuccess;
+  }
+  
+  OSDictionary *stripe = OSDynamicCast(OSDictionary, dict->getObject(gSC101DriverSummonStripeKey));
+  
+  if (stripe)
+  {
+    KINFO("summoning stripe");
+    addVolume(OSTypeAlloc(net_habitue_stripe_SC101), stripe);
+    
+    return kIOReturnSuccess;
+  }
+  
+  OSDictionary *mirror = OSDynamicCast(OSDictionary, dict->getObject(gSC101DriverSummonMirrorKey));
   
-  KINFO("summoning nub");
-  addClient(summon);
+  if (mirror)
+  {
+    KINFO("summoning mirror");
+    addVolume(OSTypeAlloc(net_habitue_mirror_SC101), mirror);
+    
+    return kIOReturnSuccess;
+  }
   
-  return kIOReturnSuccess;
+  return kIOReturnBadArgument;
 }
 
 
 IOWorkLoop *net_habitue_driver_SC101::getWorkLoop()
 {
-  return _workLoop;
+  return (_shards && _shards[0] ? _shards[0]->getWorkLoop() : NULL);
+}
+
+
+/* the least busy shard, ties going to the lowest so a lone unit lands on shard 0 and its responses need no handoff */
+net_habitue_shard_SC101 *net_habitue_driver_SC101::attachShard()
+{
+  net_habitue_shard_SC101 *shard = NULL;
+  
+  for (uint16_t i = 0; i < _shardCount; i++)
+  {
+    if (!shard || _shards[i]->getClientCount() < shard->getClientCount())
+      shard = _shards[i];
+  }
+  
+  shard->retain();
+  shard->addClient();
+  
+  return shard;
 }
 
 
@@ -184,99 +244,90 @@ void net_habitue_driver_SC101::addClient(OSDictionary *table)
 }
 
 
-/**********************************************************************************************************************************/
-#pragma mark Setup Functions
-/**********************************************************************************************************************************/
-
-
-bool net_habitue_driver_SC101::setupEventLoop(void)
+/* takes the reference on volume, which is dropped if there's already one by that name or it can't find its members */
+void net_habitue_driver_SC101::addVolume(net_habitue_volume_SC101 *volume, OSDictionary *table)
 {
-  /* create local workloop */
-  _workLoop = IOWorkLoop::workLoop();
-
-  IOWorkLoop *workLoop = getWorkLoop();
+  OSString *id = OSDynamicCast(OSString, table->getObject(gSC101DeviceIDKey));
   
-  if (!workLoop)
-  {
-    KINFO("%s: Failed to getWorkLoop()", getName());
-    return false;
-  }
+  if (!volume)
+    return;
   
-  /* set up command gate */
-  _commandGate = IOCommandGate::commandGate(this);
+  OSIterator *childIterator = getClientIterator();
   
-  if (!_commandGate)
+  if (childIterator)
   {
-    KINFO("%s: Failed to create command gate!", getName());
-    return false;
+    OSObject *child;
+    
+    while ((child = childIterator->getNextObject()))
+    {
+      net_habitue_volume_SC101 *candidate = OSDynamicCast(net_habitue_volume_SC101, child);
+      
+      if (candidate && candidate->getID()->isEqualTo(id))
+      {
+        volume->release();
+        volume = NULL;
+        break;
+      }
+    }
+    
+    childIterator->release();
   }
   
-  if (workLoop->addEventSource(_commandGate) != kIOReturnSuccess)
-  {
-    KINFO("%s: Failed to add command gate to work loop!", getName());
-    return false;
-  }
+  if (!volume)
+    return;
   
-  /* set up interrupt event source */
-  _interruptSource = IOInterruptEventSource::interruptEventSource(this,
-                                                                  OSMemberFunctionCast(IOInterruptEventAction, this, &net_habitue_driver_SC101::handleInterrupt));
+  if (!volume->init(table))
+    KINFO("bad volume");
+  else if (!volume->attach(this))
+    KINFO("attach failed");
+  else
+    volume->registerService();
   
-  if (!_interruptSource)
-  {
-    KINFO("%s: Failed to create interrupt event source!", getName());
-    return false;
-  }
+  volume->release();
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Setup Functions
+/**********************************************************************************************************************************/
+
+
+bool net_habitue_driver_SC101::setupShards(void)
+{
+  _shardCount = WORKLOOP_SHARDS;
+  _shards = IONew(net_habitue_shard_SC101 *, _shardCount);
   
-  if (workLoop->addEventSource(_interruptSource) != kIOReturnSuccess)
-  {
-    KINFO("%s: Failed to add interrupt event source to work loop!", getName());
+  if (!_shards)
     return false;
-  }
-  
-  /* set up timer event source */
-  _timerSource = IOTimerEventSource::timerEventSource(this, 
-                                                      OSMemberFunctionCast(IOTimerEventSource::Action, this, &net_habitue_driver_SC101::timeoutOccurred));
   
-  if (!_timerSource)
-  {
-    KINFO("%s: Failed to create timer event source!", getName());
-    return false;
-  }
+  bzero(_shards, _shardCount * sizeof(_shards[0]));
   
-  if (workLoop->addEventSource(_timerSource) != kIOReturnSuccess)
+  for (uint16_t i = 0; i < _shardCount; i++)
   {
-    KINFO("%s: Failed to add timer event source to work loop!", getName());
-    return false;
+    if (!(_shards[i] = OSTypeAlloc(net_habitue_shard_SC101)) || !_shards[i]->init(this, i, _shardCount))
+    {
+      KINFO("%s: Failed to set up shard %d", getName(), i);
+      return false;
+    }
   }
   
   return true;
 }
 
 
-void net_habitue_driver_SC101::cleanupEventLoop(void)
+void net_habitue_driver_SC101::cleanupShards(void)
 {
-  if (_timerSource)
-  {
-    _timerSource->cancelTimeout();
-    getWorkLoop()->removeEventSource(_timerSource);
-    _timerSource->release();
-    _timerSource = NULL;
-  }
+  if (!_shards)
+    return;
   
-  if (_interruptSource)
+  for (uint16_t i = 0; i < _shardCount; i++)
   {
-    _interruptSource->disable();
-    getWorkLoop()->removeEventSource(_interruptSource);
-    _interruptSource->release();
-    _interruptSource = NULL;
+    if (_shards[i])
+      _shards[i]->release();
   }
   
-  if (_commandGate)
-  {
-    getWorkLoop()->removeEventSource(_commandGate);
-    _commandGate->release();
-    _commandGate = NULL;
-  }  
+  IODelete(_shards, net_habitue_shard_SC101 *, _shardCount);
+  _shards = NULL;
 }
 
 
@@ -287,7 +338,8 @@ bool net_habitue_driver_SC101::setupSocket(void)
   int rcvbufsize = RCVBUF_SIZE;
   int sndbufsize = SNDBUF_SIZE;
   
-  if ((error = sock_socket(AF_INET, SOCK_DGRAM, 0, socketUpcallHandler, _interruptSource, &_so)))
+  /* shard 0 drains the socket */
+  if ((error = sock_socket(AF_INET, SOCK_DGRAM, 0, socketUpcallHandler, _shards[0]->getInterruptSource(), &_so)))
     goto out;
   
   if ((error = sock_setsockopt(_so, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on))))
@@ -342,6 +394,37 @@ void net_habitue_driver_SC101::cleanupSocket(void)
 }
 
 
+/* a socket connected to dest on an ephemeral port, whose upcall wakes the shard that will own it */
+socket_t net_habitue_driver_SC101::openFlow(const struct sockaddr_in *dest, net_habitue_shard_SC101 *shard)
+{
+  errno_t error;
+  socket_t so = NULL;
+  int rcvbufsize = RCVBUF_SIZE;
+  int sndbufsize = SNDBUF_SIZE;
+  
+  if ((error = sock_socket(AF_INET, SOCK_DGRAM, 0, socketUpcallHandler, shard->getInterruptSource(), &so)))
+    goto out;
+  
+  if ((error = sock_setsockopt(so, SOL_SOCKET, SO_RCVBUF, &rcvbufsize, sizeof(rcvbufsize))))
+    goto out;
+  
+  if ((error = sock_setsockopt(so, SOL_SOCKET, SO_SNDBUF, &sndbufsize, sizeof(sndbufsize))))
+    goto out;
+  
+  if ((error = sock_connect(so, (const struct sockaddr *)dest, 0)))
+    goto out;
+  
+  return so;
+  
+out:
+  KINFO("%s: Error %d opening flow socket", getName(), error);
+  if (so)
+    sock_close(so);
+  
+  return NULL;
+}
+
+
 /**********************************************************************************************************************************/
 #pragma mark Interrupt Handlers
 /**********************************************************************************************************************************/
@@ -353,34 +436,28 @@ static void socketUpcallHandler(socket_t so, void* cookie, int waitf)
 }
 
 
-void net_habitue_driver_SC101::handleInterrupt(IOInterruptEventSource *sender, int count)
-{
-  for (int i = 0; i < count; i++)
-    receivePacket();
-}
-
-
-void net_habitue_driver_SC101::timeoutOccurred(IOTimerEventSource *sender)
-{
-  processTimeout();
-}
-
-
 /**********************************************************************************************************************************/
 #pragma mark Core Functions
 /**********************************************************************************************************************************/
 
 
-uint16_t net_habitue_driver_SC101::getSequenceNumber(void)
+/* drain up to budget packets from the socket, then wake the shards that had responses queued for them */
+uint32_t net_habitue_driver_SC101::receivePackets(net_habitue_shard_SC101 *shard, socket_t so, uint32_t budget)
 {
-  if (_seq >= INT16_MAX)
-    _seq = 0;
-
-  return htons(_seq++);
+  uint32_t received = 0;
+  
+  while (received < budget && receivePacket(shard, (so ? so : _so)))
+    received++;
+  
+  for (uint16_t i = 0; i < _shardCount; i++)
+    _shards[i]->kick();
+  
+  return received;
 }
 
 
-void net_habitue_driver_SC101::receivePacket(void)
+/* returns false once the socket is empty. responses to another shard's requests are queued for it */
+bool net_habitue_driver_SC101::receivePacket(net_habitue_shard_SC101 *shard, socket_t so)
 {
   struct sockaddr_in addr;
   bzero(&addr, sizeof(addr));
@@ -395,36 +472,128 @@ void net_habitue_driver_SC101::receivePacket(void)
   errno_t error;
   size_t len = UINT16_MAX;
   
-  if ((error = sock_receivembuf(_so, &msghdr, &m, MSG_DONTWAIT, &len)))
+  if ((error = sock_receivembuf(so, &msghdr, &m, MSG_DONTWAIT, &len)))
   {
-    KINFO("%s: error %d from sock_receivembuf", getName(), error);
-    return;
+    if (error != EWOULDBLOCK)
+      KINFO("%s: error %d from sock_receivembuf", getName(), error);
+    return false;
   }
   
   if (len < sizeof(struct psan_ctrl_t))
   {
     KINFO("%s: short packet len=%zu", getName(), len);
+    mbuf_freem(m);
+    return true;
+  }
+  
+  struct psan_ctrl_t ctrl;
+  net_habitue_shard_SC101 *owner = shard;
+  
+  if (mbuf_copydata(m, 0, sizeof(ctrl), &ctrl) == 0)
+    owner = _shards[PSANEngine::getShardForSequence(ntohs(ctrl.seq), _shardCount)];
+  
+  if (owner != shard)
+  {
+    shard->getTransport()->countHandoff(!owner->queuePacket(&addr, m, len));
+    return true;
+  }
+  
+  SC101Packet packet(m, len);
+  
+  shard->getEngine()->handlePacket(&addr, &packet);
+  
+  return true;
+}
+
+
+/* the dictionary is published once and its numbers updated in place, as in net_habitue_device_SC101.
+ * the counters are summed over the shards' latest snapshots (the batch maximum is the largest of theirs), from
+ * shard 0's statistics timer.
+ */
+void net_habitue_driver_SC101::setupStatistics()
+{
+  OSDictionary *dict = OSDictionary::withCapacity(STATISTICS_COUNT);
+  if (!dict)
+    return;
+  
+  _statistics = IONew(OSNumber *, STATISTICS_COUNT);
+  if (!_statistics)
+  {
+    dict->release();
     return;
   }
   
-  handlePacket(&addr, m, len);
+  for (size_t i = 0; i < STATISTICS_COUNT; i++)
+  {
+    _statistics[i] = OSNumber::withNumber(0ULL, 64);
+    if (_statistics[i])
+    {
+      dict->setObject(gSC101DriverStatistics[i].key, _statistics[i]);
+      _statistics[i]->release(); // retained by dict
+    }
+  }
+  
+  setProperty(gSC101DriverStatisticsKey, dict);
+  dict->release();
+  
+  updateStatistics();
 }
 
 
-bool net_habitue_driver_SC101::sendPacket(struct sockaddr_in *dest, mbuf_t m, struct outstanding *out)
+void net_habitue_driver_SC101::updateStatistics()
 {
-  if (out)
-    registerPacketHandler(out);
+  if (!_statistics)
+    return;
+  
+  struct psan_engine_stats stats;
+  struct psan_transport_stats transportStats;
+  uint64_t rxBatchMax = 0;
+  
+  bzero(&stats, sizeof(stats));
+  bzero(&transportStats, sizeof(transportStats));
+  
+  for (uint16_t i = 0; i < _shardCount; i++)
+  {
+    struct psan_engine_stats shardStats;
+    struct psan_transport_stats shardTransportStats;
+    
+    _shards[i]->copyStatistics(&shardStats, &shardTransportStats);
+    
+    for (size_t j = 0; j < sizeof(stats) / sizeof(uint64_t); j++)
+      ((uint64_t *)&stats)[j] += ((const uint64_t *)&shardStats)[j];
+    
+    for (size_t j = 0; j < sizeof(transportStats) / sizeof(uint64_t); j++)
+      ((uint64_t *)&transportStats)[j] += ((const uint64_t *)&shardTransportStats)[j];
+    
+    rxBatchMax = max(rxBatchMax, shardStats.rxBatchMax);
+  }
+  
+  stats.rxBatchMax = rxBatchMax;
+  
+  for (size_t i = 0; i < STATISTICS_COUNT; i++)
+  {
+    const char *base = (gSC101DriverStatistics[i].transport ? (const char *)&transportStats : (const char *)&stats);
+    
+    if (_statistics[i])
+      _statistics[i]->setValue(*(const uint64_t *)(base + gSC101DriverStatistics[i].offset));
+  }
+}
 
+
+bool net_habitue_driver_SC101::sendPacket(socket_t so, const struct sockaddr_in *dest, mbuf_t m)
+{
   struct msghdr msghdr;
   bzero(&msghdr, sizeof(msghdr));
-  msghdr.msg_name = dest;
-  msghdr.msg_namelen = sizeof(*dest);
+  if (dest)
+  {
+    msghdr.msg_name = (void *)dest;
+    msghdr.msg_namelen = sizeof(*dest);
+  }
   
   errno_t error;
   size_t sent;
   
-  if ((error = sock_sendmbuf(_so, &msghdr, m, 0, &sent)))
+  if ((error = sock_sendmbuf((so ? so : _so), &msghdr, m, 0, &sent)))
   {
     KINFO("Error: sock_sendmbuf() returned %d", error);
     return false;
@@ -434,117 +603,757 @@ bool net_habitue_driver_SC101::sendPacket(struct sockaddr_in *dest, mbuf_t m, st
 }
 
 
-void net_habitue_driver_SC101::registerPacketHandler(struct outstanding *out)
-{
-  if (outstanding[out->seq] != NULL)
-    KINFO("seq#%d already used!", out->seq); // TODO(iwade) handle
-  
-  outstanding[out->seq] = out;
-
-  if (out->timeout_ms)
-    addTimeout(out);
-}
-
-
-void net_habitue_driver_SC101::unregisterPacketHandler(struct outstanding *out)
-{
-  outstanding[out->seq] = NULL;
-
-  if (out->timeout_ms)
-    removeTimeout(out);
-}
+/**********************************************************************************************************************************/
+#pragma mark Engine glue
+/**********************************************************************************************************************************/
 
 
-void net_habitue_driver_SC101::handlePacket(struct sockaddr_in *addr, mbuf_t m, size_t len)
+static bool mbuf_buffer(PSANBuffer *buffer, int skip_buffer, mbuf_t m, int skip_mbuf, int copy)
 {
-  if (mbuf_len(m) < sizeof(struct psan_ctrl_t) &&
-      mbuf_pullup(&m, sizeof(struct psan_ctrl_t)) != 0)
+  int offset = 0;
+  bool isWrite = buffer->isWrite();
+  
+  if (!buffer->prepare())
   {
-    KINFO("short packet, ignoring.");
-    return;
+    KINFO("buffer prepare failed");
+    return false;
   }
   
-  struct psan_ctrl_t *ctrl = (struct psan_ctrl_t *)mbuf_data(m);
-  struct outstanding *out = outstanding[ntohs(ctrl->seq)];
-
-  if (!out || ntohs(ctrl->seq) != out->seq || len != out->len || ctrl->cmd != out->cmd)
+  /* buffers that can be mapped are copied in one pass, straight between the mbuf chain and their pages */
+  UInt8 *bytes = (UInt8 *)buffer->getBytesNoCopy(skip_buffer, copy);
+  
+  if (bytes)
   {
-    if (ctrl->cmd == PSAN_ERROR && out && out->timeout_ms) {
-      KINFO("Drive not ready, backing off for %d seconds", SPINUP_INTERVAL_MS/1000);
-      
-      removeTimeout(out);
-      out->timeout_ms = SPINUP_INTERVAL_MS;
-      addTimeout(out);
+    errno_t error;
+    
+    if (isWrite)
+      error = mbuf_copyback(m, skip_mbuf, copy, bytes, MBUF_WAITOK);
+    else
+      error = mbuf_copydata(m, skip_mbuf, copy, bytes);
+    
+    if (!buffer->complete())
+    {
+      KINFO("buffer complete failed");
+      return false;
+    }
+    
+    if (error)
+    {
+      KINFO("failed to copy requested data: %d", error);
+      return false;
+    }
+    
+    return true;
+  }
+  
+  if (isWrite && mbuf_pkthdr_len(m) < skip_mbuf + copy)
+    mbuf_pkthdr_setlen(m, skip_mbuf + copy);
+  
+  for (; m; m = mbuf_next(m))
+  {
+    if (isWrite && mbuf_len(m) < skip_mbuf + copy && mbuf_trailingspace(m))
+      mbuf_setlen(m, min(mbuf_maxlen(m), skip_mbuf + copy));
+    
+    UInt32 available = mbuf_len(m);
+    
+    //KDEBUG("available=%d, skip_mbuf=%d", available, skip_mbuf);
+    
+    if (skip_mbuf >= available)
+    {
+      skip_mbuf -= available;
+      continue;
     }
-    else if (ctrl->cmd != PSAN_FIND && ctrl->cmd != PSAN_RESOLVE)
+    
+    UInt8 *buf = (UInt8 *)mbuf_data(m) + skip_mbuf;
+    IOByteCount len = copy;                       // remaining requested
+    len = min(len, available - skip_mbuf);        // available in mbuf
+    len = min(len, buffer->getLength() - skip_buffer - offset); // available in buffer
+    IOByteCount wrote = 0;
+    
+    if (!len)
     {
-      KDEBUG("No matching request for seq#%d,cmd=0x%02x,len=%d expected:cmd=0x%02x,len=%d",
-             ntohs(ctrl->seq), ctrl->cmd, len, out?out->cmd:0, out?out->len:-1);    
+      KDEBUG("no space, %d-%d, %llu-%d", available, skip_mbuf, buffer->getLength(), offset);
+      break;
     }
+    
+    //KDEBUG("COPY: skip_buffer=%d, offset=%d, len=%d (remaining=%d)", skip_buffer, offset, len, copy);
+    if (isWrite)
+      wrote = buffer->readBytes(skip_buffer + offset, buf, len);
+    else
+      wrote = buffer->writeBytes(skip_buffer + offset, buf, len);
 
-    mbuf_freem(m);
+    if (wrote != len)
+    {
+      KINFO("short IO");
+      break;
+    }
     
-    return;
+    offset += len;
+    copy -= len;
+    skip_mbuf = 0;
+  }
+  
+  if (!buffer->complete())
+  {
+    KINFO("buffer complete failed");
+    return false;
   }
 
-  unregisterPacketHandler(out);
+  if (copy > 0)
+  {
+    KINFO("failed to copy requested data: %d remaining", copy);
+    return false;
+  }
   
-  out->packetHandler(out->target, addr, m, len, out, out->ctx);
+  return true;
+}
+
+
+static void mbuf_release_pages(caddr_t buf, u_int size, caddr_t arg)
+{
+  ((PSANBuffer *)arg)->releasePages();
 }
 
 
-void net_habitue_driver_SC101::addTimeout(struct outstanding *new_out)
+/* append external mbufs pointing straight at the buffer's pages, one per page so each is physically contiguous.
+ * each holds its own reference on the buffer, dropped when the stack frees it (so on failure, freeing the chain cleans up).
+ */
+static bool mbuf_attach_buffer(mbuf_t m, PSANBuffer *buffer, uint64_t offset, size_t len)
 {
-  struct outstanding *out;
+  UInt8 *bytes = (UInt8 *)buffer->getBytesNoCopy(offset, len);
   
-  clock_interval_to_deadline(new_out->timeout_ms, kMillisecondScale, &new_out->timeout);
+  if (!bytes)
+    return false;
   
-  TAILQ_FOREACH_REVERSE(out, &_timeoutHead, timeoutQueue, entries)
-    if (out->timeout < new_out->timeout)
-      break;
+  mbuf_t last = m;
   
-  if (out)
-    TAILQ_INSERT_AFTER(&_timeoutHead, out, new_out, entries);
-  else
-    TAILQ_INSERT_HEAD(&_timeoutHead, new_out, entries);
+  while (mbuf_next(last))
+    last = mbuf_next(last);
+  
+  for (size_t done = 0; done < len; )
+  {
+    UInt8 *segment = bytes + done;
+    size_t segmentLen = min(len - done, PAGE_SIZE - ((uintptr_t)segment & PAGE_MASK));
+    mbuf_t ext = NULL;
+    
+    if (!buffer->retainPages())
+      return false;
+    
+    if (mbuf_attachcluster(MBUF_WAITOK, MBUF_TYPE_DATA, &ext, (caddr_t)segment, mbuf_release_pages, segmentLen, (caddr_t)buffer) != 0)
+    {
+      buffer->releasePages();
+      return false;
+    }
+    
+    mbuf_setlen(ext, segmentLen);
+    mbuf_setnext(last, ext);
+    mbuf_pkthdr_setlen(m, mbuf_pkthdr_len(m) + segmentLen);
+    
+    last = ext;
+    done += segmentLen;
+  }
   
-  if (new_out == TAILQ_FIRST(&_timeoutHead))
-    updateTimeout();
+  return true;
 }
 
 
-void net_habitue_driver_SC101::removeTimeout(struct outstanding *out)
+SC101Transport::~SC101Transport()
 {
-  bool update = false;
-  
-  if (out == TAILQ_FIRST(&_timeoutHead))
-    update = true;
+  closeFlows();
   
-  TAILQ_REMOVE(&_timeoutHead, out, entries);
-
-  if (update)
-    updateTimeout();
+  while (_ringCount)
+    mbuf_freem(_ring[--_ringCount]);
 }
 
 
-void net_habitue_driver_SC101::updateTimeout()
+/* the connected socket for a unit, opening one while there are fewer than FLOW_SOCKETS.
+ * NULL for broadcasts and for units past the limit or whose socket couldn't be opened, which use the shared socket.
+ */
+socket_t SC101Transport::getFlow(const struct sockaddr_in *dest)
 {
-  struct outstanding *out = TAILQ_FIRST(&_timeoutHead);
+  if (dest->sin_addr.s_addr == INADDR_BROADCAST)
+    return NULL;
   
-  if (out)
-    _timerSource->wakeAtTime(*((AbsoluteTime *)&out->timeout));
+  for (uint32_t i = 0; i < _flowCount; i++)
+  {
+    if (_flows[i].addr.sin_addr.s_addr == dest->sin_addr.s_addr && _flows[i].addr.sin_port == dest->sin_port)
+      return _flows[i].so;
+  }
+  
+  if (_flowCount == FLOW_SOCKETS)
+    return NULL;
+  
+  struct sc101_flow *flow = &_flows[_flowCount++];
+  
+  flow->addr = *dest;
+  
+  if ((flow->so = _driver->openFlow(dest, _shard)))
+    _transportStats.flowSockets++;
   else
+    _transportStats.flowFailures++;
+  
+  return flow->so;
+}
+
+
+void SC101Transport::closeFlows()
+{
+  for (uint32_t i = 0; i < _flowCount; i++)
+  {
+    if (_flows[i].so)
+      sock_close(_flows[i].so);
+  }
+  
+  _flowCount = 0;
+  _transportStats.flowSockets = 0;
+}
+
+
+void SC101Transport::countHandoff(bool dropped)
+{
+  _transportStats.handoffs++;
+  
+  if (dropped)
+    _transportStats.handoffDrops++;
+}
+
+
+void SC101Transport::refill(mbuf_how_t how)
+{
+  while (_ringCount < PACKET_RING_SIZE)
+  {
+    mbuf_t m;
+    
+    if (mbuf_allocpacket(how, PACKET_HEADER_MAX, NULL, &m) != 0)
+      break;
+    
+    mbuf_setlen(m, 0);
+    mbuf_pkthdr_setlen(m, 0);
+    _ring[_ringCount++] = m;
+  }
+}
+
+
+/* the stack frees every packet we hand it, so ring mbufs are consumed rather than recycled; the ring just moves the
+ * allocation out of the send path, to the end of each workloop wakeup.
+ */
+mbuf_t SC101Transport::allocHeader(const void *header, size_t headerLen)
+{
+  mbuf_t m = NULL;
+  
+  if (headerLen <= PACKET_HEADER_MAX && _ringCount)
+  {
+    m = _ring[--_ringCount];
+  }
+  else
+  {
+    _transportStats.packetRingMisses++;
+    
+    if (mbuf_allocpacket(MBUF_DONTWAIT, headerLen, NULL, &m) != 0)
+    {
+      _transportStats.packetRingExhausted++;
+      return NULL;
+    }
+  }
+  
+  if (mbuf_copyback(m, 0, headerLen, header, MBUF_DONTWAIT) != 0)
+  {
+    KINFO("mbuf_copyback failed!");
+    mbuf_freem(m);
+    return NULL;
+  }
+  
+  return m;
+}
+
+
+/* write payloads are sent by reference when the buffer allows it, so neither the first send nor any retransmit copies
+ * them, and the header comes from the preallocated ring; otherwise header and payload are copied into a fresh packet.
+ */
+bool SC101Transport::sendPacket(const struct sockaddr_in *dest, const void *header, size_t headerLen,
+                                PSANBuffer *payload, uint64_t payloadOffset, size_t payloadLen, bool anyPeer)
+{
+  bool reference = (payload && payloadLen && payload->retainPages());
+  mbuf_t m;
+  
+  if (!payloadLen || reference)
+  {
+    if (!(m = allocHeader(header, headerLen)))
+    {
+      _transportStats.sendFailures++;
+      if (reference)
+        payload->releasePages();
+      return false;
+    }
+  }
+  else
+  {
+    if (mbuf_allocpacket(MBUF_WAITOK, headerLen + payloadLen, NULL, &m) != 0)
+    {
+      KINFO("mbuf_allocpacket failed!");
+      _transportStats.sendFailures++;
+      return false;
+    }
+    
+    if (mbuf_copyback(m, 0, headerLen, header, MBUF_WAITOK) != 0)
+    {
+      KINFO("mbuf_copyback failed!");
+      _transportStats.sendFailures++;
+      mbuf_freem(m);
+      return false;
+    }
+  }
+  
+  if (reference)
+  {
+    bool attached = mbuf_attach_buffer(m, payload, payloadOffset, payloadLen);
+    
+    payload->releasePages(); /* the attached mbufs hold their own */
+    
+    if (!attached)
+    {
+      KINFO("mbuf_attach_buffer failed");
+      _transportStats.sendFailures++;
+      mbuf_freem(m);
+      return false;
+    }
+  }
+  else if (payload && payloadLen && !mbuf_buffer(payload, payloadOffset, m, headerLen, payloadLen))
+  {
+    KINFO("mbuf_buffer failed");
+    _transportStats.sendFailures++;
+    mbuf_freem(m);
+    return false;
+  }
+  
+  socket_t so = (anyPeer ? NULL : getFlow(dest));
+  
+  if (!_driver->sendPacket(so, (so ? NULL : dest), m))
+  {
+    _transportStats.sendFailures++;
+    return false;
+  }
+  
+  return true;
+}
+
+
+void SC101Transport::setTimer(uint64_t deadline)
+{
+  IOTimerEventSource *timerSource = _shard->getTimerSource();
+  uint64_t abstime;
+  
+  if (!timerSource)
+    return;
+  
+  nanoseconds_to_absolutetime(deadline, &abstime);
+  timerSource->wakeAtTime(*((AbsoluteTime *)&abstime));
+}
+
+
+void SC101Transport::cancelTimer()
+{
+  IOTimerEventSource *timerSource = _shard->getTimerSource();
+  
+  if (timerSource)
+    timerSource->cancelTimeout();
+}
+
+
+SC101Packet::~SC101Packet()
+{
+  if (_m)
+    mbuf_freem(_m);
+}
+
+
+void *SC101Packet::pullup(size_t len)
+{
+  if (!_m || len > _len)
+    return NULL;
+  
+  if (mbuf_len(_m) < len &&
+      mbuf_pullup(&_m, len) != 0)
+  {
+    /* chain is freed on failure */
+    _m = NULL;
+    return NULL;
+  }
+  
+  return mbuf_data(_m);
+}
+
+
+bool SC101Packet::copyToBuffer(PSANBuffer *buffer, uint64_t bufferOffset, size_t packetOffset, size_t len)
+{
+  if (!_m)
+    return false;
+  
+  return mbuf_buffer(buffer, bufferOffset, _m, packetOffset, len);
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Shards
+/**********************************************************************************************************************************/
+
+
+#undef super
+#define super OSObject
+
+OSDefineMetaClassAndStructors(net_habitue_shard_SC101, OSObject)
+
+
+bool net_habitue_shard_SC101::init(net_habitue_driver_SC101 *driver, uint16_t index, uint16_t count)
+{
+  if (!super::init())
+    return false;
+  
+  _driver = driver;
+  _index = index;
+  _clientCount = 0;
+  _kickPending = false;
+  
+  _workLoop = NULL;
+  _interruptSource = NULL;
+  _timerSource = NULL;
+  _statisticsTimer = NULL;
+  _commandGate = NULL;
+  _transport = NULL;
+  _engine = NULL;
+  
+  _queueHead = 0;
+  _queueCount = 0;
+  
+  bzero(&_engineSnapshot, sizeof(_engineSnapshot));
+  bzero(&_transportSnapshot, sizeof(_transportSnapshot));
+  
+  if (!(_queueLock = IOSimpleLockAlloc()) ||
+      !(_statisticsLock = IOSimpleLockAlloc()))
+    return false;
+  
+  if (!(_workLoop = IOWorkLoop::workLoop()))
+  {
+    KINFO("shard %d: Failed to create work loop!", _index);
+    return false;
+  }
+  
+  /* set up command gate */
+  _commandGate = IOCommandGate::commandGate(this);
+  
+  if (!_commandGate || _workLoop->addEventSource(_commandGate) != kIOReturnSuccess)
+  {
+    KINFO("shard %d: Failed to set up command gate!", _index);
+    return false;
+  }
+  
+  /* set up interrupt event source, for the socket on shard 0 and for handoffs from it on the rest */
+  _interruptSource = IOInterruptEventSource::interruptEventSource(this,
+                                                                  OSMemberFunctionCast(IOInterruptEventAction, this, &net_habitue_shard_SC101::handleInterrupt));
+  
+  if (!_interruptSource || _workLoop->addEventSource(_interruptSource) != kIOReturnSuccess)
+  {
+    KINFO("shard %d: Failed to set up interrupt event source!", _index);
+    return false;
+  }
+  
+  /* set up timer event source */
+  _timerSource = IOTimerEventSource::timerEventSource(this,
+                                                      OSMemberFunctionCast(IOTimerEventSource::Action, this, &net_habitue_shard_SC101::timeoutOccurred));
+  
+  if (!_timerSource || _workLoop->addEventSource(_timerSource) != kIOReturnSuccess)
+  {
+    KINFO("shard %d: Failed to set up timer event source!", _index);
+    return false;
+  }
+  
+  if (!(_transport = new SC101Transport(driver, this)) ||
+      !(_engine = new PSANEngine(_transport)))
+  {
+    KINFO("shard %d: Failed to set up engine", _index);
+    return false;
+  }
+  
+  _engine->setShard(index, count);
+  
+  if (!_engine->init())
+  {
+    KINFO("shard %d: Failed to set up engine", _index);
+    return false;
+  }
+  
+  /* the engine's counters are snapshotted here on the workloop, for the driver to sum from shard 0 */
+  _statisticsTimer = IOTimerEventSource::timerEventSource(this,
+                                                          OSMemberFunctionCast(IOTimerEventSource::Action, this, &net_habitue_shard_SC101::handleStatisticsTimer));
+  
+  if (!_statisticsTimer || _workLoop->addEventSource(_statisticsTimer) != kIOReturnSuccess)
+  {
+    KINFO("shard %d: Failed to set up statistics timer!", _index);
+    return false;
+  }
+  
+  _statisticsTimer->setTimeoutMS(STATISTICS_INTERVAL_MS);
+  
+  return true;
+}
+
+
+/* tears down the flow sockets and event sources and fails everything outstanding; safe to call more than once.
+ * receives and timeouts are shut off first, so nothing else is touching the engine or the flow sockets, then the engine
+ * is stopped on the gate, which is still there for the completions it runs to wake waiting writers and syncs.
+ */
+void net_habitue_shard_SC101::stop()
+{
+  if (_statisticsTimer)
+  {
+    _statisticsTimer->cancelTimeout();
+    _statisticsTimer->disable();
+    _workLoop->removeEventSource(_statisticsTimer);
+    _statisticsTimer->release();
+    _statisticsTimer = NULL;
+  }
+  
+  if (_interruptSource)
+    _interruptSource->disable();
+  
+  if (_timerSource)
+  {
+    _timerSource->cancelTimeout();
+    _timerSource->disable();
+  }
+  
+  if (_commandGate)
+    _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &net_habitue_shard_SC101::safeStop));
+  else
+    safeStop();
+  
+  if (_timerSource)
+  {
     _timerSource->cancelTimeout();
+    _workLoop->removeEventSource(_timerSource);
+    _timerSource->release();
+    _timerSource = NULL;
+  }
+  
+  if (_interruptSource)
+  {
+    _workLoop->removeEventSource(_interruptSource);
+    _interruptSource->release();
+    _interruptSource = NULL;
+  }
+  
+  if (_commandGate)
+  {
+    _workLoop->removeEventSource(_commandGate);
+    _commandGate->release();
+    _commandGate = NULL;
+  }
+}
+
+
+void net_habitue_shard_SC101::safeStop()
+{
+  if (_transport)
+    _transport->closeFlows();
+  
+  if (_engine)
+    _engine->stop();
 }
 
 
-void net_habitue_driver_SC101::processTimeout()
+void net_habitue_shard_SC101::free(void)
 {
-  struct outstanding *out = TAILQ_FIRST(&_timeoutHead);
+  stop();
+  
+  if (_engine)
+  {
+    delete _engine;
+    _engine = NULL;
+  }
+  
+  if (_transport)
+  {
+    delete _transport;
+    _transport = NULL;
+  }
   
-  if (out)
+  if (_queueLock)
   {
-    unregisterPacketHandler(out);
-    out->timeoutHandler(out->target, out, out->ctx);
+    for (; _queueCount; _queueCount--, _queueHead = (_queueHead + 1) % SHARD_QUEUE_SIZE)
+      mbuf_freem(_queue[_queueHead].m);
+    
+    IOSimpleLockFree(_queueLock);
+    _queueLock = NULL;
   }
+  
+  if (_statisticsLock)
+  {
+    IOSimpleLockFree(_statisticsLock);
+    _statisticsLock = NULL;
+  }
+  
+  if (_workLoop)
+  {
+    _workLoop->release();
+    _workLoop = NULL;
+  }
+  
+  super::free();
+}
+
+
+/* the first nub on a shard fills its header ring, without blocking its workloop's sends later */
+void net_habitue_shard_SC101::addClient()
+{
+  if (OSIncrementAtomic(&_clientCount) == 0)
+    _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &net_habitue_shard_SC101::refill));
+}
+
+
+void net_habitue_shard_SC101::removeClient()
+{
+  OSDecrementAtomic(&_clientCount);
+}
+
+
+void net_habitue_shard_SC101::refill()
+{
+  _transport->refill(MBUF_WAITOK);
+}
+
+
+/* takes the mbuf, freeing it if the queue is full */
+bool net_habitue_shard_SC101::queuePacket(const struct sockaddr_in *addr, mbuf_t m, size_t len)
+{
+  bool queued = false;
+  
+  IOSimpleLockLock(_queueLock);
+  
+  if (_queueCount < SHARD_QUEUE_SIZE)
+  {
+    struct sc101_handoff *handoff = &_queue[(_queueHead + _queueCount) % SHARD_QUEUE_SIZE];
+    
+    handoff->addr = *addr;
+    handoff->m = m;
+    handoff->len = len;
+    _queueCount++;
+    queued = true;
+  }
+  
+  IOSimpleLockUnlock(_queueLock);
+  
+  if (queued)
+    _kickPending = true;
+  else
+    mbuf_freem(m);
+  
+  return queued;
+}
+
+
+/* one wakeup per batch of handoffs rather than per packet */
+void net_habitue_shard_SC101::kick()
+{
+  if (!_kickPending)
+    return;
+  
+  _kickPending = false;
+  _interruptSource->interruptOccurred(NULL, NULL, NULL);
+}
+
+
+uint32_t net_habitue_shard_SC101::dequeuePackets(uint32_t budget)
+{
+  struct sc101_handoff batch[RECEIVE_BATCH];
+  uint32_t handled = 0;
+  
+  while (handled < budget)
+  {
+    uint32_t count = 0;
+    uint32_t want = min(RECEIVE_BATCH, budget - handled);
+    
+    IOSimpleLockLock(_queueLock);
+    
+    for (; _queueCount && count < want; _queueCount--, _queueHead = (_queueHead + 1) % SHARD_QUEUE_SIZE)
+      batch[count++] = _queue[_queueHead];
+    
+    IOSimpleLockUnlock(_queueLock);
+    
+    if (!count)
+      break;
+    
+    for (uint32_t i = 0; i < count; i++)
+    {
+      SC101Packet packet(batch[i].m, batch[i].len);
+      
+      _engine->handlePacket(&batch[i].addr, &packet);
+    }
+    
+    handled += count;
+  }
+  
+  return handled;
+}
+
+
+/* upcalls coalesce into one wakeup, so rather than trusting count, drain the socket (on shard 0) until it would block.
+ * after RECEIVE_BUDGET packets, reschedule ourselves so timers and commands queued on the workloop get a turn.
+ */
+void net_habitue_shard_SC101::handleInterrupt(IOInterruptEventSource *sender, int count)
+{
+  uint32_t received;
+  
+  _engine->beginBatch();
+  
+  received = dequeuePackets(RECEIVE_BUDGET);
+  
+  if (_index == 0 && received < RECEIVE_BUDGET)
+    received += _driver->receivePackets(this, NULL, RECEIVE_BUDGET - received);
+  
+  for (uint32_t i = 0; i < _transport->getFlowCount() && received < RECEIVE_BUDGET; i++)
+  {
+    if (_transport->getFlowSocket(i))
+      received += _driver->receivePackets(this, _transport->getFlowSocket(i), RECEIVE_BUDGET - received);
+  }
+  
+  bool exhausted = (received == RECEIVE_BUDGET);
+  
+  _engine->endBatch(received, exhausted);
+  
+  if (exhausted)
+    _interruptSource->interruptOccurred(NULL, NULL, NULL);
+  
+  _transport->refill(MBUF_DONTWAIT);
+}
+
+
+void net_habitue_shard_SC101::timeoutOccurred(IOTimerEventSource *sender)
+{
+  _engine->timeoutOccurred();
+  
+  _transport->refill(MBUF_DONTWAIT);
+}
+
+
+/* the engine and transport update their counters unlocked on this workloop, so other shards only see copies */
+void net_habitue_shard_SC101::handleStatisticsTimer(IOTimerEventSource *sender)
+{
+  IOSimpleLockLock(_statisticsLock);
+  _engineSnapshot = *_engine->getStatistics();
+  _transportSnapshot = *_transport->getTransportStatistics();
+  IOSimpleLockUnlock(_statisticsLock);
+  
+  if (_index == 0)
+    _driver->updateStatistics();
+  
+  _statisticsTimer->setTimeoutMS(STATISTICS_INTERVAL_MS);
+}
+
+
+void net_habitue_shard_SC101::copyStatistics(struct psan_engine_stats *stats, struct psan_transport_stats *transportStats)
+{
+  IOSimpleLockLock(_statisticsLock);
+  *stats = _engineSnapshot;
+  *transportStats = _transportSnapshot;
+  IOSimpleLockUnlock(_statisticsLock);
 }
@@ -4,6 +4,7 @@
 #import <IOKit/IOInterruptEventSource.h>
 #import <IOKit/IOTimerEventSource.h>
 #import <IOKit/IOCommandGate.h>
+#import <IOKit/IOLocks.h>
 #import <IOKit/storage/IOStorage.h>
 #import <IOKit/storage/IOBlockStorageDriver.h>
 #import <IOKit/storage/IOBlockStorageDevice.h>
@@ -16,26 +17,141 @@ extern "C" {
 #import <sys/queue.h>
 }
 
-typedef void (*PacketHandler)(OSObject *owner, struct sockaddr_in *addr, mbuf_t m, size_t len, struct outstanding *, void *ctx);
-typedef void (*TimeoutHandler)(OSObject *owner, struct outstanding *, void *ctx);
-
-struct outstanding {
-  uint8_t cmd;
-  int16_t seq;
-  uint16_t len;
-  
-  PacketHandler packetHandler;
-  TimeoutHandler timeoutHandler;
-  OSObject *target;
-  void *ctx;
-  
-  UInt32 timeout_ms;
-  UInt64 timeout; /* auto-filled by addTimeout routine */
-
-  TAILQ_ENTRY(outstanding) entries;
+#import "PSANEngine.h"
+
+class net_habitue_driver_SC101;
+class net_habitue_shard_SC101;
+class net_habitue_volume_SC101;
+
+
+/* a socket connected to one unit, NULL if it couldn't be opened */
+struct sc101_flow {
+  struct sockaddr_in addr;
+  socket_t so;
+};
+
+
+/* glue between the portable engine and the kernel socket/timer, one per shard */
+class SC101Transport : public PSANTransport
+  {
+  public:
+    SC101Transport(net_habitue_driver_SC101 *driver, net_habitue_shard_SC101 *shard) : _driver(driver), _shard(shard), _ringCount(0), _flowCount(0) {}
+    virtual ~SC101Transport();
+
+    virtual bool sendPacket(const struct sockaddr_in *dest, const void *header, size_t headerLen,
+                            PSANBuffer *payload, uint64_t payloadOffset, size_t payloadLen, bool anyPeer);
+    virtual void setTimer(uint64_t deadline);
+    virtual void cancelTimer();
+
+    /* top the header mbuf ring back up to PACKET_RING_SIZE */
+    void refill(mbuf_how_t how);
+    void countHandoff(bool dropped);
+
+    /* connected sockets are opened on first use and must be closed before the shard's interrupt source goes away */
+    uint32_t getFlowCount() { return _flowCount; }
+    socket_t getFlowSocket(uint32_t i) { return _flows[i].so; }
+    void closeFlows();
+  protected:
+    mbuf_t allocHeader(const void *header, size_t headerLen);
+    socket_t getFlow(const struct sockaddr_in *dest);
+
+    net_habitue_driver_SC101 *_driver;
+    net_habitue_shard_SC101 *_shard;
+    mbuf_t _ring[PACKET_RING_SIZE]; /* empty packet header mbufs, used from the top */
+    uint32_t _ringCount;
+    struct sc101_flow _flows[FLOW_SOCKETS];
+    uint32_t _flowCount;
+  };
+
+
+/* a received mbuf chain, as seen by the engine */
+class SC101Packet : public PSANPacket
+  {
+  public:
+    SC101Packet(mbuf_t m, size_t len) : _m(m), _len(len) {}
+    virtual ~SC101Packet();
+
+    virtual size_t getLength() { return _len; }
+    virtual void *pullup(size_t len);
+    virtual bool copyToBuffer(PSANBuffer *buffer, uint64_t bufferOffset, size_t packetOffset, size_t len);
+  protected:
+    mbuf_t _m;
+    size_t _len;
+  };
+
+
+/* a response waiting for its shard's workloop */
+struct sc101_handoff {
+  struct sockaddr_in addr;
+  mbuf_t m;
+  size_t len;
 };
 
-TAILQ_HEAD(timeoutQueue, outstanding);
+
+/* one workloop with its own engine, transport, timer and command gate, serving the nubs assigned to it.
+ * the shared socket is drained on shard 0, which queues each response for the shard whose engine sent the request.
+ */
+class net_habitue_shard_SC101 : public OSObject
+  {
+    OSDeclareDefaultStructors(net_habitue_shard_SC101)
+  public:
+    virtual bool init(net_habitue_driver_SC101 *driver, uint16_t index, uint16_t count);
+    void stop();
+
+    IOWorkLoop *getWorkLoop() { return _workLoop; }
+    IOCommandGate *getCommandGate() { return _commandGate; }
+    IOTimerEventSource *getTimerSource() { return _timerSource; }
+    IOInterruptEventSource *getInterruptSource() { return _interruptSource; }
+    PSANEngine *getEngine() { return _engine; }
+    SC101Transport *getTransport() { return _transport; }
+    uint16_t getIndex() { return _index; }
+
+    // called from driver and device
+    uint32_t getClientCount() { return (uint32_t)_clientCount; }
+    void addClient();
+    void removeClient();
+    
+    // called from shard 0
+    bool queuePacket(const struct sockaddr_in *addr, mbuf_t m, size_t len);
+    void kick();
+    /* the counters as of the shard's last statistics timer, safe from any thread */
+    void copyStatistics(struct psan_engine_stats *stats, struct psan_transport_stats *transportStats);
+  protected:
+    virtual void free(void);
+
+    // called from workloop
+    void handleInterrupt(IOInterruptEventSource *sender, int count);
+    void timeoutOccurred(IOTimerEventSource *sender);
+    void refill();
+    void safeStop();
+    void handleStatisticsTimer(IOTimerEventSource *sender);
+
+    uint32_t dequeuePackets(uint32_t budget);
+
+    net_habitue_driver_SC101 *_driver;
+    uint16_t _index;
+    volatile SInt32 _clientCount;
+    bool _kickPending; /* shard 0 queued something for us this batch */
+
+    IOWorkLoop *_workLoop;
+    IOInterruptEventSource *_interruptSource;
+    IOTimerEventSource *_timerSource;
+    IOTimerEventSource *_statisticsTimer;
+    IOCommandGate *_commandGate;
+
+    SC101Transport *_transport;
+    PSANEngine *_engine;
+
+    IOSimpleLock *_queueLock;
+    struct sc101_handoff _queue[SHARD_QUEUE_SIZE]; /* ring, filled by shard 0 */
+    uint32_t _queueHead;
+    uint32_t _queueCount;
+
+    IOSimpleLock *_statisticsLock;
+    struct psan_engine_stats _engineSnapshot;
+    struct psan_transport_stats _transportSnapshot;
+  };
+
 
 class net_habitue_driver_SC101 : public IOService
   {
@@ -46,38 +162,32 @@ class net_habitue_driver_SC101 : public IOService
     virtual IOReturn setProperties(OSObject *properties);
     virtual IOWorkLoop* getWorkLoop();
     
-    // called from workloop
-    virtual void timeoutOccurred(IOTimerEventSource *sender);
-    virtual void handleInterrupt(IOInterruptEventSource *sender, int count);
+    // called from a shard's workloop; so is NULL for the shared socket (drained on shard 0 only)
+    uint32_t receivePackets(net_habitue_shard_SC101 *shard, socket_t so, uint32_t budget);
+    // called from shard 0's statistics timer
+    void updateStatistics();
 
-    // called from device
-    uint16_t getSequenceNumber();
-    bool sendPacket(struct sockaddr_in *dest, mbuf_t m, struct outstanding *out);
+    // called from device, which keeps the reference
+    net_habitue_shard_SC101 *attachShard();
+
+    // called from transport; dest is NULL on a connected socket
+    bool sendPacket(socket_t so, const struct sockaddr_in *dest, mbuf_t m);
+    socket_t openFlow(const struct sockaddr_in *dest, net_habitue_shard_SC101 *shard);
   protected:
-    bool setupEventLoop();
-    void cleanupEventLoop();
+    bool setupShards();
+    void cleanupShards();
     bool setupSocket();
     void cleanupSocket();
     
-    void receivePacket();
-    void handlePacket(struct sockaddr_in *addr, mbuf_t m, size_t len);
-    void registerPacketHandler(struct outstanding *out);
-    void unregisterPacketHandler(struct outstanding *out);
-    
-    void addTimeout(struct outstanding *out);
-    void removeTimeout(struct outstanding *out);
-    void updateTimeout();
-    void processTimeout();
+    bool receivePacket(net_habitue_shard_SC101 *shard, socket_t so);
+    void setupStatistics();
     
     void addClient(OSDictionary *table);
+    void addVolume(net_habitue_volume_SC101 *volume, OSDictionary *table);
 
-    IOWorkLoop *_workLoop;
-    IOInterruptEventSource *_interruptSource;
-    IOTimerEventSource *_timerSource;
-    IOCommandGate *_commandGate;
+    net_habitue_shard_SC101 **_shards;
+    uint16_t _shardCount;
     socket_t _so;
-    uint16_t _seq;
 
-    struct outstanding **outstanding;
-    struct timeoutQueue _timeoutHead;
+    OSNumber **_statistics; /* in gSC101DriverStatistics order, owned by the Statistics property */
   };
@@ -26,17 +26,118 @@
 
 //
 #define kSC101DriverSummonKey "SummonNub"
+#define kSC101DriverSummonStripeKey "SummonStripe"
+#define kSC101DriverSummonMirrorKey "SummonMirror"
 
 // property keys
 #define kSC101DeviceIDKey "ID"
 #define kSC101DeviceIOMaxReadSizeKey "IOMaxReadSize"
 #define kSC101DeviceIOMaxWriteSizeKey "IOMaxWriteSize"
+#define kSC101DeviceIOSizeProbingKey "IOSizeProbing"
+#define kSC101DeviceIOReadSizeKey "IOReadSize"
+#define kSC101DeviceIOWriteSizeKey "IOWriteSize"
+#define kSC101DeviceRetransmitMinKey "RetransmitMinMS"
+#define kSC101DeviceRetransmitMaxKey "RetransmitMaxMS"
+#define kSC101DeviceCacheSizeKey "CacheSize"
+#define kSC101DeviceCacheLineSizeKey "CacheLineSize"
+#define kSC101DeviceWriteBackKey "WriteBack"
+#define kSC101DeviceSchedulerKey "Scheduler"
+#define kSC101DeviceReadDeadlineKey "ReadDeadlineMS"
+#define kSC101DeviceWriteDeadlineKey "WriteDeadlineMS"
+#define kSC101DeviceReadDepthKey "ReadQueueDepth"
+#define kSC101DeviceWriteDepthKey "WriteQueueDepth"
+#define kSC101DeviceHedgeBudgetKey "HedgeBudgetPercent"
+#define kSC101DeviceHedgePercentileKey "HedgePercentile"
 #define kSC101DevicePartitionAddressKey "Partition Address"
 #define kSC101DeviceRootAddressKey "Root Address"
 #define kSC101DevicePartNumberKey "Part Number"
 #define kSC101DeviceVersionKey "Firmware Version"
 #define kSC101DeviceLabelKey "Label"
 #define kSC101DeviceSizeKey "Size"
+#define kSC101DeviceStatisticsKey "Statistics"
+#define kSC101DeviceShardKey "Workloop Shard"
+
+// volume property keys (its name is under kSC101DeviceIDKey)
+#define kSC101VolumeMembersKey "Members"
+#define kSC101VolumeStripeUnitKey "StripeUnit"
+
+// statistics keys
+#define kSC101DeviceIOWindowKey "IO Window"
+#define kSC101DeviceIOWindowMaxKey "IO Window Max"
+#define kSC101DeviceIOWindowReductionsKey "IO Window Reductions"
+#define kSC101DeviceTimeoutsKey "Timeouts"
+#define kSC101DeviceLateResponsesKey "Late Responses"
+#define kSC101DeviceLateWaitKey "Late Response Wait NS"
+#define kSC101DeviceLateWaitMaxKey "Late Response Wait Max NS"
+#define kSC101DeviceErrorsKey "Errors"
+#define kSC101DeviceReadBytesKey "Bytes (Read)"
+#define kSC101DeviceReadBytesCopiedKey "Bytes Copied (Read)"
+#define kSC101DevicePreparesKey "Prepares"
+#define kSC101DevicePreparesSavedKey "Prepares Saved"
+#define kSC101DeviceRequestPoolHighWaterKey "Request Pool High Water"
+#define kSC101DeviceIOPoolHighWaterKey "IO Pool High Water"
+#define kSC101DeviceDeblockPoolHighWaterKey "Deblock Pool High Water"
+#define kSC101DeviceCarrierPoolHighWaterKey "Carrier Pool High Water"
+#define kSC101DevicePoolWaitsKey "Pool Waits"
+#define kSC101DevicePoolExhaustedKey "Pool Exhausted"
+#define kSC101DeviceReadAheadHitsKey "Read-Ahead Hits"
+#define kSC101DeviceReadAheadMissesKey "Read-Ahead Misses"
+#define kSC101DeviceReadAheadBytesKey "Read-Ahead Bytes"
+#define kSC101DeviceReadAheadWastedKey "Read-Ahead Wasted Bytes"
+#define kSC101DeviceCacheHitsKey "Cache Hits"
+#define kSC101DeviceCacheMissesKey "Cache Misses"
+#define kSC101DeviceCacheCoalescedKey "Cache Coalesced Misses"
+#define kSC101DeviceCacheEvictionsKey "Cache Evictions"
+#define kSC101DeviceWriteBackBytesKey "Write-Back Bytes"
+#define kSC101DeviceWriteBackFlushesKey "Write-Back Flushes"
+#define kSC101DeviceWriteBackFlushBytesKey "Write-Back Flushed Bytes"
+#define kSC101DeviceWriteBackErrorsKey "Write-Back Errors"
+#define kSC101DeviceWriteBackReadHitsKey "Write-Back Read Hits"
+#define kSC101DeviceWriteBackReadMergesKey "Write-Back Read Merges"
+#define kSC101DeviceSyncsKey "Synchronizes"
+#define kSC101DeviceCoalescedWritesKey "Coalesced Writes"
+#define kSC101DeviceCoalescedPutsKey "Coalesced PUTs"
+#define kSC101DeviceCoalescedReadsKey "Coalesced Reads"
+#define kSC101DeviceCoalescedGetsKey "Coalesced GETs"
+#define kSC101DeviceOverReadsKey "Rounded Up GETs"
+#define kSC101DeviceOverReadBytesKey "Rounded Up Bytes"
+#define kSC101DeviceQueuedReadsKey "Queued Reads"
+#define kSC101DeviceQueuedWritesKey "Queued Writes"
+#define kSC101DeviceQueueWaitReadsKey "Queue Wait NS (Read)"
+#define kSC101DeviceQueueWaitWritesKey "Queue Wait NS (Write)"
+#define kSC101DeviceQueueWaitMaxReadKey "Queue Wait Max NS (Read)"
+#define kSC101DeviceQueueWaitMaxWriteKey "Queue Wait Max NS (Write)"
+#define kSC101DeviceQueueExpiredKey "Queue Deadlines Expired"
+#define kSC101DeviceQueueWritesStarvedKey "Queue Writes Starved"
+#define kSC101DeviceIOReadLimitKey "IO Size Limit (Read)"
+#define kSC101DeviceIOWriteLimitKey "IO Size Limit (Write)"
+#define kSC101DeviceIOSizeTrialsKey "IO Sizes Tried"
+#define kSC101DeviceIOSizeRaisesKey "IO Sizes Raised"
+#define kSC101DeviceIOSizeFallbacksKey "IO Sizes Lowered"
+#define kSC101DeviceIOResplitsKey "IO Resplits"
+#define kSC101DeviceHedgesFiredKey "Hedged Reads"
+#define kSC101DeviceHedgesWonKey "Hedged Reads Won"
+#define kSC101DeviceHedgesDeniedKey "Hedged Reads Over Budget"
+
+// driver statistics keys
+#define kSC101DriverStatisticsKey "Statistics"
+#define kSC101DriverStaleResponsesKey "Stale Responses"
+#define kSC101DriverLateResponsesKey "Late Responses"
+#define kSC101DriverDuplicateResponsesKey "Duplicate Responses"
+#define kSC101DriverForeignResponsesKey "Foreign Responses"
+#define kSC101DriverMismatchedResponsesKey "Mismatched Responses"
+#define kSC101DriverRequestTableResizesKey "Request Table Resizes"
+#define kSC101DriverReceiveBatchesKey "Receive Batches"
+#define kSC101DriverReceivePacketsKey "Receive Packets"
+#define kSC101DriverReceiveBatchMaxKey "Receive Batch Max"
+#define kSC101DriverReceiveBudgetExhaustedKey "Receive Budget Exhausted"
+#define kSC101DriverSendFailuresKey "Send Failures"
+#define kSC101DriverPacketRingMissesKey "Packet Ring Misses"
+#define kSC101DriverPacketRingExhaustedKey "Packet Ring Exhausted"
+#define kSC101DriverHandoffsKey "Handoffs"
+#define kSC101DriverHandoffDropsKey "Handoff Drops"
+#define kSC101DriverFlowSocketsKey "Flow Sockets"
+#define kSC101DriverFlowFailuresKey "Flow Socket Failures"
 
 // part numbers
 #define kSC101PartNumber ((unsigned char[3]){ 0, 0, 101 })
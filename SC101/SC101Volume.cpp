@@ -0,0 +1,1482 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#import <IOKit/IOMultiMemoryDescriptor.h>
+
+#import "SC101Volume.h"
+#import "SC101Device.h"
+
+extern "C" {
+#import <libkern/OSAtomic.h>
+};
+
+static const OSSymbol *gSC101DeviceIDKey;
+static const OSSymbol *gSC101VolumeMembersKey;
+static const OSSymbol *gSC101VolumeStripeUnitKey;
+
+#define REQUEST_SIZE(count) (sizeof(struct sc101_volume_request) + ((count) - 1) * sizeof(struct sc101_volume_part))
+
+// block numbers are 32 bits at this layer, so a volume stops at this many however big its members are
+#define VOLUME_BLOCKS_MAX (1ULL << 32)
+
+// Define my superclass
+#define super IOBlockStorageDevice
+
+OSDefineMetaClassAndAbstractStructors(net_habitue_volume_SC101, IOBlockStorageDevice)
+
+
+/**********************************************************************************************************************************/
+#pragma mark IOService stubs
+/**********************************************************************************************************************************/
+
+bool net_habitue_volume_SC101::init(OSDictionary *properties)
+{
+  KINFO("init");
+
+  gSC101DeviceIDKey = OSSymbol::withCString(kSC101DeviceIDKey);
+  gSC101VolumeMembersKey = OSSymbol::withCString(kSC101VolumeMembersKey);
+  gSC101VolumeStripeUnitKey = OSSymbol::withCString(kSC101VolumeStripeUnitKey);
+
+  _workLoop = NULL;
+  _kickSource = NULL;
+  _completionLock = NULL;
+  TAILQ_INIT(&_completions);
+  _members = NULL;
+  _memberCount = 0;
+  _mediaStateEjected = false;
+  _mediaStateAttached = false;
+
+  OSString *id = OSDynamicCast(OSString, properties->getObject(gSC101DeviceIDKey));
+  if (!id)
+    return false;
+
+  OSArray *members = OSDynamicCast(OSArray, properties->getObject(gSC101VolumeMembersKey));
+  if (!members || members->getCount() < 2 || members->getCount() > VOLUME_MEMBERS_MAX)
+    return false;
+
+  for (UInt32 i = 0; i < members->getCount(); i++)
+  {
+    OSString *member = OSDynamicCast(OSString, members->getObject(i));
+    if (!member)
+      return false;
+
+    for (UInt32 j = 0; j < i; j++)
+    {
+      if (member->isEqualTo(OSDynamicCast(OSString, members->getObject(j))))
+        return false;
+    }
+  }
+
+  if (!super::init(properties))
+    return false;
+
+  _memberCount = members->getCount();
+
+  if (!(_completionLock = IOLockAlloc()))
+    return false;
+
+  if (!(_workLoop = IOWorkLoop::workLoop()))
+  {
+    KINFO("%s: Failed to create work loop!", getName());
+    return false;
+  }
+
+  /* set up interrupt event source, kicked by completions with work for the workloop */
+  _kickSource = IOInterruptEventSource::interruptEventSource(this,
+                                                             OSMemberFunctionCast(IOInterruptEventAction, this, &net_habitue_volume_SC101::handleKick));
+
+  if (!_kickSource || _workLoop->addEventSource(_kickSource) != kIOReturnSuccess)
+  {
+    KINFO("%s: Failed to set up interrupt event source!", getName());
+    return false;
+  }
+
+  return true;
+}
+
+
+void net_habitue_volume_SC101::free(void)
+{
+  if (_kickSource)
+  {
+    _kickSource->disable();
+    _workLoop->removeEventSource(_kickSource);
+    _kickSource->release();
+    _kickSource = NULL;
+  }
+
+  if (_workLoop)
+  {
+    _workLoop->release();
+    _workLoop = NULL;
+  }
+
+  if (_completionLock)
+  {
+    IOLockFree(_completionLock);
+    _completionLock = NULL;
+  }
+
+  if (_members)
+  {
+    for (UInt32 i = 0; i < _memberCount; i++)
+    {
+      if (_members[i])
+        _members[i]->release();
+    }
+
+    IODelete(_members, net_habitue_device_SC101 *, _memberCount);
+    _members = NULL;
+  }
+
+  super::free();
+}
+
+
+/* the members are the provider's nubs, found by ID. they stay attached to it and are only borrowed here, their own
+ * media out of service until the volume is detached. one already borrowed by another volume fails the attach.
+ */
+bool net_habitue_volume_SC101::attach(IOService *provider)
+{
+  OSArray *members = OSDynamicCast(OSArray, getProperty(gSC101VolumeMembersKey));
+
+  if (!_members)
+  {
+    _members = IONew(net_habitue_device_SC101 *, _memberCount);
+
+    if (!_members)
+      return false;
+
+    bzero(_members, _memberCount * sizeof(_members[0]));
+  }
+
+  OSIterator *childIterator = provider->getClientIterator();
+
+  if (childIterator)
+  {
+    OSObject *child;
+
+    while ((child = childIterator->getNextObject()))
+    {
+      net_habitue_device_SC101 *candidate = OSDynamicCast(net_habitue_device_SC101, child);
+
+      if (!candidate)
+        continue;
+
+      for (UInt32 i = 0; i < _memberCount; i++)
+      {
+        if (_members[i] || !candidate->getID()->isEqualTo(OSDynamicCast(OSString, members->getObject(i))))
+          continue;
+
+        candidate->retain();
+        _members[i] = candidate;
+      }
+    }
+
+    childIterator->release();
+  }
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (!_members[i])
+    {
+      KINFO("%s: member %s isn't attached", getName(), OSDynamicCast(OSString, members->getObject(i))->getCStringNoCopy());
+      return false;
+    }
+  }
+
+  UInt32 claimed;
+
+  for (claimed = 0; claimed < _memberCount; claimed++)
+  {
+    if (!_members[claimed]->claim())
+      break;
+  }
+
+  if (claimed < _memberCount || !super::attach(provider))
+  {
+    while (claimed--)
+      _members[claimed]->unclaim();
+
+    return false;
+  }
+
+  return true;
+}
+
+
+void net_habitue_volume_SC101::detach(IOService *provider)
+{
+  super::detach(provider);
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+    _members[i]->unclaim();
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark IOBlockStorageDevice stubs
+/**********************************************************************************************************************************/
+
+IOReturn net_habitue_volume_SC101::doEjectMedia(void)
+{
+  IOReturn ret = doSynchronizeCache();
+  if (ret != kIOReturnSuccess)
+    return ret;
+
+  _mediaStateEjected = true;
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::doFormatMedia(UInt64 byteCapacity)
+{
+  return kIOReturnUnsupported;
+}
+
+UInt32 net_habitue_volume_SC101::doGetFormatCapacities(UInt64 *capacities, UInt32 capacitiesMaxCount) const
+{
+  return 0;
+}
+
+IOReturn net_habitue_volume_SC101::doLockUnlockMedia(bool doLock)
+{
+  return kIOReturnUnsupported;
+}
+
+
+/* every member is flushed, even after one fails */
+IOReturn net_habitue_volume_SC101::doSynchronizeCache(void)
+{
+  IOReturn ret = kIOReturnSuccess;
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    IOReturn memberRet = _members[i]->doSynchronizeCache();
+
+    if (ret == kIOReturnSuccess)
+      ret = memberRet;
+  }
+
+  return ret;
+}
+
+
+char *net_habitue_volume_SC101::getVendorString(void)
+{
+  return (char *)"Netgear";
+}
+
+
+char *net_habitue_volume_SC101::getRevisionString(void)
+{
+  return (char *)"";
+}
+
+
+char *net_habitue_volume_SC101::getAdditionalDeviceInfoString(void)
+{
+  return (char *)getID()->getCStringNoCopy();
+}
+
+
+IOReturn net_habitue_volume_SC101::reportBlockSize(UInt64 *blockSize)
+{
+  *blockSize = SECTOR_SIZE;
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::reportEjectability(bool *isEjectable)
+{
+  *isEjectable = true;
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::reportLockability(bool *isLockable)
+{
+  *isLockable = false;
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::reportMaxReadTransfer(UInt64 blockSize, UInt64 *max)
+{
+  *max = getMemberMaxTransfer(false);
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::reportMaxWriteTransfer(UInt64 blockSize, UInt64 *max)
+{
+  *max = getMemberMaxTransfer(true);
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::reportMediaState(bool *mediaPresent, bool *changed)
+{
+  bool present = checkMediaPresent();
+
+  *mediaPresent = present;
+  *changed = (present != _mediaStateAttached);
+
+  if (*changed)
+  {
+    KINFO("media now %s", present ? "present" : "missing");
+    _mediaStateAttached = present;
+  }
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::reportPollRequirements(bool *pollIsRequired, bool *pollIsExpensive)
+{
+  *pollIsRequired = true;
+  *pollIsExpensive = false;
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::reportRemovability(bool *isRemovable)
+{
+  *isRemovable = true;
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_volume_SC101::reportWriteProtection(bool *isWriteProtected)
+{
+  *isWriteProtected = false;
+
+  for (UInt32 i = 0; i < _memberCount && !*isWriteProtected; i++)
+    _members[i]->reportWriteProtection(isWriteProtected);
+
+  return kIOReturnSuccess;
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark functions
+/**********************************************************************************************************************************/
+
+
+OSString *net_habitue_volume_SC101::getID()
+{
+  return OSDynamicCast(OSString, getProperty(gSC101DeviceIDKey));
+}
+
+
+IOWorkLoop *net_habitue_volume_SC101::getWorkLoop()
+{
+  return _workLoop;
+}
+
+
+/* the volume goes away with any of its members */
+bool net_habitue_volume_SC101::checkMediaPresent()
+{
+  bool present = !_mediaStateEjected;
+
+  for (UInt32 i = 0; i < _memberCount && present; i++)
+    present = _members[i]->isMediaPresent();
+
+  return present;
+}
+
+
+UInt64 net_habitue_volume_SC101::getMemberBlocks()
+{
+  UInt64 blocks = 0;
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    UInt64 maxBlock;
+
+    if (!_members[i]->isMediaPresent() || _members[i]->reportMaxValidBlock(&maxBlock) != kIOReturnSuccess)
+      return 0;
+
+    if (i == 0 || maxBlock + 1 < blocks)
+      blocks = maxBlock + 1;
+  }
+
+  return blocks;
+}
+
+
+UInt64 net_habitue_volume_SC101::getMemberMaxTransfer(bool isWrite)
+{
+  UInt64 max = 0;
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    UInt64 memberMax;
+
+    if (isWrite)
+      _members[i]->reportMaxWriteTransfer(SECTOR_SIZE, &memberMax);
+    else
+      _members[i]->reportMaxReadTransfer(SECTOR_SIZE, &memberMax);
+
+    if (i == 0 || memberMax < max)
+      max = memberMax;
+  }
+
+  return max;
+}
+
+
+struct sc101_volume_request *net_habitue_volume_SC101::allocRequest(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks,
+                                                                    IOStorageCompletion completion, UInt32 count)
+{
+  struct sc101_volume_request *request = (struct sc101_volume_request *)IOMalloc(REQUEST_SIZE(count));
+
+  if (!request)
+    return NULL;
+
+  /* wired once up front, so the members (maybe on several workloops at once) only ever add to the wire count */
+  if (buffer->prepare() != kIOReturnSuccess)
+  {
+    IOFree(request, REQUEST_SIZE(count));
+    return NULL;
+  }
+
+  bzero(request, REQUEST_SIZE(count));
+  request->completion = completion;
+  request->buffer = buffer;
+  request->block = block;
+  request->nblks = nblks;
+  request->pending = 1;
+  request->count = count;
+
+  return request;
+}
+
+
+/* for a request none of whose parts were issued */
+void net_habitue_volume_SC101::freeRequest(struct sc101_volume_request *request)
+{
+  request->buffer->complete();
+  IOFree(request, REQUEST_SIZE(request->count));
+}
+
+
+/* takes the reference on buffer. a NULL one (a failed allocation) fails the part without bothering the member */
+void net_habitue_volume_SC101::issuePart(struct sc101_volume_request *request, UInt32 i, UInt32 member,
+                                         IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks)
+{
+  struct sc101_volume_part *part = &request->parts[i];
+
+  part->request = request;
+  part->buffer = buffer;
+  part->member = member;
+  part->block = block;
+  part->nblks = nblks;
+  OSIncrementAtomic(&request->pending);
+
+  if (!buffer)
+  {
+    finishPart(part, kIOReturnNoMemory, 0);
+    return;
+  }
+
+  sendPart(part);
+}
+
+
+/* to part->member, which may block here until it has room */
+void net_habitue_volume_SC101::sendPart(struct sc101_volume_part *part)
+{
+  IOStorageCompletion completion;
+  completion.target = this;
+  completion.action = OSMemberFunctionCast(IOStorageCompletionAction, this, &net_habitue_volume_SC101::partCompletion);
+  completion.parameter = part;
+
+  part->sent = psan_uptime_ns();
+  part->tried |= (1 << part->member);
+
+  _members[part->member]->doAsyncReadWrite(part->buffer, part->block, part->nblks, completion);
+}
+
+
+void net_habitue_volume_SC101::finishIssuing(struct sc101_volume_request *request)
+{
+  if (OSDecrementAtomic(&request->pending) == 1)
+    queueRequest(request);
+}
+
+
+/* on the member's workloop */
+void net_habitue_volume_SC101::partCompletion(void *parameter, IOReturn status, UInt64 actualByteCount)
+{
+  finishPart((struct sc101_volume_part *)parameter, status, actualByteCount);
+}
+
+
+void net_habitue_volume_SC101::finishPart(struct sc101_volume_part *part, IOReturn status, UInt64 actualByteCount)
+{
+  struct sc101_volume_request *request = part->request;
+
+  part->status = status;
+  part->actualByteCount = actualByteCount;
+
+  if (part->buffer)
+  {
+    part->buffer->release();
+    part->buffer = NULL;
+  }
+
+  if (OSDecrementAtomic(&request->pending) == 1)
+    queueRequest(request);
+}
+
+
+/* a member's completion runs inside its gate, where a client starting its next request (on another member, maybe) could
+ * deadlock against that member's completions; so requests are completed from the volume's own workloop instead
+ */
+void net_habitue_volume_SC101::queueRequest(struct sc101_volume_request *request)
+{
+  IOLockLock(_completionLock);
+  TAILQ_INSERT_TAIL(&_completions, request, entries);
+  IOLockUnlock(_completionLock);
+
+  _kickSource->interruptOccurred(NULL, NULL, 0);
+}
+
+
+void net_habitue_volume_SC101::handleKick(IOInterruptEventSource *sender, int count)
+{
+  completeRequests();
+}
+
+
+void net_habitue_volume_SC101::completeRequests()
+{
+  struct sc101_volume_request *request;
+
+  for (;;)
+  {
+    IOLockLock(_completionLock);
+
+    if ((request = TAILQ_FIRST(&_completions)))
+      TAILQ_REMOVE(&_completions, request, entries);
+
+    IOLockUnlock(_completionLock);
+
+    if (!request)
+      break;
+
+    completeRequest(request);
+  }
+}
+
+
+/* on the volume's workloop. the first part to fail fails the request */
+void net_habitue_volume_SC101::completeRequest(struct sc101_volume_request *request)
+{
+  IOStorageCompletion completion = request->completion;
+  IOReturn status = kIOReturnSuccess;
+  UInt64 actualByteCount = 0;
+
+  for (UInt32 i = 0; i < request->count; i++)
+  {
+    if (status == kIOReturnSuccess)
+      status = request->parts[i].status;
+
+    actualByteCount += request->parts[i].actualByteCount;
+  }
+
+  freeRequest(request);
+
+  IOStorage::complete(completion, status, actualByteCount);
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark stripe
+/**********************************************************************************************************************************/
+
+#undef super
+#define super net_habitue_volume_SC101
+
+OSDefineMetaClassAndStructors(net_habitue_stripe_SC101, net_habitue_volume_SC101)
+
+
+bool net_habitue_stripe_SC101::init(OSDictionary *properties)
+{
+  if (!super::init(properties))
+    return false;
+
+  OSNumber *stripeUnit = OSDynamicCast(OSNumber, properties->getObject(gSC101VolumeStripeUnitKey));
+  UInt64 unitSize = (stripeUnit ? stripeUnit->unsigned64BitValue() : 0);
+
+  if (unitSize < SECTOR_SIZE || unitSize > STRIPE_UNIT_MAX || (unitSize & (unitSize - 1)))
+  {
+    unitSize = STRIPE_UNIT;
+    stripeUnit = OSNumber::withNumber(unitSize, 32);
+
+    if (stripeUnit)
+    {
+      setProperty(gSC101VolumeStripeUnitKey, stripeUnit);
+      stripeUnit->release();
+    }
+  }
+
+  _unitBlocks = unitSize / SECTOR_SIZE;
+
+  return true;
+}
+
+
+/* one request per member: the units a member holds are consecutive on it, so its pieces of the buffer are gathered into
+ * a single descriptor however many of its units the request covers.
+ */
+IOReturn net_habitue_stripe_SC101::doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion)
+{
+  UInt64 end = (UInt64)block + nblks;
+  UInt64 firstUnit = block / _unitBlocks;
+  UInt64 lastUnit = (end - 1) / _unitBlocks;
+  UInt32 units = lastUnit - firstUnit + 1;
+  UInt32 count = (units < _memberCount ? units : _memberCount);
+  UInt32 rangesMax = (units + _memberCount - 1) / _memberCount;
+
+  IOMemoryDescriptor **ranges = IONew(IOMemoryDescriptor *, rangesMax);
+  struct sc101_volume_request *request = (ranges ? allocRequest(buffer, block, nblks, completion, count) : NULL);
+
+  if (!request)
+  {
+    if (ranges)
+      IODelete(ranges, IOMemoryDescriptor *, rangesMax);
+
+    IOStorage::complete(completion, kIOReturnNoMemory, 0);
+    return kIOReturnSuccess;
+  }
+
+  for (UInt32 i = 0; i < count; i++)
+  {
+    UInt64 unit = firstUnit + i;
+    UInt32 member = unit % _memberCount;
+    UInt64 memberBlock = (unit / _memberCount) * _unitBlocks;
+    UInt32 memberBlocks = 0;
+    UInt32 rangeCount = 0;
+    bool failed = false;
+
+    for (; unit <= lastUnit; unit += _memberCount)
+    {
+      UInt64 rangeStart = (unit == firstUnit ? block : unit * _unitBlocks);
+      UInt64 rangeEnd = (unit == lastUnit ? end : (unit + 1) * _unitBlocks);
+
+      /* only the request's first unit can start part way in, and only its last can end early */
+      if (rangeCount == 0)
+        memberBlock += rangeStart - unit * _unitBlocks;
+
+      if (!(ranges[rangeCount] = IOMemoryDescriptor::withSubRange(buffer, (rangeStart - block) * SECTOR_SIZE,
+                                                                  (rangeEnd - rangeStart) * SECTOR_SIZE, buffer->getDirection())))
+      {
+        failed = true;
+        break;
+      }
+
+      rangeCount++;
+      memberBlocks += rangeEnd - rangeStart;
+    }
+
+    IOMemoryDescriptor *part = NULL;
+
+    if (!failed && rangeCount == 1)
+      part = ranges[0];
+    else
+    {
+      if (!failed)
+        part = IOMultiMemoryDescriptor::withDescriptors(ranges, rangeCount, buffer->getDirection(), false);
+
+      for (UInt32 j = 0; j < rangeCount; j++)
+        ranges[j]->release();
+    }
+
+    issuePart(request, i, member, part, memberBlock, memberBlocks);
+  }
+
+  IODelete(ranges, IOMemoryDescriptor *, rangesMax);
+  finishIssuing(request);
+
+  return kIOReturnSuccess;
+}
+
+
+char *net_habitue_stripe_SC101::getProductString(void)
+{
+  return (char *)"SC101 Stripe";
+}
+
+
+IOReturn net_habitue_stripe_SC101::reportMaxReadTransfer(UInt64 blockSize, UInt64 *max)
+{
+  *max = getMemberMaxTransfer(false) * _memberCount;
+
+  return kIOReturnSuccess;
+}
+
+
+IOReturn net_habitue_stripe_SC101::reportMaxWriteTransfer(UInt64 blockSize, UInt64 *max)
+{
+  *max = getMemberMaxTransfer(true) * _memberCount;
+
+  return kIOReturnSuccess;
+}
+
+
+/* whole rows of units only, each as deep as the smallest member allows */
+IOReturn net_habitue_stripe_SC101::reportMaxValidBlock(UInt64 *maxBlock)
+{
+  UInt64 rows = getMemberBlocks() / _unitBlocks;
+  UInt64 rowBlocks = (UInt64)_unitBlocks * _memberCount;
+
+  if (rows > VOLUME_BLOCKS_MAX / rowBlocks)
+    rows = VOLUME_BLOCKS_MAX / rowBlocks;
+
+  *maxBlock = (rows ? rows * rowBlocks - 1 : 0);
+
+  return kIOReturnSuccess;
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark mirror
+/**********************************************************************************************************************************/
+
+#undef super
+#define super net_habitue_volume_SC101
+
+#define BITMAP_SIZE(regions) ((((regions) + 31) / 32) * sizeof(UInt32))
+
+OSDefineMetaClassAndStructors(net_habitue_mirror_SC101, net_habitue_volume_SC101)
+
+
+bool net_habitue_mirror_SC101::init(OSDictionary *properties)
+{
+  _resyncTimer = NULL;
+  _lock = NULL;
+  _mirror = NULL;
+  _blocks = 0;
+  _regionBlocks = MIRROR_REGION / SECTOR_SIZE;
+  _regionCount = 0;
+  TAILQ_INIT(&_retries);
+  _generation = 0;
+  _resyncRegion = 0;
+  _resyncTargets = 0;
+  _resyncWriting = false;
+  _resyncDone = false;
+  _resyncStatus = kIOReturnSuccess;
+  _resyncBuffer = NULL;
+  _resyncView = NULL;
+
+  if (!super::init(properties))
+    return false;
+
+  /* every member starts out in sync: a new mirror is taken to be made of identical copies */
+  _mirror = IONew(struct sc101_mirror_member, _memberCount);
+
+  if (!_mirror || !(_lock = IOLockAlloc()))
+    return false;
+
+  bzero(_mirror, _memberCount * sizeof(_mirror[0]));
+
+  /* set up timer event source, to look for stale members to resync */
+  _resyncTimer = IOTimerEventSource::timerEventSource(this,
+                                                      OSMemberFunctionCast(IOTimerEventSource::Action, this, &net_habitue_mirror_SC101::handleResyncTimer));
+
+  if (!_resyncTimer || _workLoop->addEventSource(_resyncTimer) != kIOReturnSuccess)
+  {
+    KINFO("%s: Failed to set up timer event source!", getName());
+    return false;
+  }
+
+  _resyncTimer->setTimeoutMS(MIRROR_RESYNC_RETRY_MS);
+
+  return true;
+}
+
+
+void net_habitue_mirror_SC101::free(void)
+{
+  if (_resyncTimer)
+  {
+    _resyncTimer->cancelTimeout();
+    _resyncTimer->disable();
+    _workLoop->removeEventSource(_resyncTimer);
+    _resyncTimer->release();
+    _resyncTimer = NULL;
+  }
+
+  /* the base class tears it down, after the resync state it works on is gone */
+  if (_kickSource)
+    _kickSource->disable();
+
+  if (_mirror)
+  {
+    for (UInt32 i = 0; i < _memberCount; i++)
+    {
+      if (_mirror[i].dirty)
+        IOFree(_mirror[i].dirty, BITMAP_SIZE(_regionCount));
+    }
+
+    IODelete(_mirror, struct sc101_mirror_member, _memberCount);
+    _mirror = NULL;
+  }
+
+  if (_resyncView)
+  {
+    _resyncView->release();
+    _resyncView = NULL;
+  }
+
+  if (_resyncBuffer)
+  {
+    _resyncBuffer->release();
+    _resyncBuffer = NULL;
+  }
+
+  if (_lock)
+  {
+    IOLockFree(_lock);
+    _lock = NULL;
+  }
+
+  super::free();
+}
+
+
+/* a read goes to one member, falling back to the others if it fails. a write goes to every member that isn't stale,
+ * and to the stale ones' dirty maps.
+ */
+IOReturn net_habitue_mirror_SC101::doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion)
+{
+  bool isWrite = (buffer->getDirection() == kIODirectionOut);
+  UInt32 targets = 0;
+  UInt32 count = 0;
+  UInt32 generation;
+
+  IOLockLock(_lock);
+
+  if (isWrite)
+  {
+    for (UInt32 i = 0; i < _memberCount; i++)
+    {
+      if (_mirror[i].state == kSC101MirrorStale)
+      {
+        markDirty(i, block, nblks);
+        continue;
+      }
+
+      targets |= (1 << i);
+      count++;
+
+      /* the copy under way may put back what this writes */
+      if (_mirror[i].state == kSC101MirrorResyncing && (_resyncTargets & (1 << i)) &&
+          block < (UInt64)(_resyncRegion + 1) * _regionBlocks && (UInt64)block + nblks > (UInt64)_resyncRegion * _regionBlocks)
+        markRegion(i, _resyncRegion);
+    }
+  }
+  else
+  {
+    UInt32 member = selectReadMember(0);
+
+    if (member < _memberCount)
+    {
+      targets = (1 << member);
+      count = 1;
+    }
+  }
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (targets & (1 << i))
+      OSIncrementAtomic(&_mirror[i].inFlight);
+  }
+
+  generation = _generation;
+
+  IOLockUnlock(_lock);
+
+  struct sc101_volume_request *request = (count ? allocRequest(buffer, block, nblks, completion, count) : NULL);
+
+  if (!request)
+  {
+    for (UInt32 i = 0; i < _memberCount; i++)
+    {
+      if (targets & (1 << i))
+        OSDecrementAtomic(&_mirror[i].inFlight);
+    }
+
+    IOStorage::complete(completion, (count ? kIOReturnNoMemory : kIOReturnNoDevice), 0);
+    return kIOReturnSuccess;
+  }
+
+  request->generation = generation;
+
+  for (UInt32 i = 0, part = 0; i < _memberCount; i++)
+  {
+    if (!(targets & (1 << i)))
+      continue;
+
+    buffer->retain();
+    issuePart(request, part++, i, buffer, block, nblks);
+  }
+
+  finishIssuing(request);
+
+  return kIOReturnSuccess;
+}
+
+
+char *net_habitue_mirror_SC101::getProductString(void)
+{
+  return (char *)"SC101 Mirror";
+}
+
+
+IOReturn net_habitue_mirror_SC101::reportMaxValidBlock(UInt64 *maxBlock)
+{
+  *maxBlock = (_blocks ? _blocks - 1 : 0);
+
+  return kIOReturnSuccess;
+}
+
+
+/* it takes every member to put the mirror together, after which any one in sync member will do */
+bool net_habitue_mirror_SC101::checkMediaPresent()
+{
+  bool present = false;
+
+  if (!_regionCount && (!super::checkMediaPresent() || !setupRegions()))
+    return false;
+
+  if (_mediaStateEjected)
+    return false;
+
+  IOLockLock(_lock);
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (_mirror[i].state != kSC101MirrorStale && !_members[i]->isMediaPresent())
+      failMember(i);
+  }
+
+  for (UInt32 i = 0; i < _memberCount && !present; i++)
+    present = (_mirror[i].state == kSC101MirrorInSync && _members[i]->isMediaPresent());
+
+  IOLockUnlock(_lock);
+
+  return present;
+}
+
+
+/* sized by the smallest member, once they're all present */
+bool net_habitue_mirror_SC101::setupRegions()
+{
+  UInt64 blocks = getMemberBlocks();
+
+  if (blocks > VOLUME_BLOCKS_MAX)
+    blocks = VOLUME_BLOCKS_MAX;
+
+  if (!blocks)
+    return false;
+
+  UInt32 regionCount = (blocks + _regionBlocks - 1) / _regionBlocks;
+
+  if (!_resyncBuffer && !(_resyncBuffer = IOBufferMemoryDescriptor::withCapacity(MIRROR_REGION, kIODirectionInOut)))
+    return false;
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (!(_mirror[i].dirty = (UInt32 *)IOMalloc(BITMAP_SIZE(regionCount))))
+    {
+      while (i--)
+      {
+        IOFree(_mirror[i].dirty, BITMAP_SIZE(regionCount));
+        _mirror[i].dirty = NULL;
+      }
+
+      return false;
+    }
+
+    bzero(_mirror[i].dirty, BITMAP_SIZE(regionCount));
+  }
+
+  _blocks = blocks;
+  _regionCount = regionCount;
+
+  return true;
+}
+
+
+/* an in sync member that hasn't been tried, the one expected to answer soonest */
+UInt32 net_habitue_mirror_SC101::selectReadMember(UInt32 tried)
+{
+  UInt32 best = _memberCount;
+  UInt64 bestCost = 0;
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (_mirror[i].state != kSC101MirrorInSync || (tried & (1 << i)) || !_members[i]->isMediaPresent())
+      continue;
+
+    UInt64 cost = (UInt64)(_mirror[i].inFlight + 1) * (_mirror[i].latency ? _mirror[i].latency : 1);
+
+    if (best == _memberCount || cost < bestCost)
+    {
+      best = i;
+      bestCost = cost;
+    }
+  }
+
+  return best;
+}
+
+
+UInt32 net_habitue_mirror_SC101::countInSync()
+{
+  UInt32 count = 0;
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (_mirror[i].state == kSC101MirrorInSync)
+      count++;
+  }
+
+  return count;
+}
+
+
+/* true if the member is now out of sync. the last in sync one never is: it's all there is, errors and all */
+bool net_habitue_mirror_SC101::failMember(UInt32 member)
+{
+  if (_mirror[member].state == kSC101MirrorInSync && countInSync() == 1)
+    return false;
+
+  if (_mirror[member].state != kSC101MirrorStale)
+    KINFO("%s: member %s out of sync", getName(), _members[member]->getID()->getCStringNoCopy());
+
+  _mirror[member].state = kSC101MirrorStale;
+
+  return true;
+}
+
+
+void net_habitue_mirror_SC101::markDirty(UInt32 member, UInt32 block, UInt32 nblks)
+{
+  if (!nblks)
+    return;
+
+  UInt32 last = ((UInt64)block + nblks - 1) / _regionBlocks;
+
+  for (UInt32 region = block / _regionBlocks; region <= last; region++)
+    markRegion(member, region);
+}
+
+
+/* an in sync member given a dirty region has to be resynced before it's read from again */
+void net_habitue_mirror_SC101::markRegion(UInt32 member, UInt32 region)
+{
+  struct sc101_mirror_member *mirror = &_mirror[member];
+
+  if (region >= _regionCount)
+    return;
+
+  if (mirror->state == kSC101MirrorInSync)
+  {
+    if (countInSync() == 1)
+      return;
+
+    mirror->state = kSC101MirrorResyncing;
+  }
+
+  if (!(mirror->dirty[region / 32] & (1 << (region % 32))))
+  {
+    mirror->dirty[region / 32] |= (1 << (region % 32));
+    mirror->dirtyCount++;
+  }
+}
+
+
+/* on the member's workloop. a failed part puts the member out of sync, and a failed read is handed to the mirror's
+ * workloop to send to another member.
+ */
+void net_habitue_mirror_SC101::finishPart(struct sc101_volume_part *part, IOReturn status, UInt64 actualByteCount)
+{
+  struct sc101_mirror_member *mirror = &_mirror[part->member];
+  bool isWrite = (part->request->buffer->getDirection() == kIODirectionOut);
+  bool retry = false;
+
+  OSDecrementAtomic(&mirror->inFlight);
+
+  if (status == kIOReturnSuccess)
+  {
+    if (!isWrite)
+    {
+      UInt32 latency = (psan_uptime_ns() - part->sent) / 1000;
+
+      if (!mirror->latency)
+        mirror->latency = latency;
+      else
+        mirror->latency = mirror->latency - (mirror->latency >> MIRROR_LATENCY_SHIFT) + (latency >> MIRROR_LATENCY_SHIFT);
+    }
+  }
+  else
+  {
+    IOLockLock(_lock);
+
+    if (failMember(part->member) && isWrite)
+      markDirty(part->member, part->block, part->nblks);
+
+    if (!isWrite && selectReadMember(part->tried) < _memberCount)
+    {
+      part->status = status;
+      TAILQ_INSERT_TAIL(&_retries, part, entries);
+      retry = true;
+    }
+
+    IOLockUnlock(_lock);
+  }
+
+  if (retry)
+    _kickSource->interruptOccurred(NULL, NULL, 0);
+  else
+    super::finishPart(part, status, actualByteCount);
+}
+
+
+/* on the mirror's workloop. a write succeeds if any member took it: the ones that didn't are out of sync now, with it in their dirty maps */
+void net_habitue_mirror_SC101::completeRequest(struct sc101_volume_request *request)
+{
+  if (request->buffer->getDirection() != kIODirectionOut)
+  {
+    super::completeRequest(request);
+    return;
+  }
+
+  IOStorageCompletion completion = request->completion;
+  IOReturn status = kIOReturnSuccess;
+  UInt64 actualByteCount = 0;
+  bool written = false;
+
+  for (UInt32 i = 0; i < request->count; i++)
+  {
+    struct sc101_volume_part *part = &request->parts[i];
+
+    if (part->status == kIOReturnSuccess)
+    {
+      written = true;
+      if (part->actualByteCount > actualByteCount)
+        actualByteCount = part->actualByteCount;
+    }
+    else if (status == kIOReturnSuccess)
+      status = part->status;
+  }
+
+  if (written)
+    status = kIOReturnSuccess;
+
+  /* a copy started while this was in flight may have read the old data and written it over the new, even to a member
+   * that has gone stale again since
+   */
+  IOLockLock(_lock);
+
+  if (request->generation != _generation)
+  {
+    for (UInt32 i = 0; i < _memberCount; i++)
+    {
+      if (_mirror[i].state != kSC101MirrorInSync ||
+          (_mirror[i].state == kSC101MirrorInSync && (SInt32)(_mirror[i].syncedGeneration - request->generation) > 0))
+        markDirty(i, request->block, request->nblks);
+    }
+  }
+
+  IOLockUnlock(_lock);
+
+  freeRequest(request);
+
+  IOStorage::complete(completion, status, actualByteCount);
+}
+
+
+void net_habitue_mirror_SC101::handleKick(IOInterruptEventSource *sender, int count)
+{
+  super::handleKick(sender, count);
+  retryReads();
+  resyncNext();
+}
+
+
+/* stale members that are present again get their missed writes copied back */
+void net_habitue_mirror_SC101::handleResyncTimer(IOTimerEventSource *sender)
+{
+  IOLockLock(_lock);
+
+  for (UInt32 i = 0; i < _memberCount && _regionCount; i++)
+  {
+    if (_mirror[i].state == kSC101MirrorStale && _members[i]->isMediaPresent())
+    {
+      KINFO("%s: resyncing member %s, %u regions", getName(), _members[i]->getID()->getCStringNoCopy(), (unsigned)_mirror[i].dirtyCount);
+      _mirror[i].state = kSC101MirrorResyncing;
+    }
+  }
+
+  IOLockUnlock(_lock);
+
+  resyncNext();
+
+  _resyncTimer->setTimeoutMS(MIRROR_RESYNC_RETRY_MS);
+}
+
+
+void net_habitue_mirror_SC101::retryReads()
+{
+  struct sc101_volume_part *part;
+
+  for (;;)
+  {
+    UInt32 member = _memberCount;
+
+    IOLockLock(_lock);
+
+    if ((part = TAILQ_FIRST(&_retries)))
+    {
+      TAILQ_REMOVE(&_retries, part, entries);
+
+      if ((member = selectReadMember(part->tried)) < _memberCount)
+        OSIncrementAtomic(&_mirror[member].inFlight);
+    }
+
+    IOLockUnlock(_lock);
+
+    if (!part)
+      break;
+
+    if (member == _memberCount)
+    {
+      super::finishPart(part, part->status, 0);
+      continue;
+    }
+
+    part->member = member;
+    sendPart(part);
+  }
+}
+
+
+/* on the mirror's workloop, from handleKick(), which goes on to resyncNext() */
+void net_habitue_mirror_SC101::resyncCompletion(void *parameter, IOReturn status, UInt64 actualByteCount)
+{
+  _resyncStatus = status;
+  _resyncDone = true;
+}
+
+
+/* the region being copied, from source into _resyncBuffer or from there to the targets */
+bool net_habitue_mirror_SC101::resyncSend(UInt32 members, IODirection direction)
+{
+  UInt32 block = _resyncRegion * _regionBlocks;
+  UInt32 nblks = (_blocks - block < _regionBlocks ? _blocks - block : _regionBlocks);
+  UInt32 count = 0;
+  struct sc101_volume_request *request = NULL;
+  IOStorageCompletion completion;
+
+  completion.target = this;
+  completion.action = OSMemberFunctionCast(IOStorageCompletionAction, this, &net_habitue_mirror_SC101::resyncCompletion);
+  completion.parameter = NULL;
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (members & (1 << i))
+      count++;
+  }
+
+  if ((_resyncView = IOMemoryDescriptor::withSubRange(_resyncBuffer, 0, nblks * SECTOR_SIZE, direction)))
+    request = allocRequest(_resyncView, block, nblks, completion, count);
+
+  if (!request)
+  {
+    if (_resyncView)
+    {
+      _resyncView->release();
+      _resyncView = NULL;
+    }
+
+    return false;
+  }
+
+  /* it's the copy, not something it could have undone */
+  request->generation = _generation;
+
+  for (UInt32 i = 0, part = 0; i < _memberCount; i++)
+  {
+    if (!(members & (1 << i)))
+      continue;
+
+    OSIncrementAtomic(&_mirror[i].inFlight);
+    _resyncView->retain();
+    issuePart(request, part++, i, _resyncView, block, nblks);
+  }
+
+  finishIssuing(request);
+
+  return true;
+}
+
+
+/* one region at a time: read it from an in sync member, then write it to every resyncing member it's dirty on. its bit
+ * is cleared when the copy starts, so a write racing the copy just sets it again.
+ */
+void net_habitue_mirror_SC101::resyncNext()
+{
+  UInt32 source = _memberCount;
+  UInt32 region = 0;
+
+  if (_resyncTargets)
+  {
+    if (!_resyncDone)
+      return;
+
+    bool failed = (_resyncStatus != kIOReturnSuccess);
+
+    _resyncDone = false;
+    _resyncView->release();
+    _resyncView = NULL;
+
+    if (!failed && !_resyncWriting)
+    {
+      _resyncWriting = true;
+
+      if (resyncSend(_resyncTargets, kIODirectionOut))
+        return;
+
+      _resyncWriting = false;
+      failed = true;
+    }
+
+    /* a failed write has already put its members' bits back; without the data to write, they all need theirs */
+    IOLockLock(_lock);
+
+    if (failed && !_resyncWriting)
+    {
+      for (UInt32 i = 0; i < _memberCount; i++)
+      {
+        if (_resyncTargets & (1 << i))
+          markRegion(i, _resyncRegion);
+      }
+    }
+
+    _resyncTargets = 0;
+
+    IOLockUnlock(_lock);
+
+    /* the timer will have another go */
+    if (failed && !_resyncWriting)
+      return;
+  }
+
+  IOLockLock(_lock);
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (_mirror[i].state == kSC101MirrorResyncing && !_mirror[i].dirtyCount)
+    {
+      KINFO("%s: member %s back in sync", getName(), _members[i]->getID()->getCStringNoCopy());
+      _mirror[i].state = kSC101MirrorInSync;
+      _mirror[i].syncedGeneration = _generation;
+    }
+  }
+
+  /* the first region any resyncing member is missing */
+  for (UInt32 i = 0; i < _memberCount && !_resyncTargets; i++)
+  {
+    struct sc101_mirror_member *mirror = &_mirror[i];
+
+    if (mirror->state != kSC101MirrorResyncing || !mirror->dirtyCount)
+      continue;
+
+    for (UInt32 word = 0; word < (_regionCount + 31) / 32; word++)
+    {
+      if (!mirror->dirty[word])
+        continue;
+
+      for (region = word * 32; !(mirror->dirty[word] & (1 << (region % 32))); region++)
+        ;
+
+      break;
+    }
+
+    /* everyone missing it gets it from the same copy */
+    for (UInt32 j = i; j < _memberCount; j++)
+    {
+      if (_mirror[j].state != kSC101MirrorResyncing || !(_mirror[j].dirty[region / 32] & (1 << (region % 32))))
+        continue;
+
+      _mirror[j].dirty[region / 32] &= ~(1 << (region % 32));
+      _mirror[j].dirtyCount--;
+      _resyncTargets |= (1 << j);
+    }
+  }
+
+  if (_resyncTargets)
+  {
+    _resyncRegion = region;
+    _resyncWriting = false;
+    _generation++;
+
+    if ((source = selectReadMember(0)) == _memberCount)
+    {
+      for (UInt32 i = 0; i < _memberCount; i++)
+      {
+        if (_resyncTargets & (1 << i))
+          markRegion(i, region);
+      }
+
+      _resyncTargets = 0;
+    }
+  }
+
+  IOLockUnlock(_lock);
+
+  if (source == _memberCount || resyncSend(1 << source, kIODirectionIn))
+    return;
+
+  /* no memory to copy with, so try again later */
+  IOLockLock(_lock);
+
+  for (UInt32 i = 0; i < _memberCount; i++)
+  {
+    if (_resyncTargets & (1 << i))
+      markRegion(i, region);
+  }
+
+  _resyncTargets = 0;
+
+  IOLockUnlock(_lock);
+}
@@ -0,0 +1,203 @@
+#import "config.h"
+
+#import <IOKit/IOWorkLoop.h>
+#import <IOKit/IOInterruptEventSource.h>
+#import <IOKit/IOTimerEventSource.h>
+#import <IOKit/IOLocks.h>
+#import <IOKit/IOBufferMemoryDescriptor.h>
+#import <IOKit/storage/IOStorage.h>
+#import <IOKit/storage/IOBlockStorageDevice.h>
+
+#import "SC101Keys.h"
+
+extern "C" {
+#import <sys/queue.h>
+}
+
+class net_habitue_device_SC101;
+
+
+/* one member's share of a volume request */
+struct sc101_volume_part {
+  struct sc101_volume_request *request;
+  IOMemoryDescriptor *buffer; /* released once the member is done with it */
+  UInt32 member;              /* index into the volume's members */
+  UInt32 block;               /* on the member */
+  UInt32 nblks;
+  UInt32 tried;               /* members a mirror read has been sent to, as a mask */
+  UInt64 sent;                /* psan_uptime_ns() */
+  IOReturn status;
+  UInt64 actualByteCount;
+  TAILQ_ENTRY(sc101_volume_part) entries; /* on the mirror's retry list */
+};
+
+TAILQ_HEAD(sc101_volume_part_list, sc101_volume_part);
+
+/* a request to the volume, completed once every part of it has been */
+struct sc101_volume_request {
+  IOStorageCompletion completion;
+  IOMemoryDescriptor *buffer; /* the caller's, prepared here once rather than by each member */
+  UInt32 block;
+  UInt32 nblks;
+  UInt32 generation;          /* the mirror's resync copies started before this was issued */
+  volatile SInt32 pending;    /* parts still with their members, plus one until they've all been issued */
+  UInt32 count;
+  TAILQ_ENTRY(sc101_volume_request) entries; /* on the volume's completion list */
+  struct sc101_volume_part parts[1]; /* count of them */
+};
+
+TAILQ_HEAD(sc101_volume_request_list, sc101_volume_request);
+
+
+/* a block device made of several SC101 partitions, driven through their nubs (which must be attached first) */
+class net_habitue_volume_SC101 : public IOBlockStorageDevice
+  {
+    OSDeclareAbstractStructors(net_habitue_volume_SC101);
+  public:
+    virtual bool init(OSDictionary *dictionary = 0);
+    virtual bool attach(IOService *provider);
+    virtual void detach(IOService *provider);
+    virtual IOReturn doEjectMedia(void);
+    virtual IOReturn doFormatMedia(UInt64 byteCapacity);
+    virtual UInt32 doGetFormatCapacities(UInt64 *capacities, UInt32 capacitiesMaxCount) const;
+    virtual IOReturn doLockUnlockMedia(bool doLock);
+    virtual IOReturn doSynchronizeCache(void);
+    virtual char* getVendorString(void);
+    virtual char* getRevisionString(void);
+    virtual char* getAdditionalDeviceInfoString(void);
+    virtual IOReturn reportBlockSize(UInt64 *blockSize);
+    virtual IOReturn reportEjectability(bool *isEjectable);
+    virtual IOReturn reportLockability(bool *isLockable);
+    virtual IOReturn reportMaxReadTransfer(UInt64 blockSize, UInt64 *max);
+    virtual IOReturn reportMaxWriteTransfer(UInt64 blockSize, UInt64 *max);
+    virtual IOReturn reportMediaState(bool *mediaPresent, bool *changed);
+    virtual IOReturn reportPollRequirements(bool *pollIsRequired, bool *pollIsExpensive);
+    virtual IOReturn reportRemovability(bool *isRemovable);
+    virtual IOReturn reportWriteProtection(bool *isWriteProtected);
+
+    OSString *getID();
+    IOWorkLoop *getWorkLoop();
+  protected:
+    virtual void free(void);
+
+    /* every member present and the volume not ejected */
+    virtual bool checkMediaPresent();
+
+    /* the smallest of the members' sizes in blocks, and of their transfer limits */
+    UInt64 getMemberBlocks();
+    UInt64 getMemberMaxTransfer(bool isWrite);
+
+    /* fan-out: issue each part with issuePart(), then finishIssuing(). the request completes on the volume's workloop
+     * once its last part has. NULL if buffer couldn't be prepared or there's no memory; the caller completes the request
+     * itself.
+     */
+    struct sc101_volume_request *allocRequest(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks,
+                                              IOStorageCompletion completion, UInt32 count);
+    void issuePart(struct sc101_volume_request *request, UInt32 i, UInt32 member,
+                   IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks);
+    void sendPart(struct sc101_volume_part *part);
+    void finishIssuing(struct sc101_volume_request *request);
+    void partCompletion(void *parameter, IOReturn status, UInt64 actualByteCount);
+    virtual void finishPart(struct sc101_volume_part *part, IOReturn status, UInt64 actualByteCount);
+    void queueRequest(struct sc101_volume_request *request);
+    virtual void completeRequest(struct sc101_volume_request *request);
+    void freeRequest(struct sc101_volume_request *request);
+
+    /* on the volume's workloop, so a client issuing more from its completion never does so inside a member's gate */
+    virtual void handleKick(IOInterruptEventSource *sender, int count);
+    void completeRequests();
+
+    IOWorkLoop *_workLoop;
+    IOInterruptEventSource *_kickSource;
+    IOLock *_completionLock;   /* the completion list */
+    struct sc101_volume_request_list _completions; /* requests whose parts are all done, for the workloop to complete */
+
+    net_habitue_device_SC101 **_members; /* retained, in Members order */
+    UInt32 _memberCount;
+    bool _mediaStateEjected;
+    bool _mediaStateAttached; /* as last reported */
+  };
+
+
+/* RAID-0: StripeUnit sized pieces of the volume go round robin across the members */
+class net_habitue_stripe_SC101 : public net_habitue_volume_SC101
+  {
+    OSDeclareDefaultStructors(net_habitue_stripe_SC101);
+  public:
+    virtual bool init(OSDictionary *dictionary = 0);
+    virtual IOReturn doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion);
+    virtual char* getProductString(void);
+    virtual IOReturn reportMaxReadTransfer(UInt64 blockSize, UInt64 *max);
+    virtual IOReturn reportMaxWriteTransfer(UInt64 blockSize, UInt64 *max);
+    virtual IOReturn reportMaxValidBlock(UInt64 *maxBlock);
+  protected:
+    UInt32 _unitBlocks;
+  };
+
+
+enum {
+  kSC101MirrorInSync = 0, /* read from and written to */
+  kSC101MirrorStale,      /* missed writes, noted in its dirty map; left alone until it can be resynced */
+  kSC101MirrorResyncing,  /* written to, and having its dirty regions copied back from an in sync member */
+};
+
+/* how a mirror's member is doing */
+struct sc101_mirror_member {
+  UInt32 state;
+  volatile SInt32 inFlight;   /* reads and writes */
+  UInt32 latency;             /* smoothed read latency in us */
+  UInt32 syncedGeneration;    /* the mirror's _generation when it last came back in sync */
+  UInt32 *dirty;              /* a bit per region it has missed a write to */
+  UInt32 dirtyCount;
+};
+
+/* RAID-1: every member holds the whole volume */
+class net_habitue_mirror_SC101 : public net_habitue_volume_SC101
+  {
+    OSDeclareDefaultStructors(net_habitue_mirror_SC101);
+  public:
+    virtual bool init(OSDictionary *dictionary = 0);
+    virtual IOReturn doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion);
+    virtual char* getProductString(void);
+    virtual IOReturn reportMaxValidBlock(UInt64 *maxBlock);
+  protected:
+    virtual void free(void);
+    virtual bool checkMediaPresent();
+    virtual void finishPart(struct sc101_volume_part *part, IOReturn status, UInt64 actualByteCount);
+    virtual void completeRequest(struct sc101_volume_request *request);
+
+    bool setupRegions();
+
+    /* called with _lock held */
+    UInt32 selectReadMember(UInt32 tried);
+    UInt32 countInSync();
+    bool failMember(UInt32 member);
+    void markDirty(UInt32 member, UInt32 block, UInt32 nblks);
+    void markRegion(UInt32 member, UInt32 region);
+
+    /* on the mirror's workloop, where issuing can wait for a member without holding up its completions */
+    virtual void handleKick(IOInterruptEventSource *sender, int count);
+    void handleResyncTimer(IOTimerEventSource *sender);
+    void retryReads();
+    void resyncNext();
+    bool resyncSend(UInt32 members, IODirection direction);
+    void resyncCompletion(void *parameter, IOReturn status, UInt64 actualByteCount);
+
+    IOTimerEventSource *_resyncTimer;
+    IOLock *_lock;             /* member states and dirty maps, and the retry list */
+
+    struct sc101_mirror_member *_mirror; /* per member */
+    UInt64 _blocks;
+    UInt32 _regionBlocks;
+    UInt32 _regionCount;
+    struct sc101_volume_part_list _retries; /* failed reads for the workloop to send elsewhere */
+
+    UInt32 _generation;          /* resync copies started */
+    UInt32 _resyncRegion;        /* being copied, while there are _resyncTargets */
+    UInt32 _resyncTargets;       /* members it's being copied to, as a mask */
+    bool _resyncWriting;         /* copying to the targets rather than from the source */
+    volatile bool _resyncDone;   /* the current step has completed, with _resyncStatus */
+    IOReturn _resyncStatus;
+    IOBufferMemoryDescriptor *_resyncBuffer;
+    IOMemoryDescriptor *_resyncView; /* the part of _resyncBuffer the current step uses, in its direction */
+  };
@@ -18,19 +18,31 @@
 
 #pragma once
 
+#ifdef KERNEL
+#define KPRINTF(fmt, ...) kprintf(fmt, ## __VA_ARGS__)
+#define KLOG(fmt, ...) do { \
+  kprintf(fmt, ## __VA_ARGS__); \
+  IOLog(fmt, ## __VA_ARGS__); \
+} while (0)
+#else /* KERNEL */
+// the portable PSAN engine is also built as a userspace library, see linux/
+#include <stdio.h>
+#define KPRINTF(fmt, ...) fprintf(stderr, fmt, ## __VA_ARGS__)
+#define KLOG(fmt, ...) fprintf(stderr, fmt, ## __VA_ARGS__)
+#endif /* KERNEL */
+
 #ifdef DEBUG
 // #define QUEUE_MACRO_DEBUG
 // #define IOASSERT 1
 #define KDEBUG(fmt, ...) do { \
-  kprintf("%s: " fmt "\n", __FUNCTION__, ## __VA_ARGS__); \
+  KPRINTF("%s: " fmt "\n", __FUNCTION__, ## __VA_ARGS__); \
 } while (0)
 #else /* DEBUG */
 #define KDEBUG(...)
 #endif /*DEBUG */
 
 #define KINFO(fmt, ...) do { \
-  kprintf("%s: " fmt "\n", __FUNCTION__, ## __VA_ARGS__); \
-  IOLog("%s: " fmt "\n", __FUNCTION__, ## __VA_ARGS__); \
+  KLOG("%s: " fmt "\n", __FUNCTION__, ## __VA_ARGS__); \
 } while (0)
 
 // during debugging it might be useful to totally disable write requests
@@ -47,11 +59,29 @@
 // UDP allows for 64k packets, subtract 512b for request header and truncating to the next lowest power of 2
 // means the devices can probably support 32k I/Os, but we can choose a lower limit in case of packet loss.
 // jumbo frames are not supported, so UDP packets >1500 bytes are split into multiple ethernet frames.
-#define MAX_IO_READ_SIZE (16*1024)
+#define MAX_IO_READ_SIZE (32*1024)
 #define DEFAULT_IO_READ_SIZE (16*1024)
-#define MAX_IO_WRITE_SIZE (16*1024)
+#define MAX_IO_WRITE_SIZE (32*1024)
 #define DEFAULT_IO_WRITE_SIZE (4*1024)
 
+// unless probing is turned off, a device starts at the sizes it was given and moves between IO_SIZE_MIN and MAX_IO_*_SIZE.
+// once attached it GETs MAX_IO_READ_SIZE, then half that and so on (IO_SIZE_PROBE_ATTEMPTS tries each) to find the largest
+// len_power the unit answers. from then on responses and timeouts are counted per size class, halved past IO_SIZE_HISTORY.
+// every IO_SIZE_EVAL_MS, with IO_SIZE_SAMPLES of its largest IOs counted, a direction tries the next size down when more
+// than IO_SIZE_FALLBACK_LOSS per mille of them were lost (fragments, mostly), or the next size up when no more than
+// IO_SIZE_RAISE_LOSS were, and keeps it if it moves more data. a try that doesn't pay holds off the next one the same way
+// for IO_SIZE_BACKOFF_MS, doubling each time up to IO_SIZE_BACKOFF_MAX_MS.
+#define IO_SIZE_PROBING (true)
+#define IO_SIZE_MIN (1024)
+#define IO_SIZE_PROBE_ATTEMPTS (3)
+#define IO_SIZE_HISTORY (1024)
+#define IO_SIZE_EVAL_MS (1000)
+#define IO_SIZE_SAMPLES (64)
+#define IO_SIZE_FALLBACK_LOSS (20)
+#define IO_SIZE_RAISE_LOSS (2)
+#define IO_SIZE_BACKOFF_MS (10*1000)
+#define IO_SIZE_BACKOFF_MAX_MS (5*60*1000)
+
 // requests larger than the max read/write sizes above can be accepted from the block layer and split up
 // by our deblocking function.
 #define ACCEPT_IO_READ_SIZE (1*1024*1024)
@@ -61,9 +91,134 @@
 #define RCVBUF_SIZE (1*1024*1024)
 #define SNDBUF_SIZE (1*1024*1024)
 
+// retransmit timeouts track the measured round trip time per direction and IO size (SRTT + 4*RTTVAR, as TCP does),
+// doubling with each retry and clamped to MIN..MAX. sizes not yet measured start at INITIAL, which is generous
+// because a WD10EACS can take ~380ms(?!) for initial response while in power saving mode.
+#define RTO_INITIAL_MS (500)
+#define RTO_MIN_MS (20)
+#define RTO_MAX_MS (3000)
+
+// retransmit timers already due within this long of a new deadline are left alone rather than re-armed.
+#define TIMER_SLACK_MS (1)
+
+// the published Statistics dictionaries are refreshed this often, rather than on every IO or packet.
+#define STATISTICS_INTERVAL_MS (1000)
+
+// reads fail after this many attempts, writes see below.
+#define IO_MAX_ATTEMPTS (22)
+
+// hedged reads: a GET still unanswered once it's been out longer than HEDGE_PERCENTILE of the GETs its size answered in
+// is sent again under a new seq#, and whichever answer comes first is taken. one lost fragment then costs about the
+// tail of the latency distribution rather than a retransmit timeout. each is a GET's worth of extra work for the unit,
+// so no more than HEDGE_BUDGET_PERCENT of GETs are hedged (with HEDGE_BURST saved up), and 0 turns hedging off.
+// latencies are kept per size class in HEDGE_BUCKETS log buckets, halved past HEDGE_HISTORY and trusted after
+// HEDGE_MIN_SAMPLES.
+#define HEDGE_BUDGET_PERCENT (0)
+#define HEDGE_PERCENTILE (95)
+#define HEDGE_BURST (8)
+#define HEDGE_BUCKETS (76)
+#define HEDGE_HISTORY (4096)
+#define HEDGE_MIN_SAMPLES (64)
+
+// each socket wakeup drains up to RECEIVE_BUDGET datagrams before giving the rest of the workloop a turn.
+// the linux transport fetches them RECEIVE_BATCH at a time with recvmmsg().
+#define RECEIVE_BUDGET (64)
+#define RECEIVE_BATCH (16)
+
+// the kext runs WORKLOOP_SHARDS workloops, each with its own engine and timer, and gives each new nub the least busy
+// one, so with at least as many shards as units every unit is serviced on its own thread. the socket is drained on
+// shard 0, which queues up to SHARD_QUEUE_SIZE responses for each other shard before dropping them (to be retried).
+#define WORKLOOP_SHARDS (8)
+#define SHARD_QUEUE_SIZE (512)
+
+// besides the shared socket on the well known port, which resolves and broadcasts always use, each shard (or the linux
+// transport) opens up to FLOW_SOCKETS sockets connected to the units it talks to. each flow gets its own source port,
+// so the NIC can spread responses over its receive queues, and sends skip the per datagram address handling.
+#define FLOW_SOCKETS (4)
+
 // ZFS reacts adversely (panic) to disks disappearing with uncommitted data, so we may choose to retry writes
 // indefinitely in case of (long lived) network problems.
 #define RETRY_INDEFINITELY_DELAY_MS (10000)
 
-// maximum number of IOs to send to a particular device before queueing the request
-#define MAX_IO_OUTSTANDING (8)
+// number of IOs sent to a particular device before queueing the request adapts like a TCP congestion window:
+// it grows while responses come back cleanly, halves on a timeout and drops to the minimum on PSAN_ERROR.
+// several units on a 100Mbit segment can't take 8x16k bursts without dropping fragments, a quiet gigabit LAN can take more.
+#define IO_WINDOW_MIN (1)
+#define IO_WINDOW_INITIAL (8)
+#define IO_WINDOW_MAX (64)
+
+// IOs queued behind a full window go out in the order the device's scheduler picks, see PSANIOScheduler: SCHED_POLICY is
+// "fifo", "deadline" (reads first, each direction in block order) or "elevator" (one sweep over the blocks). an IO
+// queued longer than its direction's deadline goes next, and after SCHED_WRITE_STARVE reads have gone ahead of waiting
+// writes one of them does. SCHED_*_DEPTH caps the IOs in flight in each direction below the window, 0 for no cap.
+#define SCHED_POLICY "deadline"
+#define SCHED_READ_DEADLINE_MS (100)
+#define SCHED_WRITE_DEADLINE_MS (1000)
+#define SCHED_WRITE_STARVE (16)
+#define SCHED_READ_DEPTH (0)
+#define SCHED_WRITE_DEPTH (0)
+
+// a response this much slower than twice the best recently seen for its direction and size means something is
+// queueing, so shrink the window a little before it turns into loss. the best is forgotten after BASE_RTT_MS.
+#define IO_WINDOW_DELAY_US (2000)
+#define IO_WINDOW_BASE_RTT_MS (10*1000)
+
+// per-request bookkeeping comes from per-device pools, preallocated for IO_WINDOW_MAX requests in flight and grown
+// POOL_SLAB objects at a time. past POOL_LIMIT, new requests wait for old ones to finish instead of allocating.
+#define POOL_SLAB (32)
+#define POOL_LIMIT (4096)
+
+// a device follows up to READAHEAD_STREAMS sequential read streams (replacing the least recently used) and reads
+// READAHEAD_SEGMENT sized pieces ahead of each. a stream's window starts at READAHEAD_MIN on its second sequential
+// read and doubles with every read served from it, up to READAHEAD_MAX. prefetched data is capped at READAHEAD_BUDGET.
+#define READAHEAD_STREAMS (4)
+#define READAHEAD_SEGMENT (64*1024)
+#define READAHEAD_MIN (128*1024)
+#define READAHEAD_MAX (1024*1024)
+#define READAHEAD_BUDGET (4*1024*1024)
+
+// optional per-device cache of CACHE_LINE_SIZE lines (a power of 2, CACHE_LINE_MIN..CACHE_LINE_MAX), CACHE_SIZE bytes
+// of them, 0 for none, and at most CACHE_SIZE_MAX since it is wired kernel memory. reads bigger than CACHE_MAX_IO are
+// streaming rather than metadata and go around it.
+#define CACHE_SIZE (0)
+#define CACHE_SIZE_MAX (256ULL*1024*1024)
+#define CACHE_LINE_SIZE (4096)
+#define CACHE_LINE_MIN (4096)
+#define CACHE_LINE_MAX (64*1024)
+#define CACHE_MAX_IO (64*1024)
+
+// opt-in write-back: writes are acknowledged once copied into WRITEBACK_CHUNK sized, aligned chunks of memory, and each
+// dirty run in a chunk is later written as one request. chunks are flushed once more than WRITEBACK_DIRTY_HIGH bytes
+// are held, or after WRITEBACK_MAX_AGE_MS, checked every WRITEBACK_TIMER_MS. new writes wait once WRITEBACK_DIRTY_MAX
+// are held. no more than WRITEBACK_FLUSHES runs are written at once, and a failed one is retried WRITEBACK_RETRY_MS later.
+#define WRITEBACK_CHUNK (64*1024)
+#define WRITEBACK_DIRTY_MAX (16*1024*1024)
+#define WRITEBACK_DIRTY_HIGH (4*1024*1024)
+#define WRITEBACK_MAX_AGE_MS (5000)
+#define WRITEBACK_TIMER_MS (250)
+#define WRITEBACK_FLUSHES (16)
+#define WRITEBACK_RETRY_MS (1000)
+// detaching a nub waits this long for its dirty data to reach the unit, which may be gone, before dropping the rest.
+#define WRITEBACK_DETACH_MS (30*1000)
+// the kext's default when the nub isn't given a WriteBack property (helper attach -B)
+#define WRITEBACK_DEFAULT (false)
+
+// a striped volume (helper stripe) spreads its blocks over its members STRIPE_UNIT bytes at a time unless it's given a
+// StripeUnit: a power of 2, SECTOR_SIZE..STRIPE_UNIT_MAX. a unit of a couple of GETs keeps small IOs on one member
+// while a large one still reaches all of them. a volume has 2..VOLUME_MEMBERS_MAX members.
+#define STRIPE_UNIT (64*1024)
+#define STRIPE_UNIT_MAX (1024*1024)
+#define VOLUME_MEMBERS_MAX (16)
+
+// a mirrored volume (helper mirror) notes which MIRROR_REGION sized pieces of it each out of sync member has missed
+// writes to, and copies just those back, a region at a time, once the member is present again. out of sync members are
+// retried every MIRROR_RESYNC_RETRY_MS. a read goes to the in sync member with the least (IOs in flight + 1) times
+// its read latency, smoothed over the last 1 << MIRROR_LATENCY_SHIFT reads.
+#define MIRROR_REGION (1024*1024)
+#define MIRROR_RESYNC_RETRY_MS (30*1000)
+#define MIRROR_LATENCY_SHIFT (3)
+
+// the kext keeps this many packet header mbufs allocated ahead of time, topped up after each workloop wakeup,
+// so sending a request never blocks in the mbuf allocator. PACKET_HEADER_MAX covers every request header.
+#define PACKET_RING_SIZE (256)
+#define PACKET_HEADER_MAX (64)
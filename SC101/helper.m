@@ -34,23 +34,33 @@ int usage(char *err)
   fprintf(stderr, "  attach          tell kernel to attach to device\n");
   fprintf(stderr, "    [-r LEN]        maximum IO read size\n");
   fprintf(stderr, "    [-w LEN]        maximum IO write size\n");
+  fprintf(stderr, "    [-f]            fixed IO sizes: don't probe for or adapt them\n");
+  fprintf(stderr, "    [-m MS]         minimum retransmit timeout\n");
+  fprintf(stderr, "    [-M MS]         maximum retransmit timeout\n");
+  fprintf(stderr, "    [-c LEN]        cache size (default none)\n");
+  fprintf(stderr, "    [-l LEN]        cache line size\n");
+  fprintf(stderr, "    [-B]            write-back: acknowledge writes once they're in memory\n");
+  fprintf(stderr, "    [-s POLICY]     order of queued IOs: fifo, deadline or elevator\n");
+  fprintf(stderr, "    [-d MS]         read deadline for queued IOs, 0 for none\n");
+  fprintf(stderr, "    [-D MS]         write deadline for queued IOs, 0 for none\n");
+  fprintf(stderr, "    [-q N]          most reads in flight, 0 for the whole IO window\n");
+  fprintf(stderr, "    [-Q N]          most writes in flight, 0 for the whole IO window\n");
+  fprintf(stderr, "    [-H PCT[:PCTL]] hedge up to PCT%% of reads slower than the PCTL percentile of them\n");
   fprintf(stderr, "    <UUID>...       uuid(s) to attach to\n");
+  fprintf(stderr, "  stripe          tell kernel to stripe a volume across attached devices\n");
+  fprintf(stderr, "    [-u LEN]        stripe unit\n");
+  fprintf(stderr, "    <NAME>          name of the volume\n");
+  fprintf(stderr, "    <UUID>...       uuids of its members, in order\n");
+  fprintf(stderr, "  mirror          tell kernel to mirror a volume across attached devices\n");
+  fprintf(stderr, "    <NAME>          name of the volume\n");
+  fprintf(stderr, "    <UUID>...       uuids of its members, which must start out identical\n");
   
   exit(EX_USAGE);
 }
 
 
-int doAttach(char *idString, int readSize, int writeSize)
+int setDriverProperties(NSDictionary *properties)
 {
-  NSMutableDictionary *summonNub = [NSMutableDictionary dictionary];
-  NSDictionary *properties = [NSDictionary dictionaryWithObject:summonNub forKey:[NSString stringWithUTF8String:kSC101DriverSummonKey]];
-  
-  [summonNub setObject:[NSString stringWithUTF8String:idString] forKey:[NSString stringWithUTF8String:kSC101DeviceIDKey]];
-  if (readSize > 0)
-    [summonNub setObject:[NSNumber numberWithInt:readSize] forKey:[NSString stringWithUTF8String:kSC101DeviceIOMaxReadSizeKey]];
-  if (writeSize > 0)
-    [summonNub setObject:[NSNumber numberWithInt:writeSize] forKey:[NSString stringWithUTF8String:kSC101DeviceIOMaxWriteSizeKey]];
-  
   io_service_t driverObject = IO_OBJECT_NULL;
   kern_return_t ioStatus = kIOReturnSuccess;
   int ret = 1;
@@ -78,13 +88,87 @@ cleanup:
 }
 
 
+int doAttach(char *idString, int readSize, int writeSize, BOOL fixedSize, int retransmitMin, int retransmitMax, long long cacheSize, int cacheLineSize, BOOL writeBack,
+             char *scheduler, int readDeadline, int writeDeadline, int readDepth, int writeDepth,
+             int hedgeBudget, int hedgePercentile)
+{
+  NSMutableDictionary *summonNub = [NSMutableDictionary dictionary];
+  NSDictionary *properties = [NSDictionary dictionaryWithObject:summonNub forKey:[NSString stringWithUTF8String:kSC101DriverSummonKey]];
+  
+  [summonNub setObject:[NSString stringWithUTF8String:idString] forKey:[NSString stringWithUTF8String:kSC101DeviceIDKey]];
+  if (readSize > 0)
+    [summonNub setObject:[NSNumber numberWithInt:readSize] forKey:[NSString stringWithUTF8String:kSC101DeviceIOMaxReadSizeKey]];
+  if (writeSize > 0)
+    [summonNub setObject:[NSNumber numberWithInt:writeSize] forKey:[NSString stringWithUTF8String:kSC101DeviceIOMaxWriteSizeKey]];
+  if (fixedSize)
+    [summonNub setObject:[NSNumber numberWithBool:NO] forKey:[NSString stringWithUTF8String:kSC101DeviceIOSizeProbingKey]];
+  if (retransmitMin > 0)
+    [summonNub setObject:[NSNumber numberWithInt:retransmitMin] forKey:[NSString stringWithUTF8String:kSC101DeviceRetransmitMinKey]];
+  if (retransmitMax > 0)
+    [summonNub setObject:[NSNumber numberWithInt:retransmitMax] forKey:[NSString stringWithUTF8String:kSC101DeviceRetransmitMaxKey]];
+  if (cacheSize >= 0)
+    [summonNub setObject:[NSNumber numberWithLongLong:cacheSize] forKey:[NSString stringWithUTF8String:kSC101DeviceCacheSizeKey]];
+  if (cacheLineSize > 0)
+    [summonNub setObject:[NSNumber numberWithInt:cacheLineSize] forKey:[NSString stringWithUTF8String:kSC101DeviceCacheLineSizeKey]];
+  if (writeBack)
+    [summonNub setObject:[NSNumber numberWithBool:YES] forKey:[NSString stringWithUTF8String:kSC101DeviceWriteBackKey]];
+  if (scheduler)
+    [summonNub setObject:[NSString stringWithUTF8String:scheduler] forKey:[NSString stringWithUTF8String:kSC101DeviceSchedulerKey]];
+  if (readDeadline >= 0)
+    [summonNub setObject:[NSNumber numberWithInt:readDeadline] forKey:[NSString stringWithUTF8String:kSC101DeviceReadDeadlineKey]];
+  if (writeDeadline >= 0)
+    [summonNub setObject:[NSNumber numberWithInt:writeDeadline] forKey:[NSString stringWithUTF8String:kSC101DeviceWriteDeadlineKey]];
+  if (readDepth >= 0)
+    [summonNub setObject:[NSNumber numberWithInt:readDepth] forKey:[NSString stringWithUTF8String:kSC101DeviceReadDepthKey]];
+  if (writeDepth >= 0)
+    [summonNub setObject:[NSNumber numberWithInt:writeDepth] forKey:[NSString stringWithUTF8String:kSC101DeviceWriteDepthKey]];
+  if (hedgeBudget >= 0)
+    [summonNub setObject:[NSNumber numberWithInt:hedgeBudget] forKey:[NSString stringWithUTF8String:kSC101DeviceHedgeBudgetKey]];
+  if (hedgePercentile > 0)
+    [summonNub setObject:[NSNumber numberWithInt:hedgePercentile] forKey:[NSString stringWithUTF8String:kSC101DeviceHedgePercentileKey]];
+  
+  return setDriverProperties(properties);
+}
+
+
+int doVolume(char *summonKey, char *idString, int stripeUnit, int memberCount, char *members[])
+{
+  NSMutableDictionary *summonVolume = [NSMutableDictionary dictionary];
+  NSMutableArray *memberArray = [NSMutableArray array];
+  NSDictionary *properties = [NSDictionary dictionaryWithObject:summonVolume forKey:[NSString stringWithUTF8String:summonKey]];
+  
+  for (int i = 0; i < memberCount; i++)
+    [memberArray addObject:[NSString stringWithUTF8String:members[i]]];
+  
+  [summonVolume setObject:[NSString stringWithUTF8String:idString] forKey:[NSString stringWithUTF8String:kSC101DeviceIDKey]];
+  [summonVolume setObject:memberArray forKey:[NSString stringWithUTF8String:kSC101VolumeMembersKey]];
+  if (stripeUnit > 0)
+    [summonVolume setObject:[NSNumber numberWithInt:stripeUnit] forKey:[NSString stringWithUTF8String:kSC101VolumeStripeUnitKey]];
+  
+  return setDriverProperties(properties);
+}
+
+
 int attach(int argc, char *argv[])
 {
   int readSize = -1;
   int writeSize = -1;
+  BOOL fixedSize = NO;
+  int retransmitMin = -1;
+  int retransmitMax = -1;
+  long long cacheSize = -1;
+  int cacheLineSize = -1;
+  BOOL writeBack = NO;
+  char *scheduler = NULL;
+  int readDeadline = -1;
+  int writeDeadline = -1;
+  int readDepth = -1;
+  int writeDepth = -1;
+  int hedgeBudget = -1;
+  int hedgePercentile = -1;
   int ch;
   
-  while ((ch = getopt(argc, argv, "r:w:")) != -1)
+  while ((ch = getopt(argc, argv, "r:w:fm:M:c:l:Bs:d:D:q:Q:H:")) != -1)
   {
     switch (ch) {
       case 'r':
@@ -93,6 +177,43 @@ int attach(int argc, char *argv[])
       case 'w':
         writeSize = atoi(optarg);
         break;
+      case 'f':
+        fixedSize = YES;
+        break;
+      case 'm':
+        retransmitMin = atoi(optarg);
+        break;
+      case 'M':
+        retransmitMax = atoi(optarg);
+        break;
+      case 'c':
+        cacheSize = strtoll(optarg, NULL, 0);
+        break;
+      case 'l':
+        cacheLineSize = atoi(optarg);
+        break;
+      case 'B':
+        writeBack = YES;
+        break;
+      case 's':
+        scheduler = optarg;
+        break;
+      case 'd':
+        readDeadline = atoi(optarg);
+        break;
+      case 'D':
+        writeDeadline = atoi(optarg);
+        break;
+      case 'q':
+        readDepth = atoi(optarg);
+        break;
+      case 'Q':
+        writeDepth = atoi(optarg);
+        break;
+      case 'H':
+        if (sscanf(optarg, "%d:%d", &hedgeBudget, &hedgePercentile) < 1)
+          usage("bad hedging budget");
+        break;
       default:
         usage(NULL);
     }
@@ -108,7 +229,9 @@ int attach(int argc, char *argv[])
   {
     int ret;
 
-    if ((ret = doAttach(argv[i], readSize, writeSize)) != 0)
+    if ((ret = doAttach(argv[i], readSize, writeSize, fixedSize, retransmitMin, retransmitMax, cacheSize, cacheLineSize, writeBack,
+                        scheduler, readDeadline, writeDeadline, readDepth, writeDepth,
+                        hedgeBudget, hedgePercentile)) != 0)
       return ret;
   }
 
@@ -116,6 +239,34 @@ int attach(int argc, char *argv[])
 }
 
 
+int volume(int argc, char *argv[], char *summonKey, BOOL striped)
+{
+  int stripeUnit = -1;
+  int ch;
+  
+  while ((ch = getopt(argc, argv, striped ? "u:" : "")) != -1)
+  {
+    switch (ch) {
+      case 'u':
+        stripeUnit = atoi(optarg);
+        break;
+      default:
+        usage(NULL);
+    }
+  }
+  
+  argc -= optind;
+  argv += optind;
+  
+  if (argc < 1)
+    usage("missing NAME");
+  if (argc < 3)
+    usage("need at least two UUIDs");
+  
+  return doVolume(summonKey, argv[0], stripeUnit, argc - 1, argv + 1);
+}
+
+
 int main(int argc, char *argv[])
 {
   NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
@@ -125,6 +276,10 @@ int main(int argc, char *argv[])
     usage("missing action");
   else if (!strcmp(argv[1], "attach"))
     ret = attach(argc-1, argv+1);
+  else if (!strcmp(argv[1], "stripe"))
+    ret = volume(argc-1, argv+1, kSC101DriverSummonStripeKey, YES);
+  else if (!strcmp(argv[1], "mirror"))
+    ret = volume(argc-1, argv+1, kSC101DriverSummonMirrorKey, NO);
   else
     usage("unknown action");
   
@@ -0,0 +1,448 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PSANLinux.h"
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+extern "C" {
+#include "psan_wireformat.h"
+};
+
+
+PSANUDPTransport::PSANUDPTransport()
+{
+  _engine = NULL;
+  _fd = -1;
+  _deadline = 0;
+  _rxbufs = NULL;
+  _zeroCopy = false;
+  _flowCount = 0;
+  _flowMax = FLOW_SOCKETS;
+}
+
+
+PSANUDPTransport::~PSANUDPTransport()
+{
+  close();
+
+  if (_rxbufs)
+    psan_free(_rxbufs, RECEIVE_BATCH * UINT16_MAX);
+}
+
+
+bool PSANUDPTransport::open(uint16_t port)
+{
+  int on = 1;
+  int rcvbufsize = RCVBUF_SIZE;
+  int sndbufsize = SNDBUF_SIZE;
+
+  if (!_rxbufs && !(_rxbufs = (uint8_t *)psan_alloc(RECEIVE_BATCH * UINT16_MAX)))
+    goto out;
+
+  if ((_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    goto out;
+
+  if (setsockopt(_fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0)
+    goto out;
+
+  /* unlike the kext, no SO_REUSEADDR: on linux that would let us share a port with an emulator on the same host */
+  if (setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &rcvbufsize, sizeof(rcvbufsize)) < 0)
+    goto out;
+
+  if (setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, &sndbufsize, sizeof(sndbufsize)) < 0)
+    goto out;
+
+  struct sockaddr_in addr;
+  psan_sockaddr_init(&addr, INADDR_ANY, htons(port));
+
+  if (bind(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    goto out;
+
+  {
+    socklen_t addrlen = sizeof(addr);
+    getsockname(_fd, (struct sockaddr *)&addr, &addrlen);
+    KINFO("Listening on port *:%u", ntohs(addr.sin_port));
+  }
+
+  return true;
+
+out:
+  KINFO("Error: %d", errno);
+  close();
+
+  return false;
+}
+
+
+void PSANUDPTransport::close()
+{
+  for (uint32_t i = 0; i < _flowCount; i++)
+  {
+    if (_flows[i].fd >= 0)
+      ::close(_flows[i].fd);
+  }
+  _flowCount = 0;
+  _transportStats.flowSockets = 0;
+
+  if (_fd >= 0)
+    ::close(_fd);
+  _fd = -1;
+}
+
+
+/* the connected socket for a unit, opening one while there are fewer than _flowMax.
+ * -1 for broadcasts and for units past the limit or whose socket couldn't be opened, which use the shared socket.
+ */
+int PSANUDPTransport::getFlow(const struct sockaddr_in *dest)
+{
+  if (dest->sin_addr.s_addr == INADDR_BROADCAST)
+    return -1;
+
+  for (uint32_t i = 0; i < _flowCount; i++)
+  {
+    if (_flows[i].addr.sin_addr.s_addr == dest->sin_addr.s_addr && _flows[i].addr.sin_port == dest->sin_port)
+      return _flows[i].fd;
+  }
+
+  if (_flowCount >= _flowMax)
+    return -1;
+
+  struct psan_udp_flow *flow = &_flows[_flowCount++];
+  int rcvbufsize = RCVBUF_SIZE;
+  int sndbufsize = SNDBUF_SIZE;
+
+  flow->addr = *dest;
+
+  if ((flow->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+      setsockopt(flow->fd, SOL_SOCKET, SO_RCVBUF, &rcvbufsize, sizeof(rcvbufsize)) < 0 ||
+      setsockopt(flow->fd, SOL_SOCKET, SO_SNDBUF, &sndbufsize, sizeof(sndbufsize)) < 0 ||
+      connect(flow->fd, (const struct sockaddr *)dest, sizeof(*dest)) < 0)
+  {
+    KINFO("Error %d opening flow socket", errno);
+    if (flow->fd >= 0)
+      ::close(flow->fd);
+    flow->fd = -1;
+    _transportStats.flowFailures++;
+    return -1;
+  }
+
+  _transportStats.flowSockets++;
+
+  return flow->fd;
+}
+
+
+bool PSANUDPTransport::sendPacket(const struct sockaddr_in *dest, const void *header, size_t headerLen,
+                                  PSANBuffer *payload, uint64_t payloadOffset, size_t payloadLen, bool anyPeer)
+{
+  struct iovec iov[2];
+  int iovcnt = 0;
+
+  iov[iovcnt].iov_base = (void *)header;
+  iov[iovcnt].iov_len = headerLen;
+  iovcnt++;
+
+  if (payload && payloadLen &&
+      (iov[iovcnt].iov_base = payload->getBytesNoCopy(payloadOffset, payloadLen)))
+  {
+    /* sendmsg() is done with the pages by the time it returns, so retransmits just point at them again */
+    iov[iovcnt].iov_len = payloadLen;
+    iovcnt++;
+  }
+  else if (payload && payloadLen)
+  {
+    if (payloadLen > sizeof(_txbuf) ||
+        !payload->prepare() ||
+        payload->readBytes(payloadOffset, _txbuf, payloadLen) != payloadLen ||
+        !payload->complete())
+    {
+      KINFO("failed to copy payload");
+      _transportStats.sendFailures++;
+      return false;
+    }
+
+    iov[iovcnt].iov_base = _txbuf;
+    iov[iovcnt].iov_len = payloadLen;
+    iovcnt++;
+  }
+
+  int fd = (anyPeer ? -1 : getFlow(dest));
+
+  struct msghdr msghdr;
+  memset(&msghdr, 0, sizeof(msghdr));
+  if (fd < 0)
+  {
+    fd = _fd;
+    msghdr.msg_name = (void *)dest;
+    msghdr.msg_namelen = sizeof(*dest);
+  }
+  msghdr.msg_iov = iov;
+  msghdr.msg_iovlen = iovcnt;
+
+  if (sendmsg(fd, &msghdr, 0) < 0)
+  {
+    KINFO("Error: sendmsg() returned %d", errno);
+    _transportStats.sendFailures++;
+    return false;
+  }
+
+  return true;
+}
+
+
+void PSANUDPTransport::setTimer(uint64_t deadline)
+{
+  _deadline = deadline;
+}
+
+
+void PSANUDPTransport::cancelTimer()
+{
+  _deadline = 0;
+}
+
+
+/* drain a socket RECEIVE_BATCH datagrams at a time, up to RECEIVE_BUDGET per wakeup.
+ * returns true if the budget ran out with packets possibly still queued.
+ */
+bool PSANUDPTransport::receivePackets(int fd)
+{
+  struct mmsghdr msgs[RECEIVE_BATCH];
+  struct iovec iovs[RECEIVE_BATCH];
+  struct sockaddr_in addrs[RECEIVE_BATCH];
+  uint32_t received = 0;
+  bool drained = false;
+
+  _engine->beginBatch();
+
+  while (_zeroCopy && received < RECEIVE_BUDGET)
+  {
+    int count = receivePlaced(fd);
+
+    if (count <= 0)
+    {
+      drained = true;
+      break;
+    }
+
+    received++;
+  }
+
+  while (!drained && received < RECEIVE_BUDGET)
+  {
+    unsigned int want = PSAN_MIN(RECEIVE_BATCH, RECEIVE_BUDGET - received);
+
+    for (unsigned int i = 0; i < want; i++)
+    {
+      iovs[i].iov_base = _rxbufs + i * UINT16_MAX;
+      iovs[i].iov_len = UINT16_MAX;
+
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int count = recvmmsg(fd, msgs, want, MSG_DONTWAIT, NULL);
+
+    if (count < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        KINFO("error %d from recvmmsg", errno);
+      break;
+    }
+
+    drained = ((unsigned int)count < want);
+
+    for (int i = 0; i < count; i++)
+    {
+      size_t len = msgs[i].msg_len;
+
+      received++;
+
+      if (len < sizeof(struct psan_ctrl_t))
+      {
+        KINFO("short packet len=%zu", len);
+        continue;
+      }
+
+      PSANFlatPacket packet(iovs[i].iov_base, len);
+
+      _engine->handlePacket(&addrs[i], &packet);
+    }
+  }
+
+  bool exhausted = (!drained && received >= RECEIVE_BUDGET);
+
+  _engine->endBatch(received, exhausted);
+
+  return exhausted;
+}
+
+
+/* receive and dispatch one datagram, scattering its payload into place if the engine knows where it goes.
+ * returns 1 if a datagram was consumed, 0 if the socket is empty, -1 on error.
+ */
+int PSANUDPTransport::receivePlaced(int fd)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  uint8_t *header = _rxbufs;
+  size_t headerLen = sizeof(psan_get_response_t);
+
+  /* MSG_TRUNC makes the peek report the whole datagram's length */
+  ssize_t len = recvfrom(fd, header, headerLen, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT, (struct sockaddr *)&addr, &addrlen);
+
+  if (len < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+      KINFO("error %d from recvfrom", errno);
+      return -1;
+    }
+    return 0;
+  }
+
+  PSANBuffer *payload;
+  uint64_t payloadOffset;
+  size_t packetOffset;
+  size_t surplus;
+  void *bytes = NULL;
+
+  if (_engine->getPayloadPlacement(&addr, header, PSAN_MIN((size_t)len, headerLen), len,
+                                   &payload, &payloadOffset, &packetOffset, &surplus) &&
+      packetOffset <= UINT16_MAX)
+    bytes = payload->getBytesNoCopy(payloadOffset, len - packetOffset - surplus);
+
+  struct iovec iov[3];
+  int iovcnt = 0;
+
+  if (bytes)
+  {
+    iov[iovcnt].iov_base = header;
+    iov[iovcnt].iov_len = packetOffset;
+    iovcnt++;
+    iov[iovcnt].iov_base = bytes;
+    iov[iovcnt].iov_len = len - packetOffset - surplus;
+    iovcnt++;
+
+    /* the surplus of a rounded-up read is dropped anyway, so it goes after the header */
+    if (surplus)
+    {
+      iov[iovcnt].iov_base = header + packetOffset;
+      iov[iovcnt].iov_len = surplus;
+      iovcnt++;
+    }
+  }
+  else
+  {
+    iov[iovcnt].iov_base = header;
+    iov[iovcnt].iov_len = UINT16_MAX;
+    iovcnt++;
+  }
+
+  struct msghdr msghdr;
+  memset(&msghdr, 0, sizeof(msghdr));
+  msghdr.msg_iov = iov;
+  msghdr.msg_iovlen = iovcnt;
+
+  ssize_t got = recvmsg(fd, &msghdr, MSG_DONTWAIT);
+
+  if (got < 0)
+  {
+    KINFO("error %d from recvmsg", errno);
+    return -1;
+  }
+
+  if ((size_t)got < sizeof(struct psan_ctrl_t))
+  {
+    KINFO("short packet len=%zd", got);
+    return 1;
+  }
+
+  if (bytes && got == len)
+  {
+    PSANPlacedPacket packet(header, packetOffset, got, payload, payloadOffset);
+
+    _engine->handlePacket(&addr, &packet);
+  }
+  else if (!bytes)
+  {
+    PSANFlatPacket packet(header, got);
+
+    _engine->handlePacket(&addr, &packet);
+  }
+
+  return 1;
+}
+
+
+void PSANUDPTransport::runOnce(int timeout_ms)
+{
+  if (_deadline)
+  {
+    uint64_t now = psan_uptime_ns();
+    int until = (_deadline > now ? (int)((_deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC) : 0);
+
+    if (timeout_ms < 0 || until < timeout_ms)
+      timeout_ms = until;
+  }
+
+  struct pollfd pfds[1 + FLOW_SOCKETS];
+  nfds_t nfds = 0;
+
+  pfds[nfds].fd = _fd;
+  pfds[nfds].events = POLLIN;
+  pfds[nfds].revents = 0;
+  nfds++;
+
+  for (uint32_t i = 0; i < _flowCount; i++)
+  {
+    if (_flows[i].fd < 0)
+      continue;
+
+    pfds[nfds].fd = _flows[i].fd;
+    pfds[nfds].events = POLLIN;
+    pfds[nfds].revents = 0;
+    nfds++;
+  }
+
+  if (poll(pfds, nfds, timeout_ms) > 0)
+  {
+    for (nfds_t i = 0; i < nfds; i++)
+    {
+      if (pfds[i].revents & POLLIN)
+        receivePackets(pfds[i].fd);
+    }
+  }
+
+  if (_deadline && psan_uptime_ns() >= _deadline)
+    _engine->timeoutOccurred();
+}
+
+
+void PSANUDPTransport::run(volatile bool *done)
+{
+  while (!*done)
+    runOnce(-1);
+}
@@ -0,0 +1,114 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_LINUX_H__
+#define __PSAN_LINUX_H__
+
+#include "PSANEngine.h"
+#include "PSANDevice.h"
+
+
+/* a datagram whose header sits in a bounce buffer and whose payload was received straight into its destination, bar
+ * any surplus the destination would have dropped
+ */
+class PSANPlacedPacket : public PSANPacket
+  {
+  public:
+    PSANPlacedPacket(void *header, size_t headerLen, size_t len, PSANBuffer *payload, uint64_t payloadOffset)
+      : _header((uint8_t *)header), _headerLen(headerLen), _len(len), _payload(payload), _payloadOffset(payloadOffset) {}
+
+    virtual size_t getLength() { return _len; }
+
+    virtual void *pullup(size_t len)
+    {
+      return (len <= _headerLen ? _header : NULL);
+    }
+
+    virtual bool copyToBuffer(PSANBuffer *buffer, uint64_t bufferOffset, size_t packetOffset, size_t len)
+    {
+      return isPlaced(buffer, bufferOffset, packetOffset, len);
+    }
+
+    virtual bool isPlaced(PSANBuffer *buffer, uint64_t bufferOffset, size_t packetOffset, size_t len)
+    {
+      return (buffer == _payload && bufferOffset == _payloadOffset && packetOffset == _headerLen &&
+              packetOffset + len == _len);
+    }
+  protected:
+    uint8_t *_header;
+    size_t _headerLen;
+    size_t _len;
+    PSANBuffer *_payload;
+    uint64_t _payloadOffset;
+  };
+
+
+/* a socket connected to one unit, -1 if it couldn't be opened */
+struct psan_udp_flow {
+  struct sockaddr_in addr;
+  int fd;
+};
+
+
+/* UDP socket transport plus a single threaded poll() loop standing in for the kext workloop.
+ * everything (packets, timeouts, submissions from completion callbacks) runs on the thread calling run().
+ */
+class PSANUDPTransport : public PSANTransport
+  {
+  public:
+    PSANUDPTransport();
+    virtual ~PSANUDPTransport();
+
+    /* port is in host order, 0 for an ephemeral port */
+    bool open(uint16_t port);
+    void close();
+    void setEngine(PSANEngine *engine) { _engine = engine; }
+    /* peek at each response and receive read payloads straight into the caller's buffer, instead of
+     * batching them through _rxbufs and copying. costs a syscall per datagram.
+     */
+    void setZeroCopy(bool zeroCopy) { _zeroCopy = zeroCopy; }
+    /* talk to at most this many units (up to FLOW_SOCKETS) over their own connected sockets, 0 for none */
+    void setFlowSockets(uint32_t count) { _flowMax = PSAN_MIN(count, FLOW_SOCKETS); }
+
+    virtual bool sendPacket(const struct sockaddr_in *dest, const void *header, size_t headerLen,
+                            PSANBuffer *payload, uint64_t payloadOffset, size_t payloadLen, bool anyPeer);
+    virtual void setTimer(uint64_t deadline);
+    virtual void cancelTimer();
+
+    /* wait up to timeout_ms (-1 forever) for packets or the timer, dispatch them and return */
+    void runOnce(int timeout_ms);
+    /* loop until *done becomes true */
+    void run(volatile bool *done);
+  protected:
+    bool receivePackets(int fd);
+    int receivePlaced(int fd);
+    int getFlow(const struct sockaddr_in *dest);
+
+    PSANEngine *_engine;
+    int _fd;
+    struct psan_udp_flow _flows[FLOW_SOCKETS];
+    uint32_t _flowCount;
+    uint32_t _flowMax;
+    uint64_t _deadline; /* 0 when no timer is armed */
+    bool _zeroCopy;
+
+    uint8_t *_rxbufs; /* RECEIVE_BATCH of UINT16_MAX each */
+    uint8_t _txbuf[UINT16_MAX];
+  };
+
+#endif /* __PSAN_LINUX_H__ */
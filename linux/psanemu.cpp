@@ -0,0 +1,857 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* a loopback stand-in for a shelf of SC101s, for benchmarking without hardware.
+ *
+ * each simulated unit gets its own root address (base + unit*256 + 1) answering the disk info and
+ * partition table sectors, and each of its partitions its own address (base + unit*256 + 2 + partition)
+ * answering GET/PUT against a region of one shared sparse image file. RESOLVE is answered on any
+ * address, including a wildcard socket for broadcasts, and replied to from the owning unit's root.
+ *
+ * responses can be delayed (latency + jitter), serialized through a per-unit link of limited rate and
+ * buffer (tail drop), dropped outright, lost per 1480 byte IP fragment, and units spin down when idle
+ * and answer PSAN_ERROR until they have spun back up.
+ */
+
+#include "PSANPlatform.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+extern "C" {
+#include "psan_wireformat.h"
+};
+
+
+#define FRAGMENT_PAYLOAD (1480)
+#define UDP_IP_OVERHEAD (28)
+
+
+struct options {
+  uint32_t units;
+  uint32_t partitions;
+  uint64_t partitionSize;
+  const char *image;
+  const char *prefix;
+  in_addr_t base;          /* host order */
+  uint16_t port;
+  uint32_t maxTransfer;
+
+  double latencyMS;
+  double jitterMS;
+  double dropRate;
+  double fragmentLossRate;
+  double linkMbit;         /* 0 for unlimited */
+  uint32_t linkBuffer;     /* bytes queued per unit before tail drop */
+  double spinDownIdleS;    /* 0 to never spin down */
+  double spinUpS;
+  bool startSpunDown;
+  uint32_t seed;
+  bool verbose;
+};
+
+
+struct unit {
+  int rootFd;
+  struct sockaddr_in root;
+  int *partitionFds;
+  struct sockaddr_in *partitionAddrs;
+
+  uint64_t lastAccess;
+  uint64_t spinningUpUntil;
+  bool spunDown;
+
+  uint64_t linkFree;       /* when the last queued byte leaves the port */
+};
+
+
+struct pending_send {
+  uint64_t when;
+  int fd;
+  struct sockaddr_in dest;
+  size_t len;
+  uint8_t *data;
+};
+
+
+struct stats {
+  uint64_t received;
+  uint64_t resolves;
+  uint64_t gets;
+  uint64_t puts;
+  uint64_t errors;
+  uint64_t spinUps;
+  uint64_t dropped;
+  uint64_t fragmentLost;
+  uint64_t linkDropped;
+  uint64_t sent;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+};
+
+
+static struct options opts;
+static struct unit *units;
+static int wildcardFd = -1;
+static int imageFd = -1;
+static struct stats stats;
+static volatile bool done = false;
+
+static struct pending_send *heap;
+static size_t heapCount;
+static size_t heapCapacity;
+
+static uint64_t rngState;
+
+
+static void usage(const char *err)
+{
+  if (err && *err)
+    fprintf(stderr, "Error: %s\n", err);
+
+  fprintf(stderr, "Usage: psanemu [OPTIONS]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "    [-u UNITS]      number of simulated units (default 1)\n");
+  fprintf(stderr, "    [-p PARTS]      partitions per unit (default 1)\n");
+  fprintf(stderr, "    [-s SIZE]       partition size in MB (default 1024)\n");
+  fprintf(stderr, "    [-f FILE]       sparse backing image (default anonymous temp file)\n");
+  fprintf(stderr, "    [-i PREFIX]     partition IDs are PREFIX-<unit>-<partition> (default psanemu)\n");
+  fprintf(stderr, "    [-a ADDR]       base address, unit N is at ADDR + N*256 (default 127.0.1.0)\n");
+  fprintf(stderr, "    [-P PORT]       port (default %d)\n", PSAN_PORT);
+  fprintf(stderr, "    [-m LEN]        largest transfer answered, bigger ones are ignored (default 32768)\n");
+  fprintf(stderr, "    [-l MS]         per-packet response latency\n");
+  fprintf(stderr, "    [-j MS]         uniform random jitter added to latency\n");
+  fprintf(stderr, "    [-d RATE]       fraction of requests dropped\n");
+  fprintf(stderr, "    [-F RATE]       fraction of IP fragments lost, in either direction\n");
+  fprintf(stderr, "    [-B MBIT]       per-unit link rate (default unlimited)\n");
+  fprintf(stderr, "    [-Q BYTES]      per-unit link buffer before tail drop (default 65536)\n");
+  fprintf(stderr, "    [-I SECONDS]    spin down after idle for SECONDS\n");
+  fprintf(stderr, "    [-S SECONDS]    spin up time, answering PSAN_ERROR meanwhile (default 5)\n");
+  fprintf(stderr, "    [-D]            start spun down\n");
+  fprintf(stderr, "    [-x SEED]       random seed\n");
+  fprintf(stderr, "    [-v]            log every request\n");
+
+  exit(EX_USAGE);
+}
+
+
+/* xorshift64*, good enough and reproducible across runs */
+static double random01(void)
+{
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return (double)((rngState * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+
+static uint32_t fragments(size_t udpPayload)
+{
+  return (udpPayload + 8 + FRAGMENT_PAYLOAD - 1) / FRAGMENT_PAYLOAD;
+}
+
+
+static bool lostInTransit(size_t udpPayload)
+{
+  if (opts.dropRate > 0 && random01() < opts.dropRate)
+  {
+    stats.dropped++;
+    return true;
+  }
+
+  if (opts.fragmentLossRate > 0)
+  {
+    double survive = pow(1.0 - opts.fragmentLossRate, fragments(udpPayload));
+
+    if (random01() >= survive)
+    {
+      stats.fragmentLost++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+static void putUInt48(uint8_t *buf, uint64_t value)
+{
+  for (int i = 5; i >= 0; i--, value >>= 8)
+    buf[i] = value & 0xff;
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Delayed sends
+/**********************************************************************************************************************************/
+
+
+static void heapPush(struct pending_send *send)
+{
+  if (heapCount == heapCapacity)
+  {
+    heapCapacity = PSAN_MAX(64, heapCapacity * 2);
+    heap = (struct pending_send *)realloc(heap, heapCapacity * sizeof(*heap));
+  }
+
+  size_t i = heapCount++;
+
+  while (i > 0 && heap[(i - 1) / 2].when > send->when)
+  {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+
+  heap[i] = *send;
+}
+
+
+static void heapPop(void)
+{
+  struct pending_send last = heap[--heapCount];
+  size_t i = 0;
+
+  for (;;)
+  {
+    size_t child = 2 * i + 1;
+
+    if (child >= heapCount)
+      break;
+    if (child + 1 < heapCount && heap[child + 1].when < heap[child].when)
+      child++;
+    if (heap[child].when >= last.when)
+      break;
+
+    heap[i] = heap[child];
+    i = child;
+  }
+
+  if (heapCount)
+    heap[i] = last;
+}
+
+
+static void transmit(int fd, const struct sockaddr_in *dest, const void *data, size_t len)
+{
+  if (sendto(fd, data, len, 0, (const struct sockaddr *)dest, sizeof(*dest)) < 0)
+    KINFO("sendto failed: %d", errno);
+  else
+    stats.sent++;
+}
+
+
+/* queue a response, subject to loss, latency and the unit's link */
+static void respond(struct unit *unit, int fd, const struct sockaddr_in *dest, const void *data, size_t len)
+{
+  if (lostInTransit(len))
+    return;
+
+  uint64_t now = psan_uptime_ns();
+  double delayMS = opts.latencyMS + (opts.jitterMS > 0 ? random01() * opts.jitterMS : 0);
+  uint64_t when = now + (uint64_t)(delayMS * NSEC_PER_MSEC);
+
+  if (opts.linkMbit > 0)
+  {
+    uint64_t wireBytes = len + fragments(len) * UDP_IP_OVERHEAD;
+    uint64_t serialize = (uint64_t)(wireBytes * 8 * 1000.0 / opts.linkMbit);
+    uint64_t start = PSAN_MAX(when, unit->linkFree);
+    uint64_t backlog = (unit->linkFree > now ? (unit->linkFree - now) * opts.linkMbit / 8000.0 : 0);
+
+    if (backlog + wireBytes > opts.linkBuffer)
+    {
+      stats.linkDropped++;
+      return;
+    }
+
+    unit->linkFree = start + serialize;
+    when = unit->linkFree;
+  }
+
+  if (when <= now)
+  {
+    transmit(fd, dest, data, len);
+    return;
+  }
+
+  struct pending_send send;
+  send.when = when;
+  send.fd = fd;
+  send.dest = *dest;
+  send.len = len;
+  send.data = (uint8_t *)malloc(len);
+  memcpy(send.data, data, len);
+
+  heapPush(&send);
+}
+
+
+static void flushDue(void)
+{
+  uint64_t now = psan_uptime_ns();
+
+  while (heapCount && heap[0].when <= now)
+  {
+    struct pending_send send = heap[0];
+    heapPop();
+
+    transmit(send.fd, &send.dest, send.data, send.len);
+    free(send.data);
+  }
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Protocol
+/**********************************************************************************************************************************/
+
+
+static void partitionID(char *buf, size_t len, uint32_t u, uint32_t p)
+{
+  snprintf(buf, len, "%s-%u-%u", opts.prefix, u, p);
+}
+
+
+static bool lookupID(const char *id, uint32_t *u, uint32_t *p)
+{
+  char expected[64];
+
+  for (uint32_t i = 0; i < opts.units; i++)
+  {
+    for (uint32_t j = 0; j < opts.partitions; j++)
+    {
+      partitionID(expected, sizeof(expected), i, j);
+
+      if (strncmp(id, expected, sizeof(expected)) == 0)
+      {
+        *u = i;
+        *p = j;
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+
+static void handleResolve(const struct sockaddr_in *from, const uint8_t *pkt, size_t len)
+{
+  const struct psan_resolve_t *req = (const struct psan_resolve_t *)pkt;
+  char id[sizeof(req->id) + 1];
+  uint32_t u, p;
+
+  if (len < sizeof(*req))
+    return;
+
+  memcpy(id, req->id, sizeof(req->id));
+  id[sizeof(req->id)] = '\0';
+
+  stats.resolves++;
+
+  if (!lookupID(id, &u, &p))
+  {
+    if (opts.verbose)
+      KINFO("no such ID '%s'", id);
+    return;
+  }
+
+  struct psan_resolve_response_t res;
+  memset(&res, 0, sizeof(res));
+  res.ctrl.cmd = PSAN_RESOLVE_RESPONSE;
+  res.ctrl.seq = req->ctrl.seq;
+  res.ip4 = units[u].partitionAddrs[p].sin_addr;
+
+  respond(&units[u], units[u].rootFd, from, &res, sizeof(res));
+}
+
+
+static void handleRootGet(struct unit *unit, uint32_t u, const struct sockaddr_in *from, const struct psan_get_t *req, uint32_t ioLen)
+{
+  uint8_t buf[sizeof(struct psan_get_response_t) + (1 << 16)];
+  struct psan_get_t *hdr = (struct psan_get_t *)buf;
+  uint8_t *data = buf + sizeof(struct psan_get_response_t);
+  uint32_t sector = ntohl(req->sector);
+
+  *hdr = *req;
+  hdr->ctrl.cmd = PSAN_GET_RESPONSE;
+  memset(data, 0, ioLen);
+
+  for (uint32_t i = 0; i < ioLen / SECTOR_SIZE; i++, sector++)
+  {
+    uint8_t *out = data + i * SECTOR_SIZE;
+
+    if (sector == 0)
+    {
+      struct psan_get_response_disk_t *disk = (struct psan_get_response_disk_t *)out;
+      static const uint8_t partNumber[3] = { 0, 0, 101 };
+
+      strncpy(disk->version, "psanemu 1.0", sizeof(disk->version));
+      memcpy(disk->part_number, partNumber, sizeof(partNumber));
+      putUInt48(disk->sector_total, opts.partitions * opts.partitionSize / SECTOR_SIZE);
+      disk->partitions = opts.partitions;
+      snprintf(disk->label, sizeof(disk->label), "%s unit %u", opts.prefix, u);
+    }
+    else if (sector <= opts.partitions)
+    {
+      struct psan_get_response_partition_t *part = (struct psan_get_response_partition_t *)out;
+
+      snprintf(part->label, sizeof(part->label), "part %u", sector - 1);
+      putUInt48(part->sector_size, opts.partitionSize / SECTOR_SIZE);
+      partitionID(part->id, sizeof(part->id), u, sector - 1);
+    }
+  }
+
+  respond(unit, unit->rootFd, from, buf, sizeof(struct psan_get_response_t) + ioLen);
+}
+
+
+/* true if the request should be answered with PSAN_ERROR while the drive spins up */
+static bool spinningUp(struct unit *unit)
+{
+  uint64_t now = psan_uptime_ns();
+
+  if (opts.spinDownIdleS > 0 && !unit->spunDown && !unit->spinningUpUntil &&
+      now - unit->lastAccess > opts.spinDownIdleS * 1e9)
+    unit->spunDown = true;
+
+  unit->lastAccess = now;
+
+  if (unit->spunDown)
+  {
+    unit->spunDown = false;
+    unit->spinningUpUntil = now + (uint64_t)(opts.spinUpS * 1e9);
+    stats.spinUps++;
+    KINFO("unit %ld spinning up for %.1fs", (long)(unit - units), opts.spinUpS);
+  }
+
+  if (unit->spinningUpUntil)
+  {
+    if (now < unit->spinningUpUntil)
+      return true;
+
+    unit->spinningUpUntil = 0;
+  }
+
+  return false;
+}
+
+
+static void respondError(struct unit *unit, int fd, const struct sockaddr_in *from, const struct psan_ctrl_t *ctrl)
+{
+  struct psan_put_response_t err;
+  memset(&err, 0, sizeof(err));
+  err.ctrl = *ctrl;
+  err.ctrl.cmd = PSAN_ERROR;
+
+  stats.errors++;
+  respond(unit, fd, from, &err, sizeof(err));
+}
+
+
+static void handleIO(struct unit *unit, uint32_t u, int p, int fd, const struct sockaddr_in *from, const uint8_t *pkt, size_t len)
+{
+  const struct psan_ctrl_t *ctrl = (const struct psan_ctrl_t *)pkt;
+  bool isWrite = (ctrl->cmd == PSAN_PUT);
+  size_t hdrLen = (isWrite ? sizeof(struct psan_put_t) : sizeof(struct psan_get_t));
+
+  if (len < hdrLen)
+    return;
+
+  if (ctrl->len_power < 9 || ctrl->len_power > 16 || (1U << ctrl->len_power) > opts.maxTransfer)
+  {
+    if (opts.verbose)
+      KINFO("ignoring len_power %d", ctrl->len_power);
+    return;
+  }
+
+  uint32_t ioLen = 1U << ctrl->len_power;
+  uint32_t sector = ntohl(((const struct psan_get_t *)pkt)->sector);
+
+  if (isWrite && len != hdrLen + ioLen)
+  {
+    KINFO("PUT length %zu doesn't match len_power %d", len, ctrl->len_power);
+    return;
+  }
+
+  if (opts.verbose)
+    KINFO("%s unit=%u part=%d sector=%u len=%u", isWrite ? "PUT" : "GET", u, p, sector, ioLen);
+
+  if (spinningUp(unit))
+  {
+    respondError(unit, fd, from, ctrl);
+    return;
+  }
+
+  if (p < 0)
+  {
+    if (isWrite)
+      respondError(unit, fd, from, ctrl);
+    else
+      handleRootGet(unit, u, from, (const struct psan_get_t *)pkt, ioLen);
+    stats.gets += !isWrite;
+    return;
+  }
+
+  if ((uint64_t)sector * SECTOR_SIZE + ioLen > opts.partitionSize)
+  {
+    respondError(unit, fd, from, ctrl);
+    return;
+  }
+
+  off_t offset = ((off_t)u * opts.partitions + p) * opts.partitionSize + (off_t)sector * SECTOR_SIZE;
+
+  if (isWrite)
+  {
+    stats.puts++;
+
+    if (pwrite(imageFd, pkt + hdrLen, ioLen, offset) != (ssize_t)ioLen)
+    {
+      KINFO("pwrite failed: %d", errno);
+      respondError(unit, fd, from, ctrl);
+      return;
+    }
+    stats.bytesWritten += ioLen;
+
+    struct psan_put_response_t res;
+    memcpy(&res, pkt, sizeof(res));
+    res.ctrl.cmd = PSAN_PUT_RESPONSE;
+
+    respond(unit, fd, from, &res, sizeof(res));
+  }
+  else
+  {
+    uint8_t buf[sizeof(struct psan_get_response_t) + (1 << 16)];
+    struct psan_get_t *hdr = (struct psan_get_t *)buf;
+
+    stats.gets++;
+
+    *hdr = *(const struct psan_get_t *)pkt;
+    hdr->ctrl.cmd = PSAN_GET_RESPONSE;
+
+    ssize_t got = pread(imageFd, buf + sizeof(*hdr), ioLen, offset);
+    if (got < 0)
+    {
+      KINFO("pread failed: %d", errno);
+      respondError(unit, fd, from, ctrl);
+      return;
+    }
+    if ((uint32_t)got < ioLen)
+      memset(buf + sizeof(*hdr) + got, 0, ioLen - got);
+    stats.bytesRead += ioLen;
+
+    respond(unit, fd, from, buf, sizeof(*hdr) + ioLen);
+  }
+}
+
+
+/* u/p identify the socket the request arrived on, p == -1 for a unit root, u == -1 for the wildcard */
+static void handlePacket(int fd, int u, int p)
+{
+  uint8_t pkt[UINT16_MAX];
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  ssize_t len = recvfrom(fd, pkt, sizeof(pkt), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+
+  if (len < (ssize_t)sizeof(struct psan_ctrl_t))
+    return;
+
+  stats.received++;
+
+  /* a lost fragment of the request means the whole datagram never arrives */
+  if (lostInTransit(len))
+    return;
+
+  const struct psan_ctrl_t *ctrl = (const struct psan_ctrl_t *)pkt;
+
+  switch (ctrl->cmd)
+  {
+    case PSAN_RESOLVE:
+      handleResolve(&from, pkt, len);
+      break;
+    case PSAN_GET:
+    case PSAN_PUT:
+      if (u >= 0)
+        handleIO(&units[u], u, p, fd, &from, pkt, len);
+      break;
+    default:
+      if (opts.verbose)
+        KINFO("ignoring cmd 0x%02x", ctrl->cmd);
+      break;
+  }
+}
+
+
+/**********************************************************************************************************************************/
+#pragma mark Setup
+/**********************************************************************************************************************************/
+
+
+static int openSocket(in_addr_t addr)
+{
+  int on = 1;
+  int bufsize = RCVBUF_SIZE;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if (fd < 0)
+    return -1;
+
+  /* the wildcard socket shares the port with every unit address */
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  struct sockaddr_in sin;
+  psan_sockaddr_init(&sin, addr, htons(opts.port));
+
+  if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+  {
+    char name[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sin.sin_addr, name, sizeof(name));
+    KINFO("bind %s:%u failed: %d", name, opts.port, errno);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+static bool setupUnits(void)
+{
+  units = (struct unit *)calloc(opts.units, sizeof(struct unit));
+
+  for (uint32_t u = 0; u < opts.units; u++)
+  {
+    struct unit *unit = &units[u];
+    in_addr_t root = opts.base + u * 256 + 1;
+
+    psan_sockaddr_init(&unit->root, htonl(root), htons(opts.port));
+    if ((unit->rootFd = openSocket(unit->root.sin_addr.s_addr)) < 0)
+      return false;
+
+    unit->partitionFds = (int *)calloc(opts.partitions, sizeof(int));
+    unit->partitionAddrs = (struct sockaddr_in *)calloc(opts.partitions, sizeof(struct sockaddr_in));
+
+    for (uint32_t p = 0; p < opts.partitions; p++)
+    {
+      psan_sockaddr_init(&unit->partitionAddrs[p], htonl(root + 1 + p), htons(opts.port));
+      if ((unit->partitionFds[p] = openSocket(unit->partitionAddrs[p].sin_addr.s_addr)) < 0)
+        return false;
+    }
+
+    unit->lastAccess = psan_uptime_ns();
+    unit->spunDown = opts.startSpunDown;
+  }
+
+  if ((wildcardFd = openSocket(INADDR_ANY)) < 0)
+    KINFO("no wildcard socket, RESOLVE only answered on unit addresses");
+
+  return true;
+}
+
+
+static bool setupImage(void)
+{
+  if (opts.image)
+  {
+    imageFd = open(opts.image, O_RDWR | O_CREAT, 0644);
+  }
+  else
+  {
+    char path[] = "/tmp/psanemu.XXXXXX";
+
+    if ((imageFd = mkstemp(path)) >= 0)
+      unlink(path);
+  }
+
+  if (imageFd < 0)
+  {
+    KINFO("failed to open image: %d", errno);
+    return false;
+  }
+
+  off_t size = (off_t)opts.units * opts.partitions * opts.partitionSize;
+
+  if (lseek(imageFd, 0, SEEK_END) < size && ftruncate(imageFd, size) < 0)
+  {
+    KINFO("failed to size image: %d", errno);
+    return false;
+  }
+
+  return true;
+}
+
+
+static void printStats(void)
+{
+  fprintf(stderr, "received %llu (resolve %llu, get %llu, put %llu), sent %llu, PSAN_ERROR %llu, spin-ups %llu\n",
+          (unsigned long long)stats.received, (unsigned long long)stats.resolves,
+          (unsigned long long)stats.gets, (unsigned long long)stats.puts, (unsigned long long)stats.sent,
+          (unsigned long long)stats.errors, (unsigned long long)stats.spinUps);
+  fprintf(stderr, "dropped %llu, fragment lost %llu, link overflow %llu, read %llu MB, written %llu MB\n",
+          (unsigned long long)stats.dropped, (unsigned long long)stats.fragmentLost,
+          (unsigned long long)stats.linkDropped,
+          (unsigned long long)(stats.bytesRead >> 20), (unsigned long long)(stats.bytesWritten >> 20));
+}
+
+
+static void handleSignal(int sig)
+{
+  done = true;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int ch;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.units = 1;
+  opts.partitions = 1;
+  opts.partitionSize = 1024ULL * 1024 * 1024;
+  opts.prefix = "psanemu";
+  opts.base = ntohl(inet_addr("127.0.1.0"));
+  opts.port = PSAN_PORT;
+  opts.maxTransfer = 32 * 1024;
+  opts.linkBuffer = 64 * 1024;
+  opts.spinUpS = 5;
+  opts.seed = getpid();
+
+  while ((ch = getopt(argc, argv, "u:p:s:f:i:a:P:m:l:j:d:F:B:Q:I:S:Dx:v")) != -1)
+  {
+    switch (ch) {
+      case 'u': opts.units = atoi(optarg); break;
+      case 'p': opts.partitions = atoi(optarg); break;
+      case 's': opts.partitionSize = strtoull(optarg, NULL, 0) * 1024 * 1024; break;
+      case 'f': opts.image = optarg; break;
+      case 'i': opts.prefix = optarg; break;
+      case 'a':
+        {
+          struct in_addr in;
+          if (inet_pton(AF_INET, optarg, &in) != 1)
+            usage("bad address");
+          opts.base = ntohl(in.s_addr);
+        }
+        break;
+      case 'P': opts.port = atoi(optarg); break;
+      case 'm': opts.maxTransfer = atoi(optarg); break;
+      case 'l': opts.latencyMS = atof(optarg); break;
+      case 'j': opts.jitterMS = atof(optarg); break;
+      case 'd': opts.dropRate = atof(optarg); break;
+      case 'F': opts.fragmentLossRate = atof(optarg); break;
+      case 'B': opts.linkMbit = atof(optarg); break;
+      case 'Q': opts.linkBuffer = atoi(optarg); break;
+      case 'I': opts.spinDownIdleS = atof(optarg); break;
+      case 'S': opts.spinUpS = atof(optarg); break;
+      case 'D': opts.startSpunDown = true; break;
+      case 'x': opts.seed = strtoul(optarg, NULL, 0); break;
+      case 'v': opts.verbose = true; break;
+      default:
+        usage(NULL);
+    }
+  }
+
+  if (!opts.units || opts.units > 255 || !opts.partitions || opts.partitions > 254)
+    usage("bad unit or partition count");
+
+  if (!opts.partitionSize || opts.partitionSize % SECTOR_SIZE)
+    usage("bad partition size");
+
+  rngState = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  if (!setupImage() || !setupUnits())
+    return EX_OSERR;
+
+  char base[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &units[0].root.sin_addr, base, sizeof(base));
+  KINFO("%u unit(s) x %u partition(s) of %llu MB, first unit at %s:%u, IDs %s-<unit>-<partition>",
+        opts.units, opts.partitions, (unsigned long long)(opts.partitionSize >> 20), base, opts.port, opts.prefix);
+
+  signal(SIGINT, handleSignal);
+  signal(SIGTERM, handleSignal);
+
+  size_t nfds = opts.units * (1 + opts.partitions) + (wildcardFd >= 0);
+  struct pollfd *pfds = (struct pollfd *)calloc(nfds, sizeof(struct pollfd));
+  int *owners = (int *)calloc(nfds, 2 * sizeof(int));
+  size_t n = 0;
+
+  for (uint32_t u = 0; u < opts.units; u++)
+  {
+    pfds[n].fd = units[u].rootFd;
+    owners[2 * n] = u;
+    owners[2 * n + 1] = -1;
+    n++;
+
+    for (uint32_t p = 0; p < opts.partitions; p++)
+    {
+      pfds[n].fd = units[u].partitionFds[p];
+      owners[2 * n] = u;
+      owners[2 * n + 1] = p;
+      n++;
+    }
+  }
+
+  if (wildcardFd >= 0)
+  {
+    pfds[n].fd = wildcardFd;
+    owners[2 * n] = -1;
+    owners[2 * n + 1] = -1;
+    n++;
+  }
+
+  for (size_t i = 0; i < nfds; i++)
+    pfds[i].events = POLLIN;
+
+  while (!done)
+  {
+    int timeout = -1;
+
+    if (heapCount)
+    {
+      uint64_t now = psan_uptime_ns();
+      timeout = (heap[0].when > now ? (int)((heap[0].when - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC) : 0);
+    }
+
+    int ready = poll(pfds, nfds, timeout);
+
+    if (ready < 0 && errno != EINTR)
+    {
+      KINFO("poll failed: %d", errno);
+      break;
+    }
+
+    for (size_t i = 0; ready > 0 && i < nfds; i++)
+    {
+      if (pfds[i].revents & POLLIN)
+        handlePacket(pfds[i].fd, owners[2 * i], owners[2 * i + 1]);
+    }
+
+    flushDue();
+  }
+
+  printStats();
+
+  return 0;
+}
@@ -0,0 +1,666 @@
+/*
+ *  Copyright (C) 2009  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* drive the portable engine against a real device (or psanemu) from linux: attach, then run a
+ * sequential or random read/write load at a fixed queue depth and report throughput and latency.
+ */
+
+#include "PSANLinux.h"
+
+#include <arpa/inet.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+extern "C" {
+#include "psan_wireformat.h"
+};
+
+
+struct options {
+  struct sockaddr_in resolve;
+  uint16_t port;
+  uint32_t readSize;
+  uint32_t writeSize;
+  uint32_t retransmitMin;
+  uint32_t retransmitMax;
+  uint32_t ioSize;
+  uint32_t depth;
+  uint64_t count;
+  uint32_t seconds;
+  bool isWrite;
+  bool isRandom;
+  bool zeroCopy;
+  uint32_t flowSockets;
+  uint32_t readAheadStreams;
+  uint64_t cacheSize;
+  uint32_t cacheLineSize;
+  uint64_t span;
+  bool writeBack;
+  uint32_t writePercent; /* of a mixed load, 0 for all reads or all writes */
+  bool sizeProbing;
+  struct psan_sched_params sched;
+  uint32_t hedgeBudget;
+  uint32_t hedgePercentile;
+};
+
+
+struct bench_io {
+  struct bench *bench;
+  PSANFlatBuffer *buffer;
+  uint64_t started;
+  bool isWrite;
+};
+
+
+struct bench {
+  struct options *opts;
+  PSANTransport *transport;
+  PSANEngine *engine;
+  PSANDevice *device;
+
+  uint64_t nextBlock;
+  uint64_t maxBlock;
+  uint64_t issued;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t bytes;
+  uint64_t deadline;
+  uint32_t inflight;
+  uint32_t waiting; /* submissions held back until the device has room, see benchAvailable() */
+  uint32_t deferred; /* submissions asked for from inside asyncReadWrite(), see benchSubmit() */
+  bool submitting;
+  bool stopping;
+  bool done;
+  bool synced;
+  int syncStatus;
+  uint64_t syncTime;
+
+  uint64_t *latencies[2]; /* [isWrite] */
+  uint64_t latencyCount[2];
+  uint64_t latencyCapacity[2];
+};
+
+
+static void usage(const char *err)
+{
+  if (err && *err)
+    fprintf(stderr, "Error: %s\n", err);
+
+  fprintf(stderr, "Usage: psanio [OPTIONS] <UUID>\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "    [-b ADDR]       address to send RESOLVE to (default broadcast)\n");
+  fprintf(stderr, "    [-p PORT]       local port to bind (default ephemeral)\n");
+  fprintf(stderr, "    [-r LEN]        maximum IO read size (LENs take a k, m or g suffix)\n");
+  fprintf(stderr, "    [-w LEN]        maximum IO write size\n");
+  fprintf(stderr, "    [-f]            keep to those sizes rather than probing for better ones\n");
+  fprintf(stderr, "    [-m MS]         minimum retransmit timeout (default %d)\n", RTO_MIN_MS);
+  fprintf(stderr, "    [-M MS]         maximum retransmit timeout (default %d)\n", RTO_MAX_MS);
+  fprintf(stderr, "    [-s LEN]        size of each benchmark IO (default 64k)\n");
+  fprintf(stderr, "    [-q DEPTH]      IOs kept in flight (default 8)\n");
+  fprintf(stderr, "    [-n COUNT]      stop after COUNT IOs\n");
+  fprintf(stderr, "    [-t SECONDS]    stop after SECONDS (default 10)\n");
+  fprintf(stderr, "    [-W]            write instead of read (destroys data!)\n");
+  fprintf(stderr, "    [-X PERCENT]    mix reads and writes, PERCENT of the IOs writes (destroys data!)\n");
+  fprintf(stderr, "    [-R]            random instead of sequential offsets\n");
+  fprintf(stderr, "    [-Z]            receive read payloads in place instead of copying\n");
+  fprintf(stderr, "    [-F COUNT]      units given their own connected socket (default %d)\n", FLOW_SOCKETS);
+  fprintf(stderr, "    [-a STREAMS]    sequential streams to read ahead for (default 0)\n");
+  fprintf(stderr, "    [-c LEN]        cache size (default none)\n");
+  fprintf(stderr, "    [-l LEN]        cache line size (default %d)\n", CACHE_LINE_SIZE);
+  fprintf(stderr, "    [-S LEN]        only use the first LEN bytes of the device\n");
+  fprintf(stderr, "    [-B]            write-back: acknowledge writes from memory, and sync once done\n");
+  fprintf(stderr, "    [-P POLICY]     order of queued IOs: fifo, deadline or elevator (default %s)\n", SCHED_POLICY);
+  fprintf(stderr, "    [-D MS:MS]      read and write deadlines for queued IOs, 0 for none (default %d:%d)\n",
+          SCHED_READ_DEADLINE_MS, SCHED_WRITE_DEADLINE_MS);
+  fprintf(stderr, "    [-Q N:N]        most reads and writes in flight, 0 for the whole window (default %d:%d)\n",
+          SCHED_READ_DEPTH, SCHED_WRITE_DEPTH);
+  fprintf(stderr, "    [-H PCT[:PCTL]] hedge up to PCT%% of reads slower than the PCTL percentile (default %d:%d)\n",
+          HEDGE_BUDGET_PERCENT, HEDGE_PERCENTILE);
+
+  exit(EX_USAGE);
+}
+
+
+static bool isValidIOMaxSize(uint32_t size, uint32_t max)
+{
+  return (size >= SECTOR_SIZE && size <= max && !(size & (size - 1)));
+}
+
+
+/* a byte count, optionally with a k, m or g suffix, of at most max */
+static uint64_t parseLength(const char *arg, uint64_t max)
+{
+  char *end;
+  uint64_t len = strtoull(arg, &end, 0);
+  int shift = 0;
+
+  switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+  }
+
+  if (end == arg || *end || len > (max >> shift))
+    usage("bad length");
+
+  return (len << shift);
+}
+
+
+static int compareUInt64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+static void benchSubmit(struct bench *bench);
+
+
+static void benchCompletion(void *target, void *parameter, int status, uint64_t actualByteCount)
+{
+  struct bench_io *io = (struct bench_io *)parameter;
+  struct bench *bench = io->bench;
+  uint64_t latency = psan_uptime_ns() - io->started;
+
+  bench->inflight--;
+  bench->completed++;
+
+  if (status != 0)
+    bench->failed++;
+  else
+    bench->bytes += actualByteCount;
+
+  bool isWrite = io->isWrite;
+  if (bench->latencyCount[isWrite] == bench->latencyCapacity[isWrite])
+  {
+    bench->latencyCapacity[isWrite] = PSAN_MAX(1024, bench->latencyCapacity[isWrite] * 2);
+    bench->latencies[isWrite] = (uint64_t *)realloc(bench->latencies[isWrite], bench->latencyCapacity[isWrite] * sizeof(uint64_t));
+  }
+  bench->latencies[isWrite][bench->latencyCount[isWrite]++] = latency;
+
+  delete io->buffer;
+  delete io;
+
+  if (psan_uptime_ns() >= bench->deadline ||
+      (bench->opts->count && bench->issued >= bench->opts->count))
+    bench->stopping = true;
+
+  if (!bench->stopping)
+    benchSubmit(bench);
+  else if (!bench->inflight)
+    bench->done = true;
+}
+
+
+static void benchSubmitOne(struct bench *bench)
+{
+  struct options *opts = bench->opts;
+  uint32_t nblks = opts->ioSize / SECTOR_SIZE;
+  bool isWrite = (opts->writePercent ? (uint32_t)(random() % 100) < opts->writePercent : opts->isWrite);
+
+  if (opts->isRandom)
+    bench->nextBlock = ((uint64_t)random() % (bench->maxBlock / nblks)) * nblks;
+  else if (bench->nextBlock + nblks > bench->maxBlock)
+    bench->nextBlock = 0;
+
+  if (!bench->device->canAccept(isWrite, nblks))
+  {
+    bench->waiting++;
+    return;
+  }
+
+  struct bench_io *io = new bench_io;
+  io->bench = bench;
+  io->buffer = new PSANFlatBuffer(opts->ioSize, isWrite);
+  io->started = psan_uptime_ns();
+  io->isWrite = isWrite;
+
+  if (isWrite)
+    memset(io->buffer->getBytesNoCopy(), (int)(bench->issued & 0xff), opts->ioSize);
+
+  struct psan_completion completion;
+  completion.target = NULL;
+  completion.action = benchCompletion;
+  completion.parameter = io;
+
+  uint64_t block = bench->nextBlock;
+  bench->nextBlock += nblks;
+  bench->issued++;
+  bench->inflight++;
+
+  bench->device->asyncReadWrite(io->buffer, block, nblks, completion);
+}
+
+
+/* reads served from memory complete inside asyncReadWrite(), and their completions submit the next IO. those are
+ * left to the outermost call, rather than recursing once per hit.
+ */
+static void benchSubmit(struct bench *bench)
+{
+  bench->deferred++;
+
+  if (bench->submitting)
+    return;
+
+  bench->submitting = true;
+  while (bench->deferred)
+  {
+    bench->deferred--;
+    benchSubmitOne(bench);
+  }
+  bench->submitting = false;
+}
+
+
+static void benchAvailable(void *owner)
+{
+  struct bench *bench = (struct bench *)owner;
+  uint32_t waiting = bench->waiting;
+
+  bench->waiting = 0;
+
+  while (waiting-- && !bench->stopping)
+    benchSubmit(bench);
+}
+
+
+static void benchSyncCompletion(void *target, void *parameter, int status, uint64_t actualByteCount)
+{
+  struct bench *bench = (struct bench *)parameter;
+
+  bench->syncStatus = status;
+  bench->synced = true;
+}
+
+
+static void report(struct bench *bench, uint64_t elapsed)
+{
+  double seconds = (double)elapsed / 1e9;
+  char mix[32];
+
+  if (bench->opts->writePercent)
+    snprintf(mix, sizeof(mix), "%u%% write", bench->opts->writePercent);
+  else
+    snprintf(mix, sizeof(mix), "%s", bench->opts->isWrite ? "write" : "read");
+
+  printf("%s %s: %llu IOs of %u bytes, depth %u, %llu failed\n",
+         bench->opts->isRandom ? "random" : "sequential", mix,
+         (unsigned long long)bench->completed, bench->opts->ioSize, bench->opts->depth,
+         (unsigned long long)bench->failed);
+  printf("  %.1f IOPS, %.2f MB/s over %.2fs\n",
+         bench->completed / seconds, bench->bytes / seconds / (1024 * 1024), seconds);
+
+  const struct psan_device_stats *stats = bench->device->getStatistics();
+  printf("  window: now %llu, max %llu, reductions %llu, timeouts %llu, errors %llu\n",
+         (unsigned long long)stats->ioWindow, (unsigned long long)stats->ioWindowMax,
+         (unsigned long long)stats->ioWindowReductions, (unsigned long long)stats->timeouts,
+         (unsigned long long)stats->errors);
+  if (stats->readBytes)
+    printf("  copies: %llu of %llu bytes read were copied (%.2f per byte)\n",
+           (unsigned long long)stats->readBytesCopied, (unsigned long long)stats->readBytes,
+           (double)stats->readBytesCopied / stats->readBytes);
+  printf("  prepares: %llu, saved %llu\n",
+         (unsigned long long)stats->prepares, (unsigned long long)stats->preparesSaved);
+  printf("  pools: high water %llu requests, %llu IOs, %llu chunks, %llu carriers; waits %llu, exhausted %llu\n",
+         (unsigned long long)stats->requestPoolHighWater, (unsigned long long)stats->ioPoolHighWater,
+         (unsigned long long)stats->deblockPoolHighWater, (unsigned long long)stats->carrierPoolHighWater,
+         (unsigned long long)stats->poolWaits, (unsigned long long)stats->poolExhausted);
+  if (stats->readAheadHits || stats->readAheadMisses)
+    printf("  read-ahead: %llu hits, %llu misses (%.1f%%), %llu bytes prefetched, %llu wasted\n",
+           (unsigned long long)stats->readAheadHits, (unsigned long long)stats->readAheadMisses,
+           100.0 * stats->readAheadHits / (stats->readAheadHits + stats->readAheadMisses),
+           (unsigned long long)stats->readAheadBytes, (unsigned long long)stats->readAheadWasted);
+  if (stats->coalescedPuts || stats->coalescedGets || stats->overReads)
+    printf("  coalesced: %llu writes into %llu PUTs, %llu reads into %llu GETs; %llu GETs rounded up by %llu bytes\n",
+           (unsigned long long)stats->coalescedWrites, (unsigned long long)stats->coalescedPuts,
+           (unsigned long long)stats->coalescedReads, (unsigned long long)stats->coalescedGets,
+           (unsigned long long)stats->overReads, (unsigned long long)stats->overReadBytes);
+  if (stats->queuedReads || stats->queuedWrites)
+    printf("  queued (%s): %llu reads, avg %.3f max %.3f ms; %llu writes, avg %.3f max %.3f ms; %llu expired, %llu starved\n",
+           PSANIOScheduler::policyName(bench->opts->sched.policy),
+           (unsigned long long)stats->queuedReads,
+           stats->queuedReads ? (double)stats->queueWaitReads / stats->queuedReads / 1e6 : 0.0,
+           (double)stats->queueWaitMaxRead / 1e6,
+           (unsigned long long)stats->queuedWrites,
+           stats->queuedWrites ? (double)stats->queueWaitWrites / stats->queuedWrites / 1e6 : 0.0,
+           (double)stats->queueWaitMaxWrite / 1e6,
+           (unsigned long long)stats->queueExpired, (unsigned long long)stats->queueWritesStarved);
+  if (stats->cacheHits || stats->cacheMisses)
+    printf("  cache: %llu hits, %llu misses (%.1f%% hits), %llu coalesced, %llu evictions\n",
+           (unsigned long long)stats->cacheHits, (unsigned long long)stats->cacheMisses,
+           100.0 * stats->cacheHits / (stats->cacheHits + stats->cacheMisses),
+           (unsigned long long)stats->cacheCoalesced, (unsigned long long)stats->cacheEvictions);
+  if (bench->opts->writeBack)
+    printf("  write-back: %llu bytes, %llu flushes of %llu bytes, %llu errors; reads %llu from memory, %llu merged; "
+           "sync %.1f ms (%d)\n",
+           (unsigned long long)stats->writeBackBytes, (unsigned long long)stats->writeBackFlushes,
+           (unsigned long long)stats->writeBackFlushBytes, (unsigned long long)stats->writeBackErrors,
+           (unsigned long long)stats->writeBackReadHits, (unsigned long long)stats->writeBackReadMerges,
+           (double)bench->syncTime / NSEC_PER_MSEC, bench->syncStatus);
+
+  if (bench->opts->sizeProbing)
+  {
+    printf("  sizes: GET %llu (limit %llu), PUT %llu (limit %llu); %llu tried, %llu raised, %llu lowered, %llu resplit\n",
+           (unsigned long long)stats->ioReadSize, (unsigned long long)stats->ioReadLimit,
+           (unsigned long long)stats->ioWriteSize, (unsigned long long)stats->ioWriteLimit,
+           (unsigned long long)stats->ioSizeTrials, (unsigned long long)stats->ioSizeRaises, (unsigned long long)stats->ioSizeFallbacks,
+           (unsigned long long)stats->ioResplits);
+
+    for (int isWrite = 0; isWrite < 2; isWrite++)
+    {
+      const struct psan_size_state *state = bench->device->getSizeState(isWrite);
+
+      printf("  %s loss:", isWrite ? "PUT" : "GET");
+      for (int c = 0; c < PSAN_SIZE_CLASSES; c++)
+      {
+        uint64_t total = state->delivered[c] + state->lost[c];
+        if (total)
+          printf(" %u=%.1f%%", SECTOR_SIZE << c, 100.0 * state->lost[c] / total);
+      }
+      printf("\n");
+    }
+  }
+
+  if (bench->opts->hedgeBudget)
+    printf("  hedges (%u%% past p%u): %llu fired, %llu won (%.1f%%), %llu over budget\n",
+           bench->opts->hedgeBudget, bench->opts->hedgePercentile,
+           (unsigned long long)stats->hedgesFired, (unsigned long long)stats->hedgesWon,
+           stats->hedgesFired ? 100.0 * stats->hedgesWon / stats->hedgesFired : 0.0,
+           (unsigned long long)stats->hedgesDenied);
+
+  const struct psan_engine_stats *engineStats = bench->engine->getStatistics();
+  printf("  responses: late %llu, duplicate %llu, stale %llu, foreign %llu, mismatched %llu\n",
+         (unsigned long long)engineStats->late, (unsigned long long)engineStats->duplicates,
+         (unsigned long long)engineStats->stale, (unsigned long long)engineStats->foreign,
+         (unsigned long long)engineStats->mismatched);
+  if (stats->lateResponses)
+    printf("  late: %llu IOs answered on an earlier try, avg %.3f max %.3f ms after the retry was sent\n",
+           (unsigned long long)stats->lateResponses, (double)stats->lateWait / stats->lateResponses / 1e6,
+           (double)stats->lateWaitMax / 1e6);
+  printf("  receive: %llu packets in %llu batches (avg %.1f, max %llu), budget exhausted %llu\n",
+         (unsigned long long)engineStats->rxPackets, (unsigned long long)engineStats->rxBatches,
+         engineStats->rxBatches ? (double)engineStats->rxPackets / engineStats->rxBatches : 0.0,
+         (unsigned long long)engineStats->rxBatchMax, (unsigned long long)engineStats->rxBudgetExhausted);
+
+  const struct psan_transport_stats *transportStats = bench->transport->getTransportStatistics();
+  printf("  send: failures %llu; flow sockets %llu, failed %llu\n", (unsigned long long)transportStats->sendFailures,
+         (unsigned long long)transportStats->flowSockets, (unsigned long long)transportStats->flowFailures);
+
+  for (int isWrite = 0; isWrite < 2; isWrite++)
+  {
+    uint64_t count = bench->latencyCount[isWrite];
+    if (!count)
+      continue;
+
+    qsort(bench->latencies[isWrite], count, sizeof(uint64_t), compareUInt64);
+
+    static const double percentiles[] = { 50, 90, 95, 99, 99.9, 100 };
+    printf("  %s latency ms:", isWrite ? "write" : "read");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+      uint64_t index = (uint64_t)(percentiles[i] / 100 * (count - 1));
+      printf(" p%g=%.3f", percentiles[i], bench->latencies[isWrite][index] / 1e6);
+    }
+    printf("\n");
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  struct options opts;
+  int ch;
+
+  psan_sockaddr_init(&opts.resolve, INADDR_BROADCAST, htons(PSAN_PORT));
+  opts.port = 0;
+  opts.readSize = DEFAULT_IO_READ_SIZE;
+  opts.writeSize = DEFAULT_IO_WRITE_SIZE;
+  opts.retransmitMin = RTO_MIN_MS;
+  opts.retransmitMax = RTO_MAX_MS;
+  opts.ioSize = 64 * 1024;
+  opts.depth = 8;
+  opts.count = 0;
+  opts.seconds = 10;
+  opts.isWrite = false;
+  opts.isRandom = false;
+  opts.zeroCopy = false;
+  opts.flowSockets = FLOW_SOCKETS;
+  opts.readAheadStreams = 0;
+  opts.cacheSize = CACHE_SIZE;
+  opts.cacheLineSize = CACHE_LINE_SIZE;
+  opts.span = 0;
+  opts.writeBack = false;
+  opts.writePercent = 0;
+  opts.sizeProbing = IO_SIZE_PROBING;
+  opts.sched.policy = PSANIOScheduler::policyNamed(SCHED_POLICY);
+  opts.sched.deadlineMS[false] = SCHED_READ_DEADLINE_MS;
+  opts.sched.deadlineMS[true] = SCHED_WRITE_DEADLINE_MS;
+  opts.sched.depth[false] = SCHED_READ_DEPTH;
+  opts.sched.depth[true] = SCHED_WRITE_DEPTH;
+  opts.sched.writeStarve = SCHED_WRITE_STARVE;
+  opts.hedgeBudget = HEDGE_BUDGET_PERCENT;
+  opts.hedgePercentile = HEDGE_PERCENTILE;
+
+  int policy;
+
+  while ((ch = getopt(argc, argv, "b:p:r:w:fm:M:s:q:n:t:WX:RZF:a:c:l:S:BP:D:Q:H:")) != -1)
+  {
+    switch (ch) {
+      case 'b':
+        if (inet_pton(AF_INET, optarg, &opts.resolve.sin_addr) != 1)
+          usage("bad address");
+        break;
+      case 'p':
+        opts.port = atoi(optarg);
+        break;
+      case 'r':
+        opts.readSize = parseLength(optarg, UINT32_MAX);
+        break;
+      case 'w':
+        opts.writeSize = parseLength(optarg, UINT32_MAX);
+        break;
+      case 'f':
+        opts.sizeProbing = false;
+        break;
+      case 'm':
+        opts.retransmitMin = atoi(optarg);
+        break;
+      case 'M':
+        opts.retransmitMax = atoi(optarg);
+        break;
+      case 's':
+        opts.ioSize = parseLength(optarg, UINT32_MAX);
+        break;
+      case 'q':
+        opts.depth = atoi(optarg);
+        break;
+      case 'n':
+        opts.count = strtoull(optarg, NULL, 0);
+        break;
+      case 't':
+        opts.seconds = atoi(optarg);
+        break;
+      case 'W':
+        opts.isWrite = true;
+        break;
+      case 'X':
+        opts.writePercent = atoi(optarg);
+        if (opts.writePercent > 100)
+          usage("bad write percentage");
+        break;
+      case 'R':
+        opts.isRandom = true;
+        break;
+      case 'Z':
+        opts.zeroCopy = true;
+        break;
+      case 'F':
+        opts.flowSockets = atoi(optarg);
+        break;
+      case 'a':
+        opts.readAheadStreams = atoi(optarg);
+        break;
+      case 'c':
+        opts.cacheSize = parseLength(optarg, CACHE_SIZE_MAX);
+        break;
+      case 'l':
+        opts.cacheLineSize = parseLength(optarg, UINT32_MAX);
+        break;
+      case 'S':
+        opts.span = parseLength(optarg, UINT64_MAX);
+        break;
+      case 'B':
+        opts.writeBack = true;
+        break;
+      case 'P':
+        if ((policy = PSANIOScheduler::policyNamed(optarg)) < 0)
+          usage("unknown scheduler policy");
+        opts.sched.policy = policy;
+        break;
+      case 'D':
+        if (sscanf(optarg, "%u:%u", &opts.sched.deadlineMS[false], &opts.sched.deadlineMS[true]) != 2)
+          usage("bad deadlines");
+        break;
+      case 'Q':
+        if (sscanf(optarg, "%u:%u", &opts.sched.depth[false], &opts.sched.depth[true]) != 2)
+          usage("bad queue depths");
+        break;
+      case 'H':
+        if (sscanf(optarg, "%u:%u", &opts.hedgeBudget, &opts.hedgePercentile) < 1 ||
+            opts.hedgeBudget > 100 || opts.hedgePercentile < 1 || opts.hedgePercentile > 99)
+          usage("bad hedging budget or percentile");
+        break;
+      default:
+        usage(NULL);
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if (argc != 1)
+    usage("missing UUID");
+
+  if (!isValidIOMaxSize(opts.readSize, MAX_IO_READ_SIZE) || !isValidIOMaxSize(opts.writeSize, MAX_IO_WRITE_SIZE))
+    usage("IO sizes must be powers of 2 between 512 and the protocol maximum");
+
+  if (!opts.retransmitMin || opts.retransmitMin > opts.retransmitMax)
+    usage("bad retransmit timeouts");
+
+  if (opts.ioSize < SECTOR_SIZE || opts.ioSize % SECTOR_SIZE || opts.ioSize > ACCEPT_IO_READ_SIZE || !opts.depth)
+    usage("bad IO size or depth");
+
+  PSANUDPTransport transport;
+  if (!transport.open(opts.port))
+    return EX_OSERR;
+  transport.setZeroCopy(opts.zeroCopy);
+  transport.setFlowSockets(opts.flowSockets);
+
+  PSANEngine engine(&transport);
+  transport.setEngine(&engine);
+  if (!engine.init())
+    return EX_SOFTWARE;
+
+  struct bench bench;
+  memset(&bench, 0, sizeof(bench));
+
+  struct psan_device_handlers handlers;
+  memset(&handlers, 0, sizeof(handlers));
+  handlers.target = &bench;
+  handlers.availableHandler = benchAvailable;
+
+  PSANDevice device(&engine, argv[0], &handlers);
+  if (!device.init())
+    return EX_SOFTWARE;
+  device.setIOMaxSize(opts.readSize, opts.writeSize);
+  device.setIOSizeProbing(opts.sizeProbing);
+  device.setRetransmitTimeouts(opts.retransmitMin, opts.retransmitMax);
+  device.setReadAheadStreams(opts.readAheadStreams);
+  if (!device.setCache(opts.cacheSize, opts.cacheLineSize))
+    usage("bad cache size");
+  device.setWriteBack(opts.writeBack);
+  device.setScheduler(&opts.sched);
+  device.setHedging(opts.hedgeBudget, opts.hedgePercentile);
+  device.setResolveAddress(&opts.resolve);
+  device.resolve();
+
+  uint64_t attachDeadline = psan_uptime_ns() + 10 * 1000 * NSEC_PER_MSEC;
+  while (!device.isAttached() && psan_uptime_ns() < attachDeadline)
+    transport.runOnce(100);
+
+  if (!device.isAttached())
+  {
+    fprintf(stderr, "failed to attach to %s\n", argv[0]);
+    return EX_UNAVAILABLE;
+  }
+
+  char partition[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &device.getPartitionAddress()->sin_addr, partition, sizeof(partition));
+  printf("%s: %llu bytes at %s\n", device.getID(), (unsigned long long)device.getSize(), partition);
+
+  bench.opts = &opts;
+  bench.transport = &transport;
+  bench.engine = &engine;
+  bench.device = &device;
+  bench.maxBlock = device.getSize() / SECTOR_SIZE;
+  if (opts.span)
+    bench.maxBlock = PSAN_MIN(bench.maxBlock, opts.span / SECTOR_SIZE);
+
+  if (bench.maxBlock < opts.ioSize / SECTOR_SIZE)
+  {
+    fprintf(stderr, "device too small\n");
+    return EX_UNAVAILABLE;
+  }
+
+  uint64_t started = psan_uptime_ns();
+  bench.deadline = started + opts.seconds * 1000 * NSEC_PER_MSEC;
+
+  for (uint32_t i = 0; i < opts.depth && (!opts.count || i < opts.count); i++)
+    benchSubmit(&bench);
+
+  transport.run(&bench.done);
+
+  /* counted in the elapsed time, so write-back's throughput is what actually reached the unit */
+  if (opts.writeBack)
+  {
+    struct psan_completion completion;
+    completion.target = NULL;
+    completion.action = benchSyncCompletion;
+    completion.parameter = &bench;
+
+    uint64_t syncStarted = psan_uptime_ns();
+    device.synchronize(completion);
+    transport.run(&bench.synced);
+    bench.syncTime = psan_uptime_ns() - syncStarted;
+
+    if (bench.syncStatus)
+      bench.failed++;
+  }
+
+  report(&bench, psan_uptime_ns() - started);
+  free(bench.latencies[false]);
+  free(bench.latencies[true]);
+
+  device.stop();
+  engine.stop();
+
+  return (bench.failed ? 1 : 0);
+}